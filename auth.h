@@ -137,6 +137,8 @@ int	 hostbased_key_allowed(struct passwd *, const char *, char *,
 int	 user_key_allowed(struct ssh *, struct passwd *, struct sshkey *, int,
     struct sshauthopt **);
 int	 auth2_key_already_used(Authctxt *, const struct sshkey *);
+int	 authkeys_index_serialise(struct sshbuf *, int);
+int	 authkeys_index_deserialise(struct sshbuf *);
 
 /*
  * Handling auth method-specific information for logging and prevention
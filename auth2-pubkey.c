@@ -42,6 +42,8 @@
 #include <unistd.h>
 #include <limits.h>
 
+#include "openbsd-compat/sys-queue.h"
+
 #include "xmalloc.h"
 #include "ssh.h"
 #include "ssh2.h"
@@ -65,8 +67,10 @@
 #include "authfile.h"
 #include "match.h"
 #include "ssherr.h"
+#include "digest.h"
 #include "channels.h" /* XXX for session.h */
 #include "session.h" /* XXX for child_set_env(); refactor? */
+#include "probes.h"
 
 /* import */
 extern ServerOptions options;
@@ -102,6 +106,7 @@ userauth_pubkey(struct ssh *ssh)
 	    (r = sshpkt_get_cstring(ssh, &pkalg, NULL)) != 0 ||
 	    (r = sshpkt_get_string(ssh, &pkblob, &blen)) != 0)
 		fatal("%s: parse request failed: %s", __func__, ssh_err(r));
+	SSH_PROBE3(auth_pubkey_start, authctxt->user, pkalg, have_sig);
 	pktype = sshkey_type_from_name(pkalg);
 	if (pktype == KEY_UNSPEC) {
 		/* this is perfectly legal */
@@ -234,6 +239,7 @@ done:
 		authenticated = 0;
 	}
 	debug2("%s: authenticated %d pkalg %s", __func__, authenticated, pkalg);
+	SSH_PROBE2(auth_pubkey_done, authctxt->user, authenticated);
 
 	sshauthopt_free(authopts);
 	sshkey_free(key);
@@ -723,6 +729,502 @@ check_authkeys_file(struct ssh *ssh, struct passwd *pw, FILE *f,
 	return found_key;
 }
 
+/*
+ * Index of an authorized_keys file: the fingerprints of the keys each line
+ * may hold, so that only lines that might match an offered key are passed
+ * to check_authkey_line().  Lines whose parsing produces diagnostics are
+ * always checked so that what gets logged does not change.  Indexes live
+ * for the connection and, with AuthorizedKeysIndexCache, are sent back to
+ * the listener for later connections.  An index is used only while the
+ * file's device, inode, size, mtime and ctime are unchanged.
+ */
+#define AUTHKEYS_FP_LEN		32	/* SHA256 */
+#define AUTHKEYS_ID_LEN		7
+#define AUTHKEYS_INDEX_MAX	128	/* files */
+
+struct authkeys_line {
+	off_t offset;
+	u_long linenum;
+};
+
+struct authkeys_fp {
+	u_char fp[AUTHKEYS_FP_LEN];
+	u_int32_t line;
+};
+
+struct authkeys_index {
+	char *path;
+	u_int64_t id[AUTHKEYS_ID_LEN];	/* see authkeys_index_id() */
+	struct authkeys_line *lines;	/* non-comment lines */
+	u_int32_t nlines;
+	struct authkeys_fp *fps;	/* sorted by fingerprint */
+	u_int32_t nfps;
+	u_int32_t *always;		/* lines to check for any key */
+	u_int32_t nalways;
+	int dirty;			/* built by this process */
+	TAILQ_ENTRY(authkeys_index) next;
+};
+
+static TAILQ_HEAD(authkeys_index_list, authkeys_index) authkeys_indexes =
+    TAILQ_HEAD_INITIALIZER(authkeys_indexes);
+static u_int authkeys_nindexes;
+
+static void
+authkeys_index_id(const struct stat *st, u_int64_t *id)
+{
+	id[0] = st->st_dev;
+	id[1] = st->st_ino;
+	id[2] = st->st_size;
+	id[3] = st->st_mtime;
+	id[4] = st->st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	id[5] = st->st_mtim.tv_nsec;
+	id[6] = st->st_ctim.tv_nsec;
+#else
+	id[5] = id[6] = 0;
+#endif
+}
+
+static void
+authkeys_index_free(struct authkeys_index *idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->path);
+	free(idx->lines);
+	free(idx->fps);
+	free(idx->always);
+	free(idx);
+}
+
+static void
+authkeys_index_remove(struct authkeys_index *idx)
+{
+	TAILQ_REMOVE(&authkeys_indexes, idx, next);
+	authkeys_nindexes--;
+	authkeys_index_free(idx);
+}
+
+/* Add an index, replacing any for the same file */
+static void
+authkeys_index_insert(struct authkeys_index *idx)
+{
+	struct authkeys_index *old;
+
+	TAILQ_FOREACH(old, &authkeys_indexes, next) {
+		if (strcmp(old->path, idx->path) == 0) {
+			authkeys_index_remove(old);
+			break;
+		}
+	}
+	TAILQ_INSERT_HEAD(&authkeys_indexes, idx, next);
+	if (++authkeys_nindexes > AUTHKEYS_INDEX_MAX)
+		authkeys_index_remove(TAILQ_LAST(&authkeys_indexes,
+		    authkeys_index_list));
+}
+
+static struct authkeys_index *
+authkeys_index_find(const char *file, const u_int64_t *id)
+{
+	struct authkeys_index *idx;
+
+	TAILQ_FOREACH(idx, &authkeys_indexes, next) {
+		if (strcmp(idx->path, file) != 0)
+			continue;
+		if (memcmp(idx->id, id, sizeof(idx->id)) == 0)
+			return idx;
+		debug3("%s: %s has changed", __func__, file);
+		authkeys_index_remove(idx);
+		break;
+	}
+	return NULL;
+}
+
+static int
+authkeys_fp_cmp(const void *_a, const void *_b)
+{
+	const struct authkeys_fp *a = _a, *b = _b;
+	int r;
+
+	if ((r = memcmp(a->fp, b->fp, sizeof(a->fp))) != 0)
+		return r;
+	return a->line < b->line ? -1 : a->line > b->line;
+}
+
+static int
+authkeys_u32_cmp(const void *_a, const void *_b)
+{
+	u_int32_t a = *(const u_int32_t *)_a, b = *(const u_int32_t *)_b;
+
+	return a < b ? -1 : a > b;
+}
+
+/* Index the key at *cp, if any.  Returns 0 if a key was found. */
+static int
+authkeys_index_add_key(struct authkeys_index *idx, char *cp, u_int32_t line)
+{
+	struct sshkey *k;
+	u_char *fp;
+	size_t fplen;
+	int r;
+
+	if ((k = sshkey_new(KEY_UNSPEC)) == NULL)
+		fatal("%s: sshkey_new failed", __func__);
+	if (sshkey_read(k, &cp) != 0) {
+		sshkey_free(k);
+		return -1;
+	}
+	/* Only plain keys can match; certificates are matched by CA key */
+	if (!sshkey_is_cert(k)) {
+		if ((r = sshkey_fingerprint_raw(k, SSH_DIGEST_SHA256,
+		    &fp, &fplen)) != 0)
+			fatal("%s: fingerprint failed: %s", __func__,
+			    ssh_err(r));
+		if (fplen != AUTHKEYS_FP_LEN)
+			fatal("%s: bad fingerprint length", __func__);
+		idx->fps = xrecallocarray(idx->fps, idx->nfps, idx->nfps + 1,
+		    sizeof(*idx->fps));
+		memcpy(idx->fps[idx->nfps].fp, fp, fplen);
+		idx->fps[idx->nfps++].line = line;
+		free(fp);
+	}
+	sshkey_free(k);
+	return 0;
+}
+
+static void
+authkeys_index_add_always(struct authkeys_index *idx, u_int32_t line)
+{
+	idx->always = xrecallocarray(idx->always, idx->nalways,
+	    idx->nalways + 1, sizeof(*idx->always));
+	idx->always[idx->nalways++] = line;
+}
+
+/*
+ * Index a file.  check_authkey_line() reads a key from the start of the
+ * line or, failing that, after the options, so both are indexed.
+ */
+static struct authkeys_index *
+authkeys_index_build(FILE *f, const char *file, const u_int64_t *id)
+{
+	struct authkeys_index *idx;
+	struct sshauthopt *keyopts;
+	char *cp, *key_options, *line = NULL;
+	const char *reason;
+	size_t linesize = 0;
+	u_long linenum = 0;
+	u_int32_t n;
+	off_t offset;
+
+	idx = xcalloc(1, sizeof(*idx));
+	idx->path = xstrdup(file);
+	memcpy(idx->id, id, sizeof(idx->id));
+	for (;;) {
+		if ((offset = ftello(f)) == -1) {
+			error("%s: ftello %s: %s", __func__, file,
+			    strerror(errno));
+			goto fail;
+		}
+		if (getline(&line, &linesize, f) == -1)
+			break;
+		linenum++;
+		cp = line;
+		skip_space(&cp);
+		if (!*cp || *cp == '\n' || *cp == '#')
+			continue;
+		idx->lines = xrecallocarray(idx->lines, idx->nlines,
+		    idx->nlines + 1, sizeof(*idx->lines));
+		n = idx->nlines++;
+		idx->lines[n].offset = offset;
+		idx->lines[n].linenum = linenum;
+
+		authkeys_index_add_key(idx, cp, n);
+		key_options = cp;
+		if (advance_past_options(&cp) != 0) {
+			authkeys_index_add_always(idx, n);
+			continue;
+		}
+		skip_space(&cp);
+		if (authkeys_index_add_key(idx, cp, n) != 0)
+			continue;
+		/* Bad options are reported whether or not the key matches */
+		if ((keyopts = sshauthopt_parse(key_options, &reason)) == NULL)
+			authkeys_index_add_always(idx, n);
+		sshauthopt_free(keyopts);
+	}
+	if (ferror(f)) {
+		error("%s: read %s: %s", __func__, file, strerror(errno));
+		goto fail;
+	}
+	free(line);
+	if (idx->nfps > 0)
+		qsort(idx->fps, idx->nfps, sizeof(*idx->fps), authkeys_fp_cmp);
+	idx->dirty = 1;
+	debug3("%s: %s: %u lines, %u keys, %u always checked", __func__,
+	    file, idx->nlines, idx->nfps, idx->nalways);
+	return idx;
+ fail:
+	free(line);
+	authkeys_index_free(idx);
+	return NULL;
+}
+
+/*
+ * Collect the lines that may hold the given plain key, in file order.
+ * Returns the number of lines.
+ */
+static u_int32_t
+authkeys_index_select(const struct authkeys_index *idx,
+    const u_char *fp, u_int32_t **linesp)
+{
+	u_int32_t lo, hi, mid, i, *lines, n = 0;
+
+	for (lo = 0, hi = idx->nfps; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(idx->fps[mid].fp, fp, AUTHKEYS_FP_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (hi = lo; hi < idx->nfps &&
+	    memcmp(idx->fps[hi].fp, fp, AUTHKEYS_FP_LEN) == 0; hi++)
+		;
+	lines = xcalloc((size_t)(hi - lo) + idx->nalways + 1, sizeof(*lines));
+	for (i = lo; i < hi; i++)
+		lines[n++] = idx->fps[i].line;
+	for (i = 0; i < idx->nalways; i++)
+		lines[n++] = idx->always[i];
+	qsort(lines, n, sizeof(*lines), authkeys_u32_cmp);
+	*linesp = lines;
+	return n;
+}
+
+/* Read an indexed line, checking that it still starts where recorded */
+static int
+authkeys_index_read_line(FILE *f, const struct authkeys_line *l,
+    char **linep, size_t *linesizep)
+{
+	if (l->offset > 0) {
+		if (fseeko(f, l->offset - 1, SEEK_SET) != 0 ||
+		    fgetc(f) != '\n')
+			return -1;
+	} else if (fseeko(f, 0, SEEK_SET) != 0)
+		return -1;
+	if (getline(linep, linesizep, f) == -1)
+		return -1;
+	return 0;
+}
+
+/*
+ * As check_authkeys_file(), but reading only the lines that the file's
+ * index says may match.
+ */
+static int
+check_authkeys_index(struct ssh *ssh, struct passwd *pw, FILE *f,
+    char *file, struct sshkey *key, struct sshauthopt **authoptsp)
+{
+	struct authkeys_index *idx;
+	struct stat st;
+	const struct sshkey *target;
+	u_int64_t id[AUTHKEYS_ID_LEN];
+	u_int32_t i, n, *lines = NULL;
+	u_char *fp = NULL;
+	size_t fplen, linesize = 0;
+	char *cp, *line = NULL, loc[256];
+	int r, found_key = 0;
+
+	if (authoptsp != NULL)
+		*authoptsp = NULL;
+
+	target = sshkey_is_cert(key) ? key->cert->signature_key : key;
+	if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (r = sshkey_fingerprint_raw(target, SSH_DIGEST_SHA256,
+	    &fp, &fplen)) != 0 || fplen != AUTHKEYS_FP_LEN)
+		goto scan;
+	authkeys_index_id(&st, id);
+	if ((idx = authkeys_index_find(file, id)) == NULL) {
+		if ((idx = authkeys_index_build(f, file, id)) == NULL)
+			goto scan;
+		authkeys_index_insert(idx);
+	}
+
+	n = authkeys_index_select(idx, fp, &lines);
+	debug3("%s: %s: checking %u of %u lines", __func__, file,
+	    n, idx->nlines);
+	for (i = 0; i < n; i++) {
+		if (i > 0 && lines[i] == lines[i - 1])
+			continue;
+		if (lines[i] >= idx->nlines || authkeys_index_read_line(f,
+		    &idx->lines[lines[i]], &line, &linesize) != 0) {
+			debug("%s: index for %s is stale", __func__, file);
+			authkeys_index_remove(idx);
+			goto scan;
+		}
+		cp = line;
+		skip_space(&cp);
+		snprintf(loc, sizeof(loc), "%.200s:%lu", file,
+		    idx->lines[lines[i]].linenum);
+		if (check_authkey_line(ssh, pw, key, cp, loc, authoptsp) == 0) {
+			found_key = 1;
+			break;
+		}
+	}
+	goto out;
+
+ scan:
+	if (fseeko(f, 0, SEEK_SET) == 0)
+		found_key = check_authkeys_file(ssh, pw, f, file,
+		    key, authoptsp);
+ out:
+	free(line);
+	free(lines);
+	free(fp);
+	return found_key;
+}
+
+/*
+ * Serialise the indexes, or only those built by this process, for
+ * passing between the listener and connection processes.
+ */
+int
+authkeys_index_serialise(struct sshbuf *b, int dirty_only)
+{
+	struct authkeys_index *idx;
+	struct sshbuf *m;
+	u_int32_t i, n = 0;
+	int r;
+
+	if ((m = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	TAILQ_FOREACH(idx, &authkeys_indexes, next) {
+		if (dirty_only && !idx->dirty)
+			continue;
+		if ((r = sshbuf_put_cstring(m, idx->path)) != 0)
+			goto out;
+		for (i = 0; i < AUTHKEYS_ID_LEN; i++) {
+			if ((r = sshbuf_put_u64(m, idx->id[i])) != 0)
+				goto out;
+		}
+		if ((r = sshbuf_put_u32(m, idx->nlines)) != 0)
+			goto out;
+		for (i = 0; i < idx->nlines; i++) {
+			if ((r = sshbuf_put_u64(m,
+			    idx->lines[i].offset)) != 0 ||
+			    (r = sshbuf_put_u64(m,
+			    idx->lines[i].linenum)) != 0)
+				goto out;
+		}
+		if ((r = sshbuf_put_u32(m, idx->nfps)) != 0)
+			goto out;
+		for (i = 0; i < idx->nfps; i++) {
+			if ((r = sshbuf_put(m, idx->fps[i].fp,
+			    AUTHKEYS_FP_LEN)) != 0 ||
+			    (r = sshbuf_put_u32(m, idx->fps[i].line)) != 0)
+				goto out;
+		}
+		if ((r = sshbuf_put_u32(m, idx->nalways)) != 0)
+			goto out;
+		for (i = 0; i < idx->nalways; i++) {
+			if ((r = sshbuf_put_u32(m, idx->always[i])) != 0)
+				goto out;
+		}
+		n++;
+	}
+	if ((r = sshbuf_put_u32(b, n)) != 0 ||
+	    (r = sshbuf_putb(b, m)) != 0)
+		goto out;
+	r = 0;
+ out:
+	sshbuf_free(m);
+	return r;
+}
+
+static int
+authkeys_index_deserialise_one(struct sshbuf *b, struct authkeys_index **idxp)
+{
+	struct authkeys_index *idx;
+	u_int64_t offset, linenum;
+	u_int32_t i;
+	int r;
+
+	*idxp = NULL;
+	idx = xcalloc(1, sizeof(*idx));
+	if ((r = sshbuf_get_cstring(b, &idx->path, NULL)) != 0)
+		goto out;
+	for (i = 0; i < AUTHKEYS_ID_LEN; i++) {
+		if ((r = sshbuf_get_u64(b, &idx->id[i])) != 0)
+			goto out;
+	}
+	if ((r = sshbuf_get_u32(b, &idx->nlines)) != 0)
+		goto out;
+	if (idx->nlines > sshbuf_len(b) / 16) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	idx->lines = xcalloc(idx->nlines + 1, sizeof(*idx->lines));
+	for (i = 0; i < idx->nlines; i++) {
+		if ((r = sshbuf_get_u64(b, &offset)) != 0 ||
+		    (r = sshbuf_get_u64(b, &linenum)) != 0)
+			goto out;
+		/* lines must lie within the file */
+		if (offset >= idx->id[2] || offset > LLONG_MAX ||
+		    linenum > ULONG_MAX) {
+			r = SSH_ERR_INVALID_FORMAT;
+			goto out;
+		}
+		idx->lines[i].offset = (off_t)offset;
+		idx->lines[i].linenum = (u_long)linenum;
+	}
+	if ((r = sshbuf_get_u32(b, &idx->nfps)) != 0)
+		goto out;
+	if (idx->nfps > sshbuf_len(b) / (AUTHKEYS_FP_LEN + 4)) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	idx->fps = xcalloc(idx->nfps + 1, sizeof(*idx->fps));
+	for (i = 0; i < idx->nfps; i++) {
+		if ((r = sshbuf_get(b, idx->fps[i].fp, AUTHKEYS_FP_LEN)) != 0 ||
+		    (r = sshbuf_get_u32(b, &idx->fps[i].line)) != 0)
+			goto out;
+	}
+	qsort(idx->fps, idx->nfps, sizeof(*idx->fps), authkeys_fp_cmp);
+	if ((r = sshbuf_get_u32(b, &idx->nalways)) != 0)
+		goto out;
+	if (idx->nalways > sshbuf_len(b) / 4) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	idx->always = xcalloc(idx->nalways + 1, sizeof(*idx->always));
+	for (i = 0; i < idx->nalways; i++) {
+		if ((r = sshbuf_get_u32(b, &idx->always[i])) != 0)
+			goto out;
+	}
+	*idxp = idx;
+	idx = NULL;
+	r = 0;
+ out:
+	authkeys_index_free(idx);
+	return r;
+}
+
+/* Add serialised indexes, replacing any held for the same files */
+int
+authkeys_index_deserialise(struct sshbuf *b)
+{
+	struct authkeys_index *idx;
+	u_int32_t i, n;
+	int r;
+
+	if ((r = sshbuf_get_u32(b, &n)) != 0)
+		return r;
+	for (i = 0; i < n; i++) {
+		if ((r = authkeys_index_deserialise_one(b, &idx)) != 0)
+			return r;
+		authkeys_index_insert(idx);
+	}
+	return 0;
+}
+
 /* Authenticate a certificate key against TrustedUserCAKeys */
 static int
 user_cert_trusted_ca(struct ssh *ssh, struct passwd *pw, struct sshkey *key,
@@ -844,7 +1346,7 @@ user_key_allowed2(struct ssh *ssh, struct passwd *pw, struct sshkey *key,
 
 	debug("trying public key file %s", file);
 	if ((f = auth_openkeyfile(file, pw, options.strict_modes)) != NULL) {
-		found_key = check_authkeys_file(ssh, pw, f, file,
+		found_key = check_authkeys_index(ssh, pw, f, file,
 		    key, authoptsp);
 		fclose(f);
 	}
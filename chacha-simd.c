@@ -0,0 +1,247 @@
+/*
+ * Placed in the public domain.
+ *
+ * Multi-block ChaCha20 kernels for x86 processing 4 (SSE2) or 8 (AVX2)
+ * blocks at once, one block per vector lane.  The kernel is chosen at
+ * runtime from the CPU features; chacha.c remains the reference and
+ * handles the tail that does not fill a whole batch.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "chacha.h"
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+
+#include <immintrin.h>
+
+/* Advance the 64-bit block counter in input[12..13] by n blocks */
+static void
+chacha_ctr_add(struct chacha_ctx *x, u_int n)
+{
+	u_int32_t lo = x->input[12];
+
+	x->input[12] = lo + n;
+	if (x->input[12] < lo)
+		x->input[13]++;
+}
+
+/* Low and high counter words of the n blocks starting at the current one */
+static void
+chacha_ctr_lanes(const struct chacha_ctx *x, u_int32_t *lo, u_int32_t *hi,
+    u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		lo[i] = x->input[12] + i;
+		hi[i] = x->input[13] + (lo[i] < x->input[12]);
+	}
+}
+
+#define SSE2_ROTL(v, n) \
+	_mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define SSE2_QR(a, b, c, d) do { \
+	a = _mm_add_epi32(a, b); d = SSE2_ROTL(_mm_xor_si128(d, a), 16); \
+	c = _mm_add_epi32(c, d); b = SSE2_ROTL(_mm_xor_si128(b, c), 12); \
+	a = _mm_add_epi32(a, b); d = SSE2_ROTL(_mm_xor_si128(d, a), 8); \
+	c = _mm_add_epi32(c, d); b = SSE2_ROTL(_mm_xor_si128(b, c), 7); \
+} while (0)
+
+/*
+ * Transpose four vectors holding one state word of four blocks each
+ * into four vectors holding four consecutive words of one block.
+ */
+#define SSE2_TRANSPOSE(a, b, c, d) do { \
+	__m128i t0 = _mm_unpacklo_epi32(a, b); \
+	__m128i t1 = _mm_unpacklo_epi32(c, d); \
+	__m128i t2 = _mm_unpackhi_epi32(a, b); \
+	__m128i t3 = _mm_unpackhi_epi32(c, d); \
+	a = _mm_unpacklo_epi64(t0, t1); \
+	b = _mm_unpackhi_epi64(t0, t1); \
+	c = _mm_unpacklo_epi64(t2, t3); \
+	d = _mm_unpackhi_epi64(t2, t3); \
+} while (0)
+
+#define SSE2_XOR_STORE(c, m, off, v) \
+	_mm_storeu_si128((__m128i *)((c) + (off)), _mm_xor_si128(v, \
+	    _mm_loadu_si128((const __m128i *)((m) + (off)))))
+
+__attribute__((target("sse2")))
+static u_int
+chacha_blocks_sse2(struct chacha_ctx *x, const u_char *m, u_char *c,
+    u_int bytes)
+{
+	__m128i j[16], v[16];
+	u_int32_t lo[4], hi[4];
+	u_int done, i, g;
+
+	for (done = 0; bytes - done >= 4 * CHACHA_BLOCKLEN;
+	    done += 4 * CHACHA_BLOCKLEN) {
+		for (i = 0; i < 16; i++)
+			j[i] = _mm_set1_epi32(x->input[i]);
+		chacha_ctr_lanes(x, lo, hi, 4);
+		j[12] = _mm_loadu_si128((const __m128i *)lo);
+		j[13] = _mm_loadu_si128((const __m128i *)hi);
+		for (i = 0; i < 16; i++)
+			v[i] = j[i];
+		for (i = 20; i > 0; i -= 2) {
+			SSE2_QR(v[0], v[4], v[8], v[12]);
+			SSE2_QR(v[1], v[5], v[9], v[13]);
+			SSE2_QR(v[2], v[6], v[10], v[14]);
+			SSE2_QR(v[3], v[7], v[11], v[15]);
+			SSE2_QR(v[0], v[5], v[10], v[15]);
+			SSE2_QR(v[1], v[6], v[11], v[12]);
+			SSE2_QR(v[2], v[7], v[8], v[13]);
+			SSE2_QR(v[3], v[4], v[9], v[14]);
+		}
+		for (i = 0; i < 16; i++)
+			v[i] = _mm_add_epi32(v[i], j[i]);
+		for (g = 0; g < 4; g++) {
+			SSE2_TRANSPOSE(v[4 * g], v[4 * g + 1],
+			    v[4 * g + 2], v[4 * g + 3]);
+			for (i = 0; i < 4; i++)
+				SSE2_XOR_STORE(c + done, m + done,
+				    i * CHACHA_BLOCKLEN + 16 * g,
+				    v[4 * g + i]);
+		}
+		chacha_ctr_add(x, 4);
+	}
+	explicit_bzero(v, sizeof(v));
+	explicit_bzero(j, sizeof(j));
+	return done;
+}
+
+#define AVX2_ROTL(v, n) \
+	_mm256_or_si256(_mm256_slli_epi32(v, n), \
+	    _mm256_srli_epi32(v, 32 - (n)))
+
+#define AVX2_QR(a, b, c, d) do { \
+	a = _mm256_add_epi32(a, b); \
+	d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+	c = _mm256_add_epi32(c, d); \
+	b = AVX2_ROTL(_mm256_xor_si256(b, c), 12); \
+	a = _mm256_add_epi32(a, b); \
+	d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+	c = _mm256_add_epi32(c, d); \
+	b = AVX2_ROTL(_mm256_xor_si256(b, c), 7); \
+} while (0)
+
+/* As SSE2_TRANSPOSE, independently in each 128-bit half */
+#define AVX2_TRANSPOSE(a, b, c, d) do { \
+	__m256i t0 = _mm256_unpacklo_epi32(a, b); \
+	__m256i t1 = _mm256_unpacklo_epi32(c, d); \
+	__m256i t2 = _mm256_unpackhi_epi32(a, b); \
+	__m256i t3 = _mm256_unpackhi_epi32(c, d); \
+	a = _mm256_unpacklo_epi64(t0, t1); \
+	b = _mm256_unpackhi_epi64(t0, t1); \
+	c = _mm256_unpacklo_epi64(t2, t3); \
+	d = _mm256_unpackhi_epi64(t2, t3); \
+} while (0)
+
+__attribute__((target("avx2")))
+static u_int
+chacha_blocks_avx2(struct chacha_ctx *x, const u_char *m, u_char *c,
+    u_int bytes)
+{
+	const __m256i rot16 = _mm256_set_epi8(
+	    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+	    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(
+	    14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+	    14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+	__m256i j[16], v[16];
+	u_int32_t lo[8], hi[8];
+	u_int done, i, g;
+
+	for (done = 0; bytes - done >= 8 * CHACHA_BLOCKLEN;
+	    done += 8 * CHACHA_BLOCKLEN) {
+		for (i = 0; i < 16; i++)
+			j[i] = _mm256_set1_epi32(x->input[i]);
+		chacha_ctr_lanes(x, lo, hi, 8);
+		j[12] = _mm256_loadu_si256((const __m256i *)lo);
+		j[13] = _mm256_loadu_si256((const __m256i *)hi);
+		for (i = 0; i < 16; i++)
+			v[i] = j[i];
+		for (i = 20; i > 0; i -= 2) {
+			AVX2_QR(v[0], v[4], v[8], v[12]);
+			AVX2_QR(v[1], v[5], v[9], v[13]);
+			AVX2_QR(v[2], v[6], v[10], v[14]);
+			AVX2_QR(v[3], v[7], v[11], v[15]);
+			AVX2_QR(v[0], v[5], v[10], v[15]);
+			AVX2_QR(v[1], v[6], v[11], v[12]);
+			AVX2_QR(v[2], v[7], v[8], v[13]);
+			AVX2_QR(v[3], v[4], v[9], v[14]);
+		}
+		for (i = 0; i < 16; i++)
+			v[i] = _mm256_add_epi32(v[i], j[i]);
+		/*
+		 * After the transpose the low half of v[4g+i] holds words
+		 * 4g..4g+3 of block i and the high half those of block i+4.
+		 */
+		for (g = 0; g < 4; g++) {
+			AVX2_TRANSPOSE(v[4 * g], v[4 * g + 1],
+			    v[4 * g + 2], v[4 * g + 3]);
+			for (i = 0; i < 4; i++) {
+				SSE2_XOR_STORE(c + done, m + done,
+				    i * CHACHA_BLOCKLEN + 16 * g,
+				    _mm256_castsi256_si128(v[4 * g + i]));
+				SSE2_XOR_STORE(c + done, m + done,
+				    (i + 4) * CHACHA_BLOCKLEN + 16 * g,
+				    _mm256_extracti128_si256(v[4 * g + i],
+				    1));
+			}
+		}
+		chacha_ctr_add(x, 8);
+	}
+	explicit_bzero(v, sizeof(v));
+	explicit_bzero(j, sizeof(j));
+	return done;
+}
+
+#define CHACHA_SIMD_NONE	0
+#define CHACHA_SIMD_SSE2	1
+#define CHACHA_SIMD_AVX2	2
+
+/*
+ * Process as many whole batches as possible, returning the number of
+ * bytes done.  With AVX2 a remaining batch of four blocks still goes
+ * through the SSE2 kernel.
+ */
+u_int
+chacha_encrypt_blocks_simd(struct chacha_ctx *x, const u_char *m, u_char *c,
+    u_int bytes)
+{
+	static int simd = -1;
+	u_int done = 0;
+
+	if (simd == -1) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			simd = CHACHA_SIMD_AVX2;
+		else if (__builtin_cpu_supports("sse2"))
+			simd = CHACHA_SIMD_SSE2;
+		else
+			simd = CHACHA_SIMD_NONE;
+	}
+	if (simd >= CHACHA_SIMD_AVX2)
+		done = chacha_blocks_avx2(x, m, c, bytes);
+	if (simd >= CHACHA_SIMD_SSE2)
+		done += chacha_blocks_sse2(x, m + done, c + done, bytes - done);
+	return done;
+}
+
+#else /* HAVE_X86_SIMD_DISPATCH */
+
+u_int
+chacha_encrypt_blocks_simd(struct chacha_ctx *x, const u_char *m, u_char *c,
+    u_int bytes)
+{
+	return 0;
+}
+
+#endif /* HAVE_X86_SIMD_DISPATCH */
@@ -97,6 +97,13 @@ chacha_encrypt_bytes(chacha_ctx *x,const u8 *m,u8 *c,u32 bytes)
 
   if (!bytes) return;
 
+  /* let the multi-block kernels do the bulk, if available */
+  i = chacha_encrypt_blocks_simd(x, m, c, bytes);
+  m += i;
+  c += i;
+  bytes -= i;
+  if (!bytes) return;
+
   j0 = x->input[0];
   j1 = x->input[1];
   j2 = x->input[2];
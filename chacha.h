@@ -32,5 +32,11 @@ void chacha_encrypt_bytes(struct chacha_ctx *x, const u_char *m,
     __attribute__((__bounded__(__buffer__, 2, 4)))
     __attribute__((__bounded__(__buffer__, 3, 4)));
 
+/* Multi-block kernels, see chacha-simd.c; returns the bytes processed */
+u_int chacha_encrypt_blocks_simd(struct chacha_ctx *x, const u_char *m,
+    u_char *c, u_int bytes)
+    __attribute__((__bounded__(__buffer__, 2, 4)))
+    __attribute__((__bounded__(__buffer__, 3, 4)));
+
 #endif	/* CHACHA_H */
 
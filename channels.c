@@ -49,6 +49,15 @@
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+# include <sys/epoll.h>
+# define USE_EPOLL
+#endif
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && \
+    defined(SO_ZEROCOPY)
+# include <linux/errqueue.h>
+# define USE_ZEROCOPY
+#endif
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -57,6 +66,13 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#else
+# ifdef HAVE_SYS_POLL_H
+#  include <sys/poll.h>
+# endif
+#endif
 #include <stdarg.h>
 #ifdef HAVE_STDINT_H
  #include <stdint.h>
@@ -83,6 +99,7 @@
 #include "authfd.h"
 #include "pathnames.h"
 #include "match.h"
+#include "probes.h"
 
 /* -- agent forwarding */
 #define	NUM_SOCKS	10
@@ -99,8 +116,20 @@
 #define MAX_DISPLAYS  1000
 
 /* Per-channel callback for pre/post select() actions */
-typedef void chan_fn(struct ssh *, Channel *c,
-    fd_set *readset, fd_set *writeset);
+typedef void chan_fn(struct ssh *, Channel *c);
+
+/*
+ * Event loop backends used by channel_wait_events().  A backend waits until
+ * the descriptors recorded in the channels' io_want (plus any descriptors
+ * supplied by the caller as pollfds) are ready, and reports readiness via
+ * c->io_ready and pollfd revents.
+ */
+struct chan_evloop {
+	const char *name;
+	int (*init)(struct ssh *);
+	int (*wait)(struct ssh *, struct pollfd *, u_int, int);
+	void (*fd_closing)(struct ssh *, int);
+};
 
 /*
  * Data structure for storing which hosts are permitted for forward requests.
@@ -147,6 +176,16 @@ struct permission_set {
 };
 
 /* Master structure for channels state */
+/* Zero-copy output of a freed channel, see channel_zerocopy_free() */
+struct chan_zclinger {
+	TAILQ_ENTRY(chan_zclinger) entry;
+	int sock;			/* duplicate of the channel socket */
+	time_t deadline;		/* reset the connection after this */
+	size_t size;			/* data held by blocks */
+	struct channel_zcblocks blocks;
+};
+TAILQ_HEAD(chan_zclingers, chan_zclinger);
+
 struct ssh_channels {
 	/*
 	 * Pointer to an array containing all allocated channels.  The array
@@ -160,6 +199,10 @@ struct ssh_channels {
 	 */
 	u_int channels_alloc;
 
+	/* Channels currently allocated and allocated in total, for statistics */
+	u_int channels_open;
+	u_int64_t channels_created;
+
 	/*
 	 * Maximum file descriptor value used in any of the channels.  This is
 	 * updated in channel_new.
@@ -205,6 +248,23 @@ struct ssh_channels {
 
 	/* AF_UNSPEC or AF_INET or AF_INET6 */
 	int IPv4or6;
+
+	/*
+	 * Total by which window autotuning may grow the receive windows
+	 * of all channels, and by which it has grown them.
+	 */
+	u_int64_t window_budget;
+	u_int64_t window_grown;
+
+	/* Send forwarded TCP data with MSG_ZEROCOPY where supported */
+	int zerocopy;
+	/* Zero-copy output of freed channels, still used by the kernel */
+	struct chan_zclingers zc_lingering;
+	size_t zc_linger_size;
+
+	/* Event loop backend used by channel_wait_events() and its state */
+	const struct chan_evloop *evloop;
+	void *evloop_ctx;
 };
 
 /* helper */
@@ -217,6 +277,10 @@ static void channel_connect_ctx_free(struct channel_connect *);
 static Channel *rdynamic_connect_prepare(struct ssh *, char *, char *);
 static int rdynamic_connect_finish(struct ssh *, Channel *);
 
+/* zero-copy output helpers */
+static void channel_zerocopy_enable(struct ssh *, Channel *);
+static void channel_zerocopy_free(struct ssh *, Channel *);
+
 /* Setup helper */
 static void channel_handler_init(struct ssh_channels *sc);
 
@@ -236,6 +300,8 @@ channel_init_channels(struct ssh *ssh)
 	sc->channels_alloc = 10;
 	sc->channels = xcalloc(sc->channels_alloc, sizeof(*sc->channels));
 	sc->IPv4or6 = AF_UNSPEC;
+	sc->window_budget = CHAN_WINDOW_BUDGET_DEFAULT;
+	TAILQ_INIT(&sc->zc_lingering);
 	channel_handler_init(sc);
 
 	ssh->chanctxt = sc;
@@ -383,10 +449,16 @@ channel_new(struct ssh *ssh, char *ctype, int type, int rfd, int wfd, int efd,
 	}
 	/* Initialize and return new channel. */
 	c = sc->channels[found] = xcalloc(1, sizeof(Channel));
+	sc->channels_open++;
+	sc->channels_created++;
 	if ((c->input = sshbuf_new()) == NULL ||
 	    (c->output = sshbuf_new()) == NULL ||
 	    (c->extended = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
+	/* Bulk data is appended and drained at once; avoid packing it */
+	if (sshbuf_set_segmented(c->input, CHAN_BUF_SEGMENT) != 0 ||
+	    sshbuf_set_segmented(c->output, CHAN_BUF_SEGMENT) != 0)
+		fatal("%s: sshbuf_set_segmented failed", __func__);
 	c->ostate = CHAN_OUTPUT_OPEN;
 	c->istate = CHAN_INPUT_OPEN;
 	channel_register_fds(ssh, c, rfd, wfd, efd, extusage, nonblock, 0);
@@ -400,6 +472,7 @@ channel_new(struct ssh *ssh, char *ctype, int type, int rfd, int wfd, int efd,
 	c->ctl_chan = -1;
 	c->delayed = 1;		/* prevent call to channel_post handler */
 	TAILQ_INIT(&c->status_confirms);
+	TAILQ_INIT(&c->zc_held);
 	debug("channel %d: new [%s]", found, remote_name);
 	return c;
 }
@@ -429,6 +502,8 @@ channel_close_fd(struct ssh *ssh, int *fdp)
 	int ret = 0, fd = *fdp;
 
 	if (fd != -1) {
+		if (sc->evloop != NULL && sc->evloop->fd_closing != NULL)
+			sc->evloop->fd_closing(ssh, fd);
 		ret = close(fd);
 		*fdp = -1;
 		if (fd == sc->channel_max_fd)
@@ -614,6 +689,7 @@ channel_free(struct ssh *ssh, Channel *c)
 		free(s);
 	}
 
+	channel_zerocopy_free(ssh, c);
 	channel_close_fds(ssh, c);
 	sshbuf_free(c->input);
 	sshbuf_free(c->output);
@@ -635,10 +711,22 @@ channel_free(struct ssh *ssh, Channel *c)
 	if (c->filter_cleanup != NULL && c->filter_ctx != NULL)
 		c->filter_cleanup(ssh, c->self, c->filter_ctx);
 	sc->channels[c->self] = NULL;
+	sc->channels_open--;
+	sc->window_grown -= c->autotune_grown;
 	explicit_bzero(c, sizeof(*c));
 	free(c);
 }
 
+/* Number of channels currently open and opened since the start */
+void
+channel_get_counts(struct ssh *ssh, u_int *nopen, u_int64_t *ntotal)
+{
+	if (nopen != NULL)
+		*nopen = ssh->chanctxt->channels_open;
+	if (ntotal != NULL)
+		*ntotal = ssh->chanctxt->channels_created;
+}
+
 void
 channel_free_all(struct ssh *ssh)
 {
@@ -845,13 +933,16 @@ channel_open_message(struct ssh *ssh)
 		case SSH_CHANNEL_MUX_PROXY:
 		case SSH_CHANNEL_MUX_CLIENT:
 			if ((r = sshbuf_putf(buf, "  #%d %.300s "
-			    "(t%d %s%u i%u/%zu o%u/%zu fd %d/%d cc %d)\r\n",
+			    "(t%d %s%u i%u/%zu o%u/%zu fd %d/%d cc %d "
+			    "win %u/%u rwin %u rtt %.1fms)\r\n",
 			    c->self, c->remote_name,
 			    c->type,
 			    c->have_remote_id ? "r" : "nr", c->remote_id,
 			    c->istate, sshbuf_len(c->input),
 			    c->ostate, sshbuf_len(c->output),
-			    c->rfd, c->wfd, c->ctl_chan)) != 0)
+			    c->rfd, c->wfd, c->ctl_chan,
+			    c->local_window, c->local_window_max,
+			    c->remote_window, c->rtt * 1000.0)) != 0)
 				fatal("%s: sshbuf_putf: %s",
 				    __func__, ssh_err(r));
 			continue;
@@ -1016,33 +1107,30 @@ channel_set_fds(struct ssh *ssh, int id, int rfd, int wfd, int efd,
 }
 
 static void
-channel_pre_listener(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_pre_listener(struct ssh *ssh, Channel *c)
 {
-	FD_SET(c->sock, readset);
+	c->io_want |= SSH_CHAN_IO_SOCK_R;
 }
 
 static void
-channel_pre_connecting(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_pre_connecting(struct ssh *ssh, Channel *c)
 {
 	debug3("channel %d: waiting for connection", c->self);
-	FD_SET(c->sock, writeset);
+	c->io_want |= SSH_CHAN_IO_SOCK_W;
 }
 
 static void
-channel_pre_open(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_pre_open(struct ssh *ssh, Channel *c)
 {
 	if (c->istate == CHAN_INPUT_OPEN &&
 	    c->remote_window > 0 &&
 	    sshbuf_len(c->input) < c->remote_window &&
 	    sshbuf_check_reserve(c->input, CHAN_RBUF) == 0)
-		FD_SET(c->rfd, readset);
+		c->io_want |= SSH_CHAN_IO_RFD;
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
-		if (sshbuf_len(c->output) > 0) {
-			FD_SET(c->wfd, writeset);
+		if (sshbuf_len(c->output) > 0 || c->zc_out != NULL) {
+			c->io_want |= SSH_CHAN_IO_WFD;
 		} else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 			if (CHANNEL_EFD_OUTPUT_ACTIVE(c))
 				debug2("channel %d: "
@@ -1057,12 +1145,12 @@ channel_pre_open(struct ssh *ssh, Channel *c,
 	    c->ostate == CHAN_OUTPUT_CLOSED)) {
 		if (c->extended_usage == CHAN_EXTENDED_WRITE &&
 		    sshbuf_len(c->extended) > 0)
-			FD_SET(c->efd, writeset);
+			c->io_want |= SSH_CHAN_IO_EFD_W;
 		else if (c->efd != -1 && !(c->flags & CHAN_EOF_SENT) &&
 		    (c->extended_usage == CHAN_EXTENDED_READ ||
 		    c->extended_usage == CHAN_EXTENDED_IGNORE) &&
 		    sshbuf_len(c->extended) < c->remote_window)
-			FD_SET(c->efd, readset);
+			c->io_want |= SSH_CHAN_IO_EFD_R;
 	}
 	/* XXX: What about efd? races? */
 }
@@ -1144,8 +1232,7 @@ x11_open_helper(struct ssh *ssh, struct sshbuf *b)
 }
 
 static void
-channel_pre_x11_open(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_pre_x11_open(struct ssh *ssh, Channel *c)
 {
 	int ret = x11_open_helper(ssh, c->output);
 
@@ -1153,7 +1240,7 @@ channel_pre_x11_open(struct ssh *ssh, Channel *c,
 
 	if (ret == 1) {
 		c->type = SSH_CHANNEL_OPEN;
-		channel_pre_open(ssh, c, readset, writeset);
+		channel_pre_open(ssh, c);
 	} else if (ret == -1) {
 		logit("X11 connection rejected because of wrong authentication.");
 		debug2("X11 rejected %d i%d/o%d",
@@ -1168,12 +1255,11 @@ channel_pre_x11_open(struct ssh *ssh, Channel *c,
 }
 
 static void
-channel_pre_mux_client(struct ssh *ssh,
-    Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_mux_client(struct ssh *ssh, Channel *c)
 {
 	if (c->istate == CHAN_INPUT_OPEN && !c->mux_pause &&
 	    sshbuf_check_reserve(c->input, CHAN_RBUF) == 0)
-		FD_SET(c->rfd, readset);
+		c->io_want |= SSH_CHAN_IO_RFD;
 	if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
 		/* clear buffer immediately (discard any partial packet) */
 		sshbuf_reset(c->input);
@@ -1184,7 +1270,7 @@ channel_pre_mux_client(struct ssh *ssh,
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 		if (sshbuf_len(c->output) > 0)
-			FD_SET(c->wfd, writeset);
+			c->io_want |= SSH_CHAN_IO_WFD;
 		else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN)
 			chan_obuf_empty(ssh, c);
 	}
@@ -1478,8 +1564,7 @@ channel_connect_stdio_fwd(struct ssh *ssh,
 
 /* dynamic port forwarding */
 static void
-channel_pre_dynamic(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_pre_dynamic(struct ssh *ssh, Channel *c)
 {
 	const u_char *p;
 	u_int have;
@@ -1491,7 +1576,7 @@ channel_pre_dynamic(struct ssh *ssh, Channel *c,
 	/* check if the fixed size part of the packet is in buffer. */
 	if (have < 3) {
 		/* need more */
-		FD_SET(c->sock, readset);
+		c->io_want |= SSH_CHAN_IO_SOCK_R;
 		return;
 	}
 	/* try to guess the protocol */
@@ -1513,9 +1598,9 @@ channel_pre_dynamic(struct ssh *ssh, Channel *c,
 	} else if (ret == 0) {
 		debug2("channel %d: pre_dynamic: need more", c->self);
 		/* need more */
-		FD_SET(c->sock, readset);
+		c->io_want |= SSH_CHAN_IO_SOCK_R;
 		if (sshbuf_len(c->output))
-			FD_SET(c->sock, writeset);
+			c->io_want |= SSH_CHAN_IO_SOCK_W;
 	} else {
 		/* switch to the next state */
 		c->type = SSH_CHANNEL_OPENING;
@@ -1600,8 +1685,7 @@ channel_before_prepare_select_rdynamic(struct ssh *ssh, Channel *c)
 
 /* This is our fake X11 server socket. */
 static void
-channel_post_x11_listener(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_x11_listener(struct ssh *ssh, Channel *c)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
@@ -1609,7 +1693,7 @@ channel_post_x11_listener(struct ssh *ssh, Channel *c,
 	socklen_t addrlen;
 	char buf[16384], *remote_ipaddr;
 
-	if (!FD_ISSET(c->sock, readset))
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R) == 0)
 		return;
 
 	debug("X11 connection requested.");
@@ -1675,6 +1759,7 @@ port_open_helper(struct ssh *ssh, Channel *c, char *rtype)
 
 	open_preamble(ssh, __func__, c, rtype);
 	if (strcmp(rtype, "direct-tcpip") == 0) {
+		channel_zerocopy_enable(ssh, c);
 		/* target host, port */
 		if ((r = sshpkt_put_cstring(ssh, c->path)) != 0 ||
 		    (r = sshpkt_put_u32(ssh, c->host_port)) != 0) {
@@ -1731,8 +1816,7 @@ channel_set_x11_refuse_time(struct ssh *ssh, u_int refuse_time)
  * This socket is listening for connections to a forwarded TCP/IP port.
  */
 static void
-channel_post_port_listener(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_port_listener(struct ssh *ssh, Channel *c)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
@@ -1740,7 +1824,7 @@ channel_post_port_listener(struct ssh *ssh, Channel *c,
 	socklen_t addrlen;
 	char *rtype;
 
-	if (!FD_ISSET(c->sock, readset))
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R) == 0)
 		return;
 
 	debug("Connection to port %d forwarding to %.100s port %d requested.",
@@ -1791,15 +1875,14 @@ channel_post_port_listener(struct ssh *ssh, Channel *c,
  * clients.
  */
 static void
-channel_post_auth_listener(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_auth_listener(struct ssh *ssh, Channel *c)
 {
 	Channel *nc;
 	int r, newsock;
 	struct sockaddr_storage addr;
 	socklen_t addrlen;
 
-	if (!FD_ISSET(c->sock, readset))
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R) == 0)
 		return;
 
 	addrlen = sizeof(addr);
@@ -1820,13 +1903,12 @@ channel_post_auth_listener(struct ssh *ssh, Channel *c,
 }
 
 static void
-channel_post_connecting(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_connecting(struct ssh *ssh, Channel *c)
 {
 	int err = 0, sock, isopen, r;
 	socklen_t sz = sizeof(err);
 
-	if (!FD_ISSET(c->sock, writeset))
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_W) == 0)
 		return;
 	if (!c->have_remote_id)
 		fatal(":%s: channel %d: no remote id", __func__, c->self);
@@ -1841,6 +1923,8 @@ channel_post_connecting(struct ssh *ssh, Channel *c,
 		    c->self, c->connect_ctx.host, c->connect_ctx.port);
 		channel_connect_ctx_free(&c->connect_ctx);
 		c->type = SSH_CHANNEL_OPEN;
+		if (strcmp(c->ctype, "direct-tcpip") == 0)
+			channel_zerocopy_enable(ssh, c);
 		if (isopen) {
 			/* no message necessary */
 		} else {
@@ -1862,7 +1946,7 @@ channel_post_connecting(struct ssh *ssh, Channel *c,
 		    c->self, strerror(err));
 		/* Try next address, if any */
 		if ((sock = connect_next(&c->connect_ctx)) > 0) {
-			close(c->sock);
+			channel_close_fd(ssh, &c->sock);
 			c->sock = c->rfd = c->wfd = sock;
 			channel_find_maxfd(ssh->chanctxt);
 			return;
@@ -1893,20 +1977,32 @@ channel_post_connecting(struct ssh *ssh, Channel *c,
 }
 
 static int
-channel_handle_rfd(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_handle_rfd(struct ssh *ssh, Channel *c)
 {
 	char buf[CHAN_RBUF];
 	ssize_t len;
-	int r, force;
+	size_t rlen;
+	int r, force, direct;
 
 	force = c->isatty && c->detach_close && c->istate != CHAN_INPUT_CLOSED;
 
-	if (c->rfd == -1 || (!force && !FD_ISSET(c->rfd, readset)))
+	if (c->rfd == -1 || (!force && (c->io_ready & SSH_CHAN_IO_RFD) == 0))
 		return 1;
 
 	errno = 0;
-	len = read(c->rfd, buf, sizeof(buf));
+	/* Plain data is read straight into the channel buffer */
+	direct = c->input_filter == NULL && !c->datagram;
+	if (!direct)
+		len = read(c->rfd, buf, sizeof(buf));
+	else if ((r = sshbuf_read(c->rfd, c->input, sizeof(buf),
+	    &rlen)) == 0)
+		len = rlen;
+	else if (r == SSH_ERR_SYSTEM_ERROR)
+		len = -1;
+	else
+		fatal("%s: channel %d: read: %s", __func__, c->self,
+		    ssh_err(r));
+	SSH_PROBE2(channel_read, c->self, len);
 	if (len < 0 && (errno == EINTR ||
 	    ((errno == EAGAIN || errno == EWOULDBLOCK) && !force)))
 		return 1;
@@ -1927,37 +2023,307 @@ channel_handle_rfd(struct ssh *ssh, Channel *c,
 		}
 		return -1;
 	}
+	if (direct)
+		return 1;
 	if (c->input_filter != NULL) {
 		if (c->input_filter(ssh, c, buf, len) == -1) {
 			debug2("channel %d: filter stops", c->self);
 			chan_read_failed(ssh, c);
 		}
-	} else if (c->datagram) {
-		if ((r = sshbuf_put_string(c->input, buf, len)) != 0)
-			fatal("%s: channel %d: put datagram: %s", __func__,
-			    c->self, ssh_err(r));
-	} else if ((r = sshbuf_put(c->input, buf, len)) != 0) {
-		fatal("%s: channel %d: put data: %s", __func__,
+	} else if ((r = sshbuf_put_string(c->input, buf, len)) != 0) {
+		fatal("%s: channel %d: put datagram: %s", __func__,
 		    c->self, ssh_err(r));
 	}
 	return 1;
 }
 
+/*
+ * Zero-copy output for forwarded TCP connections.  With MSG_ZEROCOPY the
+ * kernel sends straight from the pages of the channel buffer instead of
+ * copying the data into the socket buffer first, so that memory must not
+ * be reused until the kernel reports on the socket error queue that it
+ * is done with it, usually once the data has been acknowledged.  Each
+ * block of c->output is detached before it is sent and held in
+ * c->zc_held until all sends made from it have completed.
+ */
+static void
+channel_zerocopy_enable(struct ssh *ssh, Channel *c)
+{
+#ifdef USE_ZEROCOPY
+	int on = 1;
+
+	if (!ssh->chanctxt->zerocopy || c->sock == -1 || c->zerocopy)
+		return;
+	if (setsockopt(c->sock, SOL_SOCKET, SO_ZEROCOPY,
+	    &on, sizeof(on)) == -1) {
+		debug("channel %d: setsockopt SO_ZEROCOPY: %s", c->self,
+		    strerror(errno));
+		return;
+	}
+	debug2("channel %d: zero-copy output", c->self);
+	c->zerocopy = 1;
+#endif
+}
+
+#ifdef USE_ZEROCOPY
+/*
+ * Reads send completions from sock and frees the blocks in held that are
+ * no longer used, except cur.  Sets *copiedp if the kernel reports that
+ * it copied the data after all.  Returns the size of the memory freed.
+ */
+static size_t
+zerocopy_reap(int sock, struct channel_zcblocks *held,
+    struct channel_zcblock *cur, int *copiedp)
+{
+	struct channel_zcblock *zb, *tmp;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(*serr) +
+		    sizeof(struct sockaddr_in6))];
+	} cmsgbuf;
+	u_int32_t lo, hi;
+	size_t freed = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR)
+				debug2("%s: recvmsg MSG_ERRQUEUE: %s",
+				    __func__, strerror(errno));
+			break;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP &&
+			    cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 &&
+			    cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copiedp = 1;
+			/* Sends lo..hi completed; credit the blocks */
+			lo = serr->ee_info;
+			hi = serr->ee_data;
+			TAILQ_FOREACH(zb, held, entry) {
+				if (zb->nsent == 0 || lo > hi ||
+				    hi < zb->first ||
+				    lo > zb->first + zb->nsent - 1)
+					continue;
+				zb->ndone += MINIMUM(hi,
+				    zb->first + zb->nsent - 1) -
+				    MAXIMUM(lo, zb->first) + 1;
+			}
+		}
+	}
+	TAILQ_FOREACH_SAFE(zb, held, entry, tmp) {
+		if (zb == cur || zb->ndone < zb->nsent)
+			continue;
+		TAILQ_REMOVE(held, zb, entry);
+		freed += zb->size;
+		sshbuf_free(zb->buf);
+		free(zb);
+	}
+	return freed;
+}
+
+static void
+channel_zerocopy_reap(Channel *c)
+{
+	int copied = 0;
+
+	zerocopy_reap(c->sock, &c->zc_held, c->zc_out, &copied);
+	/* e.g. on loopback, where it only costs */
+	if (copied && c->zerocopy) {
+		debug("channel %d: zero-copy output was copied by the "
+		    "kernel, disabling", c->self);
+		c->zerocopy = 0;
+	}
+}
+
+/*
+ * Writes from the block at the head of c->output like write(2), with
+ * MSG_ZEROCOPY while the channel uses it.
+ */
 static int
-channel_handle_wfd(struct ssh *ssh, Channel *c,
-   fd_set *readset, fd_set *writeset)
+channel_write_zerocopy(struct ssh *ssh, Channel *c)
+{
+	struct channel_zcblock *zb;
+	size_t len;
+	ssize_t n;
+	int r, flags = 0;
+
+	if ((zb = c->zc_out) == NULL) {
+		zb = xcalloc(1, sizeof(*zb));
+		if ((r = sshbuf_take_head(c->output, &zb->buf)) != 0)
+			fatal("%s: channel %d: take head: %s", __func__,
+			    c->self, ssh_err(r));
+		zb->size = sshbuf_len(zb->buf);
+		zb->first = c->zc_seq;
+		TAILQ_INSERT_TAIL(&c->zc_held, zb, entry);
+		c->zc_out = zb;
+	}
+	len = sshbuf_len(zb->buf);
+	/* Sequence numbers must not wrap within c->zc_held */
+	if (c->zerocopy && c->zc_seq < UINT32_MAX)
+		flags = MSG_ZEROCOPY;
+	n = send(c->sock, sshbuf_ptr(zb->buf), len, flags);
+	if (n == -1 && errno == ENOBUFS && flags != 0) {
+		/* Too much memory pinned for the socket; copy this one */
+		flags = 0;
+		n = send(c->sock, sshbuf_ptr(zb->buf), len, 0);
+	}
+	if (n <= 0)
+		return n;
+	if (flags != 0) {
+		c->zc_seq++;
+		zb->nsent++;
+	}
+	if ((r = sshbuf_consume(zb->buf, n)) != 0)
+		fatal("%s: channel %d: consume: %s", __func__,
+		    c->self, ssh_err(r));
+	if (sshbuf_len(zb->buf) == 0) {
+		c->zc_out = NULL;
+		if (zb->ndone == zb->nsent) {
+			TAILQ_REMOVE(&c->zc_held, zb, entry);
+			sshbuf_free(zb->buf);
+			free(zb);
+		}
+	}
+	return n;
+}
+
+/*
+ * Closes the socket of lingering output and frees its blocks.  If sends
+ * are still unfinished, the connection is reset so that the kernel drops
+ * the data it has queued instead of sending it from reused memory later.
+ */
+static void
+channel_zerocopy_linger_free(struct ssh_channels *sc,
+    struct chan_zclinger *zl)
+{
+	struct channel_zcblock *zb;
+	struct linger lin;
+
+	if (!TAILQ_EMPTY(&zl->blocks)) {
+		debug("%s: resetting connection with %zu bytes of "
+		    "unfinished zero-copy output", __func__, zl->size);
+		lin.l_onoff = 1;
+		lin.l_linger = 0;
+		if (setsockopt(zl->sock, SOL_SOCKET, SO_LINGER,
+		    &lin, sizeof(lin)) == -1)
+			error("%s: setsockopt SO_LINGER: %s", __func__,
+			    strerror(errno));
+	}
+	close(zl->sock);
+	while ((zb = TAILQ_FIRST(&zl->blocks)) != NULL) {
+		TAILQ_REMOVE(&zl->blocks, zb, entry);
+		sshbuf_free(zb->buf);
+		free(zb);
+	}
+	sc->zc_linger_size -= zl->size;
+	TAILQ_REMOVE(&sc->zc_lingering, zl, entry);
+	free(zl);
+}
+
+/* Frees the output of freed channels once done with or timed out */
+static void
+channel_zerocopy_linger(struct ssh *ssh)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	struct chan_zclinger *zl, *tmp;
+	time_t now = monotime();
+	size_t freed;
+	int copied;
+
+	TAILQ_FOREACH_SAFE(zl, &sc->zc_lingering, entry, tmp) {
+		freed = zerocopy_reap(zl->sock, &zl->blocks, NULL, &copied);
+		zl->size -= freed;
+		sc->zc_linger_size -= freed;
+		if (TAILQ_EMPTY(&zl->blocks) || zl->deadline <= now)
+			channel_zerocopy_linger_free(sc, zl);
+	}
+}
+#endif /* USE_ZEROCOPY */
+
+/*
+ * Called when c is freed.  Blocks the kernel may still send from are
+ * kept with a duplicate of the socket until their sends complete.
+ */
+static void
+channel_zerocopy_free(struct ssh *ssh, Channel *c)
+{
+#ifdef USE_ZEROCOPY
+	struct ssh_channels *sc = ssh->chanctxt;
+	struct chan_zclinger *zl;
+	struct channel_zcblock *zb;
+
+	c->zc_out = NULL;
+	if (TAILQ_EMPTY(&c->zc_held))
+		return;
+	channel_zerocopy_reap(c);
+	if (TAILQ_EMPTY(&c->zc_held))
+		return;
+	zl = xcalloc(1, sizeof(*zl));
+	TAILQ_INIT(&zl->blocks);
+	while ((zb = TAILQ_FIRST(&c->zc_held)) != NULL) {
+		TAILQ_REMOVE(&c->zc_held, zb, entry);
+		TAILQ_INSERT_TAIL(&zl->blocks, zb, entry);
+		zl->size += zb->size;
+	}
+	if ((zl->sock = dup(c->sock)) == -1) {
+		/* Without the socket the memory can only be left alone */
+		error("%s: channel %d: dup: %s; %zu bytes of zero-copy "
+		    "output not freed", __func__, c->self, strerror(errno),
+		    zl->size);
+		free(zl);
+	} else {
+		debug2("channel %d: %zu bytes of zero-copy output in use, "
+		    "lingering", c->self, zl->size);
+		zl->deadline = monotime() + CHAN_ZEROCOPY_LINGER;
+		TAILQ_INSERT_TAIL(&sc->zc_lingering, zl, entry);
+		sc->zc_linger_size += zl->size;
+	}
+	if (sc->zerocopy && sc->zc_linger_size > CHAN_ZEROCOPY_LINGER_MAX) {
+		logit("Output of closed channels holds %zu bytes; "
+		    "disabling zero-copy forwarding", sc->zc_linger_size);
+		sc->zerocopy = 0;
+	}
+#endif
+}
+
+/* Output not yet written, including a block being sent zero-copy */
+static size_t
+channel_output_len(Channel *c)
+{
+	return sshbuf_len(c->output) +
+	    (c->zc_out != NULL ? sshbuf_len(c->zc_out->buf) : 0);
+}
+
+static int
+channel_handle_wfd(struct ssh *ssh, Channel *c)
 {
 	struct termios tio;
 	u_char *data = NULL, *buf; /* XXX const; need filter API change */
-	size_t dlen, olen = 0;
-	int r, len;
+	const u_char *p;
+	size_t dlen, olen = 0, wlen;
+	int r, len, first;
 
-	if (c->wfd == -1 || !FD_ISSET(c->wfd, writeset) ||
-	    sshbuf_len(c->output) == 0)
+	if (c->wfd == -1 || (c->io_ready & SSH_CHAN_IO_WFD) == 0 ||
+	    (sshbuf_len(c->output) == 0 && c->zc_out == NULL))
 		return 1;
 
 	/* Send buffered output data to the socket. */
-	olen = sshbuf_len(c->output);
+	olen = channel_output_len(c);
 	if (c->output_filter != NULL) {
 		if ((buf = c->output_filter(ssh, c, &data, &dlen)) == NULL) {
 			debug2("channel %d: filter stops", c->self);
@@ -1973,13 +2339,15 @@ channel_handle_wfd(struct ssh *ssh, Channel *c,
 			    c->self, ssh_err(r));
 		buf = data;
 	} else {
-		buf = data = sshbuf_mutable_ptr(c->output);
-		dlen = sshbuf_len(c->output);
+		/* Written straight from the channel buffer below */
+		buf = data = NULL;
+		dlen = olen;
 	}
 
 	if (c->datagram) {
 		/* ignore truncated writes, datagrams might get lost */
 		len = write(c->wfd, buf, dlen);
+		SSH_PROBE2(channel_write, c->self, len);
 		free(data);
 		if (len < 0 && (errno == EINTR || errno == EAGAIN ||
 		    errno == EWOULDBLOCK))
@@ -1995,7 +2363,27 @@ channel_handle_wfd(struct ssh *ssh, Channel *c,
 		dlen = MIN(dlen, 8*1024);
 #endif
 
-	len = write(c->wfd, buf, dlen);
+	if (buf != NULL) {
+		first = dlen > 0 ? buf[0] : 0;
+		len = write(c->wfd, buf, dlen);
+	} else {
+		p = sshbuf_peek(c->output, &wlen);
+		first = wlen > 0 ? p[0] : 0;
+#ifdef USE_ZEROCOPY
+		if (c->zc_out != NULL ||
+		    (c->zerocopy && wlen >= CHAN_ZEROCOPY_MIN))
+			len = channel_write_zerocopy(ssh, c);
+		else
+#endif
+		if ((r = sshbuf_write(c->wfd, c->output, dlen, &wlen)) == 0)
+			len = wlen;
+		else if (r == SSH_ERR_SYSTEM_ERROR)
+			len = -1;
+		else
+			fatal("%s: channel %d: write: %s", __func__,
+			    c->self, ssh_err(r));
+	}
+	SSH_PROBE2(channel_write, c->self, len);
 	if (len < 0 &&
 	    (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
 		return 1;
@@ -2011,7 +2399,7 @@ channel_handle_wfd(struct ssh *ssh, Channel *c,
 		return -1;
 	}
 #ifndef BROKEN_TCGETATTR_ICANON
-	if (c->isatty && dlen >= 1 && buf[0] != '\r') {
+	if (c->isatty && dlen >= 1 && first != '\r') {
 		if (tcgetattr(c->wfd, &tio) == 0 &&
 		    !(tio.c_lflag & ECHO) && (tio.c_lflag & ICANON)) {
 			/*
@@ -2027,24 +2415,24 @@ channel_handle_wfd(struct ssh *ssh, Channel *c,
 		}
 	}
 #endif /* BROKEN_TCGETATTR_ICANON */
-	if ((r = sshbuf_consume(c->output, len)) != 0) {
+	if (buf != NULL && (r = sshbuf_consume(c->output, len)) != 0) {
 		fatal("%s: channel %d: consume: %s",
 		    __func__, c->self, ssh_err(r));
 	}
  out:
-	c->local_consumed += olen - sshbuf_len(c->output);
+	c->local_consumed += olen - channel_output_len(c);
 
 	return 1;
 }
 
 static int
-channel_handle_efd_write(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_handle_efd_write(struct ssh *ssh, Channel *c)
 {
 	int r;
 	ssize_t len;
 
-	if (!FD_ISSET(c->efd, writeset) || sshbuf_len(c->extended) == 0)
+	if ((c->io_ready & SSH_CHAN_IO_EFD_W) == 0 ||
+	    sshbuf_len(c->extended) == 0)
 		return 1;
 
 	len = write(c->efd, sshbuf_ptr(c->extended),
@@ -2067,14 +2455,13 @@ channel_handle_efd_write(struct ssh *ssh, Channel *c,
 }
 
 static int
-channel_handle_efd_read(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_handle_efd_read(struct ssh *ssh, Channel *c)
 {
 	char buf[CHAN_RBUF];
 	int r;
 	ssize_t len;
 
-	if (!c->detach_close && !FD_ISSET(c->efd, readset))
+	if (!c->detach_close && (c->io_ready & SSH_CHAN_IO_EFD_R) == 0)
 		return 1;
 
 	len = read(c->efd, buf, sizeof(buf));
@@ -2099,8 +2486,7 @@ channel_handle_efd_read(struct ssh *ssh, Channel *c,
 }
 
 static int
-channel_handle_efd(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_handle_efd(struct ssh *ssh, Channel *c)
 {
 	if (c->efd == -1)
 		return 1;
@@ -2108,17 +2494,82 @@ channel_handle_efd(struct ssh *ssh, Channel *c,
 	/** XXX handle drain efd, too */
 
 	if (c->extended_usage == CHAN_EXTENDED_WRITE)
-		return channel_handle_efd_write(ssh, c, readset, writeset);
+		return channel_handle_efd_write(ssh, c);
 	else if (c->extended_usage == CHAN_EXTENDED_READ ||
 	    c->extended_usage == CHAN_EXTENDED_IGNORE)
-		return channel_handle_efd_read(ssh, c, readset, writeset);
+		return channel_handle_efd_read(ssh, c);
 
 	return 1;
 }
 
+/*
+ * Receive window autotuning.  The round trip time is measured from
+ * sending a window adjust to receiving the first data that the peer could
+ * not have sent without it.  If over a round trip nearly a whole window
+ * of data was consumed, the window is what limits the transfer, so it is
+ * grown to twice the data consumed per round trip, within the budget for
+ * all channels.  Called when a window adjust is about to be sent; returns
+ * the amount to add to it.
+ */
+static u_int
+channel_autotune_window(struct ssh *ssh, Channel *c)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	double now = monotime_double(), elapsed;
+	u_int64_t per_rtt, target, grow;
+
+	if (c->autotune_sent == 0) {
+		c->autotune_edge = c->local_rcvd + c->local_window;
+		c->autotune_sent = now;
+	}
+	if (c->autotune_start == 0)
+		c->autotune_start = now;
+	c->autotune_consumed += c->local_consumed;
+	elapsed = now - c->autotune_start;
+	if (c->rtt == 0 || elapsed < c->rtt)
+		return 0;
+	per_rtt = c->autotune_consumed * c->rtt / elapsed;
+	c->autotune_start = now;
+	c->autotune_consumed = 0;
+
+	if (per_rtt * 4 < (u_int64_t)c->local_window_max * 3 ||
+	    sc->window_grown >= sc->window_budget)
+		return 0;
+	target = MINIMUM(per_rtt * 2, CHAN_WINDOW_MAX);
+	if (target < (u_int64_t)c->local_window_max + c->local_maxpacket)
+		return 0;
+	grow = MINIMUM(target - c->local_window_max,
+	    sc->window_budget - sc->window_grown);
+	sc->window_grown += grow;
+	c->autotune_grown += grow;
+	c->local_window_max += grow;
+	debug2("channel %d: window grown to %u, rtt %.1fms", c->self,
+	    c->local_window_max, c->rtt * 1000.0);
+	return grow;
+}
+
+/* Account for data received on c and complete any round trip sample */
+static void
+channel_data_received(Channel *c, size_t len)
+{
+	double sample;
+
+	c->local_window -= len;
+	c->local_rcvd += len;
+	if (c->autotune_sent == 0 || c->local_rcvd <= c->autotune_edge)
+		return;
+	sample = monotime_double() - c->autotune_sent;
+	if (c->rtt == 0 || sample < c->rtt)
+		c->rtt = sample;
+	else
+		c->rtt = (7 * c->rtt + sample) / 8;
+	c->autotune_sent = 0;
+}
+
 static int
 channel_check_window(struct ssh *ssh, Channel *c)
 {
+	u_int adjust;
 	int r;
 
 	if (c->type == SSH_CHANNEL_OPEN &&
@@ -2130,30 +2581,35 @@ channel_check_window(struct ssh *ssh, Channel *c)
 		if (!c->have_remote_id)
 			fatal(":%s: channel %d: no remote id",
 			    __func__, c->self);
+		adjust = c->local_consumed + channel_autotune_window(ssh, c);
 		if ((r = sshpkt_start(ssh,
 		    SSH2_MSG_CHANNEL_WINDOW_ADJUST)) != 0 ||
 		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-		    (r = sshpkt_put_u32(ssh, c->local_consumed)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, adjust)) != 0 ||
 		    (r = sshpkt_send(ssh)) != 0) {
 			fatal("%s: channel %i: %s", __func__,
 			    c->self, ssh_err(r));
 		}
 		debug2("channel %d: window %d sent adjust %d",
-		    c->self, c->local_window,
-		    c->local_consumed);
-		c->local_window += c->local_consumed;
+		    c->self, c->local_window, adjust);
+		c->local_window += adjust;
 		c->local_consumed = 0;
 	}
 	return 1;
 }
 
 static void
-channel_post_open(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_open(struct ssh *ssh, Channel *c)
 {
-	channel_handle_rfd(ssh, c, readset, writeset);
-	channel_handle_wfd(ssh, c, readset, writeset);
-	channel_handle_efd(ssh, c, readset, writeset);
+#ifdef USE_ZEROCOPY
+	/* Send completions on the error queue make the socket ready */
+	if (!TAILQ_EMPTY(&c->zc_held) &&
+	    (c->io_ready & (SSH_CHAN_IO_RFD|SSH_CHAN_IO_WFD)) != 0)
+		channel_zerocopy_reap(c);
+#endif
+	channel_handle_rfd(ssh, c);
+	channel_handle_wfd(ssh, c);
+	channel_handle_efd(ssh, c);
 	channel_check_window(ssh, c);
 }
 
@@ -2184,12 +2640,11 @@ read_mux(struct ssh *ssh, Channel *c, u_int need)
 }
 
 static void
-channel_post_mux_client_read(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_mux_client_read(struct ssh *ssh, Channel *c)
 {
 	u_int need;
 
-	if (c->rfd == -1 || !FD_ISSET(c->rfd, readset))
+	if (c->rfd == -1 || (c->io_ready & SSH_CHAN_IO_RFD) == 0)
 		return;
 	if (c->istate != CHAN_INPUT_OPEN && c->istate != CHAN_INPUT_WAIT_DRAIN)
 		return;
@@ -2221,13 +2676,12 @@ channel_post_mux_client_read(struct ssh *ssh, Channel *c,
 }
 
 static void
-channel_post_mux_client_write(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_mux_client_write(struct ssh *ssh, Channel *c)
 {
 	ssize_t len;
 	int r;
 
-	if (c->wfd == -1 || !FD_ISSET(c->wfd, writeset) ||
+	if (c->wfd == -1 || (c->io_ready & SSH_CHAN_IO_WFD) == 0 ||
 	    sshbuf_len(c->output) == 0)
 		return;
 
@@ -2244,16 +2698,14 @@ channel_post_mux_client_write(struct ssh *ssh, Channel *c,
 }
 
 static void
-channel_post_mux_client(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_mux_client(struct ssh *ssh, Channel *c)
 {
-	channel_post_mux_client_read(ssh, c, readset, writeset);
-	channel_post_mux_client_write(ssh, c, readset, writeset);
+	channel_post_mux_client_read(ssh, c);
+	channel_post_mux_client_write(ssh, c);
 }
 
 static void
-channel_post_mux_listener(struct ssh *ssh, Channel *c,
-    fd_set *readset, fd_set *writeset)
+channel_post_mux_listener(struct ssh *ssh, Channel *c)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
@@ -2262,7 +2714,7 @@ channel_post_mux_listener(struct ssh *ssh, Channel *c,
 	uid_t euid;
 	gid_t egid;
 
-	if (!FD_ISSET(c->sock, readset))
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R) == 0)
 		return;
 
 	debug("multiplexing control connection");
@@ -2368,8 +2820,7 @@ channel_garbage_collect(struct ssh *ssh, Channel *c)
 enum channel_table { CHAN_PRE, CHAN_POST };
 
 static void
-channel_handler(struct ssh *ssh, int table,
-    fd_set *readset, fd_set *writeset, time_t *unpause_secs)
+channel_handler(struct ssh *ssh, int table, time_t *unpause_secs)
 {
 	struct ssh_channels *sc = ssh->chanctxt;
 	chan_fn **ftab = table == CHAN_PRE ? sc->channel_pre : sc->channel_post;
@@ -2380,10 +2831,16 @@ channel_handler(struct ssh *ssh, int table,
 	now = monotime();
 	if (unpause_secs != NULL)
 		*unpause_secs = 0;
+#ifdef USE_ZEROCOPY
+	if (table == CHAN_PRE && !TAILQ_EMPTY(&sc->zc_lingering))
+		channel_zerocopy_linger(ssh);
+#endif
 	for (i = 0, oalloc = sc->channels_alloc; i < oalloc; i++) {
 		c = sc->channels[i];
 		if (c == NULL)
 			continue;
+		if (table == CHAN_PRE)
+			c->io_want = 0;
 		if (c->delayed) {
 			if (table == CHAN_PRE)
 				c->delayed = 0;
@@ -2395,7 +2852,7 @@ channel_handler(struct ssh *ssh, int table,
 			 * Run handlers that are not paused.
 			 */
 			if (c->notbefore <= now)
-				(*ftab[c->type])(ssh, c, readset, writeset);
+				(*ftab[c->type])(ssh, c);
 			else if (unpause_secs != NULL) {
 				/*
 				 * Collect the time that the earliest
@@ -2409,8 +2866,13 @@ channel_handler(struct ssh *ssh, int table,
 					*unpause_secs = c->notbefore - now;
 			}
 		}
+		if (table == CHAN_POST)
+			c->io_ready = 0;
 		channel_garbage_collect(ssh, c);
 	}
+	/* Check on the output of freed channels every second */
+	if (unpause_secs != NULL && !TAILQ_EMPTY(&sc->zc_lingering))
+		*unpause_secs = 1;
 	if (unpause_secs != NULL && *unpause_secs != 0)
 		debug3("%s: first channel unpauses in %d seconds",
 		    __func__, (int)*unpause_secs);
@@ -2438,23 +2900,61 @@ channel_before_prepare_select(struct ssh *ssh)
 }
 
 /*
- * Allocate/update select bitmasks and add any bits relevant to channels in
- * select bitmasks.
+ * Returns the SSH_CHAN_IO_* flags in 'mask' that refer to file descriptor
+ * 'fd' of channel 'c'.
  */
-void
-channel_prepare_select(struct ssh *ssh, fd_set **readsetp, fd_set **writesetp,
-    int *maxfdp, u_int *nallocp, time_t *minwait_secs)
+static u_int
+channel_fd_flags(Channel *c, int fd, u_int mask)
 {
-	u_int n, sz, nfdset;
+	u_int ret = 0;
 
-	channel_before_prepare_select(ssh); /* might update channel_max_fd */
+	if (fd == -1)
+		return 0;
+	if (fd == c->rfd)
+		ret |= SSH_CHAN_IO_RFD;
+	if (fd == c->wfd)
+		ret |= SSH_CHAN_IO_WFD;
+	if (fd == c->efd)
+		ret |= SSH_CHAN_IO_EFD_R|SSH_CHAN_IO_EFD_W;
+	if (fd == c->sock)
+		ret |= SSH_CHAN_IO_SOCK_R|SSH_CHAN_IO_SOCK_W;
+	return ret & mask;
+}
 
-	n = MAXIMUM(*maxfdp, ssh->chanctxt->channel_max_fd);
+/*
+ * Fills 'fds' with the distinct file descriptors in use by channel 'c'.
+ * Returns the number of descriptors stored.
+ */
+static u_int
+channel_fds(Channel *c, int fds[4])
+{
+	int cand[4] = { c->rfd, c->wfd, c->efd, c->sock };
+	u_int i, j, n = 0;
+
+	for (i = 0; i < 4; i++) {
+		if (cand[i] == -1)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (fds[j] == cand[i])
+				break;
+		}
+		if (j == n)
+			fds[n++] = cand[i];
+	}
+	return n;
+}
+
+/* Allocate/clear select bitmasks large enough for 'maxfd' */
+static void
+channel_alloc_fdsets(fd_set **readsetp, fd_set **writesetp, int maxfd,
+    u_int *nallocp)
+{
+	u_int sz, nfdset;
 
-	nfdset = howmany(n+1, NFDBITS);
+	nfdset = howmany(maxfd+1, NFDBITS);
 	/* Explicitly test here, because xrealloc isn't always called */
 	if (nfdset && SIZE_MAX / nfdset < sizeof(fd_mask))
-		fatal("channel_prepare_select: max_fd (%d) is too large", n);
+		fatal("%s: max_fd (%d) is too large", __func__, maxfd);
 	sz = nfdset * sizeof(fd_mask);
 
 	/* perhaps check sz < nalloc/2 and shrink? */
@@ -2463,13 +2963,97 @@ channel_prepare_select(struct ssh *ssh, fd_set **readsetp, fd_set **writesetp,
 		*writesetp = xreallocarray(*writesetp, nfdset, sizeof(fd_mask));
 		*nallocp = sz;
 	}
-	*maxfdp = n;
 	memset(*readsetp, 0, sz);
 	memset(*writesetp, 0, sz);
+}
 
-	if (!ssh_packet_is_rekeying(ssh))
-		channel_handler(ssh, CHAN_PRE, *readsetp, *writesetp,
-		    minwait_secs);
+/* Add descriptors for the channels' io_want to select bitmasks */
+static void
+channel_fill_fdsets(struct ssh *ssh, fd_set *readset, fd_set *writeset)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	Channel *c;
+	u_int i, j, n;
+	int fds[4];
+
+	for (i = 0; i < sc->channels_alloc; i++) {
+		if ((c = sc->channels[i]) == NULL || c->io_want == 0)
+			continue;
+		n = channel_fds(c, fds);
+		for (j = 0; j < n; j++) {
+			if ((c->io_want & channel_fd_flags(c, fds[j],
+			    SSH_CHAN_IO_READ)) != 0)
+				FD_SET(fds[j], readset);
+			if ((c->io_want & channel_fd_flags(c, fds[j],
+			    SSH_CHAN_IO_WRITE)) != 0)
+				FD_SET(fds[j], writeset);
+		}
+	}
+}
+
+/* Set the channels' io_ready from select bitmasks */
+static void
+channel_check_fdsets(struct ssh *ssh, fd_set *readset, fd_set *writeset)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	Channel *c;
+	u_int i, j, n;
+	int fds[4];
+
+	for (i = 0; i < sc->channels_alloc; i++) {
+		if ((c = sc->channels[i]) == NULL || c->io_want == 0)
+			continue;
+		n = channel_fds(c, fds);
+		for (j = 0; j < n; j++) {
+			if (FD_ISSET(fds[j], readset))
+				c->io_ready |= channel_fd_flags(c, fds[j],
+				    SSH_CHAN_IO_READ);
+			if (FD_ISSET(fds[j], writeset))
+				c->io_ready |= channel_fd_flags(c, fds[j],
+				    SSH_CHAN_IO_WRITE);
+		}
+	}
+}
+
+/*
+ * Run the pre handlers, which record the IO each channel is interested in
+ * in c->io_want.  Used by both the select and event backend interfaces.
+ */
+void
+channel_prepare_events(struct ssh *ssh, time_t *minwait_secs)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	u_int i;
+
+	channel_before_prepare_select(ssh); /* might update channel_max_fd */
+
+	if (!ssh_packet_is_rekeying(ssh)) {
+		channel_handler(ssh, CHAN_PRE, minwait_secs);
+		return;
+	}
+	for (i = 0; i < sc->channels_alloc; i++) {
+		if (sc->channels[i] != NULL)
+			sc->channels[i]->io_want = 0;
+	}
+}
+
+/*
+ * Allocate/update select bitmasks and add any bits relevant to channels in
+ * select bitmasks.
+ */
+void
+channel_prepare_select(struct ssh *ssh, fd_set **readsetp, fd_set **writesetp,
+    int *maxfdp, u_int *nallocp, time_t *minwait_secs)
+{
+	int n;
+
+	channel_prepare_events(ssh, minwait_secs);
+
+	n = MAXIMUM(*maxfdp, ssh->chanctxt->channel_max_fd);
+	channel_alloc_fdsets(readsetp, writesetp, n, nallocp);
+	*maxfdp = n;
+
+	channel_fill_fdsets(ssh, *readsetp, *writesetp);
 }
 
 /*
@@ -2479,7 +3063,427 @@ channel_prepare_select(struct ssh *ssh, fd_set **readsetp, fd_set **writesetp,
 void
 channel_after_select(struct ssh *ssh, fd_set *readset, fd_set *writeset)
 {
-	channel_handler(ssh, CHAN_POST, readset, writeset, NULL);
+	channel_check_fdsets(ssh, readset, writeset);
+	channel_handler(ssh, CHAN_POST, NULL);
+}
+
+/*
+ * After channel_wait_events(), perform any appropriate operations for
+ * channels which have events pending.
+ */
+void
+channel_after_events(struct ssh *ssh)
+{
+	channel_handler(ssh, CHAN_POST, NULL);
+}
+
+/* select(2) backend */
+
+struct chan_select_ctx {
+	fd_set *readset;
+	fd_set *writeset;
+	u_int nalloc;
+};
+
+static int
+chan_select_init(struct ssh *ssh)
+{
+	ssh->chanctxt->evloop_ctx = xcalloc(1, sizeof(struct chan_select_ctx));
+	return 0;
+}
+
+static int
+chan_select_wait(struct ssh *ssh, struct pollfd *pfd, u_int npfd,
+    int timeout_ms)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	struct chan_select_ctx *ctx = sc->evloop_ctx;
+	struct timeval tv, *tvp = NULL;
+	int ret, maxfd = sc->channel_max_fd;
+	u_int i;
+
+	for (i = 0; i < npfd; i++)
+		maxfd = MAXIMUM(maxfd, pfd[i].fd);
+	channel_alloc_fdsets(&ctx->readset, &ctx->writeset, maxfd,
+	    &ctx->nalloc);
+	channel_fill_fdsets(ssh, ctx->readset, ctx->writeset);
+	for (i = 0; i < npfd; i++) {
+		if (pfd[i].fd < 0)
+			continue;
+		if ((pfd[i].events & POLLIN) != 0)
+			FD_SET(pfd[i].fd, ctx->readset);
+		if ((pfd[i].events & POLLOUT) != 0)
+			FD_SET(pfd[i].fd, ctx->writeset);
+	}
+	if (timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = 1000 * (timeout_ms % 1000);
+		tvp = &tv;
+	}
+
+	if ((ret = select(maxfd + 1, ctx->readset, ctx->writeset,
+	    NULL, tvp)) == -1) {
+		memset(ctx->readset, 0, ctx->nalloc);
+		memset(ctx->writeset, 0, ctx->nalloc);
+	}
+
+	channel_check_fdsets(ssh, ctx->readset, ctx->writeset);
+	for (i = 0; i < npfd; i++) {
+		if (pfd[i].fd < 0)
+			continue;
+		if (FD_ISSET(pfd[i].fd, ctx->readset))
+			pfd[i].revents |= POLLIN;
+		if (FD_ISSET(pfd[i].fd, ctx->writeset))
+			pfd[i].revents |= POLLOUT;
+	}
+	return ret;
+}
+
+#ifdef USE_EPOLL
+/*
+ * epoll(7) backend.  Descriptors stay registered with the kernel across
+ * iterations and are only modified when a channel's interest in them
+ * changes, so the kernel's cost of a wakeup scales with the number of
+ * ready descriptors rather than with the highest descriptor number.  The
+ * interest set is still gathered from every channel's io_want, and the
+ * channel handlers still run for every channel, so each iteration remains
+ * O(channels) in userland.
+ */
+
+struct chan_epoll_fd {
+	u_int want;		/* EPOLLIN/EPOLLOUT wanted this round */
+	u_int registered;	/* events currently registered in kernel */
+	u_int revents;		/* POLLIN/POLLOUT ready this round */
+	u_int gen;		/* round in which 'want' was computed */
+	int chan;		/* owning channel or -1 */
+	int always;		/* not pollable; always ready */
+};
+
+struct chan_epoll_ctx {
+	int epfd;
+	u_int gen;
+	struct chan_epoll_fd *fds;	/* indexed by file descriptor */
+	u_int nfds;
+	int *touched, *otouched;	/* fds wanted this/last round */
+	u_int ntouched, notouched, touched_alloc;
+	struct epoll_event *events;
+	u_int nevents;
+	u_int nready;
+	int shared;		/* a descriptor is used by >1 channel */
+	pid_t pid;		/* process that owns the epoll instance */
+};
+
+static int
+chan_epoll_init(struct ssh *ssh)
+{
+	struct chan_epoll_ctx *ctx;
+	int epfd;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		debug("%s: epoll_create1: %s", __func__, strerror(errno));
+		return -1;
+	}
+	ctx = xcalloc(1, sizeof(*ctx));
+	ctx->epfd = epfd;
+	ctx->pid = getpid();
+	ssh->chanctxt->evloop_ctx = ctx;
+	return 0;
+}
+
+static struct chan_epoll_fd *
+chan_epoll_lookup(struct chan_epoll_ctx *ctx, int fd)
+{
+	u_int n;
+
+	if ((u_int)fd >= ctx->nfds) {
+		n = roundup(fd + 1, 64);
+		ctx->fds = xrecallocarray(ctx->fds, ctx->nfds, n,
+		    sizeof(*ctx->fds));
+		ctx->nfds = n;
+	}
+	return &ctx->fds[fd];
+}
+
+/* Record interest in 'events' on 'fd' for the current round */
+static void
+chan_epoll_want(struct chan_epoll_ctx *ctx, int fd, u_int events, int chan)
+{
+	struct chan_epoll_fd *e;
+
+	if (fd < 0)
+		return;
+	e = chan_epoll_lookup(ctx, fd);
+	if (e->gen != ctx->gen) {
+		e->gen = ctx->gen;
+		e->want = 0;
+		e->chan = chan;
+		if (ctx->ntouched >= ctx->touched_alloc) {
+			ctx->touched_alloc =
+			    MAXIMUM(64, ctx->touched_alloc * 2);
+			ctx->touched = xreallocarray(ctx->touched,
+			    ctx->touched_alloc, sizeof(*ctx->touched));
+			ctx->otouched = xreallocarray(ctx->otouched,
+			    ctx->touched_alloc, sizeof(*ctx->otouched));
+		}
+		ctx->touched[ctx->ntouched++] = fd;
+	} else if (e->chan != chan)
+		ctx->shared = 1;
+	e->want |= events;
+}
+
+/* Bring the kernel's interest set for 'fd' in line with e->want */
+static void
+chan_epoll_update(struct chan_epoll_ctx *ctx, int fd)
+{
+	struct chan_epoll_fd *e = &ctx->fds[fd];
+	struct epoll_event ev;
+	int op;
+
+	if (e->gen != ctx->gen)
+		e->want = 0;
+	if (e->want == e->registered || e->always)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = e->want;
+	ev.data.fd = fd;
+	if (e->want == 0)
+		op = EPOLL_CTL_DEL;
+	else
+		op = e->registered == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(ctx->epfd, op, fd, &ev) == -1) {
+		if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			op = EPOLL_CTL_MOD;
+		else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			op = EPOLL_CTL_ADD;
+		else if (op == EPOLL_CTL_ADD && errno == EPERM) {
+			/* Regular files etc. are always ready */
+			debug3("%s: fd %d is not pollable", __func__, fd);
+			e->always = 1;
+			return;
+		} else if (op == EPOLL_CTL_DEL &&
+		    (errno == ENOENT || errno == EBADF)) {
+			e->registered = 0;
+			return;
+		} else
+			fatal("%s: epoll_ctl fd %d: %s", __func__, fd,
+			    strerror(errno));
+		if (epoll_ctl(ctx->epfd, op, fd, &ev) == -1)
+			fatal("%s: epoll_ctl fd %d: %s", __func__, fd,
+			    strerror(errno));
+	}
+	e->registered = e->want;
+}
+
+static int
+chan_epoll_wait(struct ssh *ssh, struct pollfd *pfd, u_int npfd,
+    int timeout_ms)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	struct chan_epoll_ctx *ctx = sc->evloop_ctx;
+	struct chan_epoll_fd *e;
+	Channel *c;
+	u_int i, j, n, ev, events;
+	int ret, fd, fds[4], *tmp;
+
+	/* Forget readiness from the previous round */
+	for (i = 0; i < ctx->nready; i++) {
+		if ((fd = ctx->events[i].data.fd) >= 0 && (u_int)fd < ctx->nfds)
+			ctx->fds[fd].revents = 0;
+	}
+	ctx->nready = 0;
+
+	/* Compute this round's interest set */
+	if (++ctx->gen == 0)
+		ctx->gen = 1;
+	tmp = ctx->otouched;
+	ctx->otouched = ctx->touched;
+	ctx->touched = tmp;
+	ctx->notouched = ctx->ntouched;
+	ctx->ntouched = 0;
+	ctx->shared = 0;
+	for (i = 0; i < sc->channels_alloc; i++) {
+		if ((c = sc->channels[i]) == NULL)
+			continue;
+		n = channel_fds(c, fds);
+		for (j = 0; j < n; j++) {
+			ev = 0;
+			if ((c->io_want & channel_fd_flags(c, fds[j],
+			    SSH_CHAN_IO_READ)) != 0)
+				ev |= EPOLLIN;
+			if ((c->io_want & channel_fd_flags(c, fds[j],
+			    SSH_CHAN_IO_WRITE)) != 0)
+				ev |= EPOLLOUT;
+			chan_epoll_want(ctx, fds[j], ev, c->self);
+		}
+	}
+	for (i = 0; i < npfd; i++) {
+		ev = 0;
+		if ((pfd[i].events & POLLIN) != 0)
+			ev |= EPOLLIN;
+		if ((pfd[i].events & POLLOUT) != 0)
+			ev |= EPOLLOUT;
+		chan_epoll_want(ctx, pfd[i].fd, ev, -1);
+	}
+
+	/* Apply changes, including descriptors no longer of interest */
+	for (i = 0; i < ctx->ntouched; i++)
+		chan_epoll_update(ctx, ctx->touched[i]);
+	for (i = 0; i < ctx->notouched; i++) {
+		if ((u_int)ctx->otouched[i] < ctx->nfds)
+			chan_epoll_update(ctx, ctx->otouched[i]);
+	}
+
+	/* Descriptors that can't be polled are always ready */
+	for (i = 0; i < ctx->ntouched; i++) {
+		e = &ctx->fds[ctx->touched[i]];
+		if (e->always && e->want != 0) {
+			timeout_ms = 0;
+			break;
+		}
+	}
+
+	if (ctx->nevents < MAXIMUM(ctx->ntouched, 1)) {
+		ctx->nevents = MAXIMUM(ctx->ntouched, 1);
+		ctx->events = xreallocarray(ctx->events, ctx->nevents,
+		    sizeof(*ctx->events));
+	}
+	if ((ret = epoll_wait(ctx->epfd, ctx->events, ctx->nevents,
+	    timeout_ms)) == -1) {
+		for (i = 0; i < npfd; i++)
+			pfd[i].revents = 0;
+		return -1;
+	}
+	ctx->nready = ret;
+
+	for (i = 0; i < ctx->nready; i++) {
+		fd = ctx->events[i].data.fd;
+		events = ctx->events[i].events;
+		if (fd < 0 || (u_int)fd >= ctx->nfds)
+			continue;
+		e = &ctx->fds[fd];
+		if (e->gen != ctx->gen)
+			continue;
+		if ((e->want & EPOLLIN) != 0 &&
+		    (events & (EPOLLIN|EPOLLHUP|EPOLLERR)) != 0)
+			e->revents |= POLLIN;
+		if ((e->want & EPOLLOUT) != 0 &&
+		    (events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) != 0)
+			e->revents |= POLLOUT;
+		if (e->revents == 0 || e->chan < 0 || ctx->shared ||
+		    (u_int)e->chan >= sc->channels_alloc ||
+		    (c = sc->channels[e->chan]) == NULL)
+			continue;
+		if ((e->revents & POLLIN) != 0)
+			c->io_ready |= channel_fd_flags(c, fd,
+			    SSH_CHAN_IO_READ);
+		if ((e->revents & POLLOUT) != 0)
+			c->io_ready |= channel_fd_flags(c, fd,
+			    SSH_CHAN_IO_WRITE);
+	}
+	for (i = 0; i < ctx->ntouched; i++) {
+		e = &ctx->fds[ctx->touched[i]];
+		if (!e->always)
+			continue;
+		e->revents = ((e->want & EPOLLIN) ? POLLIN : 0) |
+		    ((e->want & EPOLLOUT) ? POLLOUT : 0);
+		if (e->chan >= 0 && !ctx->shared &&
+		    (u_int)e->chan < sc->channels_alloc &&
+		    (c = sc->channels[e->chan]) != NULL)
+			c->io_ready |= channel_fd_flags(c, ctx->touched[i],
+			    (e->revents & POLLIN ? SSH_CHAN_IO_READ : 0) |
+			    (e->revents & POLLOUT ? SSH_CHAN_IO_WRITE : 0));
+	}
+
+	/*
+	 * If a descriptor is shared between channels then the owner recorded
+	 * for it is ambiguous; fall back to checking every channel.
+	 */
+	for (i = 0; ctx->shared && i < sc->channels_alloc; i++) {
+		if ((c = sc->channels[i]) == NULL || c->io_want == 0)
+			continue;
+		n = channel_fds(c, fds);
+		for (j = 0; j < n; j++) {
+			e = &ctx->fds[fds[j]];
+			if ((e->revents & POLLIN) != 0)
+				c->io_ready |= channel_fd_flags(c, fds[j],
+				    SSH_CHAN_IO_READ);
+			if ((e->revents & POLLOUT) != 0)
+				c->io_ready |= channel_fd_flags(c, fds[j],
+				    SSH_CHAN_IO_WRITE);
+		}
+	}
+
+	for (i = 0; i < npfd; i++) {
+		if (pfd[i].fd < 0)
+			continue;
+		pfd[i].revents = ctx->fds[pfd[i].fd].revents & pfd[i].events;
+	}
+	return ret;
+}
+
+/* Drop a descriptor from the interest set before it is closed */
+static void
+chan_epoll_fd_closing(struct ssh *ssh, int fd)
+{
+	struct chan_epoll_ctx *ctx = ssh->chanctxt->evloop_ctx;
+	struct chan_epoll_fd *e;
+
+	if (fd < 0 || (u_int)fd >= ctx->nfds)
+		return;
+	/*
+	 * A forked child (e.g. a session before exec) shares the epoll
+	 * instance with its parent; closing its copies of the channel
+	 * descriptors must not alter the parent's interest set.
+	 */
+	if (ctx->pid != getpid())
+		return;
+	e = &ctx->fds[fd];
+	if (e->registered != 0 &&
+	    epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, NULL) == -1 &&
+	    errno != ENOENT && errno != EBADF)
+		error("%s: epoll_ctl fd %d: %s", __func__, fd,
+		    strerror(errno));
+	memset(e, 0, sizeof(*e));
+	e->chan = -1;
+}
+#endif /* USE_EPOLL */
+
+static const struct chan_evloop chan_evloops[] = {
+#ifdef USE_EPOLL
+	{ "epoll", chan_epoll_init, chan_epoll_wait, chan_epoll_fd_closing },
+#endif
+	{ "select", chan_select_init, chan_select_wait, NULL },
+	{ NULL, NULL, NULL, NULL }
+};
+
+/*
+ * Wait until channel IO recorded by channel_prepare_events() or one of the
+ * 'npfd' caller descriptors in 'pfd' is ready, or 'timeout_ms' milliseconds
+ * (-1 = infinite) have passed.  Readiness is reported via c->io_ready and
+ * pfd[].revents.  Returns the number of ready descriptors, 0 on timeout or
+ * -1 on error (with errno set).
+ */
+int
+channel_wait_events(struct ssh *ssh, struct pollfd *pfd, u_int npfd,
+    int timeout_ms)
+{
+	struct ssh_channels *sc = ssh->chanctxt;
+	const struct chan_evloop *ev;
+	u_int i;
+
+	if (sc->evloop == NULL) {
+		for (ev = chan_evloops; ev->name != NULL; ev++) {
+			if (ev->init(ssh) == 0)
+				break;
+		}
+		if (ev->name == NULL)
+			fatal("%s: no usable event backend", __func__);
+		debug("%s: using %s event backend", __func__, ev->name);
+		sc->evloop = ev;
+	}
+	for (i = 0; i < npfd; i++)
+		pfd[i].revents = 0;
+	return sc->evloop->wait(ssh, pfd, npfd, timeout_ms);
 }
 
 /*
@@ -2492,7 +3496,7 @@ channel_output_poll_input_open(struct ssh *ssh, Channel *c)
 	const u_char *pkt;
 	int r;
 
-	if ((len = sshbuf_len(c->input)) == 0) {
+	if (sshbuf_len(c->input) == 0) {
 		if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
 			/*
 			 * input-buffer is empty and read-socket shutdown:
@@ -2540,7 +3544,8 @@ channel_output_poll_input_open(struct ssh *ssh, Channel *c)
 		return;
 	}
 
-	/* Enqueue packet for buffered data. */
+	/* Enqueue packet for buffered data, up to the end of a segment. */
+	pkt = sshbuf_peek(c->input, &len);
 	if (len > c->remote_window)
 		len = c->remote_window;
 	if (len > c->remote_maxpacket)
@@ -2549,7 +3554,7 @@ channel_output_poll_input_open(struct ssh *ssh, Channel *c)
 		return;
 	if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_DATA)) != 0 ||
 	    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-	    (r = sshpkt_put_string(ssh, sshbuf_ptr(c->input), len)) != 0 ||
+	    (r = sshpkt_put_string(ssh, pkt, len)) != 0 ||
 	    (r = sshpkt_send(ssh)) != 0) {
 		fatal("%s: channel %i: data: %s", __func__,
 		    c->self, ssh_err(r));
@@ -2976,7 +3981,7 @@ channel_input_data(int type, u_int32_t seq, struct ssh *ssh)
 	 * updates are sent back. Otherwise the connection might deadlock.
 	 */
 	if (c->ostate != CHAN_OUTPUT_OPEN) {
-		c->local_window -= win_len;
+		channel_data_received(c, win_len);
 		c->local_consumed += win_len;
 		return 0;
 	}
@@ -2991,7 +3996,7 @@ channel_input_data(int type, u_int32_t seq, struct ssh *ssh)
 		    c->self, win_len, c->local_window);
 		return 0;
 	}
-	c->local_window -= win_len;
+	channel_data_received(c, win_len);
 
 	if (c->datagram) {
 		if ((r = sshbuf_put_string(c->output, data, data_len)) != 0)
@@ -3053,7 +4058,7 @@ channel_input_extended_data(int type, u_int32_t seq, struct ssh *ssh)
 	/* XXX sshpkt_getb? */
 	if ((r = sshbuf_put(c->extended, data, data_len)) != 0)
 		error("%s: append: %s", __func__, ssh_err(r));
-	c->local_window -= data_len;
+	channel_data_received(c, data_len);
 	return 0;
 }
 
@@ -3247,6 +4252,25 @@ channel_set_af(struct ssh *ssh, int af)
 	ssh->chanctxt->IPv4or6 = af;
 }
 
+/* Limit the total growth of receive windows by autotuning; 0 disables */
+void
+channel_set_window_budget(struct ssh *ssh, u_int64_t budget)
+{
+	ssh->chanctxt->window_budget = budget;
+}
+
+/* Send data of forwarded TCP connections with MSG_ZEROCOPY */
+void
+channel_set_zerocopy(struct ssh *ssh, int on)
+{
+#ifdef USE_ZEROCOPY
+	ssh->chanctxt->zerocopy = on;
+#else
+	if (on)
+		debug("%s: zero-copy output not supported", __func__);
+#endif
+}
+
 
 /*
  * Determine whether or not a port forward listens to loopback, the
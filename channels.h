@@ -73,6 +73,7 @@
 #define FORWARD_USER		0x101
 
 struct ssh;
+struct pollfd;
 struct Channel;
 typedef struct Channel Channel;
 struct fwd_perm_list;
@@ -95,6 +96,17 @@ struct channel_confirm {
 };
 TAILQ_HEAD(channel_confirms, channel_confirm);
 
+/* Output sent with MSG_ZEROCOPY, held until the kernel is done with it */
+struct channel_zcblock {
+	TAILQ_ENTRY(channel_zcblock) entry;
+	struct sshbuf *buf;	/* data not yet sent */
+	size_t size;		/* data in buf when detached */
+	u_int32_t first;	/* sequence number of its first send */
+	u_int32_t nsent;	/* MSG_ZEROCOPY sends made from buf */
+	u_int32_t ndone;	/* of these, reported complete */
+};
+TAILQ_HEAD(channel_zcblocks, channel_zcblock);
+
 /* Context for non-blocking connects */
 struct channel_connect {
 	char *host;
@@ -131,6 +143,8 @@ struct Channel {
 				 * to a matching pre-select handler.
 				 * this way post-select handlers are not
 				 * accidentally called if a FD gets reused */
+	u_int	io_want;	/* bitmask of SSH_CHAN_IO_* */
+	u_int	io_ready;	/* bitmask of SSH_CHAN_IO_* */
 	struct sshbuf *input;	/* data read from socket, to be sent over
 				 * encrypted connection */
 	struct sshbuf *output;	/* data received over encrypted connection for
@@ -151,6 +165,15 @@ struct Channel {
 	u_int	local_consumed;
 	u_int	local_maxpacket;
 	int     extended_usage;
+
+	/* receive window autotuning, see channel_autotune_window() */
+	u_int64_t local_rcvd;		/* data received in total */
+	u_int64_t autotune_edge;	/* window edge before last adjust */
+	double	autotune_sent;		/* time of that adjust, 0 if answered */
+	double	autotune_start;		/* start of consumption measurement */
+	u_int64_t autotune_consumed;	/* data consumed since then */
+	u_int	autotune_grown;		/* growth of local_window_max */
+	double	rtt;			/* window adjust round trip time */
 	int	single_connection;
 
 	char   *ctype;		/* type */
@@ -171,6 +194,12 @@ struct Channel {
 	/* keep boundaries */
 	int     		datagram;
 
+	/* zero-copy socket output, see channel_write_zerocopy() */
+	int			zerocopy;
+	struct channel_zcblock	*zc_out;	/* block being sent */
+	u_int32_t		zc_seq;		/* MSG_ZEROCOPY sends made */
+	struct channel_zcblocks	zc_held;	/* blocks the kernel uses */
+
 	/* non-blocking connect */
 	/* XXX make this a pointer so the structure can be opaque */
 	struct channel_connect	connect_ctx;
@@ -194,6 +223,10 @@ struct Channel {
 #define CHAN_X11_PACKET_DEFAULT	(16*1024)
 #define CHAN_X11_WINDOW_DEFAULT	(4*CHAN_X11_PACKET_DEFAULT)
 
+/* limits for window autotuning */
+#define CHAN_WINDOW_BUDGET_DEFAULT	(16*1024*1024)
+#define CHAN_WINDOW_MAX			(1024*1024*1024)
+
 /* possible input states */
 #define CHAN_INPUT_OPEN			0
 #define CHAN_INPUT_WAIT_DRAIN		1
@@ -212,9 +245,29 @@ struct Channel {
 #define CHAN_EOF_RCVD			0x08
 #define CHAN_LOCAL			0x10
 
+/* Channel IO interest/readiness flags, set by pre/post handlers */
+#define SSH_CHAN_IO_RFD			0x01
+#define SSH_CHAN_IO_WFD			0x02
+#define SSH_CHAN_IO_EFD_R		0x04
+#define SSH_CHAN_IO_EFD_W		0x08
+#define SSH_CHAN_IO_SOCK_R		0x10
+#define SSH_CHAN_IO_SOCK_W		0x20
+#define SSH_CHAN_IO_READ \
+	(SSH_CHAN_IO_RFD|SSH_CHAN_IO_EFD_R|SSH_CHAN_IO_SOCK_R)
+#define SSH_CHAN_IO_WRITE \
+	(SSH_CHAN_IO_WFD|SSH_CHAN_IO_EFD_W|SSH_CHAN_IO_SOCK_W)
+
 /* Read buffer size */
 #define CHAN_RBUF	(16*1024)
 
+/* Segment size of channel input and output buffers */
+#define CHAN_BUF_SEGMENT	(64*1024)
+/* Smaller writes are not worth sending with MSG_ZEROCOPY */
+#define CHAN_ZEROCOPY_MIN	(16*1024)
+/* Limits on output of freed channels that the kernel has not released */
+#define CHAN_ZEROCOPY_LINGER	60		/* seconds */
+#define CHAN_ZEROCOPY_LINGER_MAX	(16*1024*1024)	/* total bytes */
+
 /* Hard limit on number of channels */
 #define CHANNELS_MAX_CHANNELS	(16*1024)
 
@@ -280,6 +333,9 @@ int	 channel_input_status_confirm(int, u_int32_t, struct ssh *);
 void	 channel_prepare_select(struct ssh *, fd_set **, fd_set **, int *,
 	     u_int*, time_t*);
 void     channel_after_select(struct ssh *, fd_set *, fd_set *);
+void	 channel_prepare_events(struct ssh *, time_t *);
+int	 channel_wait_events(struct ssh *, struct pollfd *, u_int, int);
+void	 channel_after_events(struct ssh *);
 void     channel_output_poll(struct ssh *);
 
 int      channel_not_very_much_buffered_data(struct ssh *);
@@ -287,11 +343,14 @@ void     channel_close_all(struct ssh *);
 int      channel_still_open(struct ssh *);
 char	*channel_open_message(struct ssh *);
 int	 channel_find_open(struct ssh *);
+void	 channel_get_counts(struct ssh *, u_int *, u_int64_t *);
 
 /* tcp forwarding */
 struct Forward;
 struct ForwardOptions;
 void	 channel_set_af(struct ssh *, int af);
+void	 channel_set_window_budget(struct ssh *, u_int64_t);
+void	 channel_set_zerocopy(struct ssh *, int);
 void     channel_permit_all(struct ssh *, int);
 void	 channel_add_permission(struct ssh *, int, int, char *, int);
 void	 channel_clear_permission(struct ssh *, int, int);
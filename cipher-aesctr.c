@@ -65,19 +65,29 @@ aesctr_ivsetup(aesctr_ctx *x,const u8 *iv)
 	memcpy(x->ctr, iv, AES_BLOCK_SIZE);
 }
 
+/*
+ * Generate keystream for up to AESCTR_KS_BLOCKS blocks at a time and
+ * then XOR it over the input in one pass, rather than interleaving
+ * block encryption with a byte-at-a-time XOR.
+ */
 void
 aesctr_encrypt_bytes(aesctr_ctx *x,const u8 *m,u8 *c,u32 bytes)
 {
-	u32 n = 0;
-	u8 buf[AES_BLOCK_SIZE];
+	u8 ks[AESCTR_KS_BLOCKS * AES_BLOCK_SIZE];
+	u32 i, n, len;
 
-	while ((bytes--) > 0) {
-		if (n == 0) {
-			rijndaelEncrypt(x->ek, x->rounds, x->ctr, buf);
+	while (bytes > 0) {
+		len = bytes < sizeof(ks) ? bytes : sizeof(ks);
+		for (n = 0; n < len; n += AES_BLOCK_SIZE) {
+			rijndaelEncrypt(x->ek, x->rounds, x->ctr, ks + n);
 			aesctr_inc(x->ctr, AES_BLOCK_SIZE);
 		}
-		*(c++) = *(m++) ^ buf[n];
-		n = (n + 1) % AES_BLOCK_SIZE;
+		for (i = 0; i < len; i++)
+			c[i] = m[i] ^ ks[i];
+		m += len;
+		c += len;
+		bytes -= len;
 	}
+	explicit_bzero(ks, sizeof(ks));
 }
 #endif /* !WITH_OPENSSL */
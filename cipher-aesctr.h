@@ -21,6 +21,7 @@
 #include "rijndael.h"
 
 #define AES_BLOCK_SIZE 16
+#define AESCTR_KS_BLOCKS 32	/* keystream blocks generated per pass */
 
 typedef struct aesctr_ctx {
 	int	rounds;				/* keylen-dependent #rounds */
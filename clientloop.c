@@ -1628,6 +1628,10 @@ client_request_tun_fwd(struct ssh *ssh, int tun_mode,
 	c = channel_new(ssh, "tun", SSH_CHANNEL_OPENING, fd, fd, -1,
 	    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0, "tun", 1);
 	c->datagram = 1;
+	/* Datagrams are parsed from the buffers, keep them contiguous */
+	if (sshbuf_set_segmented(c->input, 0) != 0 ||
+	    sshbuf_set_segmented(c->output, 0) != 0)
+		fatal("%s: sshbuf_set_segmented failed", __func__);
 
 #if defined(SSH_TUN_FILTER)
 	if (options.tun_open == SSH_TUNMODE_POINTOPOINT)
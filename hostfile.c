@@ -43,7 +43,10 @@
 
 #include <netinet/in.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <resolv.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -61,6 +64,8 @@
 #include "ssherr.h"
 #include "digest.h"
 #include "hmac.h"
+#include "sshbuf.h"
+#include "atomicio.h"
 
 struct hostkeys {
 	struct hostkey_entry *entries;
@@ -658,11 +663,22 @@ match_maybe_hashed(const char *host, const char *names, int *was_hashed)
 	return match_hostname(host, names) == 1;
 }
 
-int
-hostkeys_foreach(const char *path, hostkeys_foreach_fn *callback, void *ctx,
-    const char *host, const char *ip, u_int options)
+/* A line of a known_hosts file, as located by its index */
+struct hostidx_line {
+	long offset;
+	u_long linenum;
+};
+
+/*
+ * Iterate over the lines of an open hostkeys file, or only over those
+ * listed in sel if it is not NULL.
+ */
+static int
+hostkeys_foreach_file(const char *path, FILE *f,
+    hostkeys_foreach_fn *callback, void *ctx, const char *host,
+    const char *ip, u_int options, const struct hostidx_line *sel,
+    size_t nsel)
 {
-	FILE *f;
 	char *line = NULL, ktype[128];
 	u_long linenum = 0;
 	char *cp, *cp2;
@@ -670,17 +686,22 @@ hostkeys_foreach(const char *path, hostkeys_foreach_fn *callback, void *ctx,
 	int hashed;
 	int s, r = 0;
 	struct hostkey_foreach_line lineinfo;
-	size_t linesize = 0, l;
+	size_t linesize = 0, l, nextsel = 0;
 
 	memset(&lineinfo, 0, sizeof(lineinfo));
-	if (host == NULL && (options & HKF_WANT_MATCH) != 0)
-		return SSH_ERR_INVALID_ARGUMENT;
-	if ((f = fopen(path, "r")) == NULL)
-		return SSH_ERR_SYSTEM_ERROR;
-
-	debug3("%s: reading file \"%s\"", __func__, path);
-	while (getline(&line, &linesize, f) != -1) {
-		linenum++;
+	for (;;) {
+		if (sel != NULL) {
+			if (nextsel >= nsel)
+				break;
+			if (fseek(f, sel[nextsel].offset, SEEK_SET) != 0) {
+				r = SSH_ERR_SYSTEM_ERROR;
+				break;
+			}
+			linenum = sel[nextsel++].linenum;
+		} else
+			linenum++;
+		if (getline(&line, &linesize, f) == -1)
+			break;
 		line[strcspn(line, "\n")] = '\0';
 
 		free(lineinfo.line);
@@ -829,6 +850,496 @@ hostkeys_foreach(const char *path, hostkeys_foreach_fn *callback, void *ctx,
 	sshkey_free(lineinfo.key);
 	free(lineinfo.line);
 	free(line);
+	return r;
+}
+
+int
+hostkeys_foreach(const char *path, hostkeys_foreach_fn *callback, void *ctx,
+    const char *host, const char *ip, u_int options)
+{
+	FILE *f;
+	int r;
+
+	if (host == NULL && (options & HKF_WANT_MATCH) != 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((f = fopen(path, "r")) == NULL)
+		return SSH_ERR_SYSTEM_ERROR;
+
+	debug3("%s: reading file \"%s\"", __func__, path);
+	r = hostkeys_foreach_file(path, f, callback, ctx, host, ip, options,
+	    NULL, 0);
 	fclose(f);
 	return r;
 }
+
+/*
+ * known_hosts index.
+ *
+ * load_hostkeys_indexed() keeps a sidecar file next to a known_hosts file
+ * (e.g. "known_hosts.idx") recording where each line starts and which
+ * lines may match a given name, so a lookup reads and parses only those
+ * lines.  The text file remains authoritative: the index records the
+ * device, inode, size and modification time of the file it was built from
+ * and is rebuilt whenever these change.
+ *
+ * Lines whose host patterns are all plain names are indexed under a salted
+ * hash of each name, and lines with wildcards or negations are checked on
+ * every lookup.  Hashed names can only be matched by computing their
+ * HMAC, so hashed lines are also checked on every lookup; recording which
+ * of them a name matched would keep a history of the hosts looked up and
+ * let a name be tested against all of them with one hash.
+ */
+#define HOSTIDX_SUFFIX		".idx"
+#define HOSTIDX_MAGIC		"OPENSSH_KNOWN_HOSTS_INDEX_2"
+#define HOSTIDX_SALT_LEN	16
+#define HOSTIDX_KEY_LEN		16
+#define HOSTIDX_LINE_LEN	12			/* offset, linenum */
+#define HOSTIDX_NAME_LEN	(HOSTIDX_KEY_LEN + 4)	/* key, line */
+#define HOSTIDX_MAX_SIZE	(256 * 1024 * 1024)
+
+struct hostidx {
+	struct sshbuf *buf;		/* whole index file */
+	const u_char *salt;
+	const u_char *lines;		/* offset and number of each line */
+	const u_char *names;		/* sorted by key */
+	const u_char *always;		/* lines to check for any name */
+	const u_char *hashed;		/* lines with hashed names */
+	u_int32_t nlines, nnames, nalways, nhashed;
+};
+
+struct hostidx_name {
+	u_char key[HOSTIDX_KEY_LEN];
+	u_int32_t line;
+};
+
+static int
+hostidx_key(const u_char *salt, const char *name, size_t len, u_char *key)
+{
+	struct ssh_digest_ctx *ctx;
+	u_char digest[SSH_DIGEST_MAX_LENGTH];
+	char lname[1024];
+	size_t i;
+	int r = SSH_ERR_LIBCRYPTO_ERROR;
+
+	if (len >= sizeof(lname))
+		return SSH_ERR_INVALID_ARGUMENT;
+	/* as match_hostname(), which lowercases both host and patterns */
+	for (i = 0; i < len; i++)
+		lname[i] = tolower((u_char)name[i]);
+	if ((ctx = ssh_digest_start(SSH_DIGEST_SHA256)) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if (ssh_digest_update(ctx, salt, HOSTIDX_SALT_LEN) == 0 &&
+	    ssh_digest_update(ctx, lname, len) == 0 &&
+	    ssh_digest_final(ctx, digest, sizeof(digest)) == 0) {
+		memcpy(key, digest, HOSTIDX_KEY_LEN);
+		r = 0;
+	}
+	ssh_digest_free(ctx);
+	explicit_bzero(digest, sizeof(digest));
+	return r;
+}
+
+static int
+hostidx_name_cmp(const void *_a, const void *_b)
+{
+	const struct hostidx_name *a = _a, *b = _b;
+	int r;
+
+	if ((r = memcmp(a->key, b->key, sizeof(a->key))) != 0)
+		return r;
+	return a->line < b->line ? -1 : a->line > b->line;
+}
+
+/*
+ * Index the plain names of a host pattern list, returning -1 if it
+ * contains anything match_hostname() does not compare literally.
+ */
+static int
+hostidx_add_names(const u_char *salt, const char *hosts, u_int32_t line,
+    struct hostidx_name **names, u_int32_t *nnames)
+{
+	struct hostidx_name *tmp;
+	size_t len;
+
+	if (hosts[strcspn(hosts, "*?!")] != '\0')
+		return -1;
+	for (;;) {
+		len = strcspn(hosts, ",");
+		/* match_pattern_list() fails overlong patterns */
+		if (len >= 1023)
+			return -1;
+		if ((tmp = recallocarray(*names, *nnames, *nnames + 1,
+		    sizeof(**names))) == NULL)
+			return -1;
+		*names = tmp;
+		if (hostidx_key(salt, hosts, len, tmp[*nnames].key) != 0)
+			return -1;
+		tmp[*nnames].line = line;
+		(*nnames)++;
+		if (hosts[len] == '\0')
+			break;
+		hosts += len + 1;
+	}
+	return 0;
+}
+
+static int
+hostidx_build(FILE *f, const struct stat *st, struct sshbuf *b)
+{
+	struct sshbuf *lines = NULL, *always = NULL, *hashed = NULL;
+	struct hostidx_name *names = NULL;
+	u_char salt[HOSTIDX_SALT_LEN];
+	char *line = NULL, *cp, *cp2;
+	size_t linesize = 0;
+	u_long linenum = 0;
+	u_int32_t i, nlines = 0, nnames = 0, nalways = 0, nhashed = 0;
+	long offset;
+	int r;
+
+	if ((lines = sshbuf_new()) == NULL || (always = sshbuf_new()) == NULL ||
+	    (hashed = sshbuf_new()) == NULL) {
+		r = SSH_ERR_ALLOC_FAIL;
+		goto out;
+	}
+	arc4random_buf(salt, sizeof(salt));
+	rewind(f);
+	for (;;) {
+		if ((offset = ftell(f)) == -1) {
+			r = SSH_ERR_SYSTEM_ERROR;
+			goto out;
+		}
+		if (getline(&line, &linesize, f) == -1)
+			break;
+		linenum++;
+		line[strcspn(line, "\n")] = '\0';
+
+		/* Skip the same lines as hostkeys_foreach() does */
+		for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+			;
+		if (!*cp || *cp == '#' || check_markers(&cp) == MRK_ERROR)
+			continue;
+		for (cp2 = cp; *cp2 && *cp2 != ' ' && *cp2 != '\t'; cp2++)
+			;
+		*cp2 = '\0';
+
+		if ((r = sshbuf_put_u64(lines, offset)) != 0 ||
+		    (r = sshbuf_put_u32(lines, linenum)) != 0)
+			goto out;
+		if (*cp == HASH_DELIM) {
+			if ((r = sshbuf_put_u32(hashed, nlines)) != 0)
+				goto out;
+			nhashed++;
+		} else if (hostidx_add_names(salt, cp, nlines,
+		    &names, &nnames) != 0) {
+			if ((r = sshbuf_put_u32(always, nlines)) != 0)
+				goto out;
+			nalways++;
+		}
+		nlines++;
+	}
+	if (nnames > 0)
+		qsort(names, nnames, sizeof(*names), hostidx_name_cmp);
+
+	if ((r = sshbuf_put_cstring(b, HOSTIDX_MAGIC)) != 0 ||
+	    (r = sshbuf_put_u64(b, st->st_dev)) != 0 ||
+	    (r = sshbuf_put_u64(b, st->st_ino)) != 0 ||
+	    (r = sshbuf_put_u64(b, st->st_size)) != 0 ||
+	    (r = sshbuf_put_u64(b, st->st_mtime)) != 0 ||
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	    (r = sshbuf_put_u64(b, st->st_mtim.tv_nsec)) != 0 ||
+#else
+	    (r = sshbuf_put_u64(b, 0)) != 0 ||
+#endif
+	    (r = sshbuf_put_string(b, salt, sizeof(salt))) != 0 ||
+	    (r = sshbuf_put_u32(b, nlines)) != 0 ||
+	    (r = sshbuf_putb(b, lines)) != 0 ||
+	    (r = sshbuf_put_u32(b, nnames)) != 0)
+		goto out;
+	for (i = 0; i < nnames; i++) {
+		if ((r = sshbuf_put(b, names[i].key, HOSTIDX_KEY_LEN)) != 0 ||
+		    (r = sshbuf_put_u32(b, names[i].line)) != 0)
+			goto out;
+	}
+	if ((r = sshbuf_put_u32(b, nalways)) != 0 ||
+	    (r = sshbuf_putb(b, always)) != 0 ||
+	    (r = sshbuf_put_u32(b, nhashed)) != 0 ||
+	    (r = sshbuf_putb(b, hashed)) != 0)
+		goto out;
+	debug3("%s: indexed %u lines: %u names, %u always checked, %u hashed",
+	    __func__, nlines, nnames, nalways, nhashed);
+	r = 0;
+ out:
+	free(line);
+	free(names);
+	sshbuf_free(lines);
+	sshbuf_free(always);
+	sshbuf_free(hashed);
+	return r;
+}
+
+static int
+hostidx_table(struct sshbuf *b, const u_char **tab, u_int32_t *n,
+    size_t reclen)
+{
+	int r;
+
+	if ((r = sshbuf_get_u32(b, n)) != 0)
+		return r;
+	if (*n > sshbuf_len(b) / reclen)
+		return SSH_ERR_INVALID_FORMAT;
+	*tab = sshbuf_ptr(b);
+	return sshbuf_consume(b, (size_t)*n * reclen);
+}
+
+static int
+hostidx_parse(struct hostidx *idx, const struct stat *st)
+{
+	struct sshbuf *b;
+	char *magic = NULL;
+	u_int64_t dev, ino, size, mtime, nsec;
+	size_t slen;
+	int r;
+
+	if ((b = sshbuf_fromb(idx->buf)) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_get_cstring(b, &magic, NULL)) != 0)
+		goto out;
+	if (strcmp(magic, HOSTIDX_MAGIC) != 0) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = sshbuf_get_u64(b, &dev)) != 0 ||
+	    (r = sshbuf_get_u64(b, &ino)) != 0 ||
+	    (r = sshbuf_get_u64(b, &size)) != 0 ||
+	    (r = sshbuf_get_u64(b, &mtime)) != 0 ||
+	    (r = sshbuf_get_u64(b, &nsec)) != 0)
+		goto out;
+	if (dev != (u_int64_t)st->st_dev || ino != (u_int64_t)st->st_ino ||
+	    size != (u_int64_t)st->st_size ||
+	    mtime != (u_int64_t)st->st_mtime
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	    || nsec != (u_int64_t)st->st_mtim.tv_nsec
+#endif
+	    ) {
+		r = SSH_ERR_FILE_CHANGED;
+		goto out;
+	}
+	if ((r = sshbuf_get_string_direct(b, &idx->salt, &slen)) != 0)
+		goto out;
+	if (slen != HOSTIDX_SALT_LEN) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = hostidx_table(b, &idx->lines, &idx->nlines,
+	    HOSTIDX_LINE_LEN)) != 0 ||
+	    (r = hostidx_table(b, &idx->names, &idx->nnames,
+	    HOSTIDX_NAME_LEN)) != 0 ||
+	    (r = hostidx_table(b, &idx->always, &idx->nalways, 4)) != 0 ||
+	    (r = hostidx_table(b, &idx->hashed, &idx->nhashed, 4)) != 0)
+		goto out;
+	if (sshbuf_len(b) != 0) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	r = 0;
+ out:
+	free(magic);
+	sshbuf_free(b);
+	return r;
+}
+
+/* Read an index, trusting it only if it is as private as its file */
+static int
+hostidx_load(const char *idxpath, const struct stat *st, struct hostidx *idx)
+{
+	struct stat ist;
+	u_char *p;
+	int fd, r;
+
+	if ((fd = open(idxpath, O_RDONLY)) == -1)
+		return SSH_ERR_SYSTEM_ERROR;
+	if (fstat(fd, &ist) == -1) {
+		r = SSH_ERR_SYSTEM_ERROR;
+		goto out;
+	}
+	if (!S_ISREG(ist.st_mode) || ist.st_uid != st->st_uid ||
+	    (ist.st_mode & 022) != 0) {
+		debug("%s: bad ownership or modes for %s", __func__, idxpath);
+		r = SSH_ERR_KEY_BAD_PERMISSIONS;
+		goto out;
+	}
+	if (ist.st_size > HOSTIDX_MAX_SIZE) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = sshbuf_reserve(idx->buf, ist.st_size, &p)) != 0)
+		goto out;
+	if (atomicio(read, fd, p, ist.st_size) != (size_t)ist.st_size) {
+		r = SSH_ERR_FILE_CHANGED;
+		goto out;
+	}
+	r = hostidx_parse(idx, st);
+ out:
+	close(fd);
+	return r;
+}
+
+/* Replace the index atomically; failing to is not an error */
+static void
+hostidx_save(const char *idxpath, struct sshbuf *b)
+{
+	char *tmp;
+	int fd;
+
+	xasprintf(&tmp, "%s.XXXXXXXXXX", idxpath);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug2("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b) || close(fd) != 0 ||
+	    rename(tmp, idxpath) != 0) {
+		debug2("%s: write %s: %s", __func__, idxpath, strerror(errno));
+		unlink(tmp);
+	} else
+		debug3("%s: wrote %s", __func__, idxpath);
+	free(tmp);
+}
+
+static int
+hostidx_u32_cmp(const void *_a, const void *_b)
+{
+	u_int32_t a = *(const u_int32_t *)_a, b = *(const u_int32_t *)_b;
+
+	return a < b ? -1 : a > b;
+}
+
+/* Collect the lines that may match the name with the given key, in order */
+static int
+hostidx_select(const struct hostidx *idx, const u_char *key,
+    struct hostidx_line **selp, size_t *nselp)
+{
+	struct hostidx_line *sel;
+	u_int32_t *lines, lo, hi, mid, i;
+	const u_char *p;
+	size_t nlines = 0, nsel = 0;
+
+	/* binary search for the first name record with this key */
+	for (lo = 0, hi = idx->nnames; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(idx->names + (size_t)mid * HOSTIDX_NAME_LEN,
+		    key, HOSTIDX_KEY_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (hi = lo; hi < idx->nnames && memcmp(idx->names +
+	    (size_t)hi * HOSTIDX_NAME_LEN, key, HOSTIDX_KEY_LEN) == 0; hi++)
+		;
+
+	lines = xcalloc((size_t)(hi - lo) + idx->nalways + idx->nhashed + 1,
+	    sizeof(*lines));
+	for (i = lo; i < hi; i++)
+		lines[nlines++] = PEEK_U32(idx->names +
+		    (size_t)i * HOSTIDX_NAME_LEN + HOSTIDX_KEY_LEN);
+	for (i = 0; i < idx->nalways; i++)
+		lines[nlines++] = PEEK_U32(idx->always + (size_t)i * 4);
+	for (i = 0; i < idx->nhashed; i++)
+		lines[nlines++] = PEEK_U32(idx->hashed + (size_t)i * 4);
+	qsort(lines, nlines, sizeof(*lines), hostidx_u32_cmp);
+
+	sel = xcalloc(nlines + 1, sizeof(*sel));
+	for (i = 0; i < nlines; i++) {
+		if (i > 0 && lines[i] == lines[i - 1])
+			continue;
+		if (lines[i] >= idx->nlines) {
+			free(lines);
+			free(sel);
+			return SSH_ERR_INVALID_FORMAT;
+		}
+		p = idx->lines + (size_t)lines[i] * HOSTIDX_LINE_LEN;
+		if (PEEK_U64(p) > LONG_MAX) {
+			free(lines);
+			free(sel);
+			return SSH_ERR_INVALID_FORMAT;
+		}
+		sel[nsel].offset = (long)PEEK_U64(p);
+		sel[nsel].linenum = PEEK_U32(p + 8);
+		nsel++;
+	}
+	free(lines);
+	*selp = sel;
+	*nselp = nsel;
+	return 0;
+}
+
+/*
+ * As load_hostkeys(), but using (and maintaining) an index of the file.
+ * Falls back to a full scan if the index cannot be used.
+ */
+void
+load_hostkeys_indexed(struct hostkeys *hostkeys, const char *host,
+    const char *path)
+{
+	FILE *f;
+	struct stat st;
+	struct hostidx idx;
+	struct hostidx_line *sel = NULL;
+	struct load_callback_ctx ctx;
+	u_char key[HOSTIDX_KEY_LEN];
+	char *idxpath = NULL;
+	size_t nsel = 0;
+	int r;
+
+	memset(&idx, 0, sizeof(idx));
+	memset(&ctx, 0, sizeof(ctx));
+	if (strlen(host) >= 1024 || (f = fopen(path, "r")) == NULL) {
+		load_hostkeys(hostkeys, host, path);
+		return;
+	}
+	if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode))
+		goto fallback;
+	if ((idx.buf = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	xasprintf(&idxpath, "%s%s", path, HOSTIDX_SUFFIX);
+	if ((r = hostidx_load(idxpath, &st, &idx)) != 0) {
+		debug3("%s: rebuilding %s: %s", __func__, idxpath,
+		    r == SSH_ERR_SYSTEM_ERROR ? strerror(errno) : ssh_err(r));
+		sshbuf_reset(idx.buf);
+		if ((r = hostidx_build(f, &st, idx.buf)) != 0 ||
+		    (r = hostidx_parse(&idx, &st)) != 0) {
+			debug("%s: cannot index %s: %s", __func__, path,
+			    ssh_err(r));
+			goto fallback;
+		}
+		hostidx_save(idxpath, idx.buf);
+	}
+	if ((r = hostidx_key(idx.salt, host, strlen(host), key)) != 0 ||
+	    (r = hostidx_select(&idx, key, &sel, &nsel)) != 0) {
+		debug("%s: index lookup failed for %s: %s", __func__,
+		    idxpath, ssh_err(r));
+		goto fallback;
+	}
+	debug3("%s: checking %zu of %u lines in %s", __func__, nsel,
+	    idx.nlines, path);
+
+	ctx.host = host;
+	ctx.hostkeys = hostkeys;
+	if ((r = hostkeys_foreach_file(path, f, record_hostkey, &ctx,
+	    host, NULL, HKF_WANT_MATCH|HKF_WANT_PARSE_KEY, sel, nsel)) != 0)
+		debug("%s: hostkeys_foreach failed for %s: %s",
+		    __func__, path, ssh_err(r));
+	if (ctx.num_loaded != 0)
+		debug3("%s: loaded %lu keys from %s", __func__,
+		    ctx.num_loaded, host);
+	goto out;
+
+ fallback:
+	load_hostkeys(hostkeys, host, path);
+ out:
+	fclose(f);
+	free(sel);
+	free(idxpath);
+	sshbuf_free(idx.buf);
+}
@@ -33,6 +33,7 @@ struct hostkeys;
 
 struct hostkeys *init_hostkeys(void);
 void	 load_hostkeys(struct hostkeys *, const char *, const char *);
+void	 load_hostkeys_indexed(struct hostkeys *, const char *, const char *);
 void	 free_hostkeys(struct hostkeys *);
 
 HostStatus check_key_in_hostkeys(struct hostkeys *, struct sshkey *,
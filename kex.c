@@ -53,6 +53,7 @@
 #include "ssherr.h"
 #include "sshbuf.h"
 #include "digest.h"
+#include "probes.h"
 
 /* prototype */
 static int kex_choose_conf(struct ssh *);
@@ -163,6 +164,45 @@ kex_names_valid(const char *names)
 	return 1;
 }
 
+/*
+ * Returns the supported compression methods, in order of preference
+ * when compression is requested and with "none" first otherwise.
+ */
+const char *
+compression_alg_list(int compression)
+{
+#ifdef WITH_ZSTD
+	return compression ? "zstd@openssh.com,zlib@openssh.com,zlib,none" :
+	    "none,zstd@openssh.com,zlib@openssh.com,zlib";
+#else
+	return compression ? "zlib@openssh.com,zlib,none" :
+	    "none,zlib@openssh.com,zlib";
+#endif
+}
+
+/* Validate compression method name list */
+int
+comp_names_valid(const char *names)
+{
+	char *s, *cp, *p, *m;
+
+	if (names == NULL || strcmp(names, "") == 0)
+		return 0;
+	if ((s = cp = strdup(names)) == NULL)
+		return 0;
+	for ((p = strsep(&cp, ",")); p && *p != '\0';
+	    (p = strsep(&cp, ","))) {
+		if ((m = match_list(p, compression_alg_list(0), NULL)) == NULL) {
+			error("Unsupported compression method \"%.100s\"", p);
+			free(s);
+			return 0;
+		}
+		free(m);
+	}
+	free(s);
+	return 1;
+}
+
 /*
  * Concatenate algorithm names, avoiding duplicates in the process.
  * Caller must free returned string.
@@ -487,6 +527,7 @@ kex_input_newkeys(int type, u_int32_t seq, struct ssh *ssh)
 	if ((r = ssh_set_newkeys(ssh, MODE_IN)) != 0)
 		return r;
 	kex->done = 1;
+	SSH_PROBE3(kex_done, kex->server, kex->name, kex->hostkey_alg);
 	sshbuf_reset(kex->peer);
 	/* sshbuf_reset(kex->my); */
 	kex->flags &= ~KEX_INIT_SENT;
@@ -537,6 +578,7 @@ kex_input_kexinit(int type, u_int32_t seq, struct ssh *ssh)
 	debug("SSH2_MSG_KEXINIT received");
 	if (kex == NULL)
 		return SSH_ERR_INVALID_ARGUMENT;
+	SSH_PROBE1(kex_start, kex->server);
 
 	ssh_dispatch_set(ssh, SSH2_MSG_KEXINIT, NULL);
 	ptr = sshpkt_ptr(ssh, &dlen);
@@ -744,6 +786,10 @@ choose_comp(struct sshcomp *comp, char *client, char *server)
 		comp->type = COMP_DELAYED;
 	} else if (strcmp(name, "zlib") == 0) {
 		comp->type = COMP_ZLIB;
+#ifdef WITH_ZSTD
+	} else if (strcmp(name, "zstd@openssh.com") == 0) {
+		comp->type = COMP_DELAYED;
+#endif
 	} else if (strcmp(name, "none") == 0) {
 		comp->type = COMP_NONE;
 	} else {
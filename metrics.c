@@ -0,0 +1,628 @@
+/*
+ * Placed in the public domain.
+ *
+ * Per-connection statistics for sshd.  The listener keeps a table of
+ * connection slots and a file of counter pages, one page per slot.  Each
+ * connection is given a slot before it is forked and maps just the page
+ * of that slot, where its session loop stores the packet, channel and
+ * event loop counters as it runs.  The listener maps the file read-only
+ * and keeps the slot table and totals in its own memory, so connections
+ * cannot alter anything but their own counters.  When a connection exits
+ * the listener adds its counters to the totals and frees the slot.
+ *
+ * The listener answers connections to MetricsSocket with a snapshot of
+ * the table in the Prometheus text exposition format.
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "openbsd-compat/sys-queue.h"
+#include "atomicio.h"
+#include "canohost.h"
+#include "channels.h"
+#include "log.h"
+#include "metrics.h"
+#include "misc.h"
+#include "packet.h"
+#include "sshbuf.h"
+#include "ssherr.h"
+
+/* Connections beyond this many are only counted as untracked */
+#define METRICS_SLOTS		4096
+/* Seconds a metrics client gets to read its snapshot */
+#define METRICS_WRITE_TIMEOUT	10
+
+#ifdef HAVE_ATOMIC_BUILTINS
+# define METRIC_STORE(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+# define METRIC_LOAD(p)		__atomic_load_n(&(p), __ATOMIC_RELAXED)
+# define METRIC_PUBLISH(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+# define METRIC_ACQUIRE(p)	__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#else
+# define METRIC_STORE(p, v)	((p) = (v))
+# define METRIC_LOAD(p)		(p)
+# define METRIC_PUBLISH(p, v)	((p) = (v))
+# define METRIC_ACQUIRE(p)	(p)
+#endif
+
+/* Counters kept for each connection and summed over all of them */
+enum {
+	M_IBYTES, M_OBYTES, M_IPACKETS, M_OPACKETS, M_REKEYS, M_CHANNELS,
+	M_LOOPS, M_LOOP_USEC, M_BUF_ALLOCS, M_BUF_REUSES, M_BUF_COPIED, M_MAX
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_info[M_MAX] = {
+	{ "bytes_received", "Bytes received in SSH packets." },
+	{ "bytes_sent", "Bytes sent in SSH packets." },
+	{ "packets_received", "SSH packets received." },
+	{ "packets_sent", "SSH packets sent." },
+	{ "rekeys", "Key re-exchanges completed." },
+	{ "channels_opened", "Channels opened." },
+	{ "loop_iterations", "Session event loop iterations." },
+	{ "loop_busy_microseconds",
+	    "Time spent handling events in the session event loop." },
+	{ "buffer_allocations", "Buffer memory allocations from the system." },
+	{ "buffer_reuses", "Buffer memory allocations served by the pool." },
+	{ "buffer_bytes_copied", "Bytes copied to grow or pack buffers." },
+};
+
+#define SLOT_FREE	0
+#define SLOT_USED	1	/* connection running */
+#define SLOT_EXITED	2	/* connection exited, not yet summed */
+
+/* A connection's page of the shared file, written only by the connection */
+struct metrics_counters {
+	volatile u_int64_t c[M_MAX];
+	volatile u_int64_t channels_open;
+	volatile u_int64_t loop_usec_max;
+	volatile u_int32_t has_user;		/* set once user is valid */
+	char user[64];
+};
+
+/* Listener */
+struct metrics_slot {
+	volatile sig_atomic_t state;
+	pid_t pid;
+	time_t start;
+	int port;
+	char addr[64];
+};
+
+static struct metrics_slot *slots;
+static u_int64_t accepted, untracked, closed, totals[M_MAX];
+static const u_char *region;		/* read-only view of all pages */
+static size_t slot_bytes;
+static int region_fd = -1;
+static u_int next_slot;
+static sigset_t saved_sigset;
+
+/* The counters of this connection, if any */
+static struct metrics_counters *self;
+static u_int64_t loops, loop_usec, loop_usec_max;
+
+static size_t
+slot_size(void)
+{
+	long pagesz;
+
+	if (slot_bytes == 0) {
+		if ((pagesz = sysconf(_SC_PAGESIZE)) <= 0)
+			pagesz = 4096;
+		slot_bytes = ((sizeof(struct metrics_counters) + pagesz - 1) /
+		    pagesz) * pagesz;
+	}
+	return slot_bytes;
+}
+
+static const struct metrics_counters *
+slot_counters(u_int slot)
+{
+	return (const struct metrics_counters *)
+	    (region + (size_t)slot * slot_size());
+}
+
+/* Map the page of one slot, writable, in a connection */
+static void
+slot_map(int fd, int slot)
+{
+	void *p;
+
+	if (slot < 0 || slot >= METRICS_SLOTS)
+		return;
+	if ((p = mmap(NULL, slot_size(), PROT_READ|PROT_WRITE, MAP_SHARED,
+	    fd, (off_t)slot * slot_size())) == MAP_FAILED) {
+		error("%s: mmap: %s", __func__, strerror(errno));
+		return;
+	}
+	self = p;
+}
+
+/*
+ * Create the counter file and the slot table.  The file is backed by a
+ * descriptor rather than an anonymous mapping so that connections can
+ * map their own page of it, including after being re-executed.
+ */
+int
+metrics_init(void)
+{
+	char tmpl[] = "/tmp/sshd-metrics.XXXXXXXXXX";
+	size_t len = METRICS_SLOTS * slot_size();
+	void *p;
+	int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+	if ((fd = memfd_create("sshd-metrics", MFD_CLOEXEC)) == -1)
+#endif
+	{
+		if ((fd = mkstemp(tmpl)) == -1) {
+			error("%s: mkstemp: %s", __func__, strerror(errno));
+			return -1;
+		}
+		unlink(tmpl);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	if (ftruncate(fd, len) != 0) {
+		error("%s: ftruncate: %s", __func__, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if ((p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		error("%s: mmap: %s", __func__, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if ((slots = calloc(METRICS_SLOTS, sizeof(*slots))) == NULL) {
+		error("%s: calloc failed", __func__);
+		munmap(p, len);
+		close(fd);
+		return -1;
+	}
+	region = p;
+	region_fd = fd;
+	debug("%s: %d connection slots", __func__, METRICS_SLOTS);
+	return 0;
+}
+
+int
+metrics_fd(void)
+{
+	return region_fd;
+}
+
+int
+metrics_listen(const char *path)
+{
+	mode_t omask;
+	int sock;
+
+	omask = umask(0177);
+	sock = unix_listener(path, 16, 1);
+	umask(omask);
+	if (sock == -1)
+		return -1;
+	if (set_nonblock(sock) == -1) {
+		close(sock);
+		return -1;
+	}
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	return sock;
+}
+
+/*
+ * Reserve a slot for a connection that is about to be forked.  SIGCHLD
+ * stays blocked until metrics_slot_start() records the child's pid, so
+ * that the child cannot be reaped before its slot knows about it.
+ */
+int
+metrics_slot_open(int sock)
+{
+	static const u_char zero[sizeof(struct metrics_counters)];
+	struct metrics_slot *s;
+	sigset_t nsigset;
+	char *addr;
+	u_int i;
+
+	if (region == NULL)
+		return -1;
+	accepted++;
+	for (i = 0; i < METRICS_SLOTS; i++) {
+		s = &slots[(next_slot + i) % METRICS_SLOTS];
+		if (s->state == SLOT_FREE)
+			break;
+	}
+	if (i == METRICS_SLOTS) {
+		untracked++;
+		return -1;
+	}
+	i = (next_slot + i) % METRICS_SLOTS;
+	next_slot = i + 1;
+
+	/* Clear the counters left by the previous connection */
+	if (pwrite(region_fd, zero, sizeof(zero), (off_t)i * slot_size()) !=
+	    (ssize_t)sizeof(zero)) {
+		error("%s: pwrite: %s", __func__, strerror(errno));
+		untracked++;
+		return -1;
+	}
+	memset(s, 0, sizeof(*s));
+	s->start = time(NULL);
+	addr = get_peer_ipaddr(sock);
+	strlcpy(s->addr, addr, sizeof(s->addr));
+	free(addr);
+	s->port = get_peer_port(sock);
+
+	sigemptyset(&nsigset);
+	sigaddset(&nsigset, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &nsigset, &saved_sigset);
+	return i;
+}
+
+/* Called in the listener after forking; pid <= 0 releases the slot */
+void
+metrics_slot_start(int slot, pid_t pid)
+{
+	struct metrics_slot *s;
+
+	if (slot < 0)
+		return;
+	s = &slots[slot];
+	if (pid > 0) {
+		s->pid = pid;
+		s->state = SLOT_USED;
+	} else
+		s->state = SLOT_FREE;
+	sigprocmask(SIG_SETMASK, &saved_sigset, NULL);
+}
+
+/* Called from the SIGCHLD handler, so must be async-signal-safe */
+void
+metrics_child_exited(pid_t pid)
+{
+	u_int i;
+
+	if (region == NULL)
+		return;
+	for (i = 0; i < METRICS_SLOTS; i++) {
+		if (slots[i].state == SLOT_USED && slots[i].pid == pid) {
+			slots[i].state = SLOT_EXITED;
+			return;
+		}
+	}
+}
+
+/* Add the counters of exited connections to the totals */
+void
+metrics_reap(void)
+{
+	struct metrics_slot *s;
+	u_int i, j;
+
+	if (region == NULL)
+		return;
+	for (i = 0; i < METRICS_SLOTS; i++) {
+		s = &slots[i];
+		if (s->state != SLOT_EXITED)
+			continue;
+		for (j = 0; j < M_MAX; j++)
+			totals[j] += METRIC_LOAD(slot_counters(i)->c[j]);
+		closed++;
+		s->state = SLOT_FREE;
+	}
+}
+
+/* Append a label value, escaped as the exposition format requires */
+static int
+put_label(struct sshbuf *b, const char *name, const char *value)
+{
+	int r;
+
+	if ((r = sshbuf_putf(b, "%s=\"", name)) != 0)
+		return r;
+	for (; *value != '\0'; value++) {
+		switch (*value) {
+		case '\\':
+			r = sshbuf_put(b, "\\\\", 2);
+			break;
+		case '"':
+			r = sshbuf_put(b, "\\\"", 2);
+			break;
+		case '\n':
+			r = sshbuf_put(b, "\\n", 2);
+			break;
+		default:
+			r = sshbuf_put_u8(b, *value);
+			break;
+		}
+		if (r != 0)
+			return r;
+	}
+	return sshbuf_put_u8(b, '"');
+}
+
+static int
+put_family(struct sshbuf *b, const char *name, const char *type,
+    const char *help)
+{
+	return sshbuf_putf(b, "# HELP sshd_%s %s\n# TYPE sshd_%s %s\n",
+	    name, help, name, type);
+}
+
+/* A sample of a per-connection metric, labelled with the connection */
+static int
+put_connection(struct sshbuf *b, const char *name, u_int slot,
+    u_int64_t value)
+{
+	const struct metrics_slot *s = &slots[slot];
+	const struct metrics_counters *mc = slot_counters(slot);
+	char pid[32], port[32];
+	int r;
+
+	snprintf(pid, sizeof(pid), "%ld", (long)s->pid);
+	snprintf(port, sizeof(port), "%d", s->port);
+	if ((r = sshbuf_putf(b, "sshd_connection_%s{", name)) != 0 ||
+	    (r = put_label(b, "pid", pid)) != 0 ||
+	    (r = sshbuf_put_u8(b, ',')) != 0 ||
+	    (r = put_label(b, "remote_addr", s->addr)) != 0 ||
+	    (r = sshbuf_put_u8(b, ',')) != 0 ||
+	    (r = put_label(b, "remote_port", port)) != 0 ||
+	    (r = sshbuf_put_u8(b, ',')) != 0 ||
+	    (r = put_label(b, "user",
+	    METRIC_ACQUIRE(mc->has_user) ? mc->user : "")) != 0 ||
+	    (r = sshbuf_putf(b, "} %llu\n", (unsigned long long)value)) != 0)
+		return r;
+	return 0;
+}
+
+static int
+metrics_format(struct sshbuf *b)
+{
+	const struct metrics_counters *mc;
+	u_int64_t total, nopen = 0;
+	char name[128];
+	u_int i, j;
+	int r;
+
+	for (i = 0; i < METRICS_SLOTS; i++)
+		if (slots[i].state == SLOT_USED)
+			nopen++;
+	if ((r = put_family(b, "connections_accepted_total", "counter",
+	    "Connections accepted by the listener.")) != 0 ||
+	    (r = sshbuf_putf(b, "sshd_connections_accepted_total %llu\n",
+	    (unsigned long long)accepted)) != 0 ||
+	    (r = put_family(b, "connections_untracked_total", "counter",
+	    "Connections accepted while all statistics slots were in use."))
+	    != 0 ||
+	    (r = sshbuf_putf(b, "sshd_connections_untracked_total %llu\n",
+	    (unsigned long long)untracked)) != 0 ||
+	    (r = put_family(b, "connections_closed_total", "counter",
+	    "Tracked connections that have exited.")) != 0 ||
+	    (r = sshbuf_putf(b, "sshd_connections_closed_total %llu\n",
+	    (unsigned long long)closed)) != 0 ||
+	    (r = put_family(b, "connections_open", "gauge",
+	    "Tracked connections currently running.")) != 0 ||
+	    (r = sshbuf_putf(b, "sshd_connections_open %llu\n",
+	    (unsigned long long)nopen)) != 0)
+		return r;
+
+	/* Totals over closed and running connections */
+	for (j = 0; j < M_MAX; j++) {
+		total = totals[j];
+		for (i = 0; i < METRICS_SLOTS; i++)
+			if (slots[i].state == SLOT_USED)
+				total += METRIC_LOAD(slot_counters(i)->c[j]);
+		snprintf(name, sizeof(name), "%s_total", counter_info[j].name);
+		if ((r = put_family(b, name, "counter",
+		    counter_info[j].help)) != 0 ||
+		    (r = sshbuf_putf(b, "sshd_%s %llu\n", name,
+		    (unsigned long long)total)) != 0)
+			return r;
+	}
+
+	/* Running connections */
+	for (j = 0; j < M_MAX + 3; j++) {
+		switch (j) {
+		case M_MAX:
+			r = put_family(b, "connection_channels_open", "gauge",
+			    "Channels currently open.");
+			break;
+		case M_MAX + 1:
+			r = put_family(b, "connection_loop_busy_max_microseconds",
+			    "gauge", "Longest session event loop iteration.");
+			break;
+		case M_MAX + 2:
+			r = put_family(b, "connection_start_time_seconds",
+			    "gauge", "Time the connection was accepted.");
+			break;
+		default:
+			snprintf(name, sizeof(name), "connection_%s_total",
+			    counter_info[j].name);
+			r = put_family(b, name, "counter",
+			    counter_info[j].help);
+			break;
+		}
+		if (r != 0)
+			return r;
+		for (i = 0; i < METRICS_SLOTS; i++) {
+			if (slots[i].state != SLOT_USED)
+				continue;
+			mc = slot_counters(i);
+			switch (j) {
+			case M_MAX:
+				r = put_connection(b, "channels_open", i,
+				    METRIC_LOAD(mc->channels_open));
+				break;
+			case M_MAX + 1:
+				r = put_connection(b,
+				    "loop_busy_max_microseconds", i,
+				    METRIC_LOAD(mc->loop_usec_max));
+				break;
+			case M_MAX + 2:
+				r = put_connection(b, "start_time_seconds", i,
+				    (u_int64_t)slots[i].start);
+				break;
+			default:
+				r = put_connection(b, name +
+				    strlen("connection_"), i,
+				    METRIC_LOAD(mc->c[j]));
+				break;
+			}
+			if (r != 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Accept a connection on the metrics socket and write a snapshot to it
+ * from a child process, so a slow reader cannot stall the listener.
+ */
+void
+metrics_serve(int listen_sock)
+{
+	struct sshbuf *b;
+	pid_t pid;
+	int fd, r;
+
+	if ((fd = accept(listen_sock, NULL, NULL)) == -1) {
+		if (errno != EINTR && errno != EWOULDBLOCK &&
+		    errno != ECONNABORTED && errno != EAGAIN)
+			error("%s: accept: %s", __func__, strerror(errno));
+		return;
+	}
+	if (region == NULL || (pid = fork()) == -1) {
+		close(fd);
+		return;
+	}
+	if (pid != 0) {
+		close(fd);
+		return;
+	}
+	signal(SIGALRM, SIG_DFL);
+	alarm(METRICS_WRITE_TIMEOUT);
+	if (unset_nonblock(fd) == -1)
+		_exit(1);
+	if ((b = sshbuf_new()) == NULL)
+		_exit(1);
+	if ((r = metrics_format(b)) != 0) {
+		error("%s: %s", __func__, ssh_err(r));
+		_exit(1);
+	}
+	if (atomicio(vwrite, fd, (void *)sshbuf_ptr(b), sshbuf_len(b)) !=
+	    sshbuf_len(b))
+		_exit(1);
+	_exit(0);
+}
+
+/*
+ * In a connection forked from the listener: drop the listener's table
+ * and view of the counters and map only the page of this connection.
+ */
+void
+metrics_connection(int slot)
+{
+	if (region == NULL)
+		return;
+	if (slot >= 0)
+		sigprocmask(SIG_SETMASK, &saved_sigset, NULL);
+	munmap((void *)region, METRICS_SLOTS * slot_size());
+	region = NULL;
+	free(slots);
+	slots = NULL;
+	slot_map(region_fd, slot);
+	close(region_fd);
+	region_fd = -1;
+}
+
+/* In a re-executed connection, with the file passed from the listener */
+void
+metrics_attach(int fd, int slot)
+{
+	slot_map(fd, slot);
+	close(fd);
+}
+
+/* Give up the counters, in processes that should not write them */
+void
+metrics_detach(void)
+{
+	if (self == NULL)
+		return;
+	munmap(self, slot_size());
+	self = NULL;
+}
+
+void
+metrics_set_user(const char *user)
+{
+	if (self == NULL || self->has_user)
+		return;
+	strlcpy(self->user, user, sizeof(self->user));
+	METRIC_PUBLISH(self->has_user, 1);
+}
+
+void
+metrics_update(struct ssh *ssh)
+{
+	u_int64_t v[M_MAX];
+	struct sshbuf_stats bstats;
+	u_int rekeys, nopen;
+	u_int i;
+
+	if (self == NULL)
+		return;
+	ssh_packet_get_bytes(ssh, &v[M_IBYTES], &v[M_OBYTES]);
+	ssh_packet_get_counts(ssh, &v[M_IPACKETS], &v[M_OPACKETS], &rekeys);
+	v[M_REKEYS] = rekeys;
+	channel_get_counts(ssh, &nopen, &v[M_CHANNELS]);
+	v[M_LOOPS] = loops;
+	v[M_LOOP_USEC] = loop_usec;
+	sshbuf_get_stats(&bstats);
+	v[M_BUF_ALLOCS] = bstats.allocs;
+	v[M_BUF_REUSES] = bstats.reuses;
+	v[M_BUF_COPIED] = bstats.copied;
+	for (i = 0; i < M_MAX; i++)
+		METRIC_STORE(self->c[i], v[i]);
+	METRIC_STORE(self->channels_open, nopen);
+	METRIC_STORE(self->loop_usec_max, loop_usec_max);
+}
+
+/* Returns the time an event loop iteration started, or 0 if not tracked */
+double
+metrics_loop_start(void)
+{
+	return self == NULL ? 0 : monotime_double();
+}
+
+void
+metrics_loop_end(struct ssh *ssh, double start)
+{
+	u_int64_t usec;
+
+	if (self == NULL || start == 0)
+		return;
+	usec = (monotime_double() - start) * 1000000;
+	loops++;
+	loop_usec += usec;
+	if (usec > loop_usec_max)
+		loop_usec_max = usec;
+	metrics_update(ssh);
+}
@@ -0,0 +1,29 @@
+/*
+ * Placed in the public domain.
+ */
+
+#ifndef SSH_METRICS_H
+#define SSH_METRICS_H
+
+struct ssh;
+
+/* Listener */
+int	 metrics_init(void);
+int	 metrics_listen(const char *);
+void	 metrics_serve(int);
+int	 metrics_slot_open(int);
+void	 metrics_slot_start(int, pid_t);
+void	 metrics_child_exited(pid_t);
+void	 metrics_reap(void);
+int	 metrics_fd(void);
+
+/* Connection */
+void	 metrics_attach(int, int);
+void	 metrics_connection(int);
+void	 metrics_detach(void);
+void	 metrics_set_user(const char *);
+void	 metrics_update(struct ssh *);
+double	 metrics_loop_start(void);
+void	 metrics_loop_end(struct ssh *, double);
+
+#endif /* SSH_METRICS_H */
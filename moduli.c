@@ -42,6 +42,8 @@
 #ifdef WITH_OPENSSL
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <openssl/bn.h>
 #include <openssl/dh.h>
@@ -54,11 +56,17 @@
 #include <time.h>
 #include <unistd.h>
 #include <limits.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 
 #include "xmalloc.h"
 #include "dh.h"
 #include "log.h"
 #include "misc.h"
+#include "msg.h"
+#include "sshbuf.h"
+#include "ssherr.h"
 
 #include "openbsd-compat/openssl-compat.h"
 
@@ -120,6 +128,25 @@
 #define BIT_SET(a,n)	((a)[(n)>>SHIFT_WORD] |= (1L << ((n) & 31)))
 #define BIT_TEST(a,n)	((a)[(n)>>SHIFT_WORD] & (1L << ((n) & 31)))
 
+/* Sieve workers share LargeSieve and set bits in it atomically */
+#if defined(MAP_ANON) && defined(HAVE_ATOMIC_BUILTINS)
+# define SIEVE_PARALLEL
+# define BIT_SET_SHARED(a,n) \
+	__atomic_fetch_or(&(a)[(n)>>SHIFT_WORD], 1U << ((n) & 31), \
+	    __ATOMIC_RELAXED)
+#else
+# define BIT_SET_SHARED(a,n)	BIT_SET(a,n)
+#endif
+
+/* L2 cache size assumed for sieve segments if it cannot be determined */
+#define SEGMENT_DEFAULT	(256L * 1024)	/* bytes */
+#define SEGMENT_MINIMUM	(32L * 1024)
+#define SEGMENT_MAXIMUM	(64L * 1024 * 1024)
+
+/* Number of TINY_NUMBER sized blocks of small primes, from TINY_NUMBER+3 */
+#define SMALL_BLOCKS \
+	((SMALL_MAXIMUM - 2 * TINY_NUMBER - 3 + TINY_NUMBER - 1) / TINY_NUMBER)
+
 /*
  * Prime testing defines
  */
@@ -141,10 +168,23 @@ static u_int32_t *SmallSieve, smallbits, smallbase;
 static u_int32_t *LargeSieve, largewords, largetries, largenumbers;
 static u_int32_t largebits, largememory;	/* megabytes */
 static BIGNUM *largebase;
+static u_int32_t *largelimbs, nlargelimbs;	/* largebase, MSW first */
+static int largeshared;		/* LargeSieve is shared by sieve workers */
+
+/* bits of LargeSieve marked at a time by primes in a sieve_batch */
+static u_int32_t segmentbits;
 
-int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *);
+/* progress of the sieve workers */
+static struct sieve_shared {
+	u_int32_t blocks_done;
+	u_int32_t tries;
+} *sieveshared;
+
+int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *, u_int);
 int prime_test(FILE *, FILE *, u_int32_t, u_int32_t, char *, unsigned long,
-    unsigned long);
+    unsigned long, u_int);
+
+static void print_progress(unsigned long, unsigned long, unsigned long);
 
 /*
  * print moduli out in consistent form,
@@ -178,18 +218,104 @@ qfileout(FILE * ofile, u_int32_t otype, u_int32_t otests, u_int32_t otries,
 }
 
 
+/*
+ * Primes below the segment size are collected in a batch and marked one
+ * L2 cache sized segment of LargeSieve at a time, carrying each prime's
+ * next offset from one segment to the next.  Larger primes mark at most
+ * a few bits per segment and are applied directly.
+ */
+struct sieve_batch {
+	u_int32_t n;
+	u_int32_t *step;		/* the prime */
+	u_int64_t *qnext, *pnext;	/* next bit to mark for q and p */
+};
+
+/* mark every s'th bit of LargeSieve from u, returning the next to mark */
+static u_int64_t
+sieve_mark(u_int64_t u, u_int64_t end, u_int32_t s)
+{
+	if (largeshared) {
+		for (; u < end; u += s)
+			BIT_SET_SHARED(LargeSieve, u);
+	} else {
+		for (; u < end; u += s)
+			BIT_SET(LargeSieve, u);
+	}
+	return u;
+}
+
+static void
+sieve_batch_flush(struct sieve_batch *b)
+{
+	u_int64_t seg, end;
+	u_int32_t k;
+
+	for (seg = 0; b->n > 0 && seg < largebits; seg += segmentbits) {
+		end = MINIMUM(seg + segmentbits, largebits);
+		for (k = 0; k < b->n; k++) {
+			b->qnext[k] = sieve_mark(b->qnext[k], end, b->step[k]);
+			b->pnext[k] = sieve_mark(b->pnext[k], end, b->step[k]);
+		}
+	}
+	b->n = 0;
+}
+
+/* Split largebase into 32-bit words for sieve_mod() */
+static void
+sieve_mod_init(void)
+{
+	u_char *buf;
+	u_int32_t i, len;
+
+	nlargelimbs = (BN_num_bytes(largebase) + 3) / 4;
+	len = nlargelimbs * 4;
+	buf = xcalloc(1, len);
+	if (BN_bn2bin(largebase, buf + len - BN_num_bytes(largebase)) < 0)
+		fatal("BN_bn2bin failed");
+	largelimbs = xcalloc(nlargelimbs, sizeof(*largelimbs));
+	for (i = 0; i < nlargelimbs; i++)
+		largelimbs[i] = PEEK_U32(buf + 4 * i);
+	free(buf);
+}
+
+/*
+ * largebase mod s.  This is where the sieve spends most of its time, so
+ * when 128-bit arithmetic is available each word is reduced with a
+ * multiply by a precomputed reciprocal of s rather than a division.
+ */
+static u_int32_t
+sieve_mod(u_int32_t s)
+{
+#ifdef HAVE_UNSIGNED___INT128
+	u_int64_t m = ~(u_int64_t)0 / s, x, r = 0;
+	u_int32_t i;
+
+	for (i = 0; i < nlargelimbs; i++) {
+		x = (r << 32) | largelimbs[i];
+		/* the estimate of x / s is short by at most 2 */
+		r = x - (u_int64_t)(((unsigned __int128)x * m) >> 64) * s;
+		while (r >= s)
+			r -= s;
+	}
+	return r;
+#else
+	return BN_mod_word(largebase, s);
+#endif
+}
+
 /*
  ** Sieve p's and q's with small factors
  */
 static void
-sieve_large(u_int32_t s)
+sieve_large(u_int32_t s, struct sieve_batch *b)
 {
-	u_int32_t r, u;
+	u_int32_t r;
+	u_int64_t u, qnext = largebits, pnext = largebits;
 
 	debug3("sieve_large %u", s);
 	largetries++;
 	/* r = largebase mod s */
-	r = BN_mod_word(largebase, s);
+	r = sieve_mod(s);
 	if (r == 0)
 		u = 0; /* s divides into largebase exactly */
 	else
@@ -203,14 +329,11 @@ sieve_large(u_int32_t s)
 		 */
 		if (u & 0x1)
 			u += s; /* Make largebase+u odd, and u even */
-
-		/* Mark all multiples of 2*s */
-		for (u /= 2; u < largebits; u += s)
-			BIT_SET(LargeSieve, u);
+		qnext = u / 2;
 	}
 
 	/* r = p mod s */
-	r = (2 * r + 1) % s;
+	r = (2 * (u_int64_t)r + 1) % s;
 	if (r == 0)
 		u = 0; /* s divides p exactly */
 	else
@@ -222,31 +345,214 @@ sieve_large(u_int32_t s)
 		 * largebase+u is not. Then, step through the sieve in
 		 * increments of 4*s
 		 */
-		while (u & 0x3) {
-			if (SMALL_MAXIMUM - u < s)
-				return;
+		while (u & 0x3)
 			u += s;
+		pnext = u / 4;
+	}
+
+	if (qnext >= largebits && pnext >= largebits)
+		return;
+	if (s < segmentbits) {
+		b->step[b->n] = s;
+		b->qnext[b->n] = qnext;
+		b->pnext[b->n] = pnext;
+		b->n++;
+		return;
+	}
+	/* Mark all multiples of 2*s and 4*s */
+	sieve_mark(qnext, largebits, s);
+	sieve_mark(pnext, largebits, s);
+}
+
+/*
+ * Sieve the TINY_NUMBER numbers starting at smallbase with the tiny primes
+ * and feed the small primes found to sieve_large().
+ */
+static void
+sieve_small_block(struct sieve_batch *b)
+{
+	u_int32_t i, r, s, t;
+
+	for (i = 0; i < tinybits; i++) {
+		if (BIT_TEST(TinySieve, i))
+			continue; /* 2*i+3 is composite */
+
+		/* The next tiny prime */
+		t = 2 * i + 3;
+		r = smallbase % t;
+
+		if (r == 0) {
+			s = 0; /* t divides into smallbase exactly */
+		} else {
+			/* smallbase+s is first entry divisible by t */
+			s = t - r;
 		}
 
-		/* Mark all multiples of 4*s */
-		for (u /= 4; u < largebits; u += s)
-			BIT_SET(LargeSieve, u);
+		/*
+		 * The sieve omits even numbers, so ensure that
+		 * smallbase+s is odd. Then, step through the sieve
+		 * in increments of 2*t
+		 */
+		if (s & 1)
+			s += t; /* Make smallbase+s odd, and s even */
+
+		/* Mark all multiples of 2*t */
+		for (s /= 2; s < smallbits; s += t)
+			BIT_SET(SmallSieve, s);
 	}
+
+	/*
+	 * SmallSieve
+	 */
+	for (i = 0; i < smallbits; i++) {
+		if (BIT_TEST(SmallSieve, i))
+			continue; /* 2*i+smallbase is composite */
+
+		/* The next small prime */
+		sieve_large((2 * i) + smallbase, b);
+	}
+	sieve_batch_flush(b);
+
+	memset(SmallSieve, 0, smallbits >> SHIFT_BIT);
 }
 
+/* Half of the L2 cache, leaving room for the rest of the working set */
+static u_int32_t
+sieve_segment_bits(void)
+{
+	long l2 = -1;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+	if (l2 < SEGMENT_MINIMUM || l2 > SEGMENT_MAXIMUM)
+		l2 = SEGMENT_DEFAULT;
+	return (u_int32_t)(l2 / 2) << SHIFT_BIT;
+}
+
+static u_int32_t *
+sieve_alloc(u_int32_t words)
+{
+#ifdef SIEVE_PARALLEL
+	void *p;
+
+	if (largeshared) {
+		p = mmap(NULL, words * sizeof(u_int32_t),
+		    PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
+	}
+#endif
+	return calloc(words, sizeof(u_int32_t));
+}
+
+static void
+sieve_free(u_int32_t *sieve, u_int32_t words)
+{
+#ifdef SIEVE_PARALLEL
+	if (largeshared) {
+		munmap(sieve, words * sizeof(u_int32_t));
+		return;
+	}
+#endif
+	free(sieve);
+}
+
+/*
+ * Sieve blocks [first, last) of small primes.  With several workers each
+ * is a child process marking a LargeSieve shared with the parent.
+ *
+ * The work is split by prime rather than by segment of LargeSieve since
+ * finding where a prime's first multiple falls (sieve_mod()) is about
+ * three quarters of the time for a 4096-bit sieve: per-segment workers
+ * would each have to repeat it for every prime.  Setting the bits
+ * atomically instead adds about 4% on a single core, and as a segment
+ * spans thousands of cache lines two workers seldom write the same one.
+ */
+static void
+sieve_small_blocks(u_int32_t first, u_int32_t last, struct sieve_batch *b)
+{
+	u_int32_t n;
+
+	for (n = first; n < last; n++) {
+		smallbase = TINY_NUMBER + 3 + n * TINY_NUMBER;
+		sieve_small_block(b);
+#ifdef SIEVE_PARALLEL
+		if (largeshared) {
+			__atomic_fetch_add(&sieveshared->blocks_done, 1,
+			    __ATOMIC_RELAXED);
+			continue;
+		}
+#endif
+		print_progress(0, n + 1, SMALL_BLOCKS);
+	}
+}
+
+#ifdef SIEVE_PARALLEL
+static void
+sieve_small_parallel(u_int nworkers, struct sieve_batch *b)
+{
+	pid_t *pids;
+	u_int i, running;
+	int status;
+
+	sieveshared = mmap(NULL, sizeof(*sieveshared), PROT_READ|PROT_WRITE,
+	    MAP_ANON|MAP_SHARED, -1, 0);
+	if (sieveshared == MAP_FAILED)
+		fatal("mmap: %s", strerror(errno));
+	pids = xcalloc(nworkers, sizeof(*pids));
+	for (i = 0; i < nworkers; i++) {
+		switch ((pids[i] = fork())) {
+		case -1:
+			fatal("fork: %s", strerror(errno));
+		case 0:
+			largetries = 0;
+			sieve_small_blocks(i * SMALL_BLOCKS / nworkers,
+			    (i + 1) * SMALL_BLOCKS / nworkers, b);
+			__atomic_fetch_add(&sieveshared->tries, largetries,
+			    __ATOMIC_RELAXED);
+			_exit(0);
+		default:
+			break;
+		}
+	}
+	debug("started %u sieve workers", nworkers);
+
+	for (running = nworkers; running > 0; ) {
+		sleep(1);
+		print_progress(0, __atomic_load_n(&sieveshared->blocks_done,
+		    __ATOMIC_RELAXED), SMALL_BLOCKS);
+		for (i = 0; i < nworkers; i++) {
+			if (pids[i] == -1 ||
+			    waitpid(pids[i], &status, WNOHANG) <= 0)
+				continue;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				fatal("sieve worker %ld failed", (long)pids[i]);
+			pids[i] = -1;
+			running--;
+		}
+	}
+	largetries += sieveshared->tries;
+	munmap(sieveshared, sizeof(*sieveshared));
+	sieveshared = NULL;
+	free(pids);
+}
+#endif /* SIEVE_PARALLEL */
+
 /*
  * list candidates for Sophie-Germain primes (where q = (p-1)/2)
  * to standard output.
  * The list is checked against small known primes (less than 2**30).
  */
 int
-gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
+gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start,
+    u_int nworkers)
 {
 	BIGNUM *q;
-	u_int32_t j, r, s, t;
+	u_int32_t j, r, t;
 	u_int32_t smallwords = TINY_NUMBER >> 6;
 	u_int32_t tinywords = TINY_NUMBER >> 6;
 	time_t time_start, time_stop;
+	struct sieve_batch batch;
 	u_int32_t i;
 	int ret = 0;
 
@@ -272,6 +578,13 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 	}
 	power--; /* decrement before squaring */
 
+#ifndef SIEVE_PARALLEL
+	if (nworkers > 1) {
+		logit("Parallel sieving not supported on this platform");
+		nworkers = 1;
+	}
+#endif
+
 	/*
 	 * The density of ordinary primes is on the order of 1/bits, so the
 	 * density of safe primes should be about (1/bits)**2. Set test range
@@ -309,12 +622,19 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 	/*
 	 * dynamically determine available memory
 	 */
-	while ((LargeSieve = calloc(largewords, sizeof(u_int32_t))) == NULL)
+	largeshared = nworkers > 1;
+	while ((LargeSieve = sieve_alloc(largewords)) == NULL)
 		largewords -= (1L << (SHIFT_MEGAWORD - 2)); /* 1/4 MB chunks */
 
 	largebits = largewords << SHIFT_WORD;
 	largenumbers = largebits * 2;	/* even numbers excluded */
 
+	segmentbits = sieve_segment_bits();
+	batch.n = 0;
+	batch.step = xcalloc(MAXIMUM(tinybits, smallbits), sizeof(u_int32_t));
+	batch.qnext = xcalloc(MAXIMUM(tinybits, smallbits), sizeof(u_int64_t));
+	batch.pnext = xcalloc(MAXIMUM(tinybits, smallbits), sizeof(u_int64_t));
+
 	/* validation check: count the number of primes tried */
 	largetries = 0;
 	if ((q = BN_new()) == NULL)
@@ -343,6 +663,9 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 	logit("%.24s Sieve next %u plus %u-bit", ctime(&time_start),
 	    largenumbers, power);
 	debug2("start point: 0x%s", BN_bn2hex(largebase));
+	debug("sieve segment %u bytes, %u worker(s)",
+	    segmentbits >> SHIFT_BIT, nworkers);
+	sieve_mod_init();
 
 	/*
 	 * TinySieve
@@ -358,57 +681,21 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 		for (j = i + t; j < tinybits; j += t)
 			BIT_SET(TinySieve, j);
 
-		sieve_large(t);
+		sieve_large(t, &batch);
 	}
+	sieve_batch_flush(&batch);
 
 	/*
 	 * Start the small block search at the next possible prime. To avoid
 	 * fencepost errors, the last pass is skipped.
 	 */
-	for (smallbase = TINY_NUMBER + 3;
-	    smallbase < (SMALL_MAXIMUM - TINY_NUMBER);
-	    smallbase += TINY_NUMBER) {
-		for (i = 0; i < tinybits; i++) {
-			if (BIT_TEST(TinySieve, i))
-				continue; /* 2*i+3 is composite */
-
-			/* The next tiny prime */
-			t = 2 * i + 3;
-			r = smallbase % t;
-
-			if (r == 0) {
-				s = 0; /* t divides into smallbase exactly */
-			} else {
-				/* smallbase+s is first entry divisible by t */
-				s = t - r;
-			}
-
-			/*
-			 * The sieve omits even numbers, so ensure that
-			 * smallbase+s is odd. Then, step through the sieve
-			 * in increments of 2*t
-			 */
-			if (s & 1)
-				s += t; /* Make smallbase+s odd, and s even */
-
-			/* Mark all multiples of 2*t */
-			for (s /= 2; s < smallbits; s += t)
-				BIT_SET(SmallSieve, s);
-		}
-
-		/*
-		 * SmallSieve
-		 */
-		for (i = 0; i < smallbits; i++) {
-			if (BIT_TEST(SmallSieve, i))
-				continue; /* 2*i+smallbase is composite */
-
-			/* The next small prime */
-			sieve_large((2 * i) + smallbase);
-		}
-
-		memset(SmallSieve, 0, smallwords << SHIFT_BYTE);
-	}
+	print_progress(0, 0, SMALL_BLOCKS);
+#ifdef SIEVE_PARALLEL
+	if (nworkers > 1)
+		sieve_small_parallel(nworkers, &batch);
+	else
+#endif
+		sieve_small_blocks(0, SMALL_BLOCKS, &batch);
 
 	time(&time_stop);
 
@@ -436,9 +723,13 @@ gen_candidates(FILE *out, u_int32_t memory, u_int32_t power, BIGNUM *start)
 
 	time(&time_stop);
 
-	free(LargeSieve);
+	sieve_free(LargeSieve, largewords);
 	free(SmallSieve);
 	free(TinySieve);
+	free(batch.step);
+	free(batch.qnext);
+	free(batch.pnext);
+	free(largelimbs);
 
 	logit("%.24s Found %u candidates", ctime(&time_stop), r);
 
@@ -552,19 +843,364 @@ print_progress(unsigned long start_lineno, unsigned long current_lineno,
 	/* if we don't know how many we're processing just report count+time */
 	time(&time_now);
 	if (end_lineno == ULONG_MAX) {
-		logit("%.24s processed %lu in %s", ctime(&time_now),
-		    processed, fmt_time(elapsed));
+		logit("%.24s processed %lu in %s (%.2f/s)", ctime(&time_now),
+		    processed, fmt_time(elapsed), 1 / time_per_line);
 		return;
 	}
 	percent = 100 * processed / num_to_process;
 	eta = time_per_line * remaining;
 	eta_str = xstrdup(fmt_time(eta));
-	logit("%.24s processed %lu of %lu (%lu%%) in %s, ETA %s",
+	logit("%.24s processed %lu of %lu (%lu%%) in %s (%.2f/s), ETA %s",
 	    ctime(&time_now), processed, num_to_process, percent,
-	    fmt_time(elapsed), eta_str);
+	    fmt_time(elapsed), 1 / time_per_line, eta_str);
 	free(eta_str);
 }
 
+/* Outcome of screening a single candidate line */
+#define SCREEN_SKIP	0	/* comment, malformed or unwanted line */
+#define SCREEN_FAIL	1	/* possible candidate that is not a safe prime */
+#define SCREEN_SAFE	2	/* safe prime, fields of struct screen_out set */
+
+struct screen_out {
+	u_int32_t tests, tries, size, generator;
+};
+
+/*
+ * Miller-Rabin test a single candidate line (checking both q and p).
+ * On SCREEN_SAFE, p holds the prime and out the fields to write for it.
+ */
+static int
+screen_line(char *lp, u_int32_t count_in, u_int32_t trials,
+    u_int32_t generator_wanted, BN_CTX *ctx, BIGNUM *p, BIGNUM *q,
+    struct screen_out *out)
+{
+	BIGNUM *a;
+	char *cp;
+	u_int32_t generator_known, in_tests, in_tries, in_type, in_size;
+
+	if (strlen(lp) < 14 || *lp == '!' || *lp == '#') {
+		debug2("%10u: comment or short line", count_in);
+		return SCREEN_SKIP;
+	}
+
+	/* XXX - fragile parser */
+	/* time */
+	cp = &lp[14];	/* (skip) */
+
+	/* type */
+	in_type = strtoul(cp, &cp, 10);
+
+	/* tests */
+	in_tests = strtoul(cp, &cp, 10);
+
+	if (in_tests & MODULI_TESTS_COMPOSITE) {
+		debug2("%10u: known composite", count_in);
+		return SCREEN_SKIP;
+	}
+
+	/* tries */
+	in_tries = strtoul(cp, &cp, 10);
+
+	/* size (most significant bit) */
+	in_size = strtoul(cp, &cp, 10);
+
+	/* generator (hex) */
+	generator_known = strtoul(cp, &cp, 16);
+
+	/* Skip white space */
+	cp += strspn(cp, " ");
+
+	/* modulus (hex) */
+	switch (in_type) {
+	case MODULI_TYPE_SOPHIE_GERMAIN:
+		debug2("%10u: (%u) Sophie-Germain", count_in, in_type);
+		a = q;
+		if (BN_hex2bn(&a, cp) == 0)
+			fatal("BN_hex2bn failed");
+		/* p = 2*q + 1 */
+		if (BN_lshift(p, q, 1) == 0)
+			fatal("BN_lshift failed");
+		if (BN_add_word(p, 1) == 0)
+			fatal("BN_add_word failed");
+		in_size += 1;
+		generator_known = 0;
+		break;
+	case MODULI_TYPE_UNSTRUCTURED:
+	case MODULI_TYPE_SAFE:
+	case MODULI_TYPE_SCHNORR:
+	case MODULI_TYPE_STRONG:
+	case MODULI_TYPE_UNKNOWN:
+		debug2("%10u: (%u)", count_in, in_type);
+		a = p;
+		if (BN_hex2bn(&a, cp) == 0)
+			fatal("BN_hex2bn failed");
+		/* q = (p-1) / 2 */
+		if (BN_rshift(q, p, 1) == 0)
+			fatal("BN_rshift failed");
+		break;
+	default:
+		debug2("Unknown prime type");
+		break;
+	}
+
+	/*
+	 * due to earlier inconsistencies in interpretation, check
+	 * the proposed bit size.
+	 */
+	if ((u_int32_t)BN_num_bits(p) != (in_size + 1)) {
+		debug2("%10u: bit size %u mismatch", count_in, in_size);
+		return SCREEN_SKIP;
+	}
+	if (in_size < QSIZE_MINIMUM) {
+		debug2("%10u: bit size %u too short", count_in, in_size);
+		return SCREEN_SKIP;
+	}
+
+	if (in_tests & MODULI_TESTS_MILLER_RABIN)
+		in_tries += trials;
+	else
+		in_tries = trials;
+
+	/*
+	 * guess unknown generator
+	 */
+	if (generator_known == 0) {
+		if (BN_mod_word(p, 24) == 11)
+			generator_known = 2;
+		else if (BN_mod_word(p, 12) == 5)
+			generator_known = 3;
+		else {
+			u_int32_t r = BN_mod_word(p, 10);
+
+			if (r == 3 || r == 7)
+				generator_known = 5;
+		}
+	}
+	/*
+	 * skip tests when desired generator doesn't match
+	 */
+	if (generator_wanted > 0 &&
+	    generator_wanted != generator_known) {
+		debug2("%10u: generator %d != %d",
+		    count_in, generator_known, generator_wanted);
+		return SCREEN_SKIP;
+	}
+
+	/*
+	 * Primes with no known generator are useless for DH, so
+	 * skip those.
+	 */
+	if (generator_known == 0) {
+		debug2("%10u: no known generator", count_in);
+		return SCREEN_SKIP;
+	}
+
+	/*
+	 * The (1/4)^N performance bound on Miller-Rabin is
+	 * extremely pessimistic, so don't spend a lot of time
+	 * really verifying that q is prime until after we know
+	 * that p is also prime. A single pass will weed out the
+	 * vast majority of composite q's.
+	 */
+	if (BN_is_prime_ex(q, 1, ctx, NULL) <= 0) {
+		debug("%10u: q failed first possible prime test",
+		    count_in);
+		return SCREEN_FAIL;
+	}
+
+	/*
+	 * q is possibly prime, so go ahead and really make sure
+	 * that p is prime. If it is, then we can go back and do
+	 * the same for q. If p is composite, chances are that
+	 * will show up on the first Rabin-Miller iteration so it
+	 * doesn't hurt to specify a high iteration count.
+	 */
+	if (!BN_is_prime_ex(p, trials, ctx, NULL)) {
+		debug("%10u: p is not prime", count_in);
+		return SCREEN_FAIL;
+	}
+	debug("%10u: p is almost certainly prime", count_in);
+
+	/* recheck q more rigorously */
+	if (!BN_is_prime_ex(q, trials - 1, ctx, NULL)) {
+		debug("%10u: q is not prime", count_in);
+		return SCREEN_FAIL;
+	}
+	debug("%10u: q is almost certainly prime", count_in);
+
+	out->tests = in_tests | MODULI_TESTS_MILLER_RABIN;
+	out->tries = in_tries;
+	out->size = in_size;
+	out->generator = generator_known;
+	return SCREEN_SAFE;
+}
+
+/*
+ * Parallel screening: candidate lines are handed to worker processes
+ * one at a time over a socketpair, and the results are written in input
+ * order through a window of at most SCREEN_WINDOW lines per worker, so
+ * the output and checkpoints are the same as with a single process.
+ */
+#define SCREEN_WINDOW		4
+#define SCREEN_MSG_LINE		1
+#define SCREEN_MSG_RESULT	2
+
+struct screen_worker {
+	pid_t pid;
+	int fd;
+	u_int32_t lineno;	/* line being screened or 0 if idle */
+};
+
+struct screen_slot {
+	u_int32_t lineno;	/* 0 if empty */
+	int done, status;
+	struct screen_out out;
+	char *hex;		/* prime, if status == SCREEN_SAFE */
+};
+
+static void
+screen_worker_loop(int fd, u_int32_t trials, u_int32_t generator_wanted)
+{
+	struct sshbuf *m;
+	struct screen_out out;
+	BIGNUM *q, *p;
+	BN_CTX *ctx;
+	char *lp, *hex;
+	u_int32_t lineno;
+	u_char type;
+	int r, status;
+
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((p = BN_new()) == NULL || (q = BN_new()) == NULL)
+		fatal("BN_new failed");
+	if ((ctx = BN_CTX_new()) == NULL)
+		fatal("BN_CTX_new failed");
+
+	/* the parent closes our socket once there is no more input */
+	while (ssh_msg_recv(fd, m) == 0) {
+		if ((r = sshbuf_get_u8(m, &type)) != 0 ||
+		    (r = sshbuf_get_u32(m, &lineno)) != 0 ||
+		    (r = sshbuf_get_cstring(m, &lp, NULL)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (type != SCREEN_MSG_LINE)
+			fatal("%s: unexpected message %u", __func__, type);
+		status = screen_line(lp, lineno, trials, generator_wanted,
+		    ctx, p, q, &out);
+		free(lp);
+		sshbuf_reset(m);
+		if ((r = sshbuf_put_u32(m, lineno)) != 0 ||
+		    (r = sshbuf_put_u32(m, status)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (status == SCREEN_SAFE) {
+			if ((hex = BN_bn2hex(p)) == NULL)
+				fatal("BN_bn2hex failed");
+			if ((r = sshbuf_put_u32(m, out.tests)) != 0 ||
+			    (r = sshbuf_put_u32(m, out.tries)) != 0 ||
+			    (r = sshbuf_put_u32(m, out.size)) != 0 ||
+			    (r = sshbuf_put_u32(m, out.generator)) != 0 ||
+			    (r = sshbuf_put_cstring(m, hex)) != 0)
+				fatal("%s: buffer error: %s", __func__,
+				    ssh_err(r));
+			OPENSSL_free(hex);
+		}
+		if (ssh_msg_send(fd, SCREEN_MSG_RESULT, m) != 0)
+			fatal("%s: write to parent failed", __func__);
+	}
+	_exit(0);
+}
+
+static void
+screen_workers_start(struct screen_worker *w, u_int nworkers,
+    u_int32_t trials, u_int32_t generator_wanted)
+{
+	int pair[2];
+	u_int i, j;
+
+	for (i = 0; i < nworkers; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+			fatal("socketpair: %s", strerror(errno));
+		switch ((w[i].pid = fork())) {
+		case -1:
+			fatal("fork: %s", strerror(errno));
+		case 0:
+			for (j = 0; j < i; j++)
+				close(w[j].fd);
+			close(pair[0]);
+			screen_worker_loop(pair[1], trials, generator_wanted);
+			/* NOTREACHED */
+		default:
+			close(pair[1]);
+			w[i].fd = pair[0];
+			w[i].lineno = 0;
+			break;
+		}
+	}
+	debug("started %u screening workers", nworkers);
+}
+
+static void
+screen_workers_stop(struct screen_worker *w, u_int nworkers)
+{
+	u_int i;
+
+	/* workers exit when they see EOF on their socket */
+	for (i = 0; i < nworkers; i++)
+		close(w[i].fd);
+	for (i = 0; i < nworkers; i++) {
+		while (waitpid(w[i].pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+}
+
+static void
+screen_dispatch(struct screen_worker *w, struct sshbuf *m,
+    u_int32_t lineno, const char *lp)
+{
+	int r;
+
+	sshbuf_reset(m);
+	if ((r = sshbuf_put_u32(m, lineno)) != 0 ||
+	    (r = sshbuf_put_cstring(m, lp)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (ssh_msg_send(w->fd, SCREEN_MSG_LINE, m) != 0)
+		fatal("%s: write to worker %ld failed", __func__,
+		    (long)w->pid);
+	w->lineno = lineno;
+}
+
+static void
+screen_collect(struct screen_worker *w, struct sshbuf *m,
+    struct screen_slot *slots, u_int nslots)
+{
+	struct screen_slot *slot;
+	u_int32_t lineno, status;
+	u_char type;
+	int r;
+
+	if (ssh_msg_recv(w->fd, m) != 0)
+		fatal("%s: screening worker %ld exited", __func__,
+		    (long)w->pid);
+	if ((r = sshbuf_get_u8(m, &type)) != 0 ||
+	    (r = sshbuf_get_u32(m, &lineno)) != 0 ||
+	    (r = sshbuf_get_u32(m, &status)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	slot = &slots[lineno % nslots];
+	if (type != SCREEN_MSG_RESULT || lineno != w->lineno ||
+	    slot->lineno != lineno)
+		fatal("%s: unexpected result for line %u", __func__, lineno);
+	if (status == SCREEN_SAFE &&
+	    ((r = sshbuf_get_u32(m, &slot->out.tests)) != 0 ||
+	    (r = sshbuf_get_u32(m, &slot->out.tries)) != 0 ||
+	    (r = sshbuf_get_u32(m, &slot->out.size)) != 0 ||
+	    (r = sshbuf_get_u32(m, &slot->out.generator)) != 0 ||
+	    (r = sshbuf_get_cstring(m, &slot->hex, NULL)) != 0))
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	slot->status = status;
+	slot->done = 1;
+	w->lineno = 0;
+}
+
 /*
  * perform a Miller-Rabin primality test
  * on the list of candidates
@@ -573,16 +1209,23 @@ print_progress(unsigned long start_lineno, unsigned long current_lineno,
  */
 int
 prime_test(FILE *in, FILE *out, u_int32_t trials, u_int32_t generator_wanted,
-    char *checkpoint_file, unsigned long start_lineno, unsigned long num_lines)
+    char *checkpoint_file, unsigned long start_lineno, unsigned long num_lines,
+    u_int nworkers)
 {
-	BIGNUM *q, *p, *a;
-	BN_CTX *ctx;
-	char *cp, *lp;
+	BIGNUM *q, *p;
+	BN_CTX *ctx = NULL;
+	char *lp;
 	u_int32_t count_in = 0, count_out = 0, count_possible = 0;
-	u_int32_t generator_known, in_tests, in_tries, in_type, in_size;
 	unsigned long last_processed = 0, end_lineno;
 	time_t time_start, time_stop;
-	int res;
+	struct screen_worker *workers = NULL;
+	struct screen_slot *slots = NULL, *slot;
+	struct screen_out sout;
+	struct sshbuf *m = NULL;
+	struct pollfd *pfd = NULL;
+	u_int i, nslots = 0, busy = 0;
+	u_int32_t next_out;
+	int res, status, eof = 0;
 
 	if (trials < TRIAL_MINIMUM) {
 		error("Minimum primality trials is %d", TRIAL_MINIMUM);
@@ -600,8 +1243,6 @@ prime_test(FILE *in, FILE *out, u_int32_t trials, u_int32_t generator_wanted,
 		fatal("BN_new failed");
 	if ((q = BN_new()) == NULL)
 		fatal("BN_new failed");
-	if ((ctx = BN_CTX_new()) == NULL)
-		fatal("BN_CTX_new failed");
 
 	debug2("%.24s Final %u Miller-Rabin trials (%x generator)",
 	    ctime(&time_start), trials, generator_wanted);
@@ -617,178 +1258,130 @@ prime_test(FILE *in, FILE *out, u_int32_t trials, u_int32_t generator_wanted,
 
 	res = 0;
 	lp = xmalloc(QLINESIZE + 1);
-	while (fgets(lp, QLINESIZE + 1, in) != NULL && count_in < end_lineno) {
-		count_in++;
-		if (count_in <= last_processed) {
-			debug3("skipping line %u, before checkpoint or "
-			    "specified start line", count_in);
-			continue;
-		}
-		if (checkpoint_file != NULL)
-			write_checkpoint(checkpoint_file, count_in);
-		print_progress(start_lineno, count_in, end_lineno);
-		if (strlen(lp) < 14 || *lp == '!' || *lp == '#') {
-			debug2("%10u: comment or short line", count_in);
-			continue;
-		}
-
-		/* XXX - fragile parser */
-		/* time */
-		cp = &lp[14];	/* (skip) */
-
-		/* type */
-		in_type = strtoul(cp, &cp, 10);
-
-		/* tests */
-		in_tests = strtoul(cp, &cp, 10);
-
-		if (in_tests & MODULI_TESTS_COMPOSITE) {
-			debug2("%10u: known composite", count_in);
-			continue;
-		}
-
-		/* tries */
-		in_tries = strtoul(cp, &cp, 10);
-
-		/* size (most significant bit) */
-		in_size = strtoul(cp, &cp, 10);
-
-		/* generator (hex) */
-		generator_known = strtoul(cp, &cp, 16);
-
-		/* Skip white space */
-		cp += strspn(cp, " ");
-
-		/* modulus (hex) */
-		switch (in_type) {
-		case MODULI_TYPE_SOPHIE_GERMAIN:
-			debug2("%10u: (%u) Sophie-Germain", count_in, in_type);
-			a = q;
-			if (BN_hex2bn(&a, cp) == 0)
-				fatal("BN_hex2bn failed");
-			/* p = 2*q + 1 */
-			if (BN_lshift(p, q, 1) == 0)
-				fatal("BN_lshift failed");
-			if (BN_add_word(p, 1) == 0)
-				fatal("BN_add_word failed");
-			in_size += 1;
-			generator_known = 0;
-			break;
-		case MODULI_TYPE_UNSTRUCTURED:
-		case MODULI_TYPE_SAFE:
-		case MODULI_TYPE_SCHNORR:
-		case MODULI_TYPE_STRONG:
-		case MODULI_TYPE_UNKNOWN:
-			debug2("%10u: (%u)", count_in, in_type);
-			a = p;
-			if (BN_hex2bn(&a, cp) == 0)
-				fatal("BN_hex2bn failed");
-			/* q = (p-1) / 2 */
-			if (BN_rshift(q, p, 1) == 0)
-				fatal("BN_rshift failed");
-			break;
-		default:
-			debug2("Unknown prime type");
-			break;
-		}
-
-		/*
-		 * due to earlier inconsistencies in interpretation, check
-		 * the proposed bit size.
-		 */
-		if ((u_int32_t)BN_num_bits(p) != (in_size + 1)) {
-			debug2("%10u: bit size %u mismatch", count_in, in_size);
-			continue;
-		}
-		if (in_size < QSIZE_MINIMUM) {
-			debug2("%10u: bit size %u too short", count_in, in_size);
-			continue;
+	if (nworkers <= 1) {
+		if ((ctx = BN_CTX_new()) == NULL)
+			fatal("BN_CTX_new failed");
+		while (fgets(lp, QLINESIZE + 1, in) != NULL &&
+		    count_in < end_lineno) {
+			count_in++;
+			if (count_in <= last_processed) {
+				debug3("skipping line %u, before checkpoint or "
+				    "specified start line", count_in);
+				continue;
+			}
+			if (checkpoint_file != NULL)
+				write_checkpoint(checkpoint_file, count_in);
+			print_progress(start_lineno, count_in, end_lineno);
+			status = screen_line(lp, count_in, trials,
+			    generator_wanted, ctx, p, q, &sout);
+			if (status == SCREEN_SKIP)
+				continue;
+			count_possible++;
+			if (status != SCREEN_SAFE)
+				continue;
+			if (qfileout(out, MODULI_TYPE_SAFE, sout.tests,
+			    sout.tries, sout.size, sout.generator, p)) {
+				res = -1;
+				break;
+			}
+			count_out++;
 		}
+		goto done;
+	}
 
-		if (in_tests & MODULI_TESTS_MILLER_RABIN)
-			in_tries += trials;
-		else
-			in_tries = trials;
-
-		/*
-		 * guess unknown generator
-		 */
-		if (generator_known == 0) {
-			if (BN_mod_word(p, 24) == 11)
-				generator_known = 2;
-			else if (BN_mod_word(p, 12) == 5)
-				generator_known = 3;
-			else {
-				u_int32_t r = BN_mod_word(p, 10);
-
-				if (r == 3 || r == 7)
-					generator_known = 5;
+	/* don't let the workers inherit unwritten output */
+	fflush(out);
+	nslots = nworkers * SCREEN_WINDOW;
+	workers = xcalloc(nworkers, sizeof(*workers));
+	slots = xcalloc(nslots, sizeof(*slots));
+	pfd = xcalloc(nworkers, sizeof(*pfd));
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	screen_workers_start(workers, nworkers, trials, generator_wanted);
+
+	next_out = last_processed + 1;
+	while (!eof || busy > 0) {
+		/* hand out lines while there are idle workers and room */
+		for (i = 0; !eof && i < nworkers; i++) {
+			if (workers[i].lineno != 0)
+				continue;
+			if (count_in + 1 >= next_out + nslots)
+				break;
+			while (1) {
+				if (count_in >= end_lineno ||
+				    fgets(lp, QLINESIZE + 1, in) == NULL) {
+					eof = 1;
+					break;
+				}
+				if (++count_in > last_processed)
+					break;
+				debug3("skipping line %u, before checkpoint or "
+				    "specified start line", count_in);
 			}
+			if (eof)
+				break;
+			slot = &slots[count_in % nslots];
+			slot->lineno = count_in;
+			slot->done = 0;
+			screen_dispatch(&workers[i], m, count_in, lp);
+			busy++;
 		}
-		/*
-		 * skip tests when desired generator doesn't match
-		 */
-		if (generator_wanted > 0 &&
-		    generator_wanted != generator_known) {
-			debug2("%10u: generator %d != %d",
-			    count_in, generator_known, generator_wanted);
+		if (busy == 0)
 			continue;
-		}
 
-		/*
-		 * Primes with no known generator are useless for DH, so
-		 * skip those.
-		 */
-		if (generator_known == 0) {
-			debug2("%10u: no known generator", count_in);
-			continue;
+		for (i = 0; i < nworkers; i++) {
+			pfd[i].fd = workers[i].lineno != 0 ? workers[i].fd : -1;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
 		}
-
-		count_possible++;
-
-		/*
-		 * The (1/4)^N performance bound on Miller-Rabin is
-		 * extremely pessimistic, so don't spend a lot of time
-		 * really verifying that q is prime until after we know
-		 * that p is also prime. A single pass will weed out the
-		 * vast majority of composite q's.
-		 */
-		if (BN_is_prime_ex(q, 1, ctx, NULL) <= 0) {
-			debug("%10u: q failed first possible prime test",
-			    count_in);
-			continue;
+		if (poll(pfd, nworkers, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll: %s", strerror(errno));
 		}
-
-		/*
-		 * q is possibly prime, so go ahead and really make sure
-		 * that p is prime. If it is, then we can go back and do
-		 * the same for q. If p is composite, chances are that
-		 * will show up on the first Rabin-Miller iteration so it
-		 * doesn't hurt to specify a high iteration count.
-		 */
-		if (!BN_is_prime_ex(p, trials, ctx, NULL)) {
-			debug("%10u: p is not prime", count_in);
-			continue;
+		for (i = 0; i < nworkers; i++) {
+			if ((pfd[i].revents & (POLLIN|POLLHUP|POLLERR)) == 0)
+				continue;
+			screen_collect(&workers[i], m, slots, nslots);
+			busy--;
 		}
-		debug("%10u: p is almost certainly prime", count_in);
 
-		/* recheck q more rigorously */
-		if (!BN_is_prime_ex(q, trials - 1, ctx, NULL)) {
-			debug("%10u: q is not prime", count_in);
-			continue;
+		/* write out the results that are now complete, in order */
+		while (res == 0 && (slot = &slots[next_out % nslots])->done &&
+		    slot->lineno == next_out) {
+			if (slot->status != SCREEN_SKIP)
+				count_possible++;
+			if (slot->status == SCREEN_SAFE) {
+				if (BN_hex2bn(&p, slot->hex) == 0)
+					fatal("BN_hex2bn failed");
+				free(slot->hex);
+				slot->hex = NULL;
+				if (qfileout(out, MODULI_TYPE_SAFE,
+				    slot->out.tests, slot->out.tries,
+				    slot->out.size, slot->out.generator, p)) {
+					res = -1;
+					break;
+				}
+				count_out++;
+			}
+			slot->lineno = 0;
+			if (checkpoint_file != NULL)
+				write_checkpoint(checkpoint_file, next_out);
+			print_progress(start_lineno, next_out, end_lineno);
+			next_out++;
 		}
-		debug("%10u: q is almost certainly prime", count_in);
-
-		if (qfileout(out, MODULI_TYPE_SAFE,
-		    in_tests | MODULI_TESTS_MILLER_RABIN,
-		    in_tries, in_size, generator_known, p)) {
-			res = -1;
+		if (res != 0)
 			break;
-		}
-
-		count_out++;
 	}
-
+	screen_workers_stop(workers, nworkers);
+	for (i = 0; i < nslots; i++)
+		free(slots[i].hex);
+	free(slots);
+	free(workers);
+	free(pfd);
+	sshbuf_free(m);
+
+ done:
 	time(&time_stop);
 	free(lp);
 	BN_free(p);
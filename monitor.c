@@ -93,6 +93,7 @@
 #include "authfd.h"
 #include "match.h"
 #include "ssherr.h"
+#include "probes.h"
 
 #ifdef GSSAPI
 static Gssctxt *gsscontext = NULL;
@@ -1379,6 +1380,7 @@ mm_answer_keyverify(int sock, struct sshbuf *m)
 	/* XXX use sshkey_froms here; need to change key_blob, etc. */
 	if ((r = sshkey_from_blob(blob, bloblen, &key)) != 0)
 		fatal("%s: bad public key blob: %s", __func__, ssh_err(r));
+	SSH_PROBE2(monitor_keyverify_start, sshkey_ssh_name(key), datalen);
 
 	switch (key_blobtype) {
 	case MM_USERKEY:
@@ -1399,6 +1401,7 @@ mm_answer_keyverify(int sock, struct sshbuf *m)
 
 	ret = sshkey_verify(key, signature, signaturelen, data, datalen,
 	    sigalg, active_state->compat);
+	SSH_PROBE1(monitor_keyverify_done, ret);
 	debug3("%s: %s %p signature %s", __func__, auth_method, key,
 	    (ret == 0) ? "verified" : "unverified");
 	auth2_record_key(authctxt, ret == 0, key);
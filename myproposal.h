@@ -168,7 +168,11 @@
 
 #endif /* WITH_OPENSSL */
 
+#ifdef WITH_ZSTD
+#define	KEX_DEFAULT_COMP	"none,zstd@openssh.com,zlib@openssh.com"
+#else
 #define	KEX_DEFAULT_COMP	"none,zlib@openssh.com"
+#endif
 #define	KEX_DEFAULT_LANG	""
 
 #define KEX_CLIENT \
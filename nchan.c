@@ -146,7 +146,7 @@ void
 chan_obuf_empty(struct ssh *ssh, Channel *c)
 {
 	debug2("channel %d: obuf empty", c->self);
-	if (sshbuf_len(c->output)) {
+	if (sshbuf_len(c->output) || c->zc_out != NULL) {
 		error("channel %d: chan_obuf_empty for non empty buffer",
 		    c->self);
 		return;
@@ -256,7 +256,7 @@ chan_rcvd_ieof(struct ssh *ssh, Channel *c)
 	if (c->ostate == CHAN_OUTPUT_OPEN)
 		chan_set_ostate(c, CHAN_OUTPUT_WAIT_DRAIN);
 	if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN &&
-	    sshbuf_len(c->output) == 0 &&
+	    sshbuf_len(c->output) == 0 && c->zc_out == NULL &&
 	    !CHANNEL_EFD_OUTPUT_ACTIVE(c))
 		chan_obuf_empty(ssh, c);
 }
@@ -42,6 +42,7 @@
 #include <sys/types.h>
 #include "openbsd-compat/sys-queue.h"
 #include <sys/socket.h>
+#include <sys/resource.h>
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
@@ -74,6 +75,9 @@
 #endif
 
 #include <zlib.h>
+#ifdef WITH_ZSTD
+# include <zstd.h>
+#endif
 
 #include "xmalloc.h"
 #include "crc32.h"
@@ -92,6 +96,7 @@
 #include "packet.h"
 #include "ssherr.h"
 #include "sshbuf.h"
+#include "probes.h"
 
 #ifdef PACKET_DEBUG
 #define DBG(x) x
@@ -100,12 +105,43 @@
 #endif
 
 #define PACKET_MAX_SIZE (256 * 1024)
+#define COMPRESS_CHUNK	4096	/* deflate output reserved per iteration */
+
+#define ZLIB_LEVEL	6	/* 1 (fastest) - 9 (slow, best) as in gzip */
+
+/*
+ * zstd levels up to 16 use at most a 4MB window, so peers need not
+ * accept larger ones.  The level is reconsidered after every
+ * ZSTD_SAMPLE_BYTES of input.
+ */
+#define ZSTD_LEVEL_START	3
+#define ZSTD_LEVEL_MIN		-5
+#define ZSTD_LEVEL_MAX		9
+#define ZSTD_WINDOW_LOG_MAX	22
+#define ZSTD_SAMPLE_BYTES	(1024 * 1024)
+
+/*
+ * Packet compression.  Each method negotiated by the key exchange maps
+ * to a set of functions that start and end its stream in a direction and
+ * (un)compress a packet payload.  Streams persist across packets, so
+ * later packets are compressed against the history of earlier ones.
+ */
+struct packet_comp {
+	const char *name;
+	int	(*start_out)(struct ssh *);
+	int	(*start_in)(struct ssh *);
+	int	(*compress)(struct ssh *, struct sshbuf *, struct sshbuf *);
+	int	(*uncompress)(struct ssh *, struct sshbuf *, struct sshbuf *);
+	void	(*end_out)(struct ssh *);
+	void	(*end_in)(struct ssh *);
+};
 
 struct packet_state {
 	u_int32_t seqnr;
 	u_int32_t packets;
 	u_int64_t blocks;
 	u_int64_t bytes;
+	u_int64_t total_packets;	/* not reset on rekey */
 };
 
 struct packet {
@@ -156,6 +192,25 @@ struct session_state {
 	int compression_in_failures;
 	int compression_out_failures;
 
+	/* Compression method in use in each direction */
+	const struct packet_comp *comp_in;
+	const struct packet_comp *comp_out;
+
+#ifdef WITH_ZSTD
+	/* zstd streams; one frame spans many packets */
+	ZSTD_CCtx *zstd_out;
+	ZSTD_DCtx *zstd_in;
+	u_int64_t zstd_out_raw, zstd_out_compressed;
+	u_int64_t zstd_in_raw, zstd_in_compressed;
+
+	/* Adaptive zstd level and the sample it is chosen from */
+	int zstd_level;
+	u_int64_t zstd_sample_bytes;
+	double zstd_sample_start;
+	double zstd_sample_cpu;
+	double zstd_sample_busy;
+#endif
+
 	/* default maximum packet size */
 	u_int max_packet_size;
 
@@ -201,6 +256,9 @@ struct session_state {
 	/* Used in packet_send2 */
 	int rekeying;
 
+	/* Number of completed rekeys, for statistics */
+	u_int rekeys;
+
 	/* Used in ssh_packet_send_mux() */
 	int mux;
 
@@ -460,6 +518,18 @@ ssh_packet_get_bytes(struct ssh *ssh, u_int64_t *ibytes, u_int64_t *obytes)
 		*obytes = ssh->state->p_send.bytes;
 }
 
+void
+ssh_packet_get_counts(struct ssh *ssh, u_int64_t *ipackets,
+    u_int64_t *opackets, u_int *rekeys)
+{
+	if (ipackets)
+		*ipackets = ssh->state->p_read.total_packets;
+	if (opackets)
+		*opackets = ssh->state->p_send.total_packets;
+	if (rekeys)
+		*rekeys = ssh->state->rekeys;
+}
+
 int
 ssh_packet_connection_af(struct ssh *ssh)
 {
@@ -607,28 +677,11 @@ ssh_packet_close_internal(struct ssh *ssh, int do_close)
 	/* compression state is in shared mem, so we can only release it once */
 	if (do_close && state->compression_buffer) {
 		sshbuf_free(state->compression_buffer);
-		if (state->compression_out_started) {
-			z_streamp stream = &state->compression_out_stream;
-			debug("compress outgoing: "
-			    "raw data %llu, compressed %llu, factor %.2f",
-				(unsigned long long)stream->total_in,
-				(unsigned long long)stream->total_out,
-				stream->total_in == 0 ? 0.0 :
-				(double) stream->total_out / stream->total_in);
-			if (state->compression_out_failures == 0)
-				deflateEnd(stream);
-		}
-		if (state->compression_in_started) {
-			z_streamp stream = &state->compression_in_stream;
-			debug("compress incoming: "
-			    "raw data %llu, compressed %llu, factor %.2f",
-			    (unsigned long long)stream->total_out,
-			    (unsigned long long)stream->total_in,
-			    stream->total_out == 0 ? 0.0 :
-			    (double) stream->total_in / stream->total_out);
-			if (state->compression_in_failures == 0)
-				inflateEnd(stream);
-		}
+		if (state->comp_out != NULL)
+			state->comp_out->end_out(ssh);
+		if (state->comp_in != NULL)
+			state->comp_in->end_in(ssh);
+		state->comp_out = state->comp_in = NULL;
 	}
 	cipher_free(state->send_context);
 	cipher_free(state->receive_context);
@@ -671,29 +724,13 @@ ssh_packet_get_protocol_flags(struct ssh *ssh)
 	return ssh->state->remote_protocol_flags;
 }
 
-/*
- * Starts packet compression from the next packet on in both directions.
- * Level is compression level 1 (fastest) - 9 (slow, best) as in gzip.
- */
-
 static int
-ssh_packet_init_compression(struct ssh *ssh)
+zlib_start_out(struct ssh *ssh)
 {
-	if (!ssh->state->compression_buffer &&
-	   ((ssh->state->compression_buffer = sshbuf_new()) == NULL))
-		return SSH_ERR_ALLOC_FAIL;
-	return 0;
-}
-
-static int
-start_compression_out(struct ssh *ssh, int level)
-{
-	if (level < 1 || level > 9)
-		return SSH_ERR_INVALID_ARGUMENT;
-	debug("Enabling compression at level %d.", level);
+	debug("Enabling compression at level %d.", ZLIB_LEVEL);
 	if (ssh->state->compression_out_started == 1)
 		deflateEnd(&ssh->state->compression_out_stream);
-	switch (deflateInit(&ssh->state->compression_out_stream, level)) {
+	switch (deflateInit(&ssh->state->compression_out_stream, ZLIB_LEVEL)) {
 	case Z_OK:
 		ssh->state->compression_out_started = 1;
 		break;
@@ -706,7 +743,7 @@ start_compression_out(struct ssh *ssh, int level)
 }
 
 static int
-start_compression_in(struct ssh *ssh)
+zlib_start_in(struct ssh *ssh)
 {
 	if (ssh->state->compression_in_started == 1)
 		inflateEnd(&ssh->state->compression_in_stream);
@@ -724,9 +761,9 @@ start_compression_in(struct ssh *ssh)
 
 /* XXX remove need for separate compression buffer */
 static int
-compress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
+zlib_compress(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
 {
-	u_char buf[4096];
+	u_char *buf;
 	int r, status;
 
 	if (ssh->state->compression_out_started != 1)
@@ -744,9 +781,11 @@ compress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
 
 	/* Loop compressing until deflate() returns with avail_out != 0. */
 	do {
-		/* Set up fixed-size output buffer. */
+		/* Compress directly into space reserved in the output. */
+		if ((r = sshbuf_reserve(out, COMPRESS_CHUNK, &buf)) != 0)
+			return r;
 		ssh->state->compression_out_stream.next_out = buf;
-		ssh->state->compression_out_stream.avail_out = sizeof(buf);
+		ssh->state->compression_out_stream.avail_out = COMPRESS_CHUNK;
 
 		/* Compress as much data into the buffer as possible. */
 		status = deflate(&ssh->state->compression_out_stream,
@@ -755,8 +794,8 @@ compress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
 		case Z_MEM_ERROR:
 			return SSH_ERR_ALLOC_FAIL;
 		case Z_OK:
-			/* Append compressed data to output_buffer. */
-			if ((r = sshbuf_put(out, buf, sizeof(buf) -
+			/* Trim the unused part of the reservation. */
+			if ((r = sshbuf_consume_end(out,
 			    ssh->state->compression_out_stream.avail_out)) != 0)
 				return r;
 			break;
@@ -770,7 +809,7 @@ compress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
 }
 
 static int
-uncompress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
+zlib_uncompress(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
 {
 	u_char buf[4096];
 	int r, status;
@@ -816,6 +855,300 @@ uncompress_buffer(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
 	/* NOTREACHED */
 }
 
+static void
+zlib_end_out(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	z_streamp stream = &state->compression_out_stream;
+
+	if (!state->compression_out_started)
+		return;
+	debug("compress outgoing: "
+	    "raw data %llu, compressed %llu, factor %.2f",
+	    (unsigned long long)stream->total_in,
+	    (unsigned long long)stream->total_out,
+	    stream->total_in == 0 ? 0.0 :
+	    (double) stream->total_out / stream->total_in);
+	if (state->compression_out_failures == 0)
+		deflateEnd(stream);
+	state->compression_out_started = 0;
+}
+
+static void
+zlib_end_in(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+	z_streamp stream = &state->compression_in_stream;
+
+	if (!state->compression_in_started)
+		return;
+	debug("compress incoming: "
+	    "raw data %llu, compressed %llu, factor %.2f",
+	    (unsigned long long)stream->total_out,
+	    (unsigned long long)stream->total_in,
+	    stream->total_out == 0 ? 0.0 :
+	    (double) stream->total_in / stream->total_out);
+	if (state->compression_in_failures == 0)
+		inflateEnd(stream);
+	state->compression_in_started = 0;
+}
+
+#ifdef WITH_ZSTD
+/* CPU time used by this process, in seconds */
+static double
+cpu_time(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+static void
+zstd_sample_reset(struct session_state *state)
+{
+	state->zstd_sample_bytes = 0;
+	state->zstd_sample_start = monotime_double();
+	state->zstd_sample_cpu = cpu_time();
+	state->zstd_sample_busy = 0;
+}
+
+static int
+zstd_start_out(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+
+	/* As zlib@openssh.com, the stream continues across rekeying */
+	if (state->zstd_out != NULL)
+		return 0;
+	if ((state->zstd_out = ZSTD_createCCtx()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if (state->zstd_level == 0)
+		state->zstd_level = ZSTD_LEVEL_START;
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(state->zstd_out,
+	    ZSTD_c_compressionLevel, state->zstd_level)))
+		return SSH_ERR_INTERNAL_ERROR;
+	zstd_sample_reset(state);
+	debug("Enabling zstd compression at level %d.", state->zstd_level);
+	return 0;
+}
+
+static int
+zstd_start_in(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+
+	if (state->zstd_in != NULL)
+		return 0;
+	if ((state->zstd_in = ZSTD_createDCtx()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if (ZSTD_isError(ZSTD_DCtx_setParameter(state->zstd_in,
+	    ZSTD_d_windowLogMax, ZSTD_WINDOW_LOG_MAX)))
+		return SSH_ERR_INTERNAL_ERROR;
+	return 0;
+}
+
+/*
+ * Returns the level to compress at from the last sample of output.
+ * When the process was busy for the whole sample and a good part of
+ * that went on compression, the CPU is what limits throughput, so
+ * compress less.  When it was mostly idle, it was waiting on the link
+ * (or on the data), so spend more CPU to send fewer bytes.
+ */
+static int
+zstd_adapt(struct session_state *state)
+{
+	double elapsed, cpu;
+	int level = state->zstd_level;
+
+	if (state->zstd_sample_bytes < ZSTD_SAMPLE_BYTES)
+		return level;
+	elapsed = monotime_double() - state->zstd_sample_start;
+	cpu = cpu_time() - state->zstd_sample_cpu;
+	if (cpu > elapsed * 0.9 && state->zstd_sample_busy > cpu / 4 &&
+	    level > ZSTD_LEVEL_MIN)
+		level = level == 1 ? -1 : level - 1;
+	else if (cpu < elapsed / 2 && level < ZSTD_LEVEL_MAX)
+		level = level == -1 ? 1 : level + 1;
+	zstd_sample_reset(state);
+	return level;
+}
+
+static int
+zstd_compress(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
+{
+	struct session_state *state = ssh->state;
+	ZSTD_EndDirective mode = ZSTD_e_flush;
+	ZSTD_inBuffer ib;
+	ZSTD_outBuffer ob;
+	double start;
+	u_char *buf;
+	size_t left;
+	int r, level;
+
+	if (state->zstd_out == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+	if (sshbuf_len(in) == 0)
+		return 0;
+
+	/*
+	 * The level only changes at the start of a frame, so end the
+	 * current one with this packet when a new level is due.
+	 */
+	start = monotime_double();
+	if ((level = zstd_adapt(state)) != state->zstd_level)
+		mode = ZSTD_e_end;
+
+	ib.src = sshbuf_ptr(in);
+	ib.size = sshbuf_len(in);
+	ib.pos = 0;
+	do {
+		if ((r = sshbuf_reserve(out, COMPRESS_CHUNK, &buf)) != 0)
+			return r;
+		ob.dst = buf;
+		ob.size = COMPRESS_CHUNK;
+		ob.pos = 0;
+		left = ZSTD_compressStream2(state->zstd_out, &ob, &ib, mode);
+		if (ZSTD_isError(left)) {
+			error("%s: %s", __func__, ZSTD_getErrorName(left));
+			return SSH_ERR_INTERNAL_ERROR;
+		}
+		if ((r = sshbuf_consume_end(out, ob.size - ob.pos)) != 0)
+			return r;
+		state->zstd_out_compressed += ob.pos;
+	} while (left != 0);
+	state->zstd_out_raw += ib.size;
+
+	if (mode == ZSTD_e_end) {
+		debug2("%s: level %d -> %d", __func__,
+		    state->zstd_level, level);
+		if (ZSTD_isError(ZSTD_CCtx_setParameter(state->zstd_out,
+		    ZSTD_c_compressionLevel, level)))
+			return SSH_ERR_INTERNAL_ERROR;
+		state->zstd_level = level;
+	}
+	state->zstd_sample_bytes += ib.size;
+	state->zstd_sample_busy += monotime_double() - start;
+	return 0;
+}
+
+static int
+zstd_uncompress(struct ssh *ssh, struct sshbuf *in, struct sshbuf *out)
+{
+	struct session_state *state = ssh->state;
+	ZSTD_inBuffer ib;
+	ZSTD_outBuffer ob;
+	u_char *buf;
+	size_t ret;
+	int r;
+
+	if (state->zstd_in == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+
+	ib.src = sshbuf_ptr(in);
+	ib.size = sshbuf_len(in);
+	ib.pos = 0;
+	/* Decode until the input is used up and no output is held back */
+	do {
+		if (sshbuf_len(out) >= PACKET_MAX_SIZE)
+			return SSH_ERR_INVALID_FORMAT;
+		if ((r = sshbuf_reserve(out, COMPRESS_CHUNK, &buf)) != 0)
+			return r;
+		ob.dst = buf;
+		ob.size = COMPRESS_CHUNK;
+		ob.pos = 0;
+		ret = ZSTD_decompressStream(state->zstd_in, &ob, &ib);
+		if (ZSTD_isError(ret)) {
+			debug("%s: %s", __func__, ZSTD_getErrorName(ret));
+			return SSH_ERR_INVALID_FORMAT;
+		}
+		if ((r = sshbuf_consume_end(out, ob.size - ob.pos)) != 0)
+			return r;
+		state->zstd_in_raw += ob.pos;
+	} while (ib.pos < ib.size || ob.pos == ob.size);
+	state->zstd_in_compressed += ib.size;
+	return 0;
+}
+
+static void
+zstd_end_out(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+
+	debug("compress outgoing: "
+	    "raw data %llu, compressed %llu, factor %.2f, level %d",
+	    (unsigned long long)state->zstd_out_raw,
+	    (unsigned long long)state->zstd_out_compressed,
+	    state->zstd_out_raw == 0 ? 0.0 :
+	    (double) state->zstd_out_compressed / state->zstd_out_raw,
+	    state->zstd_level);
+	ZSTD_freeCCtx(state->zstd_out);
+	state->zstd_out = NULL;
+}
+
+static void
+zstd_end_in(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+
+	debug("compress incoming: "
+	    "raw data %llu, compressed %llu, factor %.2f",
+	    (unsigned long long)state->zstd_in_raw,
+	    (unsigned long long)state->zstd_in_compressed,
+	    state->zstd_in_raw == 0 ? 0.0 :
+	    (double) state->zstd_in_compressed / state->zstd_in_raw);
+	ZSTD_freeDCtx(state->zstd_in);
+	state->zstd_in = NULL;
+}
+#endif /* WITH_ZSTD */
+
+static const struct packet_comp packet_comps[] = {
+	{ "zlib@openssh.com", zlib_start_out, zlib_start_in,
+	    zlib_compress, zlib_uncompress, zlib_end_out, zlib_end_in },
+	{ "zlib", zlib_start_out, zlib_start_in,
+	    zlib_compress, zlib_uncompress, zlib_end_out, zlib_end_in },
+#ifdef WITH_ZSTD
+	{ "zstd@openssh.com", zstd_start_out, zstd_start_in,
+	    zstd_compress, zstd_uncompress, zstd_end_out, zstd_end_in },
+#endif
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*
+ * Starts packet compression from the next packet on in the given
+ * direction, using the method negotiated in comp.
+ */
+static int
+ssh_packet_start_compression(struct ssh *ssh, int mode, struct sshcomp *comp)
+{
+	struct session_state *state = ssh->state;
+	const struct packet_comp *pc;
+
+	for (pc = packet_comps; pc->name != NULL; pc++) {
+		if (strcmp(pc->name, comp->name) == 0)
+			break;
+	}
+	if (pc->name == NULL)
+		return SSH_ERR_INTERNAL_ERROR;
+	if (!state->compression_buffer &&
+	   ((state->compression_buffer = sshbuf_new()) == NULL))
+		return SSH_ERR_ALLOC_FAIL;
+	/* A rekey may switch methods; the same one carries on its stream */
+	if (mode == MODE_OUT) {
+		if (state->comp_out != NULL && state->comp_out->end_out !=
+		    pc->end_out)
+			state->comp_out->end_out(ssh);
+		state->comp_out = pc;
+		return pc->start_out(ssh);
+	}
+	if (state->comp_in != NULL && state->comp_in->end_in != pc->end_in)
+		state->comp_in->end_in(ssh);
+	state->comp_in = pc;
+	return pc->start_in(ssh);
+}
+
 void
 ssh_clear_newkeys(struct ssh *ssh, int mode)
 {
@@ -862,6 +1195,8 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 		*ccp = NULL;
 		kex_free_newkeys(state->newkeys[mode]);
 		state->newkeys[mode] = NULL;
+		if (mode == MODE_OUT)
+			state->rekeys++;
 	}
 	/* note that both bytes and the seqnr are not reset */
 	ps->packets = ps->blocks = 0;
@@ -893,15 +1228,8 @@ ssh_set_newkeys(struct ssh *ssh, int mode)
 	if ((comp->type == COMP_ZLIB ||
 	    (comp->type == COMP_DELAYED &&
 	     state->after_authentication)) && comp->enabled == 0) {
-		if ((r = ssh_packet_init_compression(ssh)) < 0)
+		if ((r = ssh_packet_start_compression(ssh, mode, comp)) != 0)
 			return r;
-		if (mode == MODE_OUT) {
-			if ((r = start_compression_out(ssh, 6)) != 0)
-				return r;
-		} else {
-			if ((r = start_compression_in(ssh)) != 0)
-				return r;
-		}
 		comp->enabled = 1;
 	}
 	/*
@@ -991,15 +1319,9 @@ ssh_packet_enable_delayed_compress(struct ssh *ssh)
 			continue;
 		comp = &state->newkeys[mode]->comp;
 		if (comp && !comp->enabled && comp->type == COMP_DELAYED) {
-			if ((r = ssh_packet_init_compression(ssh)) != 0)
+			if ((r = ssh_packet_start_compression(ssh,
+			    mode, comp)) != 0)
 				return r;
-			if (mode == MODE_OUT) {
-				if ((r = start_compression_out(ssh, 6)) != 0)
-					return r;
-			} else {
-				if ((r = start_compression_in(ssh)) != 0)
-					return r;
-			}
 			comp->enabled = 1;
 		}
 	}
@@ -1034,6 +1356,7 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 	struct sshenc *enc   = NULL;
 	struct sshmac *mac   = NULL;
 	struct sshcomp *comp = NULL;
+	struct sshbuf *tmpbuf;
 	int r, block_size;
 
 	if (state->newkeys[MODE_OUT] != NULL) {
@@ -1060,16 +1383,20 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 		/* skip header, compress only payload */
 		if ((r = sshbuf_consume(state->outgoing_packet, 5)) != 0)
 			goto out;
+		/*
+		 * Compress behind a fresh header and swap buffers rather
+		 * than copying the compressed payload back.
+		 */
 		sshbuf_reset(state->compression_buffer);
-		if ((r = compress_buffer(ssh, state->outgoing_packet,
-		    state->compression_buffer)) != 0)
-			goto out;
-		sshbuf_reset(state->outgoing_packet);
-		if ((r = sshbuf_put(state->outgoing_packet,
+		if ((r = sshbuf_put(state->compression_buffer,
 		    "\0\0\0\0\0", 5)) != 0 ||
-		    (r = sshbuf_putb(state->outgoing_packet,
-		    state->compression_buffer)) != 0)
+		    (r = state->comp_out->compress(ssh,
+		    state->outgoing_packet, state->compression_buffer)) != 0)
 			goto out;
+		tmpbuf = state->outgoing_packet;
+		state->outgoing_packet = state->compression_buffer;
+		state->compression_buffer = tmpbuf;
+		sshbuf_reset(state->compression_buffer);
 		DBG(debug("compression: raw %d compressed %zd", len,
 		    sshbuf_len(state->outgoing_packet)));
 	}
@@ -1136,14 +1463,42 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 			goto out;
 		DBG(debug("done calc MAC out #%d", state->p_send.seqnr));
 	}
-	/* encrypt packet and append to output buffer. */
-	if ((r = sshbuf_reserve(state->output,
-	    sshbuf_len(state->outgoing_packet) + authlen, &cp)) != 0)
-		goto out;
-	if ((r = cipher_crypt(state->send_context, state->p_send.seqnr, cp,
-	    sshbuf_ptr(state->outgoing_packet),
-	    len - aadlen, aadlen, authlen)) != 0)
-		goto out;
+	if (sshbuf_len(state->output) == 0) {
+		/*
+		 * Nothing is pending, so encrypt the packet in place and
+		 * make it the output buffer instead of writing the
+		 * ciphertext to a second buffer.
+		 */
+		if ((r = sshbuf_reserve(state->outgoing_packet,
+		    authlen, NULL)) != 0)
+			goto out;
+		if ((cp = sshbuf_mutable_ptr(state->outgoing_packet)) == NULL) {
+			r = SSH_ERR_INTERNAL_ERROR;
+			goto out;
+		}
+		if ((r = cipher_crypt(state->send_context,
+		    state->p_send.seqnr, cp, cp,
+		    len - aadlen, aadlen, authlen)) != 0)
+			goto out;
+		tmpbuf = state->output;
+		state->output = state->outgoing_packet;
+		state->outgoing_packet = tmpbuf;
+	} else {
+		/*
+		 * encrypt packet and append to output buffer.  This case
+		 * is not done in place: the cipher already reads the packet
+		 * and writes the ciphertext in one pass, and avoiding that
+		 * would need packets built at the tail of the output.
+		 */
+		if ((r = sshbuf_reserve(state->output,
+		    sshbuf_len(state->outgoing_packet) + authlen, &cp)) != 0)
+			goto out;
+		if ((r = cipher_crypt(state->send_context,
+		    state->p_send.seqnr, cp,
+		    sshbuf_ptr(state->outgoing_packet),
+		    len - aadlen, aadlen, authlen)) != 0)
+			goto out;
+	}
 	/* append unencrypted MAC */
 	if (mac && mac->enabled) {
 		if (mac->etm) {
@@ -1164,6 +1519,7 @@ ssh_packet_send2_wrapped(struct ssh *ssh)
 	/* increment sequence number for outgoing packets */
 	if (++state->p_send.seqnr == 0)
 		logit("outgoing seqnr wraps around");
+	state->p_send.total_packets++;
 	if (++state->p_send.packets == 0)
 		if (!(ssh->compat & SSH_BUG_NOREKEY))
 			return SSH_ERR_NEED_REKEY;
@@ -1204,6 +1560,7 @@ ssh_packet_send2(struct ssh *ssh)
 	if (sshbuf_len(state->outgoing_packet) < 6)
 		return SSH_ERR_INTERNAL_ERROR;
 	type = sshbuf_ptr(state->outgoing_packet)[5];
+	SSH_PROBE2(packet_send, type, sshbuf_len(state->outgoing_packet) - 6);
 	need_rekey = !ssh_packet_type_is_kex(type) &&
 	    ssh_packet_need_rekeying(ssh, sshbuf_len(state->outgoing_packet));
 
@@ -1596,6 +1953,7 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 		*seqnr_p = state->p_read.seqnr;
 	if (++state->p_read.seqnr == 0)
 		logit("incoming seqnr wraps around");
+	state->p_read.total_packets++;
 	if (++state->p_read.packets == 0)
 		if (!(ssh->compat & SSH_BUG_NOREKEY))
 			return SSH_ERR_NEED_REKEY;
@@ -1622,8 +1980,8 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 	    sshbuf_len(state->incoming_packet)));
 	if (comp && comp->enabled) {
 		sshbuf_reset(state->compression_buffer);
-		if ((r = uncompress_buffer(ssh, state->incoming_packet,
-		    state->compression_buffer)) != 0)
+		if ((r = state->comp_in->uncompress(ssh,
+		    state->incoming_packet, state->compression_buffer)) != 0)
 			goto out;
 		sshbuf_reset(state->incoming_packet);
 		if ((r = sshbuf_putb(state->incoming_packet,
@@ -1640,6 +1998,7 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 		goto out;
 	if (ssh_packet_log_type(*typep))
 		debug3("receive packet: type %u", *typep);
+	SSH_PROBE2(packet_recv, *typep, sshbuf_len(state->incoming_packet));
 	if (*typep < SSH2_MSG_MIN || *typep >= SSH2_MSG_LOCAL_MIN) {
 		if ((r = sshpkt_disconnect(ssh,
 		    "Invalid ssh2 packet type: %d", *typep)) != 0 ||
@@ -2246,6 +2605,8 @@ ssh_packet_get_state(struct ssh *ssh, struct sshbuf *m)
 	    (r = sshbuf_put_u64(m, state->p_read.blocks)) != 0 ||
 	    (r = sshbuf_put_u32(m, state->p_read.packets)) != 0 ||
 	    (r = sshbuf_put_u64(m, state->p_read.bytes)) != 0 ||
+	    (r = sshbuf_put_u64(m, state->p_send.total_packets)) != 0 ||
+	    (r = sshbuf_put_u64(m, state->p_read.total_packets)) != 0 ||
 	    (r = sshbuf_put_stringb(m, state->input)) != 0 ||
 	    (r = sshbuf_put_stringb(m, state->output)) != 0)
 		return r;
@@ -2387,7 +2748,9 @@ ssh_packet_set_state(struct ssh *ssh, struct sshbuf *m)
 	    (r = sshbuf_get_u32(m, &state->p_read.seqnr)) != 0 ||
 	    (r = sshbuf_get_u64(m, &state->p_read.blocks)) != 0 ||
 	    (r = sshbuf_get_u32(m, &state->p_read.packets)) != 0 ||
-	    (r = sshbuf_get_u64(m, &state->p_read.bytes)) != 0)
+	    (r = sshbuf_get_u64(m, &state->p_read.bytes)) != 0 ||
+	    (r = sshbuf_get_u64(m, &state->p_send.total_packets)) != 0 ||
+	    (r = sshbuf_get_u64(m, &state->p_read.total_packets)) != 0)
 		return r;
 	/*
 	 * We set the time here so that in post-auth privsep slave we
@@ -30,6 +30,121 @@
 		(p)[3] = (uint8_t)((v) >> 24); \
 	} while (0)
 
+#ifdef HAVE_UNSIGNED___INT128
+/*
+ * poly1305-donna-64.h: radix 2^44 with 64x64->128 bit multiplies, about
+ * twice as fast as the 32-bit code below on 64-bit hosts.
+ */
+typedef unsigned __int128 uint128_t;
+
+#define U8TO64_LE(p) \
+	(((uint64_t)U8TO32_LE(p)) | ((uint64_t)U8TO32_LE((p) + 4) << 32))
+
+#define U64TO8_LE(p, v) \
+	do { \
+		U32TO8_LE((p), (uint32_t)(v)); \
+		U32TO8_LE((p) + 4, (uint32_t)((v) >> 32)); \
+	} while (0)
+
+void
+poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
+	uint64_t t0,t1;
+	uint64_t h0,h1,h2;
+	uint64_t r0,r1,r2;
+	uint64_t s1,s2;
+	uint64_t g0,g1,g2;
+	uint64_t c, hibit;
+	uint128_t d0,d1,d2;
+	unsigned char mp[16];
+	size_t j;
+
+	/* clamp key */
+	t0 = U8TO64_LE(key+0);
+	t1 = U8TO64_LE(key+8);
+	r0 = ( t0                    ) & 0xffc0fffffffULL;
+	r1 = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+	r2 = ((t1 >> 24)             ) & 0x00ffffffc0fULL;
+
+	/* precompute multipliers */
+	s1 = r1 * (5 << 2);
+	s2 = r2 * (5 << 2);
+
+	/* init state */
+	h0 = 0;
+	h1 = 0;
+	h2 = 0;
+	hibit = 1ULL << 40;
+
+	while (inlen > 0) {
+		if (inlen < 16) {
+			/* final bytes */
+			for (j = 0; j < inlen; j++) mp[j] = m[j];
+			mp[j++] = 1;
+			for (; j < 16; j++) mp[j] = 0;
+			m = mp;
+			inlen = 16;
+			hibit = 0;
+		}
+		t0 = U8TO64_LE(m+0);
+		t1 = U8TO64_LE(m+8);
+		m += 16;
+		inlen -= 16;
+
+		h0 += (( t0                    ) & 0xfffffffffffULL);
+		h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffffULL);
+		h2 += (((t1 >> 24)             ) & 0x3ffffffffffULL) | hibit;
+
+		d0 = (uint128_t)h0 * r0 + (uint128_t)h1 * s2 + (uint128_t)h2 * s1;
+		d1 = (uint128_t)h0 * r1 + (uint128_t)h1 * r0 + (uint128_t)h2 * s2;
+		d2 = (uint128_t)h0 * r2 + (uint128_t)h1 * r1 + (uint128_t)h2 * r0;
+
+		              c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & 0xfffffffffffULL;
+		d1 += c;      c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & 0xfffffffffffULL;
+		d2 += c;      c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & 0x3ffffffffffULL;
+		h0 += c * 5;  c = (h0 >> 44);           h0 = h0 & 0xfffffffffffULL;
+		h1 += c;
+	}
+
+	/* fully carry h */
+	             c = (h1 >> 44); h1 &= 0xfffffffffffULL;
+	h2 += c;     c = (h2 >> 42); h2 &= 0x3ffffffffffULL;
+	h0 += c * 5; c = (h0 >> 44); h0 &= 0xfffffffffffULL;
+	h1 += c;     c = (h1 >> 44); h1 &= 0xfffffffffffULL;
+	h2 += c;     c = (h2 >> 42); h2 &= 0x3ffffffffffULL;
+	h0 += c * 5; c = (h0 >> 44); h0 &= 0xfffffffffffULL;
+	h1 += c;
+
+	/* compute h + -p */
+	g0 = h0 + 5; c = (g0 >> 44); g0 &= 0xfffffffffffULL;
+	g1 = h1 + c; c = (g1 >> 44); g1 &= 0xfffffffffffULL;
+	g2 = h2 + c - (1ULL << 42);
+
+	/* select h if h < p, or h + -p if h >= p */
+	c = (g2 >> 63) - 1;
+	g0 &= c;
+	g1 &= c;
+	g2 &= c;
+	c = ~c;
+	h0 = (h0 & c) | g0;
+	h1 = (h1 & c) | g1;
+	h2 = (h2 & c) | g2;
+
+	/* h = (h + pad) */
+	t0 = U8TO64_LE(key+16);
+	t1 = U8TO64_LE(key+24);
+	h0 += (( t0                    ) & 0xfffffffffffULL)    ; c = (h0 >> 44); h0 &= 0xfffffffffffULL;
+	h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffffULL) + c; c = (h1 >> 44); h1 &= 0xfffffffffffULL;
+	h2 += (((t1 >> 24)             ) & 0x3ffffffffffULL) + c;                  h2 &= 0x3ffffffffffULL;
+
+	/* mac = h % (2^128) */
+	h0 = ((h0      ) | (h1 << 44));
+	h1 = ((h1 >> 20) | (h2 << 24));
+	U64TO8_LE(&out[0], h0);
+	U64TO8_LE(&out[8], h1);
+}
+
+#else /* HAVE_UNSIGNED___INT128 */
+
 void
 poly1305_auth(unsigned char out[POLY1305_TAGLEN], const unsigned char *m, size_t inlen, const unsigned char key[POLY1305_KEYLEN]) {
 	uint32_t t0,t1,t2,t3;
@@ -158,3 +273,5 @@ poly1305_donna_finish:
 	U32TO8_LE(&out[ 8], f2); f3 += (f2 >> 32);
 	U32TO8_LE(&out[12], f3);
 }
+
+#endif /* HAVE_UNSIGNED___INT128 */
@@ -0,0 +1,52 @@
+/*
+ * Placed in the public domain.
+ *
+ * USDT probe points, compiled in with --with-usdt.  Without it the
+ * macros expand to nothing and their arguments are not evaluated.
+ *
+ * All probes belong to the "openssh" provider.  String arguments are
+ * NUL-terminated and may be NULL.
+ *
+ *	kex_start(int server)
+ *		KEXINIT received from the peer; a key exchange begins.
+ *	kex_done(int server, char *kex_alg, char *hostkey_alg)
+ *		NEWKEYS received; the key exchange is complete.
+ *	auth_pubkey_start(char *user, char *pkalg, int have_sig)
+ *	auth_pubkey_done(char *user, int authenticated)
+ *		Around processing of a publickey userauth request; requests
+ *		without a signature only query whether the key is acceptable.
+ *	monitor_keyverify_start(char *keytype, size_t datalen)
+ *	monitor_keyverify_done(int ret)
+ *		Around the privileged signature check; ret is an SSH_ERR_*
+ *		code.
+ *	packet_send(u_int type, size_t len)
+ *	packet_recv(u_int type, size_t len)
+ *		An SSH packet was queued for sending or received; len is
+ *		the length of the payload after the type byte.
+ *	channel_read(int id, ssize_t len)
+ *	channel_write(int id, ssize_t len)
+ *		A channel read from or wrote to its local file descriptor.
+ *	session_exec_start(int session, char *type)
+ *	session_exec_done(int session, int ret)
+ *		Around starting a session's shell, command or subsystem;
+ *		type is as logged, so unforced commands are not shown.
+ */
+
+#ifndef SSH_PROBES_H
+#define SSH_PROBES_H
+
+#ifdef WITH_USDT
+# include <sys/sdt.h>
+# define SSH_PROBE1(name, a) \
+	DTRACE_PROBE1(openssh, name, a)
+# define SSH_PROBE2(name, a, b) \
+	DTRACE_PROBE2(openssh, name, a, b)
+# define SSH_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(openssh, name, a, b, c)
+#else
+# define SSH_PROBE1(name, a)
+# define SSH_PROBE2(name, a, b)
+# define SSH_PROBE3(name, a, b, c)
+#endif
+
+#endif /* SSH_PROBES_H */
@@ -51,6 +51,7 @@
 # include <vis.h>
 #endif
 
+#include "openbsd-compat/sys-queue.h"
 #include "xmalloc.h"
 #include "ssh.h"
 #include "compat.h"
@@ -66,6 +67,7 @@
 #include "uidswap.h"
 #include "myproposal.h"
 #include "digest.h"
+#include "channels.h"
 
 /* Format of the configuration file:
 
@@ -151,7 +153,7 @@ typedef enum {
 	oUser, oEscapeChar, oRhostsRSAAuthentication, oProxyCommand,
 	oGlobalKnownHostsFile, oUserKnownHostsFile, oConnectionAttempts,
 	oBatchMode, oCheckHostIP, oStrictHostKeyChecking, oCompression,
-	oCompressionLevel, oTCPKeepAlive, oNumberOfPasswordPrompts,
+	oCompressionLevel, oCompressionAlgorithms, oTCPKeepAlive, oNumberOfPasswordPrompts,
 	oUsePrivilegedPort, oLogFacility, oLogLevel, oCiphers, oMacs,
 	oPubkeyAuthentication,
 	oKbdInteractiveAuthentication, oKbdInteractiveDevices, oHostKeyAlias,
@@ -162,7 +164,7 @@ typedef enum {
 	oAddressFamily, oGssAuthentication, oGssDelegateCreds,
 	oServerAliveInterval, oServerAliveCountMax, oIdentitiesOnly,
 	oSendEnv, oSetEnv, oControlPath, oControlMaster, oControlPersist,
-	oHashKnownHosts,
+	oHashKnownHosts, oKnownHostsIndex,
 	oTunnel, oTunnelDevice,
 	oLocalCommand, oPermitLocalCommand, oRemoteCommand,
 	oVisualHostKey,
@@ -171,7 +173,8 @@ typedef enum {
 	oCanonicalizeFallbackLocal, oCanonicalizePermittedCNAMEs,
 	oStreamLocalBindMask, oStreamLocalBindUnlink, oRevokedHostKeys,
 	oFingerprintHash, oUpdateHostkeys, oHostbasedKeyTypes,
-	oPubkeyAcceptedKeyTypes, oProxyJump,
+	oPubkeyAcceptedKeyTypes, oProxyJump, oChannelWindowBudget, oBufferPool,
+	oZeroCopyForwarding,
 	oIgnore, oIgnoredUnknownOption, oDeprecated, oUnsupported
 } OpCodes;
 
@@ -257,6 +260,7 @@ static struct {
 	{ "checkhostip", oCheckHostIP },
 	{ "stricthostkeychecking", oStrictHostKeyChecking },
 	{ "compression", oCompression },
+	{ "compressionalgorithms", oCompressionAlgorithms },
 	{ "tcpkeepalive", oTCPKeepAlive },
 	{ "keepalive", oTCPKeepAlive },				/* obsolete */
 	{ "numberofpasswordprompts", oNumberOfPasswordPrompts },
@@ -282,6 +286,7 @@ static struct {
 	{ "controlmaster", oControlMaster },
 	{ "controlpersist", oControlPersist },
 	{ "hashknownhosts", oHashKnownHosts },
+	{ "knownhostsindex", oKnownHostsIndex },
 	{ "include", oInclude },
 	{ "tunnel", oTunnel },
 	{ "tunneldevice", oTunnelDevice },
@@ -293,6 +298,9 @@ static struct {
 	{ "ipqos", oIPQoS },
 	{ "requesttty", oRequestTTY },
 	{ "proxyusefdpass", oProxyUseFdpass },
+	{ "channelwindowbudget", oChannelWindowBudget },
+	{ "bufferpool", oBufferPool },
+	{ "zerocopyforwarding", oZeroCopyForwarding },
 	{ "canonicaldomains", oCanonicalDomains },
 	{ "canonicalizefallbacklocal", oCanonicalizeFallbackLocal },
 	{ "canonicalizehostname", oCanonicalizeHostname },
@@ -1192,6 +1200,18 @@ parse_int:
 			options->macs = xstrdup(arg);
 		break;
 
+	case oCompressionAlgorithms:
+		arg = strdelim(&s);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename, linenum);
+		if (*arg != '-' &&
+		    !comp_names_valid(*arg == '+' ? arg + 1 : arg))
+			fatal("%.200s line %d: Bad SSH2 compression spec '%s'.",
+			    filename, linenum, arg ? arg : "<NONE>");
+		if (*activep && options->compression_algorithms == NULL)
+			options->compression_algorithms = xstrdup(arg);
+		break;
+
 	case oKexAlgorithms:
 		arg = strdelim(&s);
 		if (!arg || *arg == '\0')
@@ -1456,6 +1476,10 @@ parse_keytypes:
 		intptr = &options->hash_known_hosts;
 		goto parse_flag;
 
+	case oKnownHostsIndex:
+		intptr = &options->known_hosts_index;
+		goto parse_flag;
+
 	case oTunnel:
 		intptr = &options->tun_open;
 		multistate_ptr = multistate_tunnel;
@@ -1583,6 +1607,29 @@ parse_keytypes:
 		intptr = &options->proxy_use_fdpass;
 		goto parse_flag;
 
+	case oChannelWindowBudget:
+		arg = strdelim(&s);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename,
+			    linenum);
+		if (scan_scaled(arg, &val64) == -1)
+			fatal("%.200s line %d: Bad number '%s': %s",
+			    filename, linenum, arg, strerror(errno));
+		if (val64 < 0)
+			fatal("%.200s line %d: Bad ChannelWindowBudget '%s'",
+			    filename, linenum, arg);
+		if (*activep && options->channel_window_budget == -1)
+			options->channel_window_budget = val64;
+		break;
+
+	case oBufferPool:
+		intptr = &options->buffer_pool;
+		goto parse_flag;
+
+	case oZeroCopyForwarding:
+		intptr = &options->zerocopy_forwarding;
+		goto parse_flag;
+
 	case oCanonicalDomains:
 		value = options->num_canonical_domains != 0;
 		while ((arg = strdelim(&s)) != NULL && *arg != '\0') {
@@ -1825,6 +1872,7 @@ initialize_options(Options * options)
 	options->check_host_ip = -1;
 	options->strict_host_key_checking = -1;
 	options->compression = -1;
+	options->compression_algorithms = NULL;
 	options->tcp_keep_alive = -1;
 	options->port = -1;
 	options->address_family = -1;
@@ -1875,6 +1923,7 @@ initialize_options(Options * options)
 	options->control_persist = -1;
 	options->control_persist_timeout = 0;
 	options->hash_known_hosts = -1;
+	options->known_hosts_index = -1;
 	options->tun_open = -1;
 	options->tun_local = -1;
 	options->tun_remote = -1;
@@ -1888,6 +1937,9 @@ initialize_options(Options * options)
 	options->ip_qos_bulk = -1;
 	options->request_tty = -1;
 	options->proxy_use_fdpass = -1;
+	options->channel_window_budget = -1;
+	options->buffer_pool = -1;
+	options->zerocopy_forwarding = -1;
 	options->ignored_unknown = NULL;
 	options->num_canonical_domains = 0;
 	options->num_permitted_cnames = 0;
@@ -2041,6 +2093,8 @@ fill_default_options(Options * options)
 	}
 	if (options->hash_known_hosts == -1)
 		options->hash_known_hosts = 0;
+	if (options->known_hosts_index == -1)
+		options->known_hosts_index = 0;
 	if (options->tun_open == -1)
 		options->tun_open = SSH_TUNMODE_NO;
 	if (options->tun_local == -1)
@@ -2059,6 +2113,12 @@ fill_default_options(Options * options)
 		options->request_tty = REQUEST_TTY_AUTO;
 	if (options->proxy_use_fdpass == -1)
 		options->proxy_use_fdpass = 0;
+	if (options->channel_window_budget == -1)
+		options->channel_window_budget = CHAN_WINDOW_BUDGET_DEFAULT;
+	if (options->buffer_pool == -1)
+		options->buffer_pool = 0;
+	if (options->zerocopy_forwarding == -1)
+		options->zerocopy_forwarding = 0;
 	if (options->canonicalize_max_dots == -1)
 		options->canonicalize_max_dots = 1;
 	if (options->canonicalize_fallback_local == -1)
@@ -2081,6 +2141,8 @@ fill_default_options(Options * options)
 	    KEX_CLIENT_MAC, all_mac) != 0 ||
 	    kex_assemble_names(&options->kex_algorithms,
 	    KEX_CLIENT_KEX, all_kex) != 0 ||
+	    kex_assemble_names(&options->compression_algorithms,
+	    compression_alg_list(1), compression_alg_list(0)) != 0 ||
 	    kex_assemble_names(&options->hostbased_key_types,
 	    KEX_DEFAULT_PK_ALG, all_key) != 0 ||
 	    kex_assemble_names(&options->pubkey_key_types,
@@ -2574,6 +2636,7 @@ dump_client_config(Options *o, const char *host)
 	dump_cfg_fmtint(oGssDelegateCreds, o->gss_deleg_creds);
 #endif /* GSSAPI */
 	dump_cfg_fmtint(oHashKnownHosts, o->hash_known_hosts);
+	dump_cfg_fmtint(oKnownHostsIndex, o->known_hosts_index);
 	dump_cfg_fmtint(oHostbasedAuthentication, o->hostbased_authentication);
 	dump_cfg_fmtint(oIdentitiesOnly, o->identities_only);
 	dump_cfg_fmtint(oKbdInteractiveAuthentication, o->kbd_interactive_authentication);
@@ -2581,9 +2644,11 @@ dump_client_config(Options *o, const char *host)
 	dump_cfg_fmtint(oPasswordAuthentication, o->password_authentication);
 	dump_cfg_fmtint(oPermitLocalCommand, o->permit_local_command);
 	dump_cfg_fmtint(oProxyUseFdpass, o->proxy_use_fdpass);
+	dump_cfg_fmtint(oBufferPool, o->buffer_pool);
 	dump_cfg_fmtint(oPubkeyAuthentication, o->pubkey_authentication);
 	dump_cfg_fmtint(oRequestTTY, o->request_tty);
 	dump_cfg_fmtint(oStreamLocalBindUnlink, o->fwd_opts.streamlocal_bind_unlink);
+	dump_cfg_fmtint(oZeroCopyForwarding, o->zerocopy_forwarding);
 	dump_cfg_fmtint(oStrictHostKeyChecking, o->strict_host_key_checking);
 	dump_cfg_fmtint(oTCPKeepAlive, o->tcp_keep_alive);
 	dump_cfg_fmtint(oTunnel, o->tun_open);
@@ -2603,6 +2668,7 @@ dump_client_config(Options *o, const char *host)
 	dump_cfg_string(oBindAddress, o->bind_address);
 	dump_cfg_string(oBindInterface, o->bind_interface);
 	dump_cfg_string(oCiphers, o->ciphers ? o->ciphers : KEX_CLIENT_ENCRYPT);
+	dump_cfg_string(oCompressionAlgorithms, o->compression_algorithms);
 	dump_cfg_string(oControlPath, o->control_path);
 	dump_cfg_string(oHostKeyAlgorithms, o->hostkeyalgorithms);
 	dump_cfg_string(oHostKeyAlias, o->host_key_alias);
@@ -2689,6 +2755,10 @@ dump_client_config(Options *o, const char *host)
 	printf("rekeylimit %llu %d\n",
 	    (unsigned long long)o->rekey_limit, o->rekey_interval);
 
+	/* oChannelWindowBudget */
+	printf("channelwindowbudget %llu\n",
+	    (unsigned long long)o->channel_window_budget);
+
 	/* oStreamLocalBindMask */
 	printf("streamlocalbindmask 0%o\n",
 	    o->fwd_opts.streamlocal_bind_mask);
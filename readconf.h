@@ -49,6 +49,7 @@ typedef struct {
 	int     check_host_ip;	/* Also keep track of keys for IP address */
 	int     strict_host_key_checking;	/* Strict host key checking. */
 	int     compression;	/* Compress packets in both directions. */
+	char   *compression_algorithms;	/* Compression methods in order. */
 	int     tcp_keep_alive;	/* Set SO_KEEPALIVE. */
 	int	ip_qos_interactive;	/* IP ToS/DSCP/class for interactive */
 	int	ip_qos_bulk;		/* IP ToS/DSCP/class for bulk traffic */
@@ -128,6 +129,7 @@ typedef struct {
 	int     control_persist_timeout; /* ControlPersist timeout (seconds) */
 
 	int	hash_known_hosts;
+	int	known_hosts_index;	/* use known_hosts.idx */
 
 	int	tun_open;	/* tun(4) */
 	int     tun_local;	/* force tun device (optional) */
@@ -142,6 +144,10 @@ typedef struct {
 
 	int	proxy_use_fdpass;
 
+	int64_t	channel_window_budget;	/* window autotuning limit */
+	int	buffer_pool;		/* reuse buffer memory */
+	int	zerocopy_forwarding;	/* MSG_ZEROCOPY for forwarded TCP */
+
 	int	num_canonical_domains;
 	char	*canonical_domains[MAX_CANON_DOMAINS];
 	int	canonicalize_hostname;
@@ -0,0 +1,87 @@
+#	Placed in the Public Domain.
+
+tid="authorized_keys index"
+
+# sshd only reads the lines of authorized_keys that its index says may
+# match an offered key; check that the line and options chosen are the
+# same as with a full scan, and that changes to the file are noticed.
+
+AK=$OBJ/authorized_keys_$USER
+cp $AK $OBJ/authorized_keys_bak
+
+rm -f $OBJ/ak_other*
+${SSHKEYGEN} -q -t ed25519 -N '' -f $OBJ/ak_other || fatal "ssh-keygen failed"
+
+# Unrelated keys around the user's, some with options.
+filler() {
+	i=0
+	while [ $i -lt $1 ]; do
+		case $i in
+		*7)	printf 'from="10.0.0.%d",no-pty ' $i ;;
+		esac
+		cat $OBJ/ak_other.pub
+		i=`expr $i + 1`
+	done
+}
+
+# Write authorized_keys with the user's keys under the given options.
+make_ak() {
+	filler 300 > $AK
+	for t in ${SSH_KEYTYPES}; do
+		printf "$1" >> $AK
+		cat $OBJ/$t.pub >> $AK
+	done
+	filler 30 >> $AK
+}
+
+expect_output() {
+	_out=`${SSH} -F $1 somehost echo unforced 2>/dev/null`
+	test "x$_out" = "x$2" || fail "$3: got \"$_out\" wanted \"$2\""
+}
+
+verbose "plain keys"
+make_ak ''
+expect_output $OBJ/ssh_proxy "unforced" "plain"
+
+verbose "options"
+make_ak 'command="echo forced a b" '
+expect_output $OBJ/ssh_proxy "forced a b" "options"
+
+verbose "first matching line"
+make_ak 'command="echo first" '
+for t in ${SSH_KEYTYPES}; do
+	printf 'command="echo second" ' >> $AK
+	cat $OBJ/$t.pub >> $AK
+done
+expect_output $OBJ/ssh_proxy "first" "first line"
+
+verbose "bad options on other lines"
+make_ak 'command="echo forced" '
+printf 'badoption ' | cat - $OBJ/ak_other.pub >> $AK
+printf 'command="unterminated ' | cat - $OBJ/ak_other.pub >> $AK
+expect_output $OBJ/ssh_proxy "forced" "bad options"
+
+verbose "comments and certificates"
+make_ak '# '
+expect_output $OBJ/ssh_proxy "" "commented out"
+make_ak 'cert-authority '
+expect_output $OBJ/ssh_proxy "" "cert-authority"
+
+verbose "listener cache"
+cp $OBJ/sshd_config $OBJ/sshd_config.orig
+echo "AuthorizedKeysIndexCache yes" >> $OBJ/sshd_config
+start_sshd
+make_ak 'command="echo cached" '
+expect_output $OBJ/ssh_config "cached" "first connection"
+expect_output $OBJ/ssh_config "cached" "second connection"
+# Same size and mtime, different contents: the ctime still changes.
+sed 's/cached/cachex/' $AK > $AK.new
+touch -r $AK $AK.new
+cat $AK.new > $AK
+touch -r $AK.new $AK
+expect_output $OBJ/ssh_config "cachex" "rewritten file"
+stop_sshd
+cp $OBJ/sshd_config.orig $OBJ/sshd_config
+
+cp $OBJ/authorized_keys_bak $AK
+rm -f $OBJ/ak_other* $AK.new $OBJ/authorized_keys_bak $OBJ/sshd_config.orig
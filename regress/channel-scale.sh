@@ -0,0 +1,62 @@
+#	Placed in the Public Domain.
+
+tid="channel scaling"
+
+# Measures the CPU time the server's event loop spends per iteration while
+# a bulk transfer runs alongside a growing number of idle forwarded
+# channels.  Each remote forward is a listening channel that the server has
+# to wait on in every loop iteration, so with a backend that rescans all
+# descriptors the cost per iteration grows with the number of channels.
+# The channel handlers visit every channel on each iteration whatever the
+# backend, so some growth remains with epoll too.
+#
+# This is a benchmark and is not run by default; use LTESTS=channel-scale.
+
+if [ ! -r /proc/self/stat ]; then
+	echo "skipped (no /proc/self/stat)"
+	exit 0
+fi
+
+tck=`getconf CLK_TCK 2>/dev/null`
+test -z "$tck" && tck=100
+nchans="0 100 500 1000"
+chunk=16384	# CHAN_RBUF: one channel read per loop iteration
+reps=20
+
+for n in $nchans; do
+	trace "$n forwarded channels"
+	cp $OBJ/ssh_proxy $OBJ/ssh_proxy_scale
+	i=0
+	while [ $i -lt $n ]; do
+		echo "RemoteForward 127.0.0.1:0 127.0.0.1:$PORT" \
+		    >> $OBJ/ssh_proxy_scale
+		i=`expr $i + 1`
+	done
+
+	# The remote shell's parent is the server session process.
+	i=0
+	while [ $i -lt $reps ]; do
+		cat ${DATA}
+		i=`expr $i + 1`
+	done | ${SSH} -F $OBJ/ssh_proxy_scale -o 'compression no' somehost \
+	    'cat /proc/$PPID/stat; cat >/dev/null; cat /proc/$PPID/stat' \
+	    > $OBJ/scale.out 2>/dev/null
+	if [ $? -ne 0 ] || [ `wc -l < $OBJ/scale.out` -ne 2 ]; then
+		fail "ssh failed with $n forwarded channels"
+		continue
+	fi
+
+	bytes=`wc -c < ${DATA}`
+	awk -v n=$n -v tck=$tck -v bytes=$bytes -v reps=$reps \
+	    -v chunk=$chunk '
+		{ t[NR] = $14 + $15 }
+		END {
+			iter = (bytes * reps) / chunk
+			ticks = t[2] - t[1]
+			printf("%-32s %6.3f s cpu, %8.2f us/iteration\n",
+			    n " forwarded channels:", ticks / tck,
+			    (ticks * 1000000 / tck) / iter)
+		}' $OBJ/scale.out
+done
+
+rm -f $OBJ/ssh_proxy_scale $OBJ/scale.out
@@ -11,7 +11,11 @@ getbytes ()
 
 tries="1 2"
 
-for c in `${SSH} -Q cipher`; do n=0; for m in `${SSH} -Q mac`; do
+# SPEED_CIPHERS restricts the run, e.g. to compare builds of one cipher.
+ciphers="${SPEED_CIPHERS}"
+test -z "$ciphers" && ciphers=`${SSH} -Q cipher`
+
+for c in $ciphers; do n=0; for m in `${SSH} -Q mac`; do
 	trace "cipher $c mac $m"
 	for x in $tries; do
 		printf "%-60s" "$c/$m:"
@@ -0,0 +1,47 @@
+#	Placed in the Public Domain.
+
+tid="compression"
+
+# Copies data in both directions with each compression method, rekeying
+# along the way, and reports the rate at which the data arrived and the
+# bytes sent on the wire per byte of data, so that the methods can be
+# compared; "none" is the baseline.
+
+LOG=$OBJ/compression.log
+CDATA=$OBJ/compression.data
+
+# Binaries compress moderately well and share code, like real data.
+cat ${SSHD_BIN} ${SSHAGENT_BIN} ${DATA} > $CDATA
+size=`wc -c < $CDATA | tr -d ' '`
+
+getbytes ()
+{
+	sed -n -e '/transferred/s/.*secs (\(.* bytes.sec\).*/\1/p' \
+	    -e '/copied/s/.*s, \(.* MB.s\).*/\1/p'
+}
+
+# The server does not offer pre-authentication "zlib".
+for m in `${SSH} -Q compression | grep -v '^zlib$'`; do
+	opts="-F $OBJ/ssh_proxy -v -E $LOG -oCompression=yes"
+	opts="$opts -oCompressionAlgorithms=$m -oRekeyLimit=1M"
+
+	trace "$m download"
+	rm -f $COPY
+	${SSH} $opts somehost "cat $CDATA" > $COPY
+	if [ $? -ne 0 ]; then
+		fail "ssh failed with compression $m download"
+	fi
+	cmp $CDATA $COPY || fail "corrupted copy with compression $m download"
+
+	trace "$m upload"
+	rm -f $COPY $LOG
+	rate=`${SSH} $opts somehost "dd of=$COPY obs=32k" < $CDATA 2>&1 | \
+	    getbytes`
+	cmp $CDATA $COPY || fail "corrupted copy with compression $m upload"
+	wire=`sed -n 's/^Transferred: sent \([0-9]*\),.*/\1/p' $LOG`
+	test -z "$wire" && wire=0
+	printf "%-20s %16s  %s\n" "$m:" "$rate" \
+	    `awk "BEGIN { printf(\"%.3f\", $wire / $size) }"`" wire/data"
+done
+
+rm -f $COPY $LOG $CDATA
@@ -0,0 +1,75 @@
+#	Placed in the Public Domain.
+
+tid="forwarding speed"
+
+# Measures the throughput of a local TCP forward in each direction with
+# ZeroCopyForwarding off and on, and checks that the data arrives intact.
+# Uploads are written to the target connection by sshd and downloads to
+# the local connection by ssh.  On loopback the kernel copies zero-copy
+# sends anyway, so the option is turned off again after the first sends
+# and both settings should come out about the same; it pays off when the
+# forwarded connections go to other hosts.
+#
+# This is a benchmark and is not run by default; use LTESTS=forward-speed.
+
+NC=$OBJ/netcat
+FDATA=$OBJ/forward-speed.data
+LOG=$OBJ/forward-speed.log
+fport=`expr $PORT + 1`
+tport=`expr $PORT + 2`
+reps=20
+
+make_tmpdir
+CTL=${SSH_REGRESS_TMP}/ctl-sock
+
+getbytes ()
+{
+	sed -n -e '/copied/s/.*s, \(.* [kMG]*B.s\).*/\1/p'
+}
+
+i=0
+while [ $i -lt $reps ]; do
+	cat ${DATA}
+	i=`expr $i + 1`
+done > $FDATA
+
+cp $OBJ/sshd_config $OBJ/sshd_config.orig
+
+for zc in no yes; do
+	cp $OBJ/sshd_config.orig $OBJ/sshd_config
+	echo "ZeroCopyForwarding $zc" >> $OBJ/sshd_config
+	start_sshd
+
+	rm -f $CTL
+	${SSH} -S $CTL -M -F $OBJ/ssh_config -f -oZeroCopyForwarding=$zc \
+	    -L$fport:127.0.0.1:$tport somehost sleep 600 || \
+		fatal "forwarding with ZeroCopyForwarding $zc failed"
+
+	trace "upload with ZeroCopyForwarding $zc"
+	rm -f $COPY
+	${NC} -l 127.0.0.1 $tport > $COPY &
+	ncpid=$!
+	sleep 1
+	dd if=$FDATA obs=32k 2>$LOG | ${NC} -N 127.0.0.1 $fport
+	wait $ncpid
+	cmp $FDATA $COPY || fail "corrupted upload with ZeroCopyForwarding $zc"
+	printf "%-40s %s\n" "upload, ZeroCopyForwarding $zc:" \
+	    "`getbytes < $LOG`"
+
+	trace "download with ZeroCopyForwarding $zc"
+	rm -f $COPY
+	${NC} -N -l 127.0.0.1 $tport < $FDATA &
+	ncpid=$!
+	sleep 1
+	${NC} 127.0.0.1 $fport < /dev/null | dd of=$COPY obs=32k 2>$LOG
+	wait $ncpid
+	cmp $FDATA $COPY || fail "corrupted download with ZeroCopyForwarding $zc"
+	printf "%-40s %s\n" "download, ZeroCopyForwarding $zc:" \
+	    "`getbytes < $LOG`"
+
+	${SSH} -F $OBJ/ssh_config -S $CTL -O exit somehost 2>/dev/null
+	stop_sshd
+done
+
+cp $OBJ/sshd_config.orig $OBJ/sshd_config
+rm -f $OBJ/sshd_config.orig $FDATA $LOG $COPY
@@ -0,0 +1,89 @@
+#	Placed in the Public Domain.
+
+tid="known_hosts index"
+
+# Checks that lookups through known_hosts.idx see the same keys as a full
+# scan of the file, including after the file changes underneath the index.
+
+KH=$OBJ/kh_idx
+IDX=$OBJ/kh_idx.idx
+
+rm -f $KH* $OBJ/kh_other*
+${SSHKEYGEN} -q -t ed25519 -N '' -f $OBJ/kh_other || fatal "ssh-keygen failed"
+
+( cat $OBJ/ssh_proxy | grep -vi knownhostsfile
+  echo "UserKnownHostsFile $KH"
+  echo "GlobalKnownHostsFile /dev/null"
+  echo "KnownHostsIndex yes" ) > $OBJ/ssh_proxy_idx
+
+# Many entries for other hosts around the real ones.
+filler() {
+	_pub=`cat $OBJ/kh_other.pub`
+	i=0
+	while [ $i -lt $1 ]; do
+		echo "host$i.example.com,10.0.`expr $i / 250`.`expr $i % 250` $_pub"
+		i=`expr $i + 1`
+	done
+}
+
+make_kh() {
+	filler 500 > $KH
+	cat >> $KH
+	filler 50 | sed 's/^host/other/' >> $KH
+}
+
+expect_connect() {
+	${SSH} -F $OBJ/ssh_proxy_idx somehost true >/dev/null 2>&1 || \
+		fail "$1: ssh failed"
+}
+
+expect_refused() {
+	${SSH} -F $OBJ/ssh_proxy_idx somehost true >/dev/null 2>&1 && \
+		fail "$1: ssh succeeded"
+}
+
+verbose "plain names"
+grep -v '^#' $OBJ/known_hosts | make_kh
+expect_connect "new index"
+test -f $IDX || fail "index not created"
+expect_connect "existing index"
+
+verbose "changed key"
+printf 'localhost-with-alias ' | cat - $OBJ/kh_other.pub | make_kh
+expect_refused "changed key"
+
+verbose "wildcard"
+grep -v '^#' $OBJ/known_hosts | sed 's/^[^ ]*/localhost-with-*/' | make_kh
+expect_connect "wildcard"
+grep -v '^#' $OBJ/known_hosts | \
+    sed 's/^[^ ]*/!localhost-with-alias,localhost-*/' | make_kh
+expect_refused "negated"
+
+verbose "hashed names"
+grep -v '^#' $OBJ/known_hosts | make_kh
+${SSHKEYGEN} -q -H -f $KH >/dev/null 2>&1 || fatal "ssh-keygen -H failed"
+rm -f $KH.old
+expect_connect "hashed, first lookup"
+cp $IDX $OBJ/kh_idx.bak
+expect_connect "hashed, second lookup"
+# Lookups must not record the names looked up
+cmp $IDX $OBJ/kh_idx.bak >/dev/null || fail "index changed by lookup"
+rm -f $OBJ/kh_idx.bak
+
+verbose "revoked key"
+( grep -v '^#' $OBJ/known_hosts
+  for t in ${SSH_KEYTYPES}; do
+	printf '@revoked * '
+	cat $OBJ/$t.pub
+  done ) | make_kh
+expect_refused "revoked"
+
+verbose "untrusted index"
+grep -v '^#' $OBJ/known_hosts | make_kh
+expect_connect "rebuilt index"
+echo garbage > $IDX
+expect_connect "corrupt index"
+chmod 666 $IDX
+expect_connect "writable index"
+
+rm -f $KH* $OBJ/kh_other* $OBJ/ssh_proxy_idx
@@ -0,0 +1,142 @@
+/*
+ * Microbenchmark for the UMAC NH inner loop.
+ *
+ * Checks that each NH implementation usable on this CPU agrees with the
+ * reference C version, then times each across 32KB packets.  Built for
+ * umac-64 by default; add -DUMAC_OUTPUT_LEN=16 to CFLAGS for umac-128.
+ *
+ * Placed in the public domain
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ERR_H
+# include <err.h>
+#endif
+
+#ifndef UMAC_OUTPUT_LEN
+# define UMAC_OUTPUT_LEN	8
+#endif
+
+/* Keep the public symbols out of the way of umac.o in libssh */
+#define umac_new	bench_umac_new
+#define umac_update	bench_umac_update
+#define umac_final	bench_umac_final
+#define umac_delete	bench_umac_delete
+#define umac_ctx	bench_umac_ctx
+
+#include "umac.c"
+
+#define PACKET_LEN	(32 * 1024)
+#define NPACKETS	20000
+
+struct nh_impl {
+	const char *name;
+	void (*fn)(void *, const void *, void *, UINT32);
+	int available;
+};
+
+static struct nh_impl impls[] = {
+	{ "reference", nh_aux_ref, 1 },
+#ifdef HAVE_X86_SIMD_DISPATCH
+	{ "sse2", nh_aux_sse2, 0 },
+	{ "avx2", nh_aux_avx2, 0 },
+#endif
+	{ NULL, NULL, 0 }
+};
+
+static void
+fill(void *p, size_t len)
+{
+	arc4random_buf(p, len);
+}
+
+/* Every length NH is called with, at every data alignment mod 16 */
+static int
+check(const struct nh_impl *impl, UINT8 *key, UINT8 *data)
+{
+	UINT64 want[STREAMS], got[STREAMS];
+	UINT32 len, off;
+
+	for (len = 32; len <= L1_KEY_LEN; len += 32) {
+		for (off = 0; off < 16; off++) {
+			fill(want, sizeof(want));
+			memcpy(got, want, sizeof(got));
+			nh_aux_ref(key, data + off, want, len);
+			impl->fn(key, data + off, got, len);
+			if (memcmp(want, got, sizeof(want)) != 0) {
+				fprintf(stderr, "%s: mismatch at len %u "
+				    "offset %u\n", impl->name, len, off);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static double
+bench(const struct nh_impl *impl, UINT8 *key, UINT8 *data)
+{
+	UINT64 h[STREAMS];
+	double start, elapsed;
+	u_int i, off;
+
+	memset(h, 0, sizeof(h));
+	start = monotime_double();
+	for (i = 0; i < NPACKETS; i++) {
+		for (off = 0; off < PACKET_LEN; off += L1_KEY_LEN)
+			impl->fn(key, data + off, h, L1_KEY_LEN);
+	}
+	elapsed = monotime_double() - start;
+	/* keep the result live */
+	if (h[0] == 0 && h[STREAMS - 1] == 0)
+		printf("(zero hash)\n");
+	return elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+	UINT8 *key, *data;
+	struct nh_impl *impl;
+	double ref_time = 0, t;
+	int ret = 0;
+
+	key = xmalloc(L1_KEY_LEN + L1_KEY_SHIFT * (STREAMS - 1));
+	data = xmalloc(PACKET_LEN + 16);
+	fill(key, L1_KEY_LEN + L1_KEY_SHIFT * (STREAMS - 1));
+	fill(data, PACKET_LEN + 16);
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+	__builtin_cpu_init();
+	impls[1].available = __builtin_cpu_supports("sse2");
+	impls[2].available = __builtin_cpu_supports("avx2");
+#endif
+
+	printf("umac-%d NH, %d x %d byte packets\n", UMAC_OUTPUT_LEN * 8,
+	    NPACKETS, PACKET_LEN);
+	for (impl = impls; impl->name != NULL; impl++) {
+		if (!impl->available) {
+			printf("%-10s not supported by this CPU\n", impl->name);
+			continue;
+		}
+		if (check(impl, key, data) != 0) {
+			ret = 1;
+			continue;
+		}
+		t = bench(impl, key, data);
+		if (ref_time == 0)
+			ref_time = t;
+		printf("%-10s %8.1f MB/s  %5.2fx\n", impl->name,
+		    ((double)NPACKETS * PACKET_LEN) / t / (1024 * 1024),
+		    ref_time / t);
+	}
+	free(key);
+	free(data);
+	return ret;
+}
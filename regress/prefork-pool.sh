@@ -0,0 +1,35 @@
+#	Placed in the Public Domain.
+
+tid="prefork pool"
+
+# Connections are handed to pre-started handlers when PreforkPool is set,
+# including several that arrive at once.
+
+cp $OBJ/sshd_config $OBJ/sshd_config.orig
+echo "PreforkPool 3" >> $OBJ/sshd_config
+
+start_sshd
+
+for n in 1 2 3 4; do
+	verbose "test $tid: sequential connection $n"
+	out=`${SSH} -F $OBJ/ssh_config somehost echo ok$n`
+	test "$out" = "ok$n" || fail "connection $n failed"
+done
+
+verbose "test $tid: concurrent connections"
+pids=""
+for n in 1 2 3 4 5 6; do
+	${SSH} -F $OBJ/ssh_config somehost true &
+	pids="$pids $!"
+done
+for p in $pids; do
+	wait $p || fail "concurrent connection failed"
+done
+
+handed=`grep -c "Passed connection to pool handler" $TEST_SSHD_LOGFILE`
+test "$handed" -ge 4 || fail "connections not passed to pool ($handed)"
+
+stop_sshd
+
+cp $OBJ/sshd_config.orig $OBJ/sshd_config
+rm -f $OBJ/sshd_config.orig
@@ -35,6 +35,8 @@ start_sshd
 echo "InvalidXXX=no" >> $OBJ/sshd_config
 
 copy_tests
+grep "Loaded parsed configuration" $TEST_SSHD_LOGFILE >/dev/null || \
+	fail "parsed configuration not passed"
 
 stop_sshd
 
@@ -40,6 +40,21 @@ echo "ls ${OBJ}" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "ls failed"
 # XXX always successful
 
+verbose "$tid: ls large directory"
+# Long names so the listing spans several READDIR replies
+LONG=`printf '%0200d' 0`
+rm -rf ${COPY}.ls
+mkdir ${COPY}.ls
+i=0
+while [ $i -lt 2000 ]; do
+	echo > ${COPY}.ls/${LONG}$i
+	i=`expr $i + 1`
+done
+n=`echo "ls -1 ${COPY}.ls" | ${SFTP} -D ${SFTPSERVER} 2>/dev/null | \
+	grep -c "${LONG}"`
+test "x$n" = "x2000" || fail "ls large directory: got $n of 2000 entries"
+rm -rf ${COPY}.ls
+
 verbose "$tid: shell"
 echo "!echo hi there" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "shell failed"
@@ -71,6 +86,18 @@ echo "get $DATA $COPY" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "get failed"
 cmp $DATA ${COPY} || fail "corrupted copy after get"
 
+verbose "$tid: reget changed file"
+printf 'changed' | dd of=${COPY} bs=1 seek=1000 conv=notrunc 2>/dev/null
+echo "reget $DATA $COPY" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
+	|| fail "reget failed"
+cmp $DATA ${COPY} || fail "corrupted copy after reget of changed file"
+cat $DATA $DATA > ${COPY}
+cp ${COPY} ${COPY}.1
+echo "reget $DATA $COPY" | ${SFTP} -b - -D ${SFTPSERVER} >/dev/null 2>&1 \
+	&& fail "reget of longer file succeeded"
+cmp ${COPY}.1 ${COPY} || fail "reget of longer file changed it"
+rm -f ${COPY}.1
+
 rm -f ${COPY}
 verbose "$tid: get quoted"
 echo "get \"$DATA\" $COPY" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
@@ -201,6 +228,17 @@ rm -f ${COPY}.2
 echo "ln -s ${COPY}.1 ${COPY}.2" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 || fail "ln -s failed"
 test -h ${COPY}.2 || fail "missing file after ln -s"
 
+verbose "$tid: cp"
+rm -f ${COPY}.3
+echo "cp ${COPY}.1 ${COPY}.3" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 || fail "cp failed"
+cmp ${COPY}.1 ${COPY}.3 || fail "corrupted copy after cp"
+dd if=/dev/zero bs=1k count=1 2>/dev/null >> ${COPY}.3
+echo "cp ${COPY}.1 ${COPY}.3" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 || fail "cp over longer file failed"
+cmp ${COPY}.1 ${COPY}.3 || fail "corrupted copy after cp over longer file"
+echo "cp ${COPY}.1 ${COPY}.2" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1
+cmp $DATA ${COPY}.1 || fail "source damaged after cp onto itself"
+rm -f ${COPY}.3
+
 verbose "$tid: mkdir"
 echo "mkdir ${COPY}.dd" | ${SFTP} -D ${SFTPSERVER} >/dev/null 2>&1 \
 	|| fail "mkdir failed"
@@ -0,0 +1,61 @@
+#	Placed in the Public Domain.
+
+tid="sftp recursive transfer"
+
+# get -r and put -r keep several files in flight at once; check that
+# trees with many files of varied sizes arrive intact, with -p times.
+
+SRC=${OBJ}/tree_src
+DST=${OBJ}/tree_dst
+SFTPCMDFILE=${OBJ}/batch
+
+rm -rf $SRC $DST ${DST}.2
+mkdir -p $SRC/a/b/c $SRC/d $SRC/empty
+i=0
+while [ $i -lt 60 ]; do
+	dd if=$DATA of=$SRC/a/f$i bs=97 count=$i >/dev/null 2>&1
+	echo $i > $SRC/a/b/c/g$i
+	i=`expr $i + 1`
+done
+cp $DATA $SRC/d/big
+: > $SRC/d/zero
+touch -t 200101010101 $SRC/a/f7 $SRC/d
+
+check_tree() {
+	diff -r $SRC $1 >/dev/null 2>&1 || fail "$2: trees differ"
+	test "`ls -ld $1/d | awk '{print $6 $7 $8}'`" = \
+	    "`ls -ld $SRC/d | awk '{print $6 $7 $8}'`" || \
+		fail "$2: directory time not preserved"
+	test "`ls -l $1/a/f7 | awk '{print $6 $7 $8}'`" = \
+	    "`ls -l $SRC/a/f7 | awk '{print $6 $7 $8}'`" || \
+		fail "$2: file time not preserved"
+}
+
+for R in 1 3 adaptive; do
+	case $R in
+	adaptive)	ROPT="" ;;
+	*)		ROPT="-R $R" ;;
+	esac
+	verbose "$tid: num_requests $R"
+	rm -rf $DST ${DST}.2
+	mkdir -p ${DST}.2/tree_src
+	cat > $SFTPCMDFILE <<EOF2
+get -rp $SRC $DST
+put -rp $SRC ${DST}.2
+EOF2
+	${SFTP} -D ${SFTPSERVER} -B 1000 $ROPT -b $SFTPCMDFILE \
+	    >/dev/null 2>&1 || fail "sftp failed"
+	check_tree $DST "get"
+	check_tree ${DST}.2/tree_src "put"
+done
+
+verbose "$tid: failed file"
+rm -rf $DST
+mkdir -p $DST/a/f3
+echo "get -r $SRC/a $DST" > $SFTPCMDFILE
+${SFTP} -D ${SFTPSERVER} -b $SFTPCMDFILE >/dev/null 2>&1 && \
+	fail "get succeeded with unwritable file"
+cmp $SRC/a/f59 $DST/a/f59 || fail "get stopped at unwritable file"
+cmp $SRC/a/b/c/g42 $DST/a/b/c/g42 || fail "get corrupted file"
+
+rm -rf $SRC $DST ${DST}.2 $SFTPCMDFILE
@@ -11,13 +11,25 @@ put $DATA ${COPY}.2
 EOF
 
 BUFFERSIZE="5 1000 32000 64000"
-REQUESTS="1 2 10"
+REQUESTS="1 2 10 adaptive"
 
+# Also run the server with I/O worker threads.
+cat > $OBJ/sftp-server-workers.sh << EOF
+#!/bin/sh
+exec ${SFTPSERVER} -w 4 "\$@"
+EOF
+chmod a+rx $OBJ/sftp-server-workers.sh
+
+for S in ${SFTPSERVER} $OBJ/sftp-server-workers.sh; do
 for B in ${BUFFERSIZE}; do
 	for R in ${REQUESTS}; do
-                verbose "test $tid: buffer_size $B num_requests $R"
+                verbose "test $tid: server $S buffer_size $B num_requests $R"
+		case $R in
+		adaptive)	ROPT="" ;;
+		*)		ROPT="-R $R" ;;
+		esac
 		rm -f ${COPY}.1 ${COPY}.2
-		${SFTP} -D ${SFTPSERVER} -B $B -R $R -b $SFTPCMDFILE \
+		${SFTP} -D $S -B $B $ROPT -b $SFTPCMDFILE \
 		> /dev/null 2>&1
 		r=$?
 		if [ $r -ne 0 ]; then
@@ -28,5 +40,6 @@ for B in ${BUFFERSIZE}; do
 		fi
 	done
 done
+done
 rm -f ${COPY}.1 ${COPY}.2
-rm -f $SFTPCMDFILE
+rm -f $SFTPCMDFILE $OBJ/sftp-server-workers.sh
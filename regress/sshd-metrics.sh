@@ -0,0 +1,65 @@
+#	Placed in the Public Domain.
+
+tid="sshd metrics socket"
+
+# Checks that the counters of running and finished connections show up
+# on MetricsSocket, with and without re-execution of sshd.
+
+NC=$OBJ/netcat
+SOCK=$OBJ/metrics.sock
+OUT=$OBJ/metrics.out
+
+cp $OBJ/sshd_config $OBJ/sshd_config.orig
+echo "MetricsSocket $SOCK" >> $OBJ/sshd_config
+
+# Fetch a snapshot until the given awk condition holds for it.
+wait_metrics() {
+	n=0
+	while [ $n -lt 10 ]; do
+		$NC -U $SOCK < /dev/null > $OUT 2>/dev/null
+		awk "$1"' { found = 1 } END { exit !found }' $OUT && return 0
+		sleep 1
+		n=`expr $n + 1`
+	done
+	return 1
+}
+
+size=`wc -c < $DATA | tr -d ' '`
+
+for rexec in "" "-r"; do
+	verbose "test $tid: sshd $rexec"
+	start_sshd $rexec
+	test -S $SOCK || fail "socket not created"
+	case "`ls -l $SOCK`" in
+	srw-------*)	;;
+	*)		fail "bad socket permissions" ;;
+	esac
+
+	wait_metrics '$1 == "sshd_connections_open" && $2 == 0' || \
+		fail "no idle snapshot"
+
+	${SSH} -F $OBJ/ssh_config somehost sleep 30 &
+	client=$!
+	wait_metrics '/^sshd_connection_channels_open{/ &&
+	    index($0, "user=\"'$USER'\"") && $2 == 1' || \
+		fail "running connection not listed"
+	kill $client
+	wait $client 2>/dev/null
+
+	${SSH} -F $OBJ/ssh_config somehost 'cat > /dev/null' < $DATA || \
+		fail "ssh failed"
+	wait_metrics '$1 == "sshd_connections_open" && $2 == 0' || \
+		fail "connections not closed"
+	wait_metrics '$1 == "sshd_bytes_received_total" && $2 > '$size || \
+		fail "bytes received not counted"
+	wait_metrics '$1 == "sshd_connections_closed_total" && $2 == 2' || \
+		fail "closed connections not counted"
+	wait_metrics '$1 == "sshd_channels_opened_total" && $2 >= 2' || \
+		fail "channels not counted"
+
+	stop_sshd
+	test -S $SOCK && fail "socket not removed"
+done
+
+cp $OBJ/sshd_config.orig $OBJ/sshd_config
+rm -f $OBJ/sshd_config.orig $OUT
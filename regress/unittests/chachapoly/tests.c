@@ -0,0 +1,253 @@
+/*
+ * Regress test for chacha20 / poly1305 / chacha20-poly1305
+ *
+ * Placed in the public domain
+ */
+
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "chacha.h"
+#include "poly1305.h"
+#include "cipher-chachapoly.h"
+#include "misc.h"
+#include "sshbuf.h"
+#include "digest.h"
+#include "ssherr.h"
+
+/* Enough for several 8-block batches plus a tail */
+#define BUFLEN	5000
+
+/* chacha20, all-zero 256 bit key and IV (RFC 7539 A.1 test vector #1) */
+static const u_char zero_ks[64] = {
+	0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+	0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+	0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a,
+	0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+	0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d,
+	0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+	0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c,
+	0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86,
+};
+
+/*
+ * SHA256 of 4999 bytes of keystream for key 00..1f, IV 00..07 and a
+ * zero counter.
+ */
+static const u_char long_ks_sha256[32] = {
+	0x73, 0xb9, 0x68, 0x50, 0x28, 0x3a, 0x71, 0xf4,
+	0xc8, 0xae, 0x94, 0xc8, 0x4e, 0x0d, 0x4e, 0x81,
+	0x30, 0x0b, 0xde, 0xbd, 0x00, 0x0c, 0x17, 0x82,
+	0x92, 0x1d, 0x6f, 0x68, 0xd6, 0xf5, 0xeb, 0xbc,
+};
+
+/* As above, 1000 bytes starting at block 0xfffffffc */
+static const u_char wrap_ks_sha256[32] = {
+	0x95, 0x8e, 0xa7, 0x48, 0xf0, 0x0c, 0xea, 0x44,
+	0x78, 0x40, 0x22, 0x31, 0x7b, 0x3a, 0x15, 0x37,
+	0xac, 0x7a, 0x7a, 0xf1, 0x24, 0x44, 0x50, 0x00,
+	0x7d, 0xa9, 0x44, 0x5b, 0xd9, 0x92, 0x1b, 0xc6,
+};
+
+/* RFC 7539 2.5.2 */
+static const u_char poly_key[POLY1305_KEYLEN] = {
+	0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+	0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+	0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+	0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b,
+};
+static const u_char poly_tag[POLY1305_TAGLEN] = {
+	0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+	0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9,
+};
+
+/*
+ * SHA256 over the concatenated tags of messages 0..299 bytes long
+ * (byte i of each is i & 0xff) under the key whose byte i is 7i+3.
+ */
+static const u_char poly_tags_sha256[32] = {
+	0xc1, 0x43, 0xc5, 0x39, 0x0c, 0x66, 0x76, 0xe1,
+	0x52, 0x12, 0xe0, 0xeb, 0x0e, 0x4b, 0xc4, 0xd0,
+	0x80, 0x43, 0x6f, 0x89, 0xfb, 0x87, 0x57, 0x5d,
+	0xbd, 0x2a, 0xb8, 0x8a, 0x74, 0x38, 0x28, 0x09,
+};
+
+static void
+setup(struct chacha_ctx *ctx, u_int32_t ctrlo)
+{
+	u_char key[32], iv[CHACHA_NONCELEN], ctr[CHACHA_CTRLEN];
+	u_int i;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = i;
+	for (i = 0; i < sizeof(iv); i++)
+		iv[i] = i;
+	/* the block counter is little-endian */
+	memset(ctr, 0, sizeof(ctr));
+	for (i = 0; i < 4; i++)
+		ctr[i] = (ctrlo >> (8 * i)) & 0xff;
+	chacha_keysetup(ctx, key, 256);
+	chacha_ivsetup(ctx, iv, ctr);
+}
+
+static void
+test_chacha(void)
+{
+	struct chacha_ctx ctx;
+	u_char key[32], iv[CHACHA_NONCELEN], d[SSH_DIGEST_MAX_LENGTH];
+	u_char *a, *b;
+	u_int len, off, n;
+
+	a = calloc(1, BUFLEN);
+	b = calloc(1, BUFLEN);
+	ASSERT_PTR_NE(a, NULL);
+	ASSERT_PTR_NE(b, NULL);
+
+	TEST_START("chacha20 zero key");
+	memset(key, 0, sizeof(key));
+	memset(iv, 0, sizeof(iv));
+	chacha_keysetup(&ctx, key, 256);
+	chacha_ivsetup(&ctx, iv, NULL);
+	chacha_encrypt_bytes(&ctx, a, a, sizeof(zero_ks));
+	ASSERT_MEM_EQ(a, zero_ks, sizeof(zero_ks));
+	TEST_DONE();
+
+	TEST_START("chacha20 long keystream");
+	memset(a, 0, BUFLEN);
+	setup(&ctx, 0);
+	chacha_encrypt_bytes(&ctx, a, a, 4999);
+	ASSERT_INT_EQ(ssh_digest_memory(SSH_DIGEST_SHA256, a, 4999,
+	    d, sizeof(d)), 0);
+	ASSERT_MEM_EQ(d, long_ks_sha256, sizeof(long_ks_sha256));
+	TEST_DONE();
+
+	TEST_START("chacha20 counter wrap");
+	memset(a, 0, BUFLEN);
+	setup(&ctx, 0xfffffffc);
+	chacha_encrypt_bytes(&ctx, a, a, 1000);
+	ASSERT_INT_EQ(ssh_digest_memory(SSH_DIGEST_SHA256, a, 1000,
+	    d, sizeof(d)), 0);
+	ASSERT_MEM_EQ(d, wrap_ks_sha256, sizeof(wrap_ks_sha256));
+	TEST_DONE();
+
+	/*
+	 * Calls shorter than four blocks always use the reference code,
+	 * so comparing against one-block calls checks the multi-block
+	 * kernels and their hand-off to the reference for every length.
+	 */
+	TEST_START("chacha20 multi-block matches reference");
+	for (len = 1; len <= 20 * CHACHA_BLOCKLEN; len += 7) {
+		for (off = 0; off < len; off++)
+			a[off] = b[off] = (u_char)(off * 13 + len);
+		setup(&ctx, 0xfffffff0);
+		chacha_encrypt_bytes(&ctx, a, a, len);
+		setup(&ctx, 0xfffffff0);
+		for (off = 0; off < len; off += n) {
+			n = MINIMUM(len - off, CHACHA_BLOCKLEN);
+			chacha_encrypt_bytes(&ctx, b + off, b + off, n);
+		}
+		ASSERT_MEM_EQ(a, b, len);
+	}
+	TEST_DONE();
+
+	TEST_START("chacha20 unaligned buffers");
+	memset(a, 0, BUFLEN);
+	memset(b, 0, BUFLEN);
+	setup(&ctx, 0);
+	chacha_encrypt_bytes(&ctx, a + 1, b + 3, 4000);
+	setup(&ctx, 0);
+	chacha_encrypt_bytes(&ctx, a, a, 4000);
+	ASSERT_MEM_EQ(b + 3, a, 4000);
+	TEST_DONE();
+
+	free(a);
+	free(b);
+}
+
+static void
+test_poly1305(void)
+{
+	const char *msg = "Cryptographic Forum Research Group";
+	u_char key[POLY1305_KEYLEN], m[300], tag[POLY1305_TAGLEN];
+	u_char tags[300 * POLY1305_TAGLEN], d[SSH_DIGEST_MAX_LENGTH];
+	u_int i;
+
+	TEST_START("poly1305 rfc7539");
+	poly1305_auth(tag, msg, strlen(msg), poly_key);
+	ASSERT_MEM_EQ(tag, poly_tag, sizeof(poly_tag));
+	TEST_DONE();
+
+	TEST_START("poly1305 lengths");
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = i * 7 + 3;
+	for (i = 0; i < sizeof(m); i++)
+		m[i] = i & 0xff;
+	for (i = 0; i < sizeof(m); i++)
+		poly1305_auth(tags + i * POLY1305_TAGLEN, m, i, key);
+	ASSERT_INT_EQ(ssh_digest_memory(SSH_DIGEST_SHA256,
+	    tags, sizeof(tags), d, sizeof(d)), 0);
+	ASSERT_MEM_EQ(d, poly_tags_sha256, sizeof(poly_tags_sha256));
+	TEST_DONE();
+}
+
+static void
+test_chachapoly(void)
+{
+	struct chachapoly_ctx ctx;
+	u_char key[64], pkt[4 + 1024 + POLY1305_TAGLEN];
+	u_char enc[sizeof(pkt)], dec[sizeof(pkt)];
+	u_int i, plen;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = i;
+	for (i = 0; i < sizeof(pkt); i++)
+		pkt[i] = i;
+	POKE_U32(pkt, 1024);
+
+	TEST_START("chachapoly round trip");
+	ASSERT_INT_EQ(chachapoly_init(&ctx, key, sizeof(key)), 0);
+	ASSERT_INT_EQ(chachapoly_crypt(&ctx, 7, enc, pkt, 1024, 4,
+	    POLY1305_TAGLEN, 1), 0);
+	ASSERT_INT_EQ(chachapoly_get_length(&ctx, &plen, 7, enc, 4), 0);
+	ASSERT_U32_EQ(plen, 1024);
+	ASSERT_INT_EQ(chachapoly_crypt(&ctx, 7, dec, enc, 1024, 4,
+	    POLY1305_TAGLEN, 0), 0);
+	ASSERT_MEM_EQ(dec, pkt, 4 + 1024);
+	TEST_DONE();
+
+	TEST_START("chachapoly in place");
+	memcpy(dec, pkt, sizeof(pkt));
+	ASSERT_INT_EQ(chachapoly_crypt(&ctx, 7, dec, dec, 1024, 4,
+	    POLY1305_TAGLEN, 1), 0);
+	ASSERT_MEM_EQ(dec, enc, sizeof(enc));
+	TEST_DONE();
+
+	TEST_START("chachapoly wrong seqnr");
+	ASSERT_INT_EQ(chachapoly_crypt(&ctx, 8, dec, enc, 1024, 4,
+	    POLY1305_TAGLEN, 0), SSH_ERR_MAC_INVALID);
+	TEST_DONE();
+
+	TEST_START("chachapoly corrupt payload");
+	enc[100] ^= 1;
+	ASSERT_INT_EQ(chachapoly_crypt(&ctx, 7, dec, enc, 1024, 4,
+	    POLY1305_TAGLEN, 0), SSH_ERR_MAC_INVALID);
+	TEST_DONE();
+}
+
+void
+tests(void)
+{
+	test_chacha();
+	test_poly1305();
+	test_chachapoly();
+}
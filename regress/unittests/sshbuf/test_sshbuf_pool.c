@@ -0,0 +1,137 @@
+/*
+ * Regress test for the sshbuf memory pool
+ *
+ * Placed in the public domain
+ */
+
+#define SSHBUF_INTERNAL 1	/* access internals for testing */
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "ssherr.h"
+#include "sshbuf.h"
+
+void sshbuf_pool_tests(void);
+
+void
+sshbuf_pool_tests(void)
+{
+	struct sshbuf *p1, *p2;
+	struct sshbuf_stats st1, st2;
+	u_char *dp;
+	size_t alloc;
+	int i;
+
+	sshbuf_pool_enable(1);
+
+	TEST_START("pool size classes");
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	ASSERT_SIZE_T_EQ(sshbuf_alloc(p1), SSHBUF_SIZE_INIT);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 1000, &dp), 0);
+	memset(dp, 0xd7, 1000);
+	ASSERT_SIZE_T_EQ(sshbuf_alloc(p1), 1024);
+	TEST_DONE();
+
+	TEST_START("pool reuses cleared memory");
+	sshbuf_free(p1);
+	sshbuf_get_stats(&st1);
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 1000, &dp), 0);
+	ASSERT_MEM_FILLED_EQ(dp, 0, 1000);
+	sshbuf_get_stats(&st2);
+	ASSERT_U64_EQ(st2.allocs, st1.allocs);
+	ASSERT_U64_GT(st2.reuses, st1.reuses);
+	TEST_DONE();
+
+	TEST_START("pool reset keeps memory");
+	memset(dp, 0xd7, 1000);
+	alloc = sshbuf_alloc(p1);
+	sshbuf_reset(p1);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 0);
+	ASSERT_SIZE_T_EQ(sshbuf_alloc(p1), alloc);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 1000, &dp), 0);
+	ASSERT_MEM_FILLED_EQ(dp, 0, 1000);
+	sshbuf_free(p1);
+	TEST_DONE();
+
+	TEST_START("pool geometric growth");
+	sshbuf_get_stats(&st1);
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	for (i = 0; i < 1024; i++) {
+		ASSERT_INT_EQ(sshbuf_reserve(p1, 1024, &dp), 0);
+		memset(dp, i & 0xff, 1024);
+	}
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 1024 * 1024);
+	ASSERT_SIZE_T_EQ(sshbuf_alloc(p1), 1024 * 1024);
+	sshbuf_get_stats(&st2);
+	ASSERT_U64_LT(st2.copied - st1.copied, 1024 * 1024);
+	for (i = 0; i < 1024; i++) {
+		ASSERT_MEM_FILLED_EQ(sshbuf_ptr(p1), i & 0xff, 1024);
+		ASSERT_INT_EQ(sshbuf_consume(p1, 1024), 0);
+	}
+	sshbuf_free(p1);
+	TEST_DONE();
+
+	TEST_START("pool respects max size");
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	ASSERT_INT_EQ(sshbuf_set_max_size(p1, 1223), 0);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 1223, &dp), 0);
+	ASSERT_SIZE_T_LE(sshbuf_alloc(p1), 1223);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 1, &dp), SSH_ERR_NO_BUFFER_SPACE);
+	sshbuf_free(p1);
+	TEST_DONE();
+
+	TEST_START("pool grows packed buffer");
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 200, &dp), 0);
+	memset(dp, 0x11, 100);
+	memset(dp + 100, 0x22, 100);
+	ASSERT_INT_EQ(sshbuf_consume(p1, 100), 0);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 300, &dp), 0);
+	memset(dp, 0x33, 300);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 400);
+	ASSERT_MEM_FILLED_EQ(sshbuf_ptr(p1), 0x22, 100);
+	ASSERT_MEM_FILLED_EQ(sshbuf_ptr(p1) + 100, 0x33, 300);
+	sshbuf_free(p1);
+	TEST_DONE();
+
+	TEST_START("pool with child buffers");
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	ASSERT_INT_EQ(sshbuf_put(p1, "hello", 5), 0);
+	p2 = sshbuf_fromb(p1);
+	ASSERT_PTR_NE(p2, NULL);
+	ASSERT_U_INT_EQ(sshbuf_refcount(p1), 2);
+	sshbuf_free(p1);
+	ASSERT_MEM_EQ(sshbuf_ptr(p2), "hello", 5);
+	sshbuf_free(p2);
+	TEST_DONE();
+
+	TEST_START("pool disable releases memory");
+	sshbuf_get_stats(&st1);
+	sshbuf_pool_enable(0);
+	sshbuf_get_stats(&st2);
+	ASSERT_U64_GT(st2.frees, st1.frees);
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	sshbuf_get_stats(&st1);
+	ASSERT_U64_EQ(st1.reuses, st2.reuses);
+	ASSERT_U64_EQ(st1.allocs, st2.allocs + 2);
+	sshbuf_free(p1);
+	TEST_DONE();
+}
@@ -0,0 +1,259 @@
+/*
+ * Regress test for segmented sshbuf buffers
+ *
+ * Placed in the public domain
+ */
+
+#define SSHBUF_INTERNAL 1	/* access internals for testing */
+#include "includes.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <stdio.h>
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../test_helper/test_helper.h"
+
+#include "ssherr.h"
+#include "sshbuf.h"
+
+void sshbuf_segmented_tests(void);
+
+#define SEGSIZE	4096
+
+/* Appends len bytes, each the low byte of its offset in the stream */
+static void
+put_pattern(struct sshbuf *b, size_t start, size_t len)
+{
+	u_char *dp;
+	size_t i;
+
+	ASSERT_INT_EQ(sshbuf_reserve(b, len, &dp), 0);
+	for (i = 0; i < len; i++)
+		dp[i] = (start + i) & 0xff;
+}
+
+static void
+check_pattern(const u_char *p, size_t start, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		ASSERT_U8_EQ(p[i], (start + i) & 0xff);
+}
+
+void
+sshbuf_segmented_tests(void)
+{
+	struct sshbuf *p1, *p2, *b;
+	struct sshbuf_stats st1, st2;
+	const u_char *cp;
+	u_char *dp;
+	u_int32_t v32;
+	u_int16_t v16;
+	size_t len, n, done, off;
+	int i, pfd[2];
+
+	TEST_START("segmented append");
+	p1 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	ASSERT_INT_EQ(sshbuf_set_segmented(p1, SEGSIZE), 0);
+	put_pattern(p1, 0, 1000);
+	ASSERT_PTR_EQ(p1->segs, NULL);
+	for (off = 1000; off < 20000; off += 1000)
+		put_pattern(p1, off, 1000);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 20000);
+	ASSERT_PTR_NE(p1->segs, NULL);
+	ASSERT_SIZE_T_GE(p1->segs->alloc, SEGSIZE);
+	TEST_DONE();
+
+	TEST_START("segmented peek and consume");
+	sshbuf_get_stats(&st1);
+	off = 0;
+	while (sshbuf_len(p1) > 0) {
+		cp = sshbuf_peek(p1, &len);
+		ASSERT_PTR_NE(cp, NULL);
+		ASSERT_SIZE_T_GT(len, 0);
+		n = MIN(len, 700);
+		check_pattern(cp, off, n);
+		ASSERT_INT_EQ(sshbuf_consume(p1, n), 0);
+		off += n;
+	}
+	ASSERT_SIZE_T_EQ(off, 20000);
+	ASSERT_PTR_EQ(p1->segs, NULL);
+	sshbuf_get_stats(&st2);
+	ASSERT_U64_EQ(st2.copied, st1.copied);
+	TEST_DONE();
+
+	TEST_START("segmented draining without packing");
+	p2 = sshbuf_new();
+	ASSERT_PTR_NE(p2, NULL);
+	for (i = 0; i < 2; i++) {
+		/* A half-drained contiguous buffer packs, a segmented not */
+		b = i == 0 ? p2 : p1;
+		put_pattern(b, 0, 20000);
+		sshbuf_get_stats(&st1);
+		for (off = 20000, done = 0; off < 400000; off += 1000) {
+			put_pattern(b, off, 1000);
+			cp = sshbuf_peek(b, &len);
+			n = MIN(len, 1000);
+			check_pattern(cp, done, n);
+			ASSERT_INT_EQ(sshbuf_consume(b, n), 0);
+			done += n;
+		}
+		sshbuf_get_stats(&st2);
+		if (b == p2)
+			ASSERT_U64_GT(st2.copied, st1.copied);
+		else
+			ASSERT_U64_EQ(st2.copied, st1.copied);
+	}
+	sshbuf_free(p2);
+	TEST_DONE();
+
+	TEST_START("segmented join on sshbuf_ptr");
+	sshbuf_reset(p1);
+	ASSERT_PTR_EQ(p1->segs, NULL);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 0);
+	for (off = 0; off < 20000; off += 1000)
+		put_pattern(p1, off, 1000);
+	ASSERT_INT_EQ(sshbuf_consume(p1, 300), 0);
+	cp = sshbuf_ptr(p1);
+	ASSERT_PTR_NE(cp, NULL);
+	ASSERT_PTR_EQ(p1->segs, NULL);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 19700);
+	check_pattern(cp, 300, 19700);
+	TEST_DONE();
+
+	TEST_START("segmented parse across segments");
+	sshbuf_reset(p1);
+	/* Leave too little room for the value, which starts a segment */
+	len = sshbuf_alloc(p1) - 2;
+	put_pattern(p1, 0, len);
+	ASSERT_INT_EQ(sshbuf_put_u32(p1, 0x11223344), 0);
+	ASSERT_PTR_NE(p1->segs, NULL);
+	ASSERT_INT_EQ(sshbuf_consume(p1, len - 2), 0);
+	ASSERT_INT_EQ(sshbuf_get_u32(p1, &v32), 0);
+	ASSERT_U32_EQ(v32, (((len - 2) & 0xff) << 24) |
+	    (((len - 1) & 0xff) << 16) | 0x1122);
+	ASSERT_INT_EQ(sshbuf_get_u16(p1, &v16), 0);
+	ASSERT_U16_EQ(v16, 0x3344);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 0);
+	TEST_DONE();
+
+	TEST_START("segmented consume_end");
+	for (off = 0; off < 10000; off += 1000)
+		put_pattern(p1, off, 1000);
+	ASSERT_INT_EQ(sshbuf_consume_end(p1, 2500), 0);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 7500);
+	check_pattern(sshbuf_ptr(p1), 0, 7500);
+	TEST_DONE();
+
+	TEST_START("segmented child buffer");
+	sshbuf_reset(p1);
+	put_pattern(p1, 0, 1000);
+	put_pattern(p1, 1000, SEGSIZE);
+	p2 = sshbuf_fromb(p1);
+	ASSERT_PTR_NE(p2, NULL);
+	ASSERT_PTR_EQ(p1->segs, NULL);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p2), 1000 + SEGSIZE);
+	check_pattern(sshbuf_ptr(p2), 0, 1000 + SEGSIZE);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, 1, &dp), SSH_ERR_BUFFER_READ_ONLY);
+	sshbuf_free(p2);
+	TEST_DONE();
+
+	TEST_START("segmented max size");
+	sshbuf_reset(p1);
+	ASSERT_INT_EQ(sshbuf_set_max_size(p1, 3 * SEGSIZE), 0);
+	put_pattern(p1, 0, 1000);
+	put_pattern(p1, 1000, 2 * SEGSIZE);
+	ASSERT_INT_EQ(sshbuf_reserve(p1, SEGSIZE, &dp),
+	    SSH_ERR_NO_BUFFER_SPACE);
+	ASSERT_SIZE_T_EQ(sshbuf_avail(p1), SEGSIZE - 1000);
+	ASSERT_INT_EQ(sshbuf_set_max_size(p1, 2 * SEGSIZE),
+	    SSH_ERR_NO_BUFFER_SPACE);
+	ASSERT_INT_EQ(sshbuf_set_max_size(p1, SSHBUF_SIZE_MAX), 0);
+	TEST_DONE();
+
+	TEST_START("segmented take head");
+	sshbuf_reset(p1);
+	put_pattern(p1, 0, 1000);
+	put_pattern(p1, 1000, 2 * SEGSIZE);
+	ASSERT_INT_EQ(sshbuf_consume(p1, 100), 0);
+	sshbuf_get_stats(&st1);
+	off = 100;
+	while (sshbuf_len(p1) > 0) {
+		cp = sshbuf_peek(p1, &len);
+		ASSERT_INT_EQ(sshbuf_take_head(p1, &b), 0);
+		ASSERT_PTR_EQ(sshbuf_ptr(b), cp);
+		ASSERT_SIZE_T_EQ(sshbuf_len(b), len);
+		check_pattern(cp, off, len);
+		off += len;
+		sshbuf_free(b);
+	}
+	ASSERT_SIZE_T_EQ(off, 1000 + 2 * SEGSIZE);
+	sshbuf_get_stats(&st2);
+	ASSERT_U64_EQ(st2.copied, st1.copied);
+	ASSERT_INT_EQ(sshbuf_take_head(p1, &b), SSH_ERR_MESSAGE_INCOMPLETE);
+	ASSERT_PTR_EQ(b, NULL);
+	put_pattern(p1, 0, 1000);
+	ASSERT_SIZE_T_EQ(sshbuf_len(p1), 1000);
+	check_pattern(sshbuf_ptr(p1), 0, 1000);
+	TEST_DONE();
+
+	TEST_START("segmented back to contiguous");
+	sshbuf_reset(p1);
+	put_pattern(p1, 0, 1000);
+	put_pattern(p1, 1000, SEGSIZE);
+	ASSERT_INT_EQ(sshbuf_set_segmented(p1, 0), 0);
+	ASSERT_PTR_EQ(p1->segs, NULL);
+	put_pattern(p1, 1000 + SEGSIZE, SEGSIZE);
+	ASSERT_PTR_EQ(p1->segs, NULL);
+	check_pattern(sshbuf_ptr(p1), 0, 1000 + 2 * SEGSIZE);
+	sshbuf_free(p1);
+	TEST_DONE();
+
+	TEST_START("sshbuf_read and sshbuf_write");
+	ASSERT_INT_EQ(pipe(pfd), 0);
+	p1 = sshbuf_new();
+	p2 = sshbuf_new();
+	ASSERT_PTR_NE(p1, NULL);
+	ASSERT_PTR_NE(p2, NULL);
+	ASSERT_INT_EQ(sshbuf_set_segmented(p2, SEGSIZE), 0);
+	for (off = 0; off < 40000; off += 1000) {
+		/* Through the pipe into a segmented buffer */
+		put_pattern(p1, off, 1000);
+		ASSERT_INT_EQ(sshbuf_write(pfd[1], p1, 1000, &n), 0);
+		ASSERT_SIZE_T_EQ(n, 1000);
+		ASSERT_SIZE_T_EQ(sshbuf_len(p1), 0);
+		ASSERT_INT_EQ(sshbuf_read(pfd[0], p2, 1000, &n), 0);
+		ASSERT_SIZE_T_EQ(n, 1000);
+	}
+	ASSERT_SIZE_T_EQ(sshbuf_len(p2), 40000);
+	ASSERT_PTR_NE(p2->segs, NULL);
+	/* And back out of it in segment-spanning writes */
+	for (off = 0; off < 40000; off += 3000) {
+		ASSERT_INT_EQ(sshbuf_write(pfd[1], p2, 3000, &n), 0);
+		ASSERT_SIZE_T_EQ(n, MIN(3000, 40000 - off));
+		ASSERT_INT_EQ(sshbuf_read(pfd[0], p1, 3000, &n), 0);
+		ASSERT_SIZE_T_EQ(n, MIN(3000, 40000 - off));
+		check_pattern(sshbuf_ptr(p1), off, n);
+		sshbuf_reset(p1);
+	}
+	ASSERT_SIZE_T_EQ(sshbuf_len(p2), 0);
+	close(pfd[1]);
+	ASSERT_INT_EQ(sshbuf_read(pfd[0], p2, 1000, &n), 0);
+	ASSERT_SIZE_T_EQ(n, 0);
+	close(pfd[0]);
+	ASSERT_INT_EQ(sshbuf_read(pfd[0], p2, 1000, &n),
+	    SSH_ERR_SYSTEM_ERROR);
+	ASSERT_INT_EQ(errno, EBADF);
+	sshbuf_free(p1);
+	sshbuf_free(p2);
+	TEST_DONE();
+}
@@ -5,8 +5,14 @@
  * Placed in the public domain
  */
 
+#include "includes.h"
+
+#include <sys/types.h>
+
 #include "../test_helper/test_helper.h"
 
+#include "sshbuf.h"
+
 void sshbuf_tests(void);
 void sshbuf_getput_basic_tests(void);
 void sshbuf_getput_crypto_tests(void);
@@ -14,6 +20,8 @@ void sshbuf_misc_tests(void);
 void sshbuf_fuzz_tests(void);
 void sshbuf_getput_fuzz_tests(void);
 void sshbuf_fixed(void);
+void sshbuf_pool_tests(void);
+void sshbuf_segmented_tests(void);
 
 void
 tests(void)
@@ -24,5 +32,16 @@ tests(void)
 	sshbuf_misc_tests();
 	sshbuf_fuzz_tests();
 	sshbuf_getput_fuzz_tests();
+	sshbuf_pool_tests();
+	sshbuf_segmented_tests();
+
+	/* Repeat the basic tests with the buffer pool enabled */
+	sshbuf_pool_enable(1);
+	sshbuf_tests();
+	sshbuf_getput_basic_tests();
+	sshbuf_fuzz_tests();
+	sshbuf_segmented_tests();
+	sshbuf_pool_enable(0);
+
 	sshbuf_fixed();
 }
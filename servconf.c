@@ -64,6 +64,7 @@
 #include "auth.h"
 #include "myproposal.h"
 #include "digest.h"
+#include "version.h"
 
 static void add_listen_addr(ServerOptions *, const char *,
     const char *, int);
@@ -72,7 +73,19 @@ static void add_one_listen_addr(ServerOptions *, const char *,
 
 /* Use of privilege separation or not */
 extern int use_privsep;
-extern struct sshbuf *cfg;
+
+/*
+ * Lines of the Match blocks in the configuration.  Directives outside of
+ * Match blocks never apply when the configuration is reprocessed for a
+ * connection, so parse_server_match_config() only needs these.
+ */
+struct match_line {
+	int	 linenum;
+	int	 is_match;	/* The Match line itself */
+	char	*line;
+};
+static struct match_line *match_lines;
+static u_int num_match_lines;
 
 /* Initializes the server options to their default values. */
 
@@ -179,6 +192,12 @@ initialize_server_options(ServerOptions *options)
 	options->fingerprint_hash = -1;
 	options->disable_forwarding = -1;
 	options->expose_userauth_info = -1;
+	options->authorized_keys_index_cache = -1;
+	options->metrics_socket = NULL;
+	options->prefork_pool = -1;
+	options->channel_window_budget = -1;
+	options->buffer_pool = -1;
+	options->zerocopy_forwarding = -1;
 }
 
 /* Returns 1 if a string option is unset or set to "none" or 0 otherwise. */
@@ -373,6 +392,14 @@ fill_default_server_options(ServerOptions *options)
 		options->max_authtries = DEFAULT_AUTH_FAIL_MAX;
 	if (options->max_sessions == -1)
 		options->max_sessions = DEFAULT_SESSIONS_MAX;
+	if (options->prefork_pool == -1)
+		options->prefork_pool = 0;
+	if (options->channel_window_budget == -1)
+		options->channel_window_budget = CHAN_WINDOW_BUDGET_DEFAULT;
+	if (options->buffer_pool == -1)
+		options->buffer_pool = 0;
+	if (options->zerocopy_forwarding == -1)
+		options->zerocopy_forwarding = 0;
 	if (options->use_dns == -1)
 		options->use_dns = 0;
 	if (options->client_alive_interval == -1)
@@ -407,6 +434,8 @@ fill_default_server_options(ServerOptions *options)
 		options->disable_forwarding = 0;
 	if (options->expose_userauth_info == -1)
 		options->expose_userauth_info = 0;
+	if (options->authorized_keys_index_cache == -1)
+		options->authorized_keys_index_cache = 0;
 
 	assemble_algorithms(options);
 
@@ -422,6 +451,7 @@ fill_default_server_options(ServerOptions *options)
 		} \
 	} while(0)
 	CLEAR_ON_NONE(options->pid_file);
+	CLEAR_ON_NONE(options->metrics_socket);
 	CLEAR_ON_NONE(options->xauth_location);
 	CLEAR_ON_NONE(options->banner);
 	CLEAR_ON_NONE(options->trusted_user_ca_keys);
@@ -492,7 +522,8 @@ typedef enum {
 	sAuthenticationMethods, sHostKeyAgent, sPermitUserRC,
 	sStreamLocalBindMask, sStreamLocalBindUnlink,
 	sAllowStreamLocalForwarding, sFingerprintHash, sDisableForwarding,
-	sExposeAuthInfo, sRDomain,
+	sExposeAuthInfo, sRDomain, sAuthorizedKeysIndexCache, sMetricsSocket,
+	sPreforkPool, sChannelWindowBudget, sBufferPool, sZeroCopyForwarding,
 	sDeprecated, sIgnore, sUnsupported
 } ServerOpCodes;
 
@@ -640,6 +671,12 @@ static struct {
 	{ "disableforwarding", sDisableForwarding, SSHCFG_ALL },
 	{ "exposeauthinfo", sExposeAuthInfo, SSHCFG_ALL },
 	{ "rdomain", sRDomain, SSHCFG_ALL },
+	{ "authorizedkeysindexcache", sAuthorizedKeysIndexCache, SSHCFG_GLOBAL },
+	{ "metricssocket", sMetricsSocket, SSHCFG_GLOBAL },
+	{ "preforkpool", sPreforkPool, SSHCFG_GLOBAL },
+	{ "channelwindowbudget", sChannelWindowBudget, SSHCFG_GLOBAL },
+	{ "bufferpool", sBufferPool, SSHCFG_GLOBAL },
+	{ "zerocopyforwarding", sZeroCopyForwarding, SSHCFG_GLOBAL },
 	{ NULL, sBadOption, 0 }
 };
 
@@ -1374,6 +1411,10 @@ process_server_config_line(ServerOptions *options, char *line,
 			servconf_add_hostcert(filename, linenum, options, arg);
 		break;
 
+	case sMetricsSocket:
+		charptr = &options->metrics_socket;
+		goto parse_filename;
+
 	case sPidFile:
 		charptr = &options->pid_file;
  parse_filename:
@@ -1785,6 +1826,41 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->max_sessions;
 		goto parse_int;
 
+	case sPreforkPool:
+		arg = strdelim(&cp);
+		if ((errstr = atoi_err(arg, &value)) != NULL)
+			fatal("%s line %d: integer value %s.",
+			    filename, linenum, errstr);
+		if (value > PREFORK_POOL_MAX)
+			fatal("%s line %d: PreforkPool too large (max %d).",
+			    filename, linenum, PREFORK_POOL_MAX);
+		if (*activep && options->prefork_pool == -1)
+			options->prefork_pool = value;
+		break;
+
+	case sChannelWindowBudget:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.", filename,
+			    linenum);
+		if (scan_scaled(arg, &val64) == -1)
+			fatal("%.200s line %d: Bad number '%s': %s",
+			    filename, linenum, arg, strerror(errno));
+		if (val64 < 0)
+			fatal("%.200s line %d: Bad ChannelWindowBudget '%s'",
+			    filename, linenum, arg);
+		if (*activep && options->channel_window_budget == -1)
+			options->channel_window_budget = val64;
+		break;
+
+	case sBufferPool:
+		intptr = &options->buffer_pool;
+		goto parse_flag;
+
+	case sZeroCopyForwarding:
+		intptr = &options->zerocopy_forwarding;
+		goto parse_flag;
+
 	case sBanner:
 		charptr = &options->banner;
 		goto parse_filename;
@@ -2126,6 +2202,10 @@ process_server_config_line(ServerOptions *options, char *line,
 		intptr = &options->expose_userauth_info;
 		goto parse_flag;
 
+	case sAuthorizedKeysIndexCache:
+		intptr = &options->authorized_keys_index_cache;
+		goto parse_flag;
+
 	case sRDomain:
 		charptr = &options->routing_domain;
 		arg = strdelim(&cp);
@@ -2202,9 +2282,25 @@ parse_server_match_config(ServerOptions *options,
    struct connection_info *connectinfo)
 {
 	ServerOptions mo;
+	struct match_line *ml;
+	int active = 0, bad_options = 0;
+	char *line;
+	u_int i;
 
 	initialize_server_options(&mo);
-	parse_server_config(&mo, "reprocess config", cfg, connectinfo);
+	for (i = 0; i < num_match_lines; i++) {
+		ml = &match_lines[i];
+		if (!ml->is_match && !active)
+			continue;
+		line = xstrdup(ml->line);
+		if (process_server_config_line(&mo, line, "reprocess config",
+		    ml->linenum, &active, connectinfo) != 0)
+			bad_options++;
+		free(line);
+	}
+	if (bad_options > 0)
+		fatal("reprocess config: terminating, %d bad configuration "
+		    "options", bad_options);
 	copy_set_server_options(options, &mo, 0);
 }
 
@@ -2347,6 +2443,43 @@ copy_set_server_options(ServerOptions *dst, ServerOptions *src, int preauth)
 #undef M_CP_STROPT
 #undef M_CP_STRARRAYOPT
 
+static void
+match_lines_free(struct match_line *lines, u_int nlines)
+{
+	u_int i;
+
+	for (i = 0; i < nlines; i++)
+		free(lines[i].line);
+	free(lines);
+}
+
+/* Remember a configuration line if it belongs to a Match block */
+static void
+match_lines_add(const char *line, int linenum)
+{
+	struct match_line *ml;
+	char *cp, *arg, *obuf;
+	int is_match;
+
+	obuf = cp = xstrdup(line);
+	if ((arg = strdelim(&cp)) != NULL && *arg == '\0')
+		arg = strdelim(&cp);
+	if (arg == NULL || *arg == '\0' || *arg == '#') {
+		free(obuf);
+		return;
+	}
+	is_match = strcasecmp(arg, "match") == 0;
+	free(obuf);
+	if (!is_match && num_match_lines == 0)
+		return;
+	match_lines = xrecallocarray(match_lines, num_match_lines,
+	    num_match_lines + 1, sizeof(*match_lines));
+	ml = &match_lines[num_match_lines++];
+	ml->linenum = linenum;
+	ml->is_match = is_match;
+	ml->line = xstrdup(line);
+}
+
 void
 parse_server_config(ServerOptions *options, const char *filename,
     struct sshbuf *conf, struct connection_info *connectinfo)
@@ -2358,9 +2491,16 @@ parse_server_config(ServerOptions *options, const char *filename,
 
 	if ((obuf = cbuf = sshbuf_dup_string(conf)) == NULL)
 		fatal("%s: sshbuf_dup_string failed", __func__);
+	if (connectinfo == NULL) {
+		match_lines_free(match_lines, num_match_lines);
+		match_lines = NULL;
+		num_match_lines = 0;
+	}
 	active = connectinfo ? 0 : 1;
 	linenum = 1;
 	while ((cp = strsep(&cbuf, "\n")) != NULL) {
+		if (connectinfo == NULL)
+			match_lines_add(cp, linenum);
 		if (process_server_config_line(options, cp, filename,
 		    linenum++, &active, connectinfo) != 0)
 			bad_options++;
@@ -2372,6 +2512,238 @@ parse_server_config(ServerOptions *options, const char *filename,
 	process_queued_listen_addrs(options);
 }
 
+/*
+ * The pointer members of ServerOptions other than the listen addresses,
+ * which are only used by the listener.
+ * NB. any new pointer member must be added here.
+ */
+#define SERIALISE_STRING_OPTS() do { \
+		M_SER_STROPT(routing_domain); \
+		M_SER_STROPT(host_key_agent); \
+		M_SER_STROPT(pid_file); \
+		M_SER_STROPT(xauth_location); \
+		M_SER_STROPT(ciphers); \
+		M_SER_STROPT(macs); \
+		M_SER_STROPT(kex_algorithms); \
+		M_SER_STROPT(hostbased_key_types); \
+		M_SER_STROPT(hostkeyalgorithms); \
+		M_SER_STROPT(pubkey_key_types); \
+		M_SER_STROPT(permit_user_env_whitelist); \
+		M_SER_STROPT(banner); \
+		M_SER_STROPT(adm_forced_command); \
+		M_SER_STROPT(chroot_directory); \
+		M_SER_STROPT(revoked_keys_file); \
+		M_SER_STROPT(trusted_user_ca_keys); \
+		M_SER_STROPT(authorized_keys_command); \
+		M_SER_STROPT(authorized_keys_command_user); \
+		M_SER_STROPT(authorized_principals_file); \
+		M_SER_STROPT(authorized_principals_command); \
+		M_SER_STROPT(authorized_principals_command_user); \
+		M_SER_STROPT(version_addendum); \
+		M_SER_STROPT(metrics_socket); \
+		M_SER_STRARRAYOPT(host_key_files, num_host_key_files); \
+		M_SER_STRARRAYOPT(host_cert_files, num_host_cert_files); \
+		M_SER_STRARRAYOPT(allow_users, num_allow_users); \
+		M_SER_STRARRAYOPT(deny_users, num_deny_users); \
+		M_SER_STRARRAYOPT(allow_groups, num_allow_groups); \
+		M_SER_STRARRAYOPT(deny_groups, num_deny_groups); \
+		M_SER_STRARRAYOPT(accept_env, num_accept_env); \
+		M_SER_STRARRAYOPT(setenv, num_setenv); \
+		M_SER_STRARRAYOPT(authorized_keys_files, num_authkeys_files); \
+		M_SER_STRARRAYOPT(permitted_opens, num_permitted_opens); \
+		M_SER_STRARRAYOPT(permitted_listens, num_permitted_listens); \
+		M_SER_STRARRAYOPT(auth_methods, num_auth_methods); \
+	} while (0)
+
+static int
+put_opt_string(struct sshbuf *b, const char *s)
+{
+	int r;
+
+	if ((r = sshbuf_put_u8(b, s != NULL)) != 0)
+		return r;
+	if (s != NULL && (r = sshbuf_put_cstring(b, s)) != 0)
+		return r;
+	return 0;
+}
+
+static int
+get_opt_string(struct sshbuf *b, char **sp)
+{
+	u_char present;
+	int r;
+
+	*sp = NULL;
+	if ((r = sshbuf_get_u8(b, &present)) != 0)
+		return r;
+	if (present && (r = sshbuf_get_cstring(b, sp, NULL)) != 0)
+		return r;
+	return 0;
+}
+
+/*
+ * Serialise the options produced by parse_server_config() from conf,
+ * together with the Match blocks, so that a re-executed sshd can load
+ * them instead of parsing conf again.  The result is only accepted by
+ * the same release and for the same configuration text:
+ *	string	SHA256 hash of conf
+ *	string	release
+ *	string	ServerOptions
+ *	(u8 present, string)	for each SERIALISE_STRING_OPTS member and
+ *				subsystem name, command and arguments
+ *	u32	number of Match block lines
+ *	(u32 line number, u8 is_match, string line)	for each
+ */
+int
+serialise_server_config(struct sshbuf *b, ServerOptions *options,
+    struct sshbuf *conf)
+{
+	u_char hash[SSH_DIGEST_MAX_LENGTH];
+	u_int i, j, n;
+	int r;
+
+	/*
+	 * ServerOptions is sent as is, so a pointer member missing from
+	 * SERIALISE_STRING_OPTS would reach the new process dangling.
+	 * The listen addresses and subsystems are handled apart.
+	 */
+	n = 5;
+#define M_SER_STROPT(x) n++
+#define M_SER_STRARRAYOPT(x, nx) n++
+	SERIALISE_STRING_OPTS();
+#undef M_SER_STROPT
+#undef M_SER_STRARRAYOPT
+	if (n != SERVOPT_NUM_POINTERS)
+		fatal("%s: SERIALISE_STRING_OPTS covers %u of %u pointer "
+		    "members", __func__, n, SERVOPT_NUM_POINTERS);
+
+	if ((r = ssh_digest_buffer(SSH_DIGEST_SHA256, conf,
+	    hash, sizeof(hash))) != 0 ||
+	    (r = sshbuf_put_string(b, hash,
+	    ssh_digest_bytes(SSH_DIGEST_SHA256))) != 0 ||
+	    (r = sshbuf_put_cstring(b, SSH_RELEASE)) != 0 ||
+	    (r = sshbuf_put_string(b, options, sizeof(*options))) != 0)
+		return r;
+
+#define M_SER_STROPT(x) do { \
+		if ((r = put_opt_string(b, options->x)) != 0) \
+			return r; \
+	} while (0)
+#define M_SER_STRARRAYOPT(x, nx) do { \
+		for (i = 0; i < options->nx; i++) \
+			M_SER_STROPT(x[i]); \
+	} while (0)
+	SERIALISE_STRING_OPTS();
+	M_SER_STRARRAYOPT(subsystem_name, num_subsystems);
+	M_SER_STRARRAYOPT(subsystem_command, num_subsystems);
+	M_SER_STRARRAYOPT(subsystem_args, num_subsystems);
+#undef M_SER_STROPT
+#undef M_SER_STRARRAYOPT
+
+	if ((r = sshbuf_put_u32(b, num_match_lines)) != 0)
+		return r;
+	for (j = 0; j < num_match_lines; j++) {
+		if ((r = sshbuf_put_u32(b, match_lines[j].linenum)) != 0 ||
+		    (r = sshbuf_put_u8(b, match_lines[j].is_match)) != 0 ||
+		    (r = sshbuf_put_cstring(b, match_lines[j].line)) != 0)
+			return r;
+	}
+	return 0;
+}
+
+/*
+ * Load options and Match blocks serialised by serialise_server_config()
+ * in place of parse_server_config().  Returns SSH_ERR_INVALID_FORMAT
+ * without changing anything if they were not produced from conf by this
+ * release.
+ */
+int
+deserialise_server_config(struct sshbuf *b, ServerOptions *options,
+    struct sshbuf *conf)
+{
+	ServerOptions o;
+	struct match_line *lines = NULL;
+	u_char hash[SSH_DIGEST_MAX_LENGTH], *h = NULL, *so = NULL, is_match;
+	char *release = NULL;
+	size_t hlen, solen;
+	u_int i, j, nlines = 0;
+	u_int32_t n, linenum;
+	int r;
+
+	if ((r = ssh_digest_buffer(SSH_DIGEST_SHA256, conf,
+	    hash, sizeof(hash))) != 0 ||
+	    (r = sshbuf_get_string(b, &h, &hlen)) != 0 ||
+	    (r = sshbuf_get_cstring(b, &release, NULL)) != 0 ||
+	    (r = sshbuf_get_string(b, &so, &solen)) != 0)
+		goto out;
+	if (hlen != ssh_digest_bytes(SSH_DIGEST_SHA256) ||
+	    memcmp(h, hash, hlen) != 0 || strcmp(release, SSH_RELEASE) != 0 ||
+	    solen != sizeof(o)) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	memcpy(&o, so, sizeof(o));
+	if (o.num_subsystems > MAX_SUBSYSTEMS) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	o.queued_listen_addrs = NULL;
+	o.num_queued_listens = 0;
+	o.listen_addrs = NULL;
+	o.num_listen_addrs = 0;
+
+	/* NB. on error the strings loaded so far are not freed */
+#define M_SER_STROPT(x) do { \
+		if ((r = get_opt_string(b, &o.x)) != 0) \
+			goto out; \
+	} while (0)
+#define M_SER_STRARRAYOPT(x, nx) do { \
+		o.x = o.nx == 0 ? NULL : xcalloc(o.nx, sizeof(*o.x)); \
+		for (i = 0; i < o.nx; i++) \
+			M_SER_STROPT(x[i]); \
+	} while (0)
+	SERIALISE_STRING_OPTS();
+#undef M_SER_STRARRAYOPT
+	for (i = 0; i < o.num_subsystems; i++) {
+		M_SER_STROPT(subsystem_name[i]);
+		M_SER_STROPT(subsystem_command[i]);
+		M_SER_STROPT(subsystem_args[i]);
+	}
+#undef M_SER_STROPT
+
+	if ((r = sshbuf_get_u32(b, &n)) != 0)
+		goto out;
+	if (n > sshbuf_len(b)) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if (n != 0)
+		lines = xcalloc(n, sizeof(*lines));
+	for (j = 0; j < n; j++, nlines++) {
+		if ((r = sshbuf_get_u32(b, &linenum)) != 0 ||
+		    (r = sshbuf_get_u8(b, &is_match)) != 0 ||
+		    (r = sshbuf_get_cstring(b, &lines[j].line, NULL)) != 0)
+			goto out;
+		lines[j].linenum = (int)linenum;
+		lines[j].is_match = is_match;
+	}
+
+	/* Success */
+	match_lines_free(match_lines, num_match_lines);
+	match_lines = lines;
+	num_match_lines = nlines;
+	lines = NULL;
+	nlines = 0;
+	*options = o;
+	r = 0;
+ out:
+	match_lines_free(lines, nlines);
+	free(h);
+	free(release);
+	free(so);
+	return r;
+}
+
 static const char *
 fmt_multistate_int(int val, const struct multistate *m)
 {
@@ -2529,6 +2901,7 @@ dump_config(ServerOptions *o)
 	dump_cfg_int(sX11DisplayOffset, o->x11_display_offset);
 	dump_cfg_int(sMaxAuthTries, o->max_authtries);
 	dump_cfg_int(sMaxSessions, o->max_sessions);
+	dump_cfg_int(sPreforkPool, o->prefork_pool);
 	dump_cfg_int(sClientAliveInterval, o->client_alive_interval);
 	dump_cfg_int(sClientAliveCountMax, o->client_alive_count_max);
 	dump_cfg_oct(sStreamLocalBindMask, o->fwd_opts.streamlocal_bind_mask);
@@ -2570,18 +2943,22 @@ dump_config(ServerOptions *o)
 	dump_cfg_fmtint(sTCPKeepAlive, o->tcp_keep_alive);
 	dump_cfg_fmtint(sEmptyPasswd, o->permit_empty_passwd);
 	dump_cfg_fmtint(sCompression, o->compression);
+	dump_cfg_fmtint(sBufferPool, o->buffer_pool);
 	dump_cfg_fmtint(sGatewayPorts, o->fwd_opts.gateway_ports);
 	dump_cfg_fmtint(sUseDNS, o->use_dns);
 	dump_cfg_fmtint(sAllowTcpForwarding, o->allow_tcp_forwarding);
+	dump_cfg_fmtint(sZeroCopyForwarding, o->zerocopy_forwarding);
 	dump_cfg_fmtint(sAllowAgentForwarding, o->allow_agent_forwarding);
 	dump_cfg_fmtint(sDisableForwarding, o->disable_forwarding);
 	dump_cfg_fmtint(sAllowStreamLocalForwarding, o->allow_streamlocal_forwarding);
 	dump_cfg_fmtint(sStreamLocalBindUnlink, o->fwd_opts.streamlocal_bind_unlink);
 	dump_cfg_fmtint(sFingerprintHash, o->fingerprint_hash);
 	dump_cfg_fmtint(sExposeAuthInfo, o->expose_userauth_info);
+	dump_cfg_fmtint(sAuthorizedKeysIndexCache, o->authorized_keys_index_cache);
 
 	/* string arguments */
 	dump_cfg_string(sPidFile, o->pid_file);
+	dump_cfg_string(sMetricsSocket, o->metrics_socket);
 	dump_cfg_string(sXAuthLocation, o->xauth_location);
 	dump_cfg_string(sCiphers, o->ciphers ? o->ciphers : KEX_SERVER_ENCRYPT);
 	dump_cfg_string(sMacs, o->macs ? o->macs : KEX_SERVER_MAC);
@@ -2652,6 +3029,9 @@ dump_config(ServerOptions *o)
 	printf("rekeylimit %llu %d\n", (unsigned long long)o->rekey_limit,
 	    o->rekey_interval);
 
+	printf("channelwindowbudget %llu\n",
+	    (unsigned long long)o->channel_window_budget);
+
 	printf("permitopen");
 	if (o->num_permitted_opens == 0)
 		printf(" any");
@@ -19,6 +19,7 @@
 #define MAX_PORTS		256	/* Max # ports. */
 
 #define MAX_SUBSYSTEMS		256	/* Max # subsystems. */
+#define SERVOPT_NUM_POINTERS	40	/* Pointer members of ServerOptions */
 
 /* permit_root_login */
 #define	PERMIT_NOT_SET		-1
@@ -38,6 +39,7 @@
 
 #define DEFAULT_AUTH_FAIL_MAX	6	/* Default for MaxAuthTries */
 #define DEFAULT_SESSIONS_MAX	10	/* Default for MaxSessions */
+#define PREFORK_POOL_MAX	256	/* Max for PreforkPool */
 
 /* Magic name for internal sftp-server */
 #define INTERNAL_SFTP_NAME	"internal-sftp"
@@ -62,6 +64,10 @@ struct listenaddr {
 	struct addrinfo *addrs;
 };
 
+/*
+ * NB. a new pointer member must be counted in SERVOPT_NUM_POINTERS and
+ * added to servconf.c:SERIALISE_STRING_OPTS.
+ */
 typedef struct {
 	u_int	num_ports;
 	u_int	ports_from_cmdline;
@@ -208,6 +214,12 @@ typedef struct {
 
 	int	fingerprint_hash;
 	int	expose_userauth_info;
+	int	authorized_keys_index_cache;
+	char   *metrics_socket;		/* UNIX socket for sshd metrics */
+	int	prefork_pool;		/* Pre-started connection handlers */
+	int64_t channel_window_budget;	/* Window autotuning limit */
+	int	buffer_pool;		/* Reuse buffer memory */
+	int	zerocopy_forwarding;	/* MSG_ZEROCOPY for forwarded TCP */
 	u_int64_t timing_secret;
 }       ServerOptions;
 
@@ -265,6 +277,10 @@ void	 load_server_config(const char *, struct sshbuf *);
 void	 parse_server_config(ServerOptions *, const char *, struct sshbuf *,
 	     struct connection_info *);
 void	 parse_server_match_config(ServerOptions *, struct connection_info *);
+int	 serialise_server_config(struct sshbuf *, ServerOptions *,
+	     struct sshbuf *);
+int	 deserialise_server_config(struct sshbuf *, ServerOptions *,
+	     struct sshbuf *);
 int	 parse_server_match_testspec(struct connection_info *, char *);
 int	 server_match_spec_complete(struct connection_info *);
 void	 copy_set_server_options(ServerOptions *, ServerOptions *, int);
@@ -48,6 +48,14 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#else
+# ifdef HAVE_SYS_POLL_H
+#  include <sys/poll.h>
+# endif
+#endif
 #include <pwd.h>
 #include <signal.h>
 #include <string.h>
@@ -76,6 +84,7 @@
 #include "dispatch.h"
 #include "auth-options.h"
 #include "serverloop.h"
+#include "metrics.h"
 #include "ssherr.h"
 
 extern ServerOptions options;
@@ -144,17 +153,17 @@ notify_parent(void)
 		(void)write(notify_pipe[1], "", 1);
 }
 static void
-notify_prepare(fd_set *readset)
+notify_prepare(struct pollfd *pfd)
 {
-	if (notify_pipe[0] != -1)
-		FD_SET(notify_pipe[0], readset);
+	pfd->fd = notify_pipe[0];
+	pfd->events = POLLIN;
 }
 static void
-notify_done(fd_set *readset)
+notify_done(struct pollfd *pfd)
 {
 	char c;
 
-	if (notify_pipe[0] != -1 && FD_ISSET(notify_pipe[0], readset))
+	if (notify_pipe[0] != -1 && (pfd->revents & POLLIN) != 0)
 		while (read(notify_pipe[0], &c, 1) != -1)
 			debug2("%s: reading", __func__);
 }
@@ -204,27 +213,32 @@ client_alive_check(struct ssh *ssh)
 	packet_send();
 }
 
+/* Indices of the descriptors polled by server_loop2() */
+#define SERVER_PFD_IN		0
+#define SERVER_PFD_OUT		1
+#define SERVER_PFD_NOTIFY	2
+#define SERVER_NPFD		3
+
 /*
- * Sleep in select() until we can do something.  This will initialize the
- * select masks.  Upon return, the masks will indicate which descriptors
- * have data or can accept data.  Optionally, a maximum time can be specified
- * for the duration of the wait (0 = infinite).
+ * Sleep until we can do something.  The channel layer's event backend
+ * (see channel_wait_events()) waits for the channel descriptors along with
+ * the descriptors in 'pfd'.  Upon return, channel io_ready and pfd revents
+ * will indicate which descriptors have data or can accept data.
+ * Optionally, a maximum time can be specified for the duration of the
+ * wait (0 = infinite).
  */
 static void
 wait_until_can_do_something(struct ssh *ssh,
-    int connection_in, int connection_out,
-    fd_set **readsetp, fd_set **writesetp, int *maxfdp,
-    u_int *nallocp, u_int64_t max_time_ms)
+    int connection_in, int connection_out, struct pollfd *pfd,
+    u_int64_t max_time_ms)
 {
-	struct timeval tv, *tvp;
-	int ret;
+	int ret, timeout_ms;
 	time_t minwait_secs = 0;
 	int client_alive_scheduled = 0;
 	static time_t last_client_time;
 
-	/* Allocate and update select() masks for channel descriptors. */
-	channel_prepare_select(ssh, readsetp, writesetp, maxfdp,
-	    nallocp, &minwait_secs);
+	/* Run the pre handlers to collect channel IO interest. */
+	channel_prepare_events(ssh, &minwait_secs);
 
 	/* XXX need proper deadline system for rekey/client alive */
 	if (minwait_secs != 0)
@@ -251,15 +265,16 @@ wait_until_can_do_something(struct ssh *ssh,
 	/* wrong: bad condition XXX */
 	if (channel_not_very_much_buffered_data())
 #endif
-	FD_SET(connection_in, *readsetp);
-	notify_prepare(*readsetp);
+	pfd[SERVER_PFD_IN].fd = connection_in;
+	pfd[SERVER_PFD_IN].events = POLLIN;
+	notify_prepare(&pfd[SERVER_PFD_NOTIFY]);
 
 	/*
 	 * If we have buffered packet data going to the client, mark that
 	 * descriptor.
 	 */
-	if (packet_have_data_to_write())
-		FD_SET(connection_out, *writesetp);
+	pfd[SERVER_PFD_OUT].fd = connection_out;
+	pfd[SERVER_PFD_OUT].events = packet_have_data_to_write() ? POLLOUT : 0;
 
 	/*
 	 * If child has terminated and there is enough buffer space to read
@@ -270,27 +285,22 @@ wait_until_can_do_something(struct ssh *ssh,
 			max_time_ms = 100;
 
 	if (max_time_ms == 0)
-		tvp = NULL;
-	else {
-		tv.tv_sec = max_time_ms / 1000;
-		tv.tv_usec = 1000 * (max_time_ms % 1000);
-		tvp = &tv;
-	}
+		timeout_ms = -1;
+	else
+		timeout_ms = MINIMUM(max_time_ms, INT_MAX);
 
 	/* Wait for something to happen, or the timeout to expire. */
-	ret = select((*maxfdp)+1, *readsetp, *writesetp, NULL, tvp);
+	ret = channel_wait_events(ssh, pfd, SERVER_NPFD, timeout_ms);
 
 	if (ret == -1) {
-		memset(*readsetp, 0, *nallocp);
-		memset(*writesetp, 0, *nallocp);
 		if (errno != EINTR)
-			error("select: %.100s", strerror(errno));
+			error("%s: %.100s", __func__, strerror(errno));
 	} else if (client_alive_scheduled) {
 		time_t now = monotime();
 
 		if (ret == 0) { /* timeout */
 			client_alive_check(ssh);
-		} else if (FD_ISSET(connection_in, *readsetp)) {
+		} else if ((pfd[SERVER_PFD_IN].revents & POLLIN) != 0) {
 			last_client_time = now;
 		} else if (last_client_time != 0 && last_client_time +
 		    options.client_alive_interval <= now) {
@@ -299,7 +309,7 @@ wait_until_can_do_something(struct ssh *ssh,
 		}
 	}
 
-	notify_done(*readsetp);
+	notify_done(&pfd[SERVER_PFD_NOTIFY]);
 }
 
 /*
@@ -307,13 +317,13 @@ wait_until_can_do_something(struct ssh *ssh,
  * in buffers and processed later.
  */
 static int
-process_input(struct ssh *ssh, fd_set *readset, int connection_in)
+process_input(struct ssh *ssh, struct pollfd *pfd, int connection_in)
 {
 	int len;
 	char buf[16384];
 
 	/* Read and buffer any input data from the client. */
-	if (FD_ISSET(connection_in, readset)) {
+	if ((pfd->revents & POLLIN) != 0) {
 		len = read(connection_in, buf, sizeof(buf));
 		if (len == 0) {
 			verbose("Connection closed by %.100s port %d",
@@ -340,10 +350,10 @@ process_input(struct ssh *ssh, fd_set *readset, int connection_in)
  * Sends data from internal buffers to client program stdin.
  */
 static void
-process_output(fd_set *writeset, int connection_out)
+process_output(struct pollfd *pfd, int connection_out)
 {
 	/* Send any buffered packet data to the client. */
-	if (FD_ISSET(connection_out, writeset))
+	if ((pfd->revents & POLLOUT) != 0)
 		packet_write_poll();
 }
 
@@ -378,10 +388,10 @@ collect_children(struct ssh *ssh)
 void
 server_loop2(struct ssh *ssh, Authctxt *authctxt)
 {
-	fd_set *readset = NULL, *writeset = NULL;
-	int max_fd;
-	u_int nalloc = 0, connection_in, connection_out;
+	struct pollfd pfd[SERVER_NPFD];
+	u_int connection_in, connection_out;
 	u_int64_t rekey_timeout_ms = 0;
+	double woke = 0;
 
 	debug("Entering interactive session for SSH2.");
 
@@ -397,9 +407,7 @@ server_loop2(struct ssh *ssh, Authctxt *authctxt)
 	}
 
 	notify_setup();
-
-	max_fd = MAXIMUM(connection_in, connection_out);
-	max_fd = MAXIMUM(max_fd, notify_pipe[0]);
+	memset(pfd, 0, sizeof(pfd));
 
 	server_init_dispatch();
 
@@ -414,8 +422,10 @@ server_loop2(struct ssh *ssh, Authctxt *authctxt)
 		else
 			rekey_timeout_ms = 0;
 
+		metrics_loop_end(ssh, woke);
 		wait_until_can_do_something(ssh, connection_in, connection_out,
-		    &readset, &writeset, &max_fd, &nalloc, rekey_timeout_ms);
+		    pfd, rekey_timeout_ms);
+		woke = metrics_loop_start();
 
 		if (received_sigterm) {
 			logit("Exiting on signal %d", (int)received_sigterm);
@@ -425,18 +435,16 @@ server_loop2(struct ssh *ssh, Authctxt *authctxt)
 
 		collect_children(ssh);
 		if (!ssh_packet_is_rekeying(ssh))
-			channel_after_select(ssh, readset, writeset);
-		if (process_input(ssh, readset, connection_in) < 0)
+			channel_after_events(ssh);
+		if (process_input(ssh, &pfd[SERVER_PFD_IN], connection_in) < 0)
 			break;
-		process_output(writeset, connection_out);
+		process_output(&pfd[SERVER_PFD_OUT], connection_out);
 	}
 	collect_children(ssh);
 
-	free(readset);
-	free(writeset);
-
 	/* free all channels, no more reads and writes */
 	channel_free_all(ssh);
+	metrics_update(ssh);
 
 	/* free remaining sessions, e.g. remove wtmp entries */
 	session_destroy_all(ssh, NULL);
@@ -564,6 +572,10 @@ server_request_tun(struct ssh *ssh)
 	c = channel_new(ssh, "tun", SSH_CHANNEL_OPEN, sock, sock, -1,
 	    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0, "tun", 1);
 	c->datagram = 1;
+	/* Datagrams are parsed from the buffers, keep them contiguous */
+	if (sshbuf_set_segmented(c->input, 0) != 0 ||
+	    sshbuf_set_segmented(c->output, 0) != 0)
+		fatal("%s: sshbuf_set_segmented failed", __func__);
 #if defined(SSH_TUN_FILTER)
 	if (mode == SSH_TUNMODE_POINTOPOINT)
 		channel_register_filter(ssh, c->self, sys_tun_infilter,
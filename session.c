@@ -96,6 +96,7 @@
 #include "monitor_wrap.h"
 #include "sftp.h"
 #include "atomicio.h"
+#include "probes.h"
 
 #if defined(KRB5) && defined(USE_AFS)
 #include <kafs.h>
@@ -737,6 +738,7 @@ do_exec(struct ssh *ssh, Session *s, const char *command)
 	    ssh_remote_ipaddr(ssh),
 	    ssh_remote_port(ssh),
 	    s->self);
+	SSH_PROBE2(session_exec_start, s->self, session_type);
 
 #ifdef SSH_AUDIT_EVENTS
 	if (command != NULL)
@@ -753,6 +755,7 @@ do_exec(struct ssh *ssh, Session *s, const char *command)
 		ret = do_exec_pty(ssh, s, command);
 	else
 		ret = do_exec_no_pty(ssh, s, command);
+	SSH_PROBE2(session_exec_done, s->self, ret);
 
 	original_command = NULL;
 
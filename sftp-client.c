@@ -53,6 +53,7 @@
 #include "progressmeter.h"
 #include "misc.h"
 #include "utf8.h"
+#include "digest.h"
 
 #include "sftp.h"
 #include "sftp-common.h"
@@ -67,6 +68,9 @@ extern int showprogress;
 /* Maximum depth to descend in directory trees */
 #define MAX_DIR_DEPTH 64
 
+/* READDIR requests to keep outstanding while listing a directory */
+#define READDIR_INFLIGHT 4
+
 /* Directory separator characters */
 #ifdef HAVE_CYGWIN
 # define SFTP_DIRECTORY_CHARS      "/\\"
@@ -86,6 +90,8 @@ struct sftp_conn {
 #define SFTP_EXT_FSTATVFS	0x00000004
 #define SFTP_EXT_HARDLINK	0x00000008
 #define SFTP_EXT_FSYNC		0x00000010
+#define SFTP_EXT_COPY_DATA	0x00000020
+#define SFTP_EXT_CHECK_FILE	0x00000040
 	u_int exts;
 	u_int64_t limit_kbps;
 	struct bwlimit bwlimit_in, bwlimit_out;
@@ -463,6 +469,14 @@ do_init(int fd_in, int fd_out, u_int transfer_buflen, u_int num_requests,
 		    strcmp((char *)value, "1") == 0) {
 			ret->exts |= SFTP_EXT_FSYNC;
 			known = 1;
+		} else if (strcmp(name, "copy-data@openssh.com") == 0 &&
+		    strcmp((char *)value, "1") == 0) {
+			ret->exts |= SFTP_EXT_COPY_DATA;
+			known = 1;
+		} else if (strcmp(name, "check-file-blocks@openssh.com") == 0 &&
+		    strcmp((char *)value, "1") == 0) {
+			ret->exts |= SFTP_EXT_CHECK_FILE;
+			known = 1;
 		}
 		if (known) {
 			debug2("Server supports extension \"%s\" revision %s",
@@ -529,15 +543,16 @@ static int
 do_lsreaddir(struct sftp_conn *conn, const char *path, int print_flag,
     SFTP_DIRENT ***dir)
 {
-	struct sshbuf *msg;
-	u_int count, id, i, expected_id, ents = 0;
+	struct sshbuf *msg, *reply = NULL, *replies[READDIR_INFLIGHT];
+	u_int count, id, i, first_id, next_id, ents = 0, maxents = 0;
 	size_t handle_len;
-	u_char type, *handle;
+	u_char type, types[READDIR_INFLIGHT], *handle;
 	int status = SSH2_FX_FAILURE;
-	int r;
+	int r, eof = 0, failed = 0;
 
 	if (dir)
 		*dir = NULL;
+	memset(replies, 0, sizeof(replies));
 
 	id = conn->msg_id++;
 
@@ -562,70 +577,99 @@ do_lsreaddir(struct sftp_conn *conn, const char *path, int print_flag,
 		(*dir)[0] = NULL;
 	}
 
-	for (; !interrupted;) {
-		id = expected_id = conn->msg_id++;
-
-		debug3("Sending SSH2_FXP_READDIR I:%u", id);
-
-		sshbuf_reset(msg);
-		if ((r = sshbuf_put_u8(msg, SSH2_FXP_READDIR)) != 0 ||
-		    (r = sshbuf_put_u32(msg, id)) != 0 ||
-		    (r = sshbuf_put_string(msg, handle, handle_len)) != 0)
-			fatal("%s: buffer error: %s", __func__, ssh_err(r));
-		send_msg(conn, msg);
-
-		sshbuf_reset(msg);
-
-		get_msg(conn, msg);
-
-		if ((r = sshbuf_get_u8(msg, &type)) != 0 ||
-		    (r = sshbuf_get_u32(msg, &id)) != 0)
-			fatal("%s: buffer error: %s", __func__, ssh_err(r));
-
-		debug3("Received reply T:%u I:%u", type, id);
+	/*
+	 * Keep several READDIR requests in flight.  Replies may arrive in
+	 * any order, so each is held until those for earlier requests have
+	 * been handled.  Once one reports EOF the rest only need draining.
+	 */
+	first_id = next_id = conn->msg_id;
+	for (;;) {
+		sshbuf_free(reply);
+		reply = NULL;
+		while (!eof && !interrupted &&
+		    next_id - first_id < READDIR_INFLIGHT) {
+			id = conn->msg_id++;
+			next_id++;
+			debug3("Sending SSH2_FXP_READDIR I:%u", id);
+			sshbuf_reset(msg);
+			if ((r = sshbuf_put_u8(msg, SSH2_FXP_READDIR)) != 0 ||
+			    (r = sshbuf_put_u32(msg, id)) != 0 ||
+			    (r = sshbuf_put_string(msg, handle,
+			    handle_len)) != 0)
+				fatal("%s: buffer error: %s",
+				    __func__, ssh_err(r));
+			send_msg(conn, msg);
+		}
+		if (first_id == next_id)
+			break;
 
-		if (id != expected_id)
-			fatal("ID mismatch (%u != %u)", id, expected_id);
+		if (replies[first_id % READDIR_INFLIGHT] == NULL) {
+			if ((reply = sshbuf_new()) == NULL)
+				fatal("%s: sshbuf_new failed", __func__);
+			get_msg(conn, reply);
+			if ((r = sshbuf_get_u8(reply, &type)) != 0 ||
+			    (r = sshbuf_get_u32(reply, &id)) != 0)
+				fatal("%s: buffer error: %s",
+				    __func__, ssh_err(r));
+			debug3("Received reply T:%u I:%u", type, id);
+			if (id - first_id >= next_id - first_id ||
+			    replies[id % READDIR_INFLIGHT] != NULL)
+				fatal("ID mismatch (%u not in %u-%u)",
+				    id, first_id, next_id - 1);
+			replies[id % READDIR_INFLIGHT] = reply;
+			types[id % READDIR_INFLIGHT] = type;
+			reply = NULL;
+			continue;
+		}
+		reply = replies[first_id % READDIR_INFLIGHT];
+		type = types[first_id % READDIR_INFLIGHT];
+		replies[first_id % READDIR_INFLIGHT] = NULL;
+		first_id++;
 
 		if (type == SSH2_FXP_STATUS) {
 			u_int rstatus;
 
-			if ((r = sshbuf_get_u32(msg, &rstatus)) != 0)
+			if ((r = sshbuf_get_u32(reply, &rstatus)) != 0)
 				fatal("%s: buffer error: %s",
 				    __func__, ssh_err(r));
 			debug3("Received SSH2_FXP_STATUS %d", rstatus);
-			if (rstatus == SSH2_FX_EOF)
-				break;
-			error("Couldn't read directory: %s", fx2txt(rstatus));
-			goto out;
+			if (rstatus != SSH2_FX_EOF && !eof) {
+				error("Couldn't read directory: %s",
+				    fx2txt(rstatus));
+				failed = 1;
+			}
+			eof = 1;
+			continue;
 		} else if (type != SSH2_FXP_NAME)
 			fatal("Expected SSH2_FXP_NAME(%u) packet, got %u",
 			    SSH2_FXP_NAME, type);
 
-		if ((r = sshbuf_get_u32(msg, &count)) != 0)
+		if ((r = sshbuf_get_u32(reply, &count)) != 0)
 			fatal("%s: buffer error: %s", __func__, ssh_err(r));
 		if (count > SSHBUF_SIZE_MAX)
 			fatal("%s: nonsensical number of entries", __func__);
-		if (count == 0)
-			break;
+		if (count == 0 || failed) {
+			eof = 1;
+			continue;
+		}
 		debug3("Received %d SSH2_FXP_NAME responses", count);
 		for (i = 0; i < count; i++) {
 			char *filename, *longname;
 			Attrib a;
 
-			if ((r = sshbuf_get_cstring(msg, &filename,
+			if ((r = sshbuf_get_cstring(reply, &filename,
 			    NULL)) != 0 ||
-			    (r = sshbuf_get_cstring(msg, &longname,
+			    (r = sshbuf_get_cstring(reply, &longname,
 			    NULL)) != 0)
 				fatal("%s: buffer error: %s",
 				    __func__, ssh_err(r));
-			if ((r = decode_attrib(msg, &a)) != 0) {
+			if ((r = decode_attrib(reply, &a)) != 0) {
 				error("%s: couldn't decode attrib: %s",
 				    __func__, ssh_err(r));
 				free(filename);
 				free(longname);
-				sshbuf_free(msg);
-				return -1;
+				failed = eof = 1;
+				break;
 			}
 
 			if (print_flag)
@@ -640,7 +684,11 @@ do_lsreaddir(struct sftp_conn *conn, const char *path, int print_flag,
 				error("Server sent suspect path \"%s\" "
 				    "during readdir of \"%s\"", filename, path);
 			} else if (dir) {
-				*dir = xreallocarray(*dir, ents + 2, sizeof(**dir));
+				if (ents + 2 > maxents) {
+					maxents = MAXIMUM(ents + 2, maxents * 2);
+					*dir = xreallocarray(*dir, maxents,
+					    sizeof(**dir));
+				}
 				(*dir)[ents] = xcalloc(1, sizeof(***dir));
 				(*dir)[ents]->filename = xstrdup(filename);
 				(*dir)[ents]->longname = xstrdup(longname);
@@ -651,10 +699,15 @@ do_lsreaddir(struct sftp_conn *conn, const char *path, int print_flag,
 			free(longname);
 		}
 	}
+	if (failed)
+		goto out;
 	status = 0;
 
  out:
 	sshbuf_free(msg);
+	sshbuf_free(reply);
+	for (i = 0; i < READDIR_INFLIGHT; i++)
+		sshbuf_free(replies[i]);
 	do_close(conn, handle, handle_len);
 	free(handle);
 
@@ -773,7 +826,6 @@ do_lstat(struct sftp_conn *conn, const char *path, int quiet)
 	return(get_decode_stat(conn, id, quiet));
 }
 
-#ifdef notyet
 Attrib *
 do_fstat(struct sftp_conn *conn, const u_char *handle, u_int handle_len,
     int quiet)
@@ -786,7 +838,6 @@ do_fstat(struct sftp_conn *conn, const u_char *handle, u_int handle_len,
 
 	return(get_decode_stat(conn, id, quiet));
 }
-#endif
 
 int
 do_setstat(struct sftp_conn *conn, const char *path, Attrib *a)
@@ -956,6 +1007,126 @@ do_hardlink(struct sftp_conn *conn, const char *oldpath, const char *newpath)
 	return status == SSH2_FX_OK ? 0 : -1;
 }
 
+/* Open a remote file, returning its handle or NULL on failure */
+static u_char *
+send_open(struct sftp_conn *conn, const char *path, u_int pflags, Attrib *a,
+    size_t *handle_lenp)
+{
+	struct sshbuf *msg;
+	Attrib junk;
+	u_int id;
+	int r;
+
+	if (a == NULL) {
+		attrib_clear(&junk); /* Send empty attributes */
+		a = &junk;
+	}
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	id = conn->msg_id++;
+	if ((r = sshbuf_put_u8(msg, SSH2_FXP_OPEN)) != 0 ||
+	    (r = sshbuf_put_u32(msg, id)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, path)) != 0 ||
+	    (r = sshbuf_put_u32(msg, pflags)) != 0 ||
+	    (r = encode_attrib(msg, a)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	send_msg(conn, msg);
+	debug3("Sent message SSH2_FXP_OPEN I:%u P:%s", id, path);
+	sshbuf_free(msg);
+
+	return get_handle(conn, id, handle_lenp, "remote open(\"%s\")", path);
+}
+
+int
+do_copy(struct sftp_conn *conn, const char *oldpath, const char *newpath)
+{
+	struct sshbuf *msg;
+	Attrib *a, attr;
+	u_char *old_handle = NULL, *new_handle = NULL;
+	size_t old_handle_len, new_handle_len;
+	u_int64_t size;
+	u_int status, id;
+	int r, ret = -1;
+
+	if ((conn->exts & SFTP_EXT_COPY_DATA) == 0) {
+		error("Server does not support copy-data@openssh.com extension");
+		return -1;
+	}
+
+	if ((a = do_stat(conn, oldpath, 0)) == NULL)
+		return -1;
+	if ((a->flags & SSH2_FILEXFER_ATTR_PERMISSIONS) &&
+	    !S_ISREG(a->perm)) {
+		error("Cannot copy non-regular file: %s", oldpath);
+		return -1;
+	}
+	/* Create the copy with the source's permissions, less set[ug]id */
+	attrib_clear(&attr);
+	if (a->flags & SSH2_FILEXFER_ATTR_PERMISSIONS) {
+		attr.flags = SSH2_FILEXFER_ATTR_PERMISSIONS;
+		attr.perm = a->perm & 0777;
+	}
+
+	if ((old_handle = send_open(conn, oldpath, SSH2_FXF_READ, NULL,
+	    &old_handle_len)) == NULL)
+		return -1;
+	if ((a = do_fstat(conn, old_handle, old_handle_len, 0)) == NULL)
+		goto out;
+	if ((a->flags & SSH2_FILEXFER_ATTR_SIZE) == 0) {
+		error("Server did not report size of \"%s\"", oldpath);
+		goto out;
+	}
+	size = a->size;
+	/*
+	 * The destination is truncated only after the copy: if it is
+	 * really the source under another name the server refuses the
+	 * copy and the file is left intact.
+	 */
+	if ((new_handle = send_open(conn, newpath,
+	    SSH2_FXF_WRITE|SSH2_FXF_CREAT, &attr, &new_handle_len)) == NULL)
+		goto out;
+	if (size == 0)
+		goto truncate;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	id = conn->msg_id++;
+	if ((r = sshbuf_put_u8(msg, SSH2_FXP_EXTENDED)) != 0 ||
+	    (r = sshbuf_put_u32(msg, id)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, "copy-data@openssh.com")) != 0 ||
+	    (r = sshbuf_put_string(msg, old_handle, old_handle_len)) != 0 ||
+	    (r = sshbuf_put_u64(msg, 0)) != 0 ||
+	    (r = sshbuf_put_u64(msg, size)) != 0 ||
+	    (r = sshbuf_put_string(msg, new_handle, new_handle_len)) != 0 ||
+	    (r = sshbuf_put_u64(msg, 0)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	send_msg(conn, msg);
+	debug3("Sent message copy-data@openssh.com I:%u \"%s\" -> \"%s\"",
+	    id, oldpath, newpath);
+	sshbuf_free(msg);
+
+	status = get_status(conn, id);
+	if (status != SSH2_FX_OK) {
+		error("Couldn't copy file \"%s\" to \"%s\": %s", oldpath,
+		    newpath, fx2txt(status));
+		goto out;
+	}
+ truncate:
+	attrib_clear(&attr);
+	attr.flags = SSH2_FILEXFER_ATTR_SIZE;
+	attr.size = size;
+	if (do_fsetstat(conn, new_handle, new_handle_len, &attr) == 0)
+		ret = 0;
+ out:
+	if (new_handle != NULL && do_close(conn, new_handle,
+	    new_handle_len) != 0)
+		ret = -1;
+	do_close(conn, old_handle, old_handle_len);
+	free(old_handle);
+	free(new_handle);
+	return ret;
+}
+
 int
 do_symlink(struct sftp_conn *conn, const char *oldpath, const char *newpath)
 {
@@ -1158,6 +1329,325 @@ send_read_request(struct sftp_conn *conn, u_int id, u_int64_t offset,
 	sshbuf_free(msg);
 }
 
+/*
+ * Adaptive request window for transfers, modelled on BBR.  The window is
+ * kept at twice the estimated bandwidth-delay product: the highest
+ * delivery rate seen over the last few round trips times the lowest
+ * request latency seen over the last few seconds.  Until the delivery
+ * rate stops growing the window grows by a request per reply, doubling
+ * every round trip.  A request count given with -R fixes the window.
+ */
+#define XFER_WIN_INIT		4	/* requests */
+#define XFER_WIN_MIN		2
+#define XFER_WIN_MAX		4096
+#define XFER_WIN_MAX_BYTES	(64 * 1024 * 1024)
+#define XFER_WIN_GAIN		2.0
+#define XFER_WIN_BW_ROUNDS	10	/* max bandwidth filter length */
+#define XFER_WIN_RTT_SECS	10.0	/* min RTT filter length */
+#define XFER_WIN_FULL_ROUNDS	3	/* rounds without 25% growth */
+
+struct xfer_window {
+	int adaptive;
+	u_int cur, max;			/* requests in flight */
+	u_int lo, hi;			/* range of cur, for stats */
+	int startup;
+	u_int64_t delivered;		/* bytes completed */
+	u_int64_t round_end;		/* delivered when round ends */
+	u_int round;
+	double bw[XFER_WIN_BW_ROUNDS];	/* bytes/s, max per round */
+	double full_bw;
+	u_int full_rounds;
+	double min_rtt, min_rtt_stamp;
+	double start, rtt_sum;
+	u_int64_t nacks;
+};
+
+static void
+xfer_window_init(struct xfer_window *w, struct sftp_conn *conn, u_int buflen)
+{
+	memset(w, 0, sizeof(*w));
+	w->start = monotime_double();
+	w->adaptive = conn->num_requests == 0;
+	if (w->adaptive) {
+		w->cur = XFER_WIN_INIT;
+		w->max = MINIMUM(XFER_WIN_MAX,
+		    MAXIMUM(XFER_WIN_MIN, XFER_WIN_MAX_BYTES / buflen));
+		w->startup = 1;
+	} else
+		w->cur = w->max = conn->num_requests;
+	w->lo = w->hi = w->cur;
+}
+
+static double
+xfer_window_bw(const struct xfer_window *w)
+{
+	double bw = 0;
+	u_int i;
+
+	for (i = 0; i < XFER_WIN_BW_ROUNDS; i++)
+		bw = MAXIMUM(bw, w->bw[i]);
+	return bw;
+}
+
+/*
+ * Account for a completed request of len bytes that was sent at time
+ * "sent", when "delivered" bytes had completed, and resize the window.
+ */
+static void
+xfer_window_ack(struct xfer_window *w, double sent, u_int64_t delivered,
+    size_t len, u_int buflen)
+{
+	double bw, now = monotime_double(), rtt = now - sent;
+	u_int target;
+
+	w->delivered += len;
+	w->nacks++;
+	w->rtt_sum += rtt;
+	if (rtt <= 0)
+		return;
+
+	if (w->min_rtt == 0 || rtt <= w->min_rtt ||
+	    now - w->min_rtt_stamp > XFER_WIN_RTT_SECS) {
+		w->min_rtt = rtt;
+		w->min_rtt_stamp = now;
+	}
+	/* A round ends when a request sent after it began completes */
+	if (delivered >= w->round_end) {
+		w->round_end = w->delivered;
+		w->round++;
+		w->bw[w->round % XFER_WIN_BW_ROUNDS] = 0;
+		if (w->startup) {
+			bw = xfer_window_bw(w);
+			if (bw >= w->full_bw * 1.25) {
+				w->full_bw = bw;
+				w->full_rounds = 0;
+			} else if (++w->full_rounds >= XFER_WIN_FULL_ROUNDS) {
+				debug2("%s: bandwidth %.0f KB/s reached after "
+				    "%u rounds", __func__, bw / 1024, w->round);
+				w->startup = 0;
+			}
+		}
+	}
+	bw = (w->delivered - delivered) / rtt;
+	if (bw > w->bw[w->round % XFER_WIN_BW_ROUNDS])
+		w->bw[w->round % XFER_WIN_BW_ROUNDS] = bw;
+
+	if (!w->adaptive)
+		return;
+	if (w->startup)
+		target = w->cur + 1;
+	else {
+		target = (u_int)MINIMUM((double)w->max, XFER_WIN_GAIN *
+		    xfer_window_bw(w) * w->min_rtt / buflen + 1);
+	}
+	w->cur = MAXIMUM(XFER_WIN_MIN, MINIMUM(w->max, target));
+	w->lo = MINIMUM(w->lo, w->cur);
+	w->hi = MAXIMUM(w->hi, w->cur);
+}
+
+static void
+xfer_window_report(const struct xfer_window *w, const char *path, u_int buflen)
+{
+	double elapsed = monotime_double() - w->start;
+
+	if (w->nacks == 0 || elapsed <= 0)
+		return;
+	debug("Transferred \"%s\": %llu bytes in %.2fs (%.1f KB/s)", path,
+	    (unsigned long long)w->delivered, elapsed,
+	    w->delivered / elapsed / 1024);
+	debug("Requests: %llu, RTT min %.1fms avg %.1fms, window %s %u-%u "
+	    "(%u KB max), bandwidth estimate %.1f KB/s",
+	    (unsigned long long)w->nacks, w->min_rtt * 1000,
+	    w->rtt_sum / w->nacks * 1000,
+	    w->adaptive ? "adaptive" : "fixed", w->lo, w->hi,
+	    (u_int)(((u_int64_t)w->hi * buflen) / 1024),
+	    xfer_window_bw(w) / 1024);
+}
+
+/*
+ * Delta resume: before resuming a download, the existing local data is
+ * compared block by block with digests computed by the server, and
+ * only blocks that differ are fetched again.
+ */
+#define DELTA_BLOCK_SIZE	(128 * 1024)
+#define DELTA_DIGEST		"sha256"
+
+struct delta {
+	u_int64_t end;		/* length of the compared prefix */
+	u_int64_t same_bytes;	/* bytes in matching blocks */
+	size_t nblocks;
+	u_char *same;		/* per block: local copy is up to date */
+};
+
+static void
+send_check_file(struct sftp_conn *conn, u_int id, const u_char *handle,
+    u_int handle_len, u_int64_t offset, u_int64_t len)
+{
+	struct sshbuf *msg;
+	int r;
+
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u8(msg, SSH2_FXP_EXTENDED)) != 0 ||
+	    (r = sshbuf_put_u32(msg, id)) != 0 ||
+	    (r = sshbuf_put_cstring(msg,
+	    "check-file-blocks@openssh.com")) != 0 ||
+	    (r = sshbuf_put_string(msg, handle, handle_len)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, DELTA_DIGEST)) != 0 ||
+	    (r = sshbuf_put_u64(msg, offset)) != 0 ||
+	    (r = sshbuf_put_u64(msg, len)) != 0 ||
+	    (r = sshbuf_put_u32(msg, DELTA_BLOCK_SIZE)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	send_msg(conn, msg);
+	debug3("Sent message check-file-blocks@openssh.com I:%u %llu+%llu",
+	    id, (unsigned long long)offset, (unsigned long long)len);
+	sshbuf_free(msg);
+}
+
+/* Returns nonzero if the local block at offset has the given digest */
+static int
+delta_block_same(int fd, u_int64_t offset, size_t len, const u_char *digest,
+    size_t dlen)
+{
+	struct ssh_digest_ctx *ctx;
+	u_char buf[64 * 1024], d[SSH_DIGEST_MAX_LENGTH];
+	size_t done, n;
+	ssize_t r;
+
+	if ((ctx = ssh_digest_start(SSH_DIGEST_SHA256)) == NULL)
+		fatal("%s: ssh_digest_start failed", __func__);
+	for (done = 0; done < len; done += r) {
+		n = MINIMUM(sizeof(buf), len - done);
+		if ((r = pread(fd, buf, n, offset + done)) == -1 &&
+		    errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if (r <= 0)
+			break;
+		if (ssh_digest_update(ctx, buf, r) != 0)
+			fatal("%s: ssh_digest_update failed", __func__);
+	}
+	if (ssh_digest_final(ctx, d, sizeof(d)) != 0)
+		fatal("%s: ssh_digest_final failed", __func__);
+	ssh_digest_free(ctx);
+	return done == len && timingsafe_bcmp(d, digest, dlen) == 0;
+}
+
+/*
+ * Compare the first len bytes of local_fd with the remote file.  The
+ * request for the next run of digests is sent before the local blocks
+ * of the current one are hashed so the two sides work in parallel.
+ * Returns NULL if the server could not provide the digests.
+ */
+static struct delta *
+delta_check(struct sftp_conn *conn, const u_char *handle, u_int handle_len,
+    int local_fd, u_int64_t len)
+{
+	struct sshbuf *msg;
+	struct delta *d;
+	const u_char *digests;
+	char *name = NULL;
+	u_int64_t off, next;
+	size_t i, n, dlen = ssh_digest_bytes(SSH_DIGEST_SHA256), blen;
+	u_int id, rid, status;
+	u_char type;
+	int r, pending, ok = 0;
+
+	d = xcalloc(1, sizeof(*d));
+	d->end = len;
+	d->nblocks = (len + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+	d->same = xcalloc(d->nblocks, 1);
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+
+	id = conn->msg_id++;
+	send_check_file(conn, id, handle, handle_len, 0, len);
+	for (off = 0;; off = next) {
+		sshbuf_reset(msg);
+		get_msg(conn, msg);
+		if ((r = sshbuf_get_u8(msg, &type)) != 0 ||
+		    (r = sshbuf_get_u32(msg, &rid)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (rid != id)
+			fatal("ID mismatch (%u != %u)", rid, id);
+		if (type == SSH2_FXP_STATUS) {
+			if ((r = sshbuf_get_u32(msg, &status)) != 0)
+				fatal("%s: buffer error: %s",
+				    __func__, ssh_err(r));
+			debug("Server could not check blocks: %s",
+			    fx2txt(status));
+			break;
+		}
+		if (type != SSH2_FXP_EXTENDED_REPLY)
+			fatal("Expected SSH2_FXP_EXTENDED_REPLY(%u) packet, "
+			    "got %u", SSH2_FXP_EXTENDED_REPLY, type);
+		free(name);
+		if ((r = sshbuf_get_cstring(msg, &name, NULL)) != 0 ||
+		    (r = sshbuf_get_string_direct(msg, &digests, &n)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (strcmp(name, DELTA_DIGEST) != 0 || n % dlen != 0) {
+			error("Server sent bad block digests");
+			break;
+		}
+		n /= dlen;
+		next = MINIMUM(off + (u_int64_t)n * DELTA_BLOCK_SIZE, len);
+		/* No digests at all means the remote file is shorter */
+		if ((pending = n > 0 && next < len && !interrupted)) {
+			id = conn->msg_id++;
+			send_check_file(conn, id, handle, handle_len,
+			    next, len - next);
+		}
+		for (i = 0; i < n && off < next; i++) {
+			blen = MINIMUM(DELTA_BLOCK_SIZE, next - off);
+			if (delta_block_same(local_fd, off,
+			    blen, digests + i * dlen, dlen)) {
+				d->same[off / DELTA_BLOCK_SIZE] = 1;
+				d->same_bytes += blen;
+			}
+			off += blen;
+		}
+		if (!pending) {
+			ok = !interrupted;
+			break;
+		}
+	}
+	sshbuf_free(msg);
+	free(name);
+	if (!ok) {
+		free(d->same);
+		free(d);
+		return NULL;
+	}
+	debug("Delta resume: %llu of %llu bytes up to date",
+	    (unsigned long long)d->same_bytes, (unsigned long long)len);
+	return d;
+}
+
+/* Returns the first offset at or after off that needs to be fetched */
+static u_int64_t
+delta_skip(const struct delta *d, u_int64_t off)
+{
+	while (off < d->end && d->same[off / DELTA_BLOCK_SIZE])
+		off = MINIMUM((off / DELTA_BLOCK_SIZE + 1) * DELTA_BLOCK_SIZE,
+		    d->end);
+	return off;
+}
+
+/* Clamps a read at off to the run of blocks that need to be fetched */
+static size_t
+delta_len(const struct delta *d, u_int64_t off, size_t len)
+{
+	u_int64_t end = off;
+
+	while (end < d->end && !d->same[end / DELTA_BLOCK_SIZE])
+		end = MINIMUM((end / DELTA_BLOCK_SIZE + 1) * DELTA_BLOCK_SIZE,
+		    d->end);
+	if (end < d->end && end - off < len)
+		len = end - off;
+	return len;
+}
+
 int
 do_download(struct sftp_conn *conn, const char *remote_path,
     const char *local_path, Attrib *a, int preserve_flag, int resume_flag,
@@ -1166,7 +1656,7 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 	Attrib junk;
 	struct sshbuf *msg;
 	u_char *handle;
-	int local_fd = -1, write_error;
+	int local_fd = -1, local_readable = 0, write_error;
 	int read_error, write_errno, reordered = 0, r;
 	u_int64_t offset = 0, size, highwater;
 	u_int mode, id, buflen, num_req, max_req, status = SSH2_FX_OK;
@@ -1177,10 +1667,14 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 		u_int id;
 		size_t len;
 		u_int64_t offset;
+		double sent;
+		u_int64_t delivered;
 		TAILQ_ENTRY(request) tq;
 	};
 	TAILQ_HEAD(reqhead, request) requests;
 	struct request *req;
+	struct xfer_window win;
+	struct delta *delta = NULL;
 	u_char type;
 
 	TAILQ_INIT(&requests);
@@ -1229,8 +1723,15 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 		return(-1);
 	}
 
-	local_fd = open(local_path,
-	    O_WRONLY | O_CREAT | (resume_flag ? 0 : O_TRUNC), mode | S_IWUSR);
+	/* A delta resume needs to read back the existing data */
+	local_fd = -1;
+	if (resume_flag && (conn->exts & SFTP_EXT_CHECK_FILE))
+		local_fd = open(local_path, O_RDWR | O_CREAT, mode | S_IWUSR);
+	if (local_fd == -1)
+		local_fd = open(local_path, O_WRONLY | O_CREAT |
+		    (resume_flag ? 0 : O_TRUNC), mode | S_IWUSR);
+	else
+		local_readable = 1;
 	if (local_fd == -1) {
 		error("Couldn't open local file \"%s\" for writing: %s",
 		    local_path, strerror(errno));
@@ -1258,6 +1759,9 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 				close(local_fd);
 			return -1;
 		}
+		if (local_readable && st.st_size > 0)
+			delta = delta_check(conn, handle, handle_len, local_fd,
+			    st.st_size);
 		offset = highwater = st.st_size;
 	}
 
@@ -1265,6 +1769,12 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 	write_error = read_error = write_errno = num_req = 0;
 	max_req = 1;
 	progress_counter = offset;
+	if (delta != NULL) {
+		offset = 0;
+		highwater = delta_skip(delta, 0);
+		progress_counter = delta->same_bytes;
+	}
+	xfer_window_init(&win, conn, buflen);
 
 	if (showprogress && size != 0)
 		start_progress_meter(remote_path, size, &progress_counter);
@@ -1285,15 +1795,21 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 
 		/* Send some more requests */
 		while (num_req < max_req) {
+			req = xcalloc(1, sizeof(*req));
+			req->len = buflen;
+			if (delta != NULL) {
+				offset = delta_skip(delta, offset);
+				req->len = delta_len(delta, offset, buflen);
+			}
 			debug3("Request range %llu -> %llu (%d/%d)",
 			    (unsigned long long)offset,
-			    (unsigned long long)offset + buflen - 1,
+			    (unsigned long long)offset + req->len - 1,
 			    num_req, max_req);
-			req = xcalloc(1, sizeof(*req));
 			req->id = conn->msg_id++;
-			req->len = buflen;
 			req->offset = offset;
-			offset += buflen;
+			req->sent = monotime_double();
+			req->delivered = win.delivered;
+			offset += req->len;
 			num_req++;
 			TAILQ_INSERT_TAIL(&requests, req, tq);
 			send_read_request(conn, req->id, req->offset,
@@ -1344,12 +1860,16 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 				write_error = 1;
 				max_req = 0;
 			}
-			else if (!reordered && req->offset <= highwater)
+			else if (!reordered && req->offset <= highwater) {
 				highwater = req->offset + len;
-			else if (!reordered && req->offset > highwater)
+				if (delta != NULL)
+					highwater = delta_skip(delta, highwater);
+			} else if (!reordered && req->offset > highwater)
 				reordered = 1;
 			progress_counter += len;
 			free(data);
+			xfer_window_ack(&win, req->sent, req->delivered, len,
+			    buflen);
 
 			if (len == req->len) {
 				TAILQ_REMOVE(&requests, req, tq);
@@ -1365,6 +1885,8 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 				req->id = conn->msg_id++;
 				req->len -= len;
 				req->offset += len;
+				req->sent = monotime_double();
+				req->delivered = win.delivered;
 				send_read_request(conn, req->id,
 				    req->offset, req->len, handle, handle_len);
 				/* Reduce the request size */
@@ -1379,6 +1901,8 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 					    (unsigned long long)offset,
 					    num_req);
 					max_req = 1;
+				} else if (win.adaptive) {
+					max_req = win.cur;
 				} else if (max_req <= conn->num_requests) {
 					++max_req;
 				}
@@ -1392,6 +1916,7 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 
 	if (showprogress && size)
 		stop_progress_meter();
+	xfer_window_report(&win, remote_path, buflen);
 
 	/* Sanity check */
 	if (TAILQ_FIRST(&requests) != NULL)
@@ -1402,6 +1927,13 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 			error("Unable to resume download of \"%s\": "
 			    "server reordered requests", local_path);
 		}
+		/*
+		 * Blocks of the old data past highwater may already have been
+		 * found to match and the next delta resume checks the others
+		 * again, so only cut back what was added past its old end.
+		 */
+		if (delta != NULL)
+			highwater = MAXIMUM(highwater, (u_int64_t)st.st_size);
 		debug("truncating at %llu", (unsigned long long)highwater);
 		if (ftruncate(local_fd, highwater) == -1)
 			error("ftruncate \"%s\": %s", local_path,
@@ -1450,14 +1982,707 @@ do_download(struct sftp_conn *conn, const char *remote_path,
 	close(local_fd);
 	sshbuf_free(msg);
 	free(handle);
+	if (delta != NULL) {
+		free(delta->same);
+		free(delta);
+	}
 
 	return status == SSH2_FX_OK ? 0 : -1;
 }
 
+/*
+ * Transfer engine for recursive get/put.  Regular files found while
+ * walking a tree are queued, and once a batch has been collected up to
+ * XFER_FILES_MAX of them are transferred at a time, their OPEN, READ or
+ * WRITE, FSETSTAT and CLOSE requests interleaved on the connection.  Each
+ * file is a small state machine advanced by the replies to its requests;
+ * the data requests of all files together are bounded by one transfer
+ * window.  Directory attributes are applied once the files in them are
+ * done.
+ */
+#define XFER_FILES_MAX		16	/* files in flight */
+#define XFER_BATCH_MAX		1024	/* files queued before starting */
+
+enum xfer_state {
+	XFER_OPEN, XFER_DATA, XFER_SETSTAT, XFER_FSYNC, XFER_CLOSE, XFER_DONE
+};
+
+struct xfer_file {
+	char *src, *dst;
+	Attrib a;
+	enum xfer_state state;
+	u_char *handle;
+	size_t handle_len;
+	int fd;
+	u_int64_t offset, size, highwater;
+	int reordered, eof, failed;
+	int read_error, write_error, write_errno;
+	u_int status;
+	u_int nreq;			/* data requests outstanding */
+	TAILQ_ENTRY(xfer_file) tq;
+};
+
+struct xfer_req {
+	u_int id;
+	struct xfer_file *f;
+	u_int64_t offset;
+	size_t len;
+	double sent;
+	u_int64_t delivered;
+	TAILQ_ENTRY(xfer_req) tq;
+};
+
+struct xfer_dir {
+	char *path;
+	Attrib a;
+	TAILQ_ENTRY(xfer_dir) tq;
+};
+
+struct xfer_queue {
+	struct sftp_conn *conn;
+	int download, preserve_flag, resume_flag, fsync_flag;
+	const char *title;
+	TAILQ_HEAD(, xfer_file) queued, active;
+	TAILQ_HEAD(, xfer_req) reqs;
+	TAILQ_HEAD(, xfer_dir) dirs;
+	u_int nqueued, nactive, nreqs;
+	struct xfer_window win;
+	struct sshbuf *msg;
+	u_char *data;
+	off_t progress, total;
+};
+
+static void
+xfer_queue_init(struct xfer_queue *q, struct sftp_conn *conn, int download,
+    const char *title, int preserve_flag, int resume_flag, int fsync_flag)
+{
+	memset(q, 0, sizeof(*q));
+	q->conn = conn;
+	q->download = download;
+	q->title = title;
+	q->preserve_flag = preserve_flag;
+	q->resume_flag = resume_flag;
+	q->fsync_flag = fsync_flag;
+	TAILQ_INIT(&q->queued);
+	TAILQ_INIT(&q->active);
+	TAILQ_INIT(&q->reqs);
+	TAILQ_INIT(&q->dirs);
+	if ((q->msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (!download)
+		q->data = xmalloc(conn->transfer_buflen);
+	xfer_window_init(&q->win, conn, conn->transfer_buflen);
+}
+
+static void
+xfer_file_free(struct xfer_file *f)
+{
+	if (f->fd != -1)
+		close(f->fd);
+	free(f->handle);
+	free(f->src);
+	free(f->dst);
+	free(f);
+}
+
+static struct xfer_req *
+xfer_req_new(struct xfer_queue *q, struct xfer_file *f, u_int64_t offset,
+    size_t len)
+{
+	struct xfer_req *req;
+
+	req = xcalloc(1, sizeof(*req));
+	req->id = q->conn->msg_id++;
+	req->f = f;
+	req->offset = offset;
+	req->len = len;
+	req->sent = monotime_double();
+	req->delivered = q->win.delivered;
+	TAILQ_INSERT_TAIL(&q->reqs, req, tq);
+	q->nreqs++;
+	return req;
+}
+
+/* Open the local file to upload and work out the attributes to send */
+static int
+xfer_open_upload(struct xfer_queue *q, struct xfer_file *f)
+{
+	struct stat sb;
+
+	if ((f->fd = open(f->src, O_RDONLY, 0)) == -1) {
+		error("Couldn't open local file \"%s\" for reading: %s",
+		    f->src, strerror(errno));
+		return -1;
+	}
+	if (fstat(f->fd, &sb) == -1) {
+		error("Couldn't fstat local file \"%s\": %s",
+		    f->src, strerror(errno));
+		return -1;
+	}
+	if (!S_ISREG(sb.st_mode)) {
+		error("%s is not a regular file", f->src);
+		return -1;
+	}
+	stat_to_attrib(&sb, &f->a);
+	f->a.flags &= ~SSH2_FILEXFER_ATTR_SIZE;
+	f->a.flags &= ~SSH2_FILEXFER_ATTR_UIDGID;
+	f->a.perm &= 0777;
+	if (!q->preserve_flag)
+		f->a.flags &= ~SSH2_FILEXFER_ATTR_ACMODTIME;
+	return 0;
+}
+
+static void
+xfer_send_open(struct xfer_queue *q, struct xfer_file *f)
+{
+	struct xfer_req *req = xfer_req_new(q, f, 0, 0);
+	const char *path = q->download ? f->src : f->dst;
+	Attrib junk;
+	int r;
+
+	attrib_clear(&junk);
+	sshbuf_reset(q->msg);
+	if ((r = sshbuf_put_u8(q->msg, SSH2_FXP_OPEN)) != 0 ||
+	    (r = sshbuf_put_u32(q->msg, req->id)) != 0 ||
+	    (r = sshbuf_put_cstring(q->msg, path)) != 0 ||
+	    (r = sshbuf_put_u32(q->msg, q->download ? SSH2_FXF_READ :
+	    SSH2_FXF_WRITE|SSH2_FXF_CREAT|SSH2_FXF_TRUNC)) != 0 ||
+	    (r = encode_attrib(q->msg, q->download ? &junk : &f->a)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	send_msg(q->conn, q->msg);
+	debug3("Sent message SSH2_FXP_OPEN I:%u P:%s", req->id, path);
+	f->state = XFER_OPEN;
+}
+
+/* Send the next data request for a file, returning 0 if none was sent */
+static int
+xfer_send_data(struct xfer_queue *q, struct xfer_file *f)
+{
+	struct xfer_req *req;
+	u_int buflen = q->conn->transfer_buflen;
+	ssize_t len;
+	int r;
+
+	if (q->download) {
+		/* Only one request at a time past the expected EOF */
+		if (f->offset >= f->size && f->nreq > 0)
+			return 0;
+		req = xfer_req_new(q, f, f->offset, buflen);
+		send_read_request(q->conn, req->id, req->offset, req->len,
+		    f->handle, f->handle_len);
+		f->offset += buflen;
+		f->nreq++;
+		return 1;
+	}
+
+	do
+		len = read(f->fd, q->data, buflen);
+	while (len == -1 &&
+	    (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK));
+	if (len == -1)
+		fatal("Couldn't read from \"%s\": %s", f->src,
+		    strerror(errno));
+	if (len == 0) {
+		f->eof = 1;
+		return 0;
+	}
+	req = xfer_req_new(q, f, f->offset, len);
+	sshbuf_reset(q->msg);
+	if ((r = sshbuf_put_u8(q->msg, SSH2_FXP_WRITE)) != 0 ||
+	    (r = sshbuf_put_u32(q->msg, req->id)) != 0 ||
+	    (r = sshbuf_put_string(q->msg, f->handle, f->handle_len)) != 0 ||
+	    (r = sshbuf_put_u64(q->msg, f->offset)) != 0 ||
+	    (r = sshbuf_put_string(q->msg, q->data, len)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	send_msg(q->conn, q->msg);
+	debug3("Sent message SSH2_FXP_WRITE I:%u O:%llu S:%zd",
+	    req->id, (unsigned long long)f->offset, len);
+	f->offset += len;
+	f->nreq++;
+	return 1;
+}
+
+/* Send the request that moves a file to the given state */
+static void
+xfer_send_state(struct xfer_queue *q, struct xfer_file *f,
+    enum xfer_state state)
+{
+	struct xfer_req *req;
+	int r;
+
+	f->state = state;
+	if (state == XFER_DONE)
+		return;
+	req = xfer_req_new(q, f, 0, 0);
+	switch (state) {
+	case XFER_SETSTAT:
+		send_string_attrs_request(q->conn, req->id, SSH2_FXP_FSETSTAT,
+		    f->handle, f->handle_len, &f->a);
+		return;
+	case XFER_FSYNC:
+		sshbuf_reset(q->msg);
+		if ((r = sshbuf_put_u8(q->msg, SSH2_FXP_EXTENDED)) != 0 ||
+		    (r = sshbuf_put_u32(q->msg, req->id)) != 0 ||
+		    (r = sshbuf_put_cstring(q->msg,
+		    "fsync@openssh.com")) != 0 ||
+		    (r = sshbuf_put_string(q->msg, f->handle,
+		    f->handle_len)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		send_msg(q->conn, q->msg);
+		debug3("Sent message fsync@openssh.com I:%u", req->id);
+		return;
+	case XFER_CLOSE:
+		send_string_request(q->conn, req->id, SSH2_FXP_CLOSE,
+		    f->handle, f->handle_len);
+		return;
+	default:
+		fatal("%s: bad state %d", __func__, state);
+	}
+}
+
+/* Open the local side of a file whose remote open succeeded */
+static int
+xfer_open_local(struct xfer_queue *q, struct xfer_file *f)
+{
+	struct stat st;
+	mode_t mode;
+
+	if (!q->download)
+		return 0;
+	/* Do not preserve set[ug]id here, as we do not preserve ownership */
+	mode = (f->a.flags & SSH2_FILEXFER_ATTR_PERMISSIONS) ?
+	    f->a.perm & 0777 : 0666;
+	f->fd = open(f->dst, O_WRONLY | O_CREAT |
+	    (q->resume_flag ? 0 : O_TRUNC), mode | S_IWUSR);
+	if (f->fd == -1) {
+		error("Couldn't open local file \"%s\" for writing: %s",
+		    f->dst, strerror(errno));
+		return -1;
+	}
+	if (!q->resume_flag)
+		return 0;
+	if (fstat(f->fd, &st) == -1) {
+		error("Unable to stat local file \"%s\": %s",
+		    f->dst, strerror(errno));
+		return -1;
+	}
+	if (st.st_size < 0) {
+		error("\"%s\" has negative size", f->dst);
+		return -1;
+	}
+	if ((u_int64_t)st.st_size > f->size) {
+		error("Unable to resume download of \"%s\": "
+		    "local file is larger than remote", f->dst);
+		return -1;
+	}
+	f->offset = f->highwater = st.st_size;
+	q->progress += st.st_size;
+	return 0;
+}
+
+/* All data requests for a file have completed */
+static void
+xfer_data_done(struct xfer_queue *q, struct xfer_file *f)
+{
+	if (!q->download) {
+		if (f->status != SSH2_FX_OK) {
+			error("Couldn't write to remote file \"%s\": %s",
+			    f->dst, fx2txt(f->status));
+			f->failed = 1;
+		}
+		if (close(f->fd) == -1) {
+			error("Couldn't close local file \"%s\": %s",
+			    f->src, strerror(errno));
+			f->failed = 1;
+		}
+		f->fd = -1;
+		if (q->preserve_flag)
+			xfer_send_state(q, f, XFER_SETSTAT);
+		else if (q->fsync_flag && (q->conn->exts & SFTP_EXT_FSYNC))
+			xfer_send_state(q, f, XFER_FSYNC);
+		else
+			xfer_send_state(q, f, XFER_CLOSE);
+		return;
+	}
+
+	/* Truncate at highest contiguous point to avoid holes on interrupt */
+	if (f->read_error || f->write_error || interrupted) {
+		if (f->reordered && q->resume_flag) {
+			error("Unable to resume download of \"%s\": "
+			    "server reordered requests", f->dst);
+		}
+		debug("truncating at %llu", (unsigned long long)f->highwater);
+		if (ftruncate(f->fd, f->highwater) == -1)
+			error("ftruncate \"%s\": %s", f->dst, strerror(errno));
+	}
+	if (f->read_error) {
+		error("Couldn't read from remote file \"%s\" : %s",
+		    f->src, fx2txt(f->status));
+		f->failed = 1;
+	} else if (f->write_error) {
+		error("Couldn't write to \"%s\": %s", f->dst,
+		    strerror(f->write_errno));
+		f->failed = 1;
+	}
+	xfer_send_state(q, f, XFER_CLOSE);
+}
+
+/* The remote file has been closed; finish the local side */
+static void
+xfer_closed(struct xfer_queue *q, struct xfer_file *f)
+{
+	struct timeval tv[2];
+	mode_t mode;
+
+	if (!q->download) {
+		if (f->failed)
+			error("Uploading of file %s to %s failed!",
+			    f->src, f->dst);
+		return;
+	}
+	if (interrupted)
+		f->failed = 1;
+	mode = (f->a.flags & SSH2_FILEXFER_ATTR_PERMISSIONS) ?
+	    f->a.perm & 0777 : 0666;
+	if (!f->failed) {
+		/* Override umask and utimes if asked */
+#ifdef HAVE_FCHMOD
+		if (q->preserve_flag && fchmod(f->fd, mode) == -1)
+#else
+		if (q->preserve_flag && chmod(f->dst, mode) == -1)
+#endif /* HAVE_FCHMOD */
+			error("Couldn't set mode on \"%s\": %s", f->dst,
+			    strerror(errno));
+		if (q->preserve_flag &&
+		    (f->a.flags & SSH2_FILEXFER_ATTR_ACMODTIME)) {
+			tv[0].tv_sec = f->a.atime;
+			tv[1].tv_sec = f->a.mtime;
+			tv[0].tv_usec = tv[1].tv_usec = 0;
+			if (utimes(f->dst, tv) == -1)
+				error("Can't set times on \"%s\": %s",
+				    f->dst, strerror(errno));
+		}
+		if (q->fsync_flag) {
+			debug("syncing \"%s\"", f->dst);
+			if (fsync(f->fd) == -1)
+				error("Couldn't sync file \"%s\": %s",
+				    f->dst, strerror(errno));
+		}
+	}
+	if (f->failed)
+		error("Download of file %s to %s failed", f->src, f->dst);
+}
+
+static void
+xfer_recv_data(struct xfer_queue *q, struct xfer_file *f, struct xfer_req *req,
+    u_char type)
+{
+	u_int buflen = q->conn->transfer_buflen;
+	struct xfer_req *nreq;
+	u_char *data;
+	size_t len;
+	u_int status;
+	int r;
+
+	if (type == SSH2_FXP_STATUS) {
+		if ((r = sshbuf_get_u32(q->msg, &status)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		debug3("SSH2_FXP_STATUS %u", status);
+		if (q->download) {
+			if (status != SSH2_FX_EOF) {
+				f->read_error = 1;
+				f->status = status;
+			}
+			f->eof = 1;
+			return;
+		}
+		if (status != SSH2_FX_OK && f->status == SSH2_FX_OK) {
+			f->status = status;
+			f->eof = 1;
+		}
+		q->progress += req->len;
+		xfer_window_ack(&q->win, req->sent, req->delivered, req->len,
+		    buflen);
+		return;
+	}
+	if (!q->download || type != SSH2_FXP_DATA)
+		fatal("Expected SSH2_FXP_DATA(%u) packet, got %u",
+		    SSH2_FXP_DATA, type);
+
+	if ((r = sshbuf_get_string(q->msg, &data, &len)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	debug3("Received data %llu -> %llu", (unsigned long long)req->offset,
+	    (unsigned long long)req->offset + len - 1);
+	if (len > req->len)
+		fatal("Received more data than asked for %zu > %zu",
+		    len, req->len);
+	if ((lseek(f->fd, req->offset, SEEK_SET) == -1 ||
+	    atomicio(vwrite, f->fd, data, len) != len) &&
+	    !f->write_error) {
+		f->write_errno = errno;
+		f->write_error = 1;
+		f->eof = 1;
+	} else if (!f->reordered && req->offset <= f->highwater)
+		f->highwater = req->offset + len;
+	else if (!f->reordered && req->offset > f->highwater)
+		f->reordered = 1;
+	q->progress += len;
+	free(data);
+	xfer_window_ack(&q->win, req->sent, req->delivered, len, buflen);
+
+	if (len < req->len) {
+		/* Resend the request for the missing data */
+		debug3("Short data block, re-requesting %llu -> %llu",
+		    (unsigned long long)req->offset + len,
+		    (unsigned long long)req->offset + req->len - 1);
+		nreq = xfer_req_new(q, f, req->offset + len, req->len - len);
+		send_read_request(q->conn, nreq->id, nreq->offset, nreq->len,
+		    f->handle, f->handle_len);
+		f->nreq++;
+	}
+}
+
+/* Wait for a reply and advance the file it belongs to */
+static void
+xfer_recv(struct xfer_queue *q)
+{
+	struct xfer_req *req;
+	struct xfer_file *f;
+	u_int id, status;
+	u_char type;
+	int r;
+
+	sshbuf_reset(q->msg);
+	get_msg(q->conn, q->msg);
+	if ((r = sshbuf_get_u8(q->msg, &type)) != 0 ||
+	    (r = sshbuf_get_u32(q->msg, &id)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	debug3("Received reply T:%u I:%u", type, id);
+
+	/* Find the request in our queue */
+	TAILQ_FOREACH(req, &q->reqs, tq) {
+		if (req->id == id)
+			break;
+	}
+	if (req == NULL)
+		fatal("Unexpected reply %u", id);
+	TAILQ_REMOVE(&q->reqs, req, tq);
+	q->nreqs--;
+	f = req->f;
+
+	if (f->state == XFER_DATA) {
+		f->nreq--;
+		xfer_recv_data(q, f, req, type);
+		free(req);
+		if (f->nreq == 0 && (f->eof || interrupted))
+			xfer_data_done(q, f);
+		return;
+	}
+	free(req);
+
+	if (f->state == XFER_OPEN && type == SSH2_FXP_HANDLE) {
+		if ((r = sshbuf_get_string(q->msg, &f->handle,
+		    &f->handle_len)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (xfer_open_local(q, f) != 0) {
+			f->failed = 1;
+			xfer_send_state(q, f, XFER_CLOSE);
+		} else if (interrupted)
+			xfer_data_done(q, f);
+		else
+			f->state = XFER_DATA;
+		return;
+	}
+	if (type != SSH2_FXP_STATUS)
+		fatal("Expected SSH2_FXP_STATUS(%u) packet, got %u",
+		    SSH2_FXP_STATUS, type);
+	if ((r = sshbuf_get_u32(q->msg, &status)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	debug3("SSH2_FXP_STATUS %u", status);
+
+	switch (f->state) {
+	case XFER_OPEN:
+		error("remote open(\"%s\"): %s",
+		    q->download ? f->src : f->dst, fx2txt(status));
+		f->failed = 1;
+		xfer_closed(q, f);
+		f->state = XFER_DONE;
+		break;
+	case XFER_SETSTAT:
+		if (status != SSH2_FX_OK)
+			error("Couldn't fsetstat: %s", fx2txt(status));
+		if (q->fsync_flag && (q->conn->exts & SFTP_EXT_FSYNC))
+			xfer_send_state(q, f, XFER_FSYNC);
+		else
+			xfer_send_state(q, f, XFER_CLOSE);
+		break;
+	case XFER_FSYNC:
+		if (status != SSH2_FX_OK)
+			error("Couldn't sync file: %s", fx2txt(status));
+		xfer_send_state(q, f, XFER_CLOSE);
+		break;
+	case XFER_CLOSE:
+		if (status != SSH2_FX_OK) {
+			error("Couldn't close file: %s", fx2txt(status));
+			f->failed = 1;
+		}
+		xfer_closed(q, f);
+		f->state = XFER_DONE;
+		break;
+	default:
+		fatal("%s: unexpected reply in state %d", __func__, f->state);
+	}
+}
+
+/* Set the attributes of directories whose files have all been sent */
+static void
+xfer_finish_dirs(struct xfer_queue *q)
+{
+	struct xfer_dir *d;
+	struct timeval tv[2];
+
+	while ((d = TAILQ_FIRST(&q->dirs)) != NULL) {
+		TAILQ_REMOVE(&q->dirs, d, tq);
+		if (!q->download)
+			do_setstat(q->conn, d->path, &d->a);
+		else if (d->a.flags & SSH2_FILEXFER_ATTR_ACMODTIME) {
+			tv[0].tv_sec = d->a.atime;
+			tv[1].tv_sec = d->a.mtime;
+			tv[0].tv_usec = tv[1].tv_usec = 0;
+			if (utimes(d->path, tv) == -1)
+				error("Can't set times on \"%s\": %s",
+				    d->path, strerror(errno));
+		} else
+			debug("Server did not send times for directory "
+			    "\"%s\"", d->path);
+		free(d->path);
+		free(d);
+	}
+}
+
+/*
+ * Transfer all queued files and apply the directory attributes queued
+ * behind them.  Returns -1 if any file failed.
+ */
+static int
+xfer_queue_run(struct xfer_queue *q)
+{
+	struct xfer_file *f, *tmp;
+	int ret = 0;
+
+	if (showprogress && q->total > 0)
+		start_progress_meter(q->title, q->total, &q->progress);
+	while (!TAILQ_EMPTY(&q->queued) || !TAILQ_EMPTY(&q->active)) {
+		/* Start more files while there is room in the window */
+		while (!interrupted && q->nactive < XFER_FILES_MAX &&
+		    q->nreqs < q->win.cur &&
+		    (f = TAILQ_FIRST(&q->queued)) != NULL) {
+			TAILQ_REMOVE(&q->queued, f, tq);
+			q->nqueued--;
+			if (!q->download && xfer_open_upload(q, f) != 0) {
+				error("Uploading of file %s to %s failed!",
+				    f->src, f->dst);
+				xfer_file_free(f);
+				ret = -1;
+				continue;
+			}
+			TAILQ_INSERT_TAIL(&q->active, f, tq);
+			q->nactive++;
+			xfer_send_open(q, f);
+		}
+		/* Files never started are dropped on interrupt */
+		while (interrupted && (f = TAILQ_FIRST(&q->queued)) != NULL) {
+			TAILQ_REMOVE(&q->queued, f, tq);
+			q->nqueued--;
+			xfer_file_free(f);
+			ret = -1;
+		}
+		/* Fill the window, oldest files first */
+		TAILQ_FOREACH(f, &q->active, tq) {
+			while (!interrupted && f->state == XFER_DATA &&
+			    !f->eof && q->nreqs < q->win.cur &&
+			    xfer_send_data(q, f))
+				;
+			/* An upload may reach EOF with nothing in flight */
+			if (f->state == XFER_DATA && f->nreq == 0 &&
+			    (f->eof || interrupted))
+				xfer_data_done(q, f);
+		}
+		if (q->nreqs > 0)
+			xfer_recv(q);
+		else if (!TAILQ_EMPTY(&q->active))
+			fatal("%s: files in flight without requests", __func__);
+		TAILQ_FOREACH_SAFE(f, &q->active, tq, tmp) {
+			if (f->state != XFER_DONE)
+				continue;
+			if (f->failed)
+				ret = -1;
+			TAILQ_REMOVE(&q->active, f, tq);
+			q->nactive--;
+			xfer_file_free(f);
+		}
+	}
+	if (showprogress && q->total > 0)
+		stop_progress_meter();
+	q->progress = q->total = 0;
+	xfer_finish_dirs(q);
+	return ret;
+}
+
+/*
+ * Queue a file for transfer with its source attributes.  A full batch is
+ * transferred before returning.
+ */
+static int
+xfer_queue_add(struct xfer_queue *q, const char *src, const char *dst,
+    Attrib *a)
+{
+	struct xfer_file *f;
+
+	f = xcalloc(1, sizeof(*f));
+	f->src = xstrdup(src);
+	f->dst = xstrdup(dst);
+	f->a = *a;
+	f->fd = -1;
+	if (a->flags & SSH2_FILEXFER_ATTR_SIZE) {
+		f->size = a->size;
+		q->total += a->size;
+	}
+	TAILQ_INSERT_TAIL(&q->queued, f, tq);
+	if (++q->nqueued < XFER_BATCH_MAX)
+		return 0;
+	return xfer_queue_run(q);
+}
+
+/* Queue the attributes of a directory, to be set after its contents */
+static void
+xfer_queue_dir(struct xfer_queue *q, const char *path, Attrib *a)
+{
+	struct xfer_dir *d;
+
+	d = xcalloc(1, sizeof(*d));
+	d->path = xstrdup(path);
+	d->a = *a;
+	TAILQ_INSERT_TAIL(&q->dirs, d, tq);
+}
+
+/* Transfer whatever is still queued and release the queue */
+static int
+xfer_queue_done(struct xfer_queue *q)
+{
+	int ret;
+
+	ret = xfer_queue_run(q);
+	xfer_window_report(&q->win, q->title, q->conn->transfer_buflen);
+	sshbuf_free(q->msg);
+	free(q->data);
+	return ret;
+}
+
 static int
-download_dir_internal(struct sftp_conn *conn, const char *src, const char *dst,
-    int depth, Attrib *dirattrib, int preserve_flag, int print_flag,
-    int resume_flag, int fsync_flag)
+download_dir_internal(struct sftp_conn *conn, struct xfer_queue *q,
+    const char *src, const char *dst, int depth, Attrib *dirattrib,
+    int preserve_flag, int print_flag)
 {
 	int i, ret = 0;
 	SFTP_DIRENT **dir_entries;
@@ -1510,18 +2735,25 @@ download_dir_internal(struct sftp_conn *conn, const char *src, const char *dst,
 			if (strcmp(filename, ".") == 0 ||
 			    strcmp(filename, "..") == 0)
 				continue;
-			if (download_dir_internal(conn, new_src, new_dst,
+			if (download_dir_internal(conn, q, new_src, new_dst,
 			    depth + 1, &(dir_entries[i]->a), preserve_flag,
-			    print_flag, resume_flag, fsync_flag) == -1)
+			    print_flag) == -1)
 				ret = -1;
-		} else if (S_ISREG(dir_entries[i]->a.perm) ) {
+		} else if (S_ISREG(dir_entries[i]->a.perm) && q->resume_flag &&
+		    (conn->exts & SFTP_EXT_CHECK_FILE) &&
+		    access(new_dst, F_OK) == 0) {
+			/* Delta resume compares blocks before fetching any */
 			if (do_download(conn, new_src, new_dst,
-			    &(dir_entries[i]->a), preserve_flag,
-			    resume_flag, fsync_flag) == -1) {
+			    &(dir_entries[i]->a), preserve_flag, 1,
+			    q->fsync_flag) == -1) {
 				error("Download of file %s to %s failed",
 				    new_src, new_dst);
 				ret = -1;
 			}
+		} else if (S_ISREG(dir_entries[i]->a.perm) ) {
+			if (xfer_queue_add(q, new_src, new_dst,
+			    &(dir_entries[i]->a)) == -1)
+				ret = -1;
 		} else
 			logit("%s: not a regular file\n", new_src);
 
@@ -1529,19 +2761,9 @@ download_dir_internal(struct sftp_conn *conn, const char *src, const char *dst,
 	free(new_dst);
 	free(new_src);
 
-	if (preserve_flag) {
-		if (dirattrib->flags & SSH2_FILEXFER_ATTR_ACMODTIME) {
-			struct timeval tv[2];
-			tv[0].tv_sec = dirattrib->atime;
-			tv[1].tv_sec = dirattrib->mtime;
-			tv[0].tv_usec = tv[1].tv_usec = 0;
-			if (utimes(dst, tv) == -1)
-				error("Can't set times on \"%s\": %s",
-				    dst, strerror(errno));
-		} else
-			debug("Server did not send times for directory "
-			    "\"%s\"", dst);
-	}
+	/* Set times once the files queued above have been written */
+	if (preserve_flag)
+		xfer_queue_dir(q, dst, dirattrib);
 
 	free_sftp_dirents(dir_entries);
 
@@ -1553,6 +2775,7 @@ download_dir(struct sftp_conn *conn, const char *src, const char *dst,
     Attrib *dirattrib, int preserve_flag, int print_flag, int resume_flag,
     int fsync_flag)
 {
+	struct xfer_queue q;
 	char *src_canon;
 	int ret;
 
@@ -1561,8 +2784,12 @@ download_dir(struct sftp_conn *conn, const char *src, const char *dst,
 		return -1;
 	}
 
-	ret = download_dir_internal(conn, src_canon, dst, 0,
-	    dirattrib, preserve_flag, print_flag, resume_flag, fsync_flag);
+	xfer_queue_init(&q, conn, 1, src_canon, preserve_flag, resume_flag,
+	    fsync_flag);
+	ret = download_dir_internal(conn, &q, src_canon, dst, 0,
+	    dirattrib, preserve_flag, print_flag);
+	if (xfer_queue_done(&q) == -1)
+		ret = -1;
 	free(src_canon);
 	return ret;
 }
@@ -1586,10 +2813,13 @@ do_upload(struct sftp_conn *conn, const char *local_path,
 		u_int id;
 		u_int len;
 		off_t offset;
+		double sent;
+		u_int64_t delivered;
 		TAILQ_ENTRY(outstanding_ack) tq;
 	};
 	TAILQ_HEAD(ackhead, outstanding_ack) acks;
 	struct outstanding_ack *ack = NULL;
+	struct xfer_window win;
 	size_t handle_len;
 
 	TAILQ_INIT(&acks);
@@ -1665,6 +2895,7 @@ do_upload(struct sftp_conn *conn, const char *local_path,
 
 	startid = ackid = id + 1;
 	data = xmalloc(conn->transfer_buflen);
+	xfer_window_init(&win, conn, conn->transfer_buflen);
 
 	/* Read from local and write to remote */
 	offset = progress_counter = (resume ? c->size : 0);
@@ -1697,6 +2928,8 @@ do_upload(struct sftp_conn *conn, const char *local_path,
 			ack->id = ++id;
 			ack->offset = offset;
 			ack->len = len;
+			ack->sent = monotime_double();
+			ack->delivered = win.delivered;
 			TAILQ_INSERT_TAIL(&acks, ack, tq);
 
 			sshbuf_reset(msg);
@@ -1717,8 +2950,9 @@ do_upload(struct sftp_conn *conn, const char *local_path,
 		if (ack == NULL)
 			fatal("Unexpected ACK %u", id);
 
-		if (id == startid || len == 0 ||
-		    id - ackid >= conn->num_requests) {
+		/* Drain acks until back within the window, which may shrink */
+		while (TAILQ_FIRST(&acks) != NULL &&
+		    (id == startid || len == 0 || id - ackid >= win.cur)) {
 			u_int rid;
 
 			sshbuf_reset(msg);
@@ -1749,6 +2983,8 @@ do_upload(struct sftp_conn *conn, const char *local_path,
 			    ack->id, ack->len, (long long)ack->offset);
 			++ackid;
 			progress_counter += ack->len;
+			xfer_window_ack(&win, ack->sent, ack->delivered,
+			    ack->len, conn->transfer_buflen);
 			free(ack);
 		}
 		offset += len;
@@ -1759,6 +2995,7 @@ do_upload(struct sftp_conn *conn, const char *local_path,
 
 	if (showprogress)
 		stop_progress_meter();
+	xfer_window_report(&win, local_path, conn->transfer_buflen);
 	free(data);
 
 	if (status != SSH2_FX_OK) {
@@ -1789,15 +3026,16 @@ do_upload(struct sftp_conn *conn, const char *local_path,
 }
 
 static int
-upload_dir_internal(struct sftp_conn *conn, const char *src, const char *dst,
-    int depth, int preserve_flag, int print_flag, int resume, int fsync_flag)
+upload_dir_internal(struct sftp_conn *conn, struct xfer_queue *q,
+    const char *src, const char *dst, int depth, int preserve_flag,
+    int print_flag, int resume, int fsync_flag)
 {
 	int ret = 0;
 	DIR *dirp;
 	struct dirent *dp;
 	char *filename, *new_src = NULL, *new_dst = NULL;
 	struct stat sb;
-	Attrib a, *dirattrib;
+	Attrib a, fa, *dirattrib;
 
 	if (depth >= MAX_DIR_DEPTH) {
 		error("Maximum directory depth exceeded: %d levels", depth);
@@ -1861,11 +3099,16 @@ upload_dir_internal(struct sftp_conn *conn, const char *src, const char *dst,
 			    strcmp(filename, "..") == 0)
 				continue;
 
-			if (upload_dir_internal(conn, new_src, new_dst,
+			if (upload_dir_internal(conn, q, new_src, new_dst,
 			    depth + 1, preserve_flag, print_flag, resume,
 			    fsync_flag) == -1)
 				ret = -1;
+		} else if (S_ISREG(sb.st_mode) && !resume) {
+			stat_to_attrib(&sb, &fa);
+			if (xfer_queue_add(q, new_src, new_dst, &fa) == -1)
+				ret = -1;
 		} else if (S_ISREG(sb.st_mode)) {
+			/* Resuming needs the remote size first */
 			if (do_upload(conn, new_src, new_dst,
 			    preserve_flag, resume, fsync_flag) == -1) {
 				error("Uploading of file %s to %s failed!",
@@ -1878,7 +3121,8 @@ upload_dir_internal(struct sftp_conn *conn, const char *src, const char *dst,
 	free(new_dst);
 	free(new_src);
 
-	do_setstat(conn, dst, &a);
+	/* Set attributes once the files queued above have been written */
+	xfer_queue_dir(q, dst, &a);
 
 	(void) closedir(dirp);
 	return ret;
@@ -1888,6 +3132,7 @@ int
 upload_dir(struct sftp_conn *conn, const char *src, const char *dst,
     int preserve_flag, int print_flag, int resume, int fsync_flag)
 {
+	struct xfer_queue q;
 	char *dst_canon;
 	int ret;
 
@@ -1896,8 +3141,11 @@ upload_dir(struct sftp_conn *conn, const char *src, const char *dst,
 		return -1;
 	}
 
-	ret = upload_dir_internal(conn, src, dst_canon, 0, preserve_flag,
+	xfer_queue_init(&q, conn, 0, src, preserve_flag, resume, fsync_flag);
+	ret = upload_dir_internal(conn, &q, src, dst_canon, 0, preserve_flag,
 	    print_flag, resume, fsync_flag);
+	if (xfer_queue_done(&q) == -1)
+		ret = -1;
 
 	free(dst_canon);
 	return ret;
@@ -85,6 +85,9 @@ Attrib *do_stat(struct sftp_conn *, const char *, int);
 /* Get file attributes of 'path' (does not follow symlinks) */
 Attrib *do_lstat(struct sftp_conn *, const char *, int);
 
+/* Get file attributes of open file handle */
+Attrib *do_fstat(struct sftp_conn *, const u_char *, u_int, int);
+
 /* Set file attributes of 'path' */
 int do_setstat(struct sftp_conn *, const char *, Attrib *);
 
@@ -103,6 +106,9 @@ int do_rename(struct sftp_conn *, const char *, const char *, int force_legacy);
 /* Link 'oldpath' to 'newpath' */
 int do_hardlink(struct sftp_conn *, const char *, const char *);
 
+/* Copy 'oldpath' to 'newpath' on the server */
+int do_copy(struct sftp_conn *, const char *, const char *);
+
 /* Rename 'oldpath' to 'newpath' */
 int do_symlink(struct sftp_conn *, const char *, const char *);
 
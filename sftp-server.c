@@ -32,7 +32,11 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <pwd.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -46,11 +50,14 @@
 #include "log.h"
 #include "misc.h"
 #include "match.h"
+#include "digest.h"
 #include "uidswap.h"
 
 #include "sftp.h"
 #include "sftp-common.h"
 
+#include "openbsd-compat/sys-queue.h"
+
 /* Our verbosity */
 static LogLevel log_level = SYSLOG_LEVEL_ERROR;
 
@@ -74,6 +81,9 @@ static int readonly;
 /* Requests that are allowed/denied */
 static char *request_whitelist, *request_blacklist;
 
+/* Number of worker threads for file reads and writes (-w) */
+static int num_workers;
+
 /* portable attributes, etc. */
 typedef struct Stat Stat;
 
@@ -107,6 +117,8 @@ static void process_extended_statvfs(u_int32_t id);
 static void process_extended_fstatvfs(u_int32_t id);
 static void process_extended_hardlink(u_int32_t id);
 static void process_extended_fsync(u_int32_t id);
+static void process_extended_copy_data(u_int32_t id);
+static void process_extended_check_file_blocks(u_int32_t id);
 static void process_extended(u_int32_t id);
 
 struct sftp_handler {
@@ -148,6 +160,10 @@ struct sftp_handler extended_handlers[] = {
 	{ "fstatvfs", "fstatvfs@openssh.com", 0, process_extended_fstatvfs, 0 },
 	{ "hardlink", "hardlink@openssh.com", 0, process_extended_hardlink, 1 },
 	{ "fsync", "fsync@openssh.com", 0, process_extended_fsync, 1 },
+	{ "copy-data", "copy-data@openssh.com", 0,
+	   process_extended_copy_data, 1 },
+	{ "check-file-blocks", "check-file-blocks@openssh.com", 0,
+	   process_extended_check_file_blocks, 0 },
 	{ NULL, NULL, 0, NULL, 0 }
 };
 
@@ -276,6 +292,7 @@ struct Handle {
 	int flags;
 	char *name;
 	u_int64_t bytes_read, bytes_write;
+	u_int io_jobs;		/* reads and writes in progress */
 	int next_unused;
 };
 
@@ -318,6 +335,7 @@ handle_new(int use, const char *name, int fd, int flags, DIR *dirp)
 	handles[i].flags = flags;
 	handles[i].name = xstrdup(name);
 	handles[i].bytes_read = handles[i].bytes_write = 0;
+	handles[i].io_jobs = 0;
 
 	return i;
 }
@@ -571,10 +589,18 @@ static void
 send_names(u_int32_t id, int count, const Stat *stats)
 {
 	struct sshbuf *msg;
+	size_t len = 9;
 	int i, r;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
+	/* Large readdir replies would otherwise be regrown many times */
+	for (i = 0; i < count; i++) {
+		len += 8 + strlen(stats[i].name) +
+		    strlen(stats[i].long_name) + 64;
+	}
+	if ((r = sshbuf_allocate(msg, len)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	if ((r = sshbuf_put_u8(msg, SSH2_FXP_NAME)) != 0 ||
 	    (r = sshbuf_put_u32(msg, id)) != 0 ||
 	    (r = sshbuf_put_u32(msg, count)) != 0)
@@ -666,6 +692,13 @@ process_init(void)
 	    (r = sshbuf_put_cstring(msg, "1")) != 0 || /* version */
 	    /* fsync extension */
 	    (r = sshbuf_put_cstring(msg, "fsync@openssh.com")) != 0 ||
+	    (r = sshbuf_put_cstring(msg, "1")) != 0 || /* version */
+	    /* copy-data extension */
+	    (r = sshbuf_put_cstring(msg, "copy-data@openssh.com")) != 0 ||
+	    (r = sshbuf_put_cstring(msg, "1")) != 0 || /* version */
+	    /* check-file-blocks extension */
+	    (r = sshbuf_put_cstring(msg,
+	    "check-file-blocks@openssh.com")) != 0 ||
 	    (r = sshbuf_put_cstring(msg, "1")) != 0) /* version */
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	send_msg(msg);
@@ -729,12 +762,293 @@ process_close(u_int32_t id)
 	send_status(id, status);
 }
 
+/* Reply to a read that returned ret, with errno set on failure */
+static void
+read_done(u_int32_t id, int handle, const u_char *buf, ssize_t ret)
+{
+	if (ret < 0)
+		send_status(id, errno_to_portable(errno));
+	else if (ret == 0)
+		send_status(id, SSH2_FX_EOF);
+	else {
+		send_data(id, buf, ret);
+		handle_update_read(handle, ret);
+	}
+}
+
+/* Reply to a write of len bytes that returned ret */
+static void
+write_done(u_int32_t id, int handle, size_t len, ssize_t ret)
+{
+	int status;
+
+	if (ret < 0) {
+		error("process_write: write failed");
+		status = errno_to_portable(errno);
+	} else if ((size_t)ret == len) {
+		status = SSH2_FX_OK;
+		handle_update_write(handle, ret);
+	} else {
+		debug2("nothing at all written");
+		status = SSH2_FX_FAILURE;
+	}
+	send_status(id, status);
+}
+
+/*
+ * Worker threads for file I/O (-w).  READ and WRITE requests are handed
+ * to a pool of threads that do nothing but pread(2) and pwrite(2); the
+ * main thread queues each reply when its job completes, so a slow disk
+ * holds up only the requests that wait on it.  A request that depends on
+ * I/O in progress on its handle, such as an overlapping write or a close,
+ * stops the processing of further input until that I/O has finished.
+ * Requests that name a path, such as a rename or a setstat, may refer to
+ * any file being written and so wait until all I/O has finished.
+ */
+#ifdef HAVE_PTHREAD
+
+#define IO_MAX_JOBS	64	/* reads and writes in progress */
+
+struct io_job {
+	u_char type;			/* SSH2_FXP_READ or SSH2_FXP_WRITE */
+	u_int32_t id;
+	int handle, fd, append;
+	u_int64_t off;
+	u_char *data;
+	size_t len;
+	ssize_t ret;
+	int err;
+	TAILQ_ENTRY(io_job) tq;		/* pending or done, under io_lock */
+	TAILQ_ENTRY(io_job) all;	/* main thread only */
+};
+
+static TAILQ_HEAD(, io_job) io_all = TAILQ_HEAD_INITIALIZER(io_all);
+static TAILQ_HEAD(io_list, io_job) io_pending =
+    TAILQ_HEAD_INITIALIZER(io_pending);
+static struct io_list io_done = TAILQ_HEAD_INITIALIZER(io_done);
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static u_int io_njobs;
+static int io_notify[2] = { -1, -1 };
+
+/* Workers must not log or allocate: they only touch the job */
+static void *
+io_worker(void *arg)
+{
+	struct io_job *job;
+	int wake;
+
+	pthread_mutex_lock(&io_lock);
+	for (;;) {
+		while ((job = TAILQ_FIRST(&io_pending)) == NULL)
+			pthread_cond_wait(&io_cond, &io_lock);
+		TAILQ_REMOVE(&io_pending, job, tq);
+		pthread_mutex_unlock(&io_lock);
+
+		do {
+			if (job->type == SSH2_FXP_READ)
+				job->ret = pread(job->fd, job->data, job->len,
+				    job->off);
+			else if (job->append)
+				job->ret = write(job->fd, job->data, job->len);
+			else
+				job->ret = pwrite(job->fd, job->data, job->len,
+				    job->off);
+		} while (job->ret == -1 && errno == EINTR);
+		job->err = errno;
+
+		pthread_mutex_lock(&io_lock);
+		wake = TAILQ_EMPTY(&io_done);
+		TAILQ_INSERT_TAIL(&io_done, job, tq);
+		if (wake)
+			(void)write(io_notify[1], "", 1);
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+static void
+io_start(int n)
+{
+	pthread_t t;
+	sigset_t all, old;
+	int i, r;
+
+	if (pipe(io_notify) == -1)
+		fatal("%s: pipe: %s", __func__, strerror(errno));
+	set_nonblock(io_notify[0]);
+	/* Signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < n; i++) {
+		if ((r = pthread_create(&t, NULL, io_worker, NULL)) != 0)
+			fatal("%s: pthread_create: %s", __func__, strerror(r));
+		pthread_detach(t);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	debug("%s: %d I/O workers", __func__, n);
+}
+
+static void
+io_submit(u_char type, u_int32_t id, int handle, u_int64_t off,
+    u_char *data, size_t len)
+{
+	struct io_job *job;
+
+	job = xcalloc(1, sizeof(*job));
+	job->type = type;
+	job->id = id;
+	job->handle = handle;
+	job->fd = handle_to_fd(handle);
+	job->append = (handle_to_flags(handle) & O_APPEND) != 0;
+	job->off = off;
+	job->data = data;
+	job->len = len;
+	handles[handle].io_jobs++;
+	io_njobs++;
+	TAILQ_INSERT_TAIL(&io_all, job, all);
+
+	pthread_mutex_lock(&io_lock);
+	TAILQ_INSERT_TAIL(&io_pending, job, tq);
+	pthread_cond_signal(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+}
+
+/* Send the replies for completed jobs */
+static void
+io_reap(void)
+{
+	struct io_list done = TAILQ_HEAD_INITIALIZER(done);
+	struct io_job *job;
+	char buf[64];
+
+	while (read(io_notify[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&io_lock);
+	while ((job = TAILQ_FIRST(&io_done)) != NULL) {
+		TAILQ_REMOVE(&io_done, job, tq);
+		TAILQ_INSERT_TAIL(&done, job, tq);
+	}
+	pthread_mutex_unlock(&io_lock);
+
+	while ((job = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, job, tq);
+		TAILQ_REMOVE(&io_all, job, all);
+		io_njobs--;
+		handles[job->handle].io_jobs--;
+		errno = job->err;
+		if (job->type == SSH2_FXP_READ)
+			read_done(job->id, job->handle, job->data, job->ret);
+		else
+			write_done(job->id, job->handle, job->len, job->ret);
+		free(job->data);
+		free(job);
+	}
+}
+
+/*
+ * Returns nonzero if the request in msg must wait for I/O in progress.
+ * Reads may overlap other reads; anything else on a handle with I/O in
+ * progress waits, as does any request not made on a handle.
+ */
+static int
+io_blocked(const u_char *msg, size_t msglen)
+{
+	struct sshbuf *b;
+	struct io_job *job;
+	const u_char *data;
+	char *ext = NULL;
+	u_char type;
+	u_int32_t id, len = 0;
+	u_int64_t off = 0;
+	size_t dlen;
+	int handle = -1, blocked = 0;
+
+	if (io_njobs == 0)
+		return 0;
+	if ((b = sshbuf_from(msg, msglen)) == NULL)
+		fatal("%s: sshbuf_from failed", __func__);
+	/* Malformed requests are left for process() to reject */
+	if (sshbuf_get_u8(b, &type) != 0 || sshbuf_get_u32(b, &id) != 0)
+		goto out;
+	switch (type) {
+	case SSH2_FXP_READ:
+	case SSH2_FXP_WRITE:
+		if (get_handle(b, &handle) != 0 ||
+		    sshbuf_get_u64(b, &off) != 0)
+			goto out;
+		if (type == SSH2_FXP_READ) {
+			if (sshbuf_get_u32(b, &len) != 0)
+				goto out;
+		} else {
+			if (sshbuf_get_string_direct(b, &data, &dlen) != 0)
+				goto out;
+			len = dlen;
+		}
+		if (io_njobs >= IO_MAX_JOBS) {
+			blocked = 1;
+			break;
+		}
+		TAILQ_FOREACH(job, &io_all, all) {
+			if (job->handle != handle ||
+			    (type == SSH2_FXP_READ &&
+			    job->type == SSH2_FXP_READ))
+				continue;
+			if (job->append || (handle_to_flags(handle) & O_APPEND) ||
+			    (off < job->off + job->len && job->off < off + len)) {
+				blocked = 1;
+				break;
+			}
+		}
+		break;
+	case SSH2_FXP_CLOSE:
+	case SSH2_FXP_READDIR:
+	case SSH2_FXP_FSTAT:
+	case SSH2_FXP_FSETSTAT:
+		if (get_handle(b, &handle) == 0 && handle >= 0)
+			blocked = handles[handle].io_jobs > 0;
+		break;
+	case SSH2_FXP_EXTENDED:
+		if (sshbuf_get_cstring(b, &ext, NULL) != 0)
+			goto out;
+		if ((strcmp(ext, "fsync@openssh.com") == 0 ||
+		    strcmp(ext, "fstatvfs@openssh.com") == 0 ||
+		    strcmp(ext, "check-file-blocks@openssh.com") == 0) &&
+		    get_handle(b, &handle) == 0 && handle >= 0)
+			blocked = handles[handle].io_jobs > 0;
+		else if (strcmp(ext, "copy-data@openssh.com") == 0 &&
+		    get_handle(b, &handle) == 0) {
+			/* Either the source or the destination may be busy */
+			if (handle >= 0)
+				blocked = handles[handle].io_jobs > 0;
+			if (!blocked && sshbuf_consume(b, 16) == 0 &&
+			    get_handle(b, &handle) == 0 && handle >= 0)
+				blocked = handles[handle].io_jobs > 0;
+		} else
+			blocked = 1;
+		break;
+	default:
+		blocked = 1;
+		break;
+	}
+ out:
+	if (blocked && handle == -1)
+		debug3("request %u: waiting for all I/O", id);
+	else if (blocked)
+		debug3("request %u: waiting for I/O on handle %d", id, handle);
+	free(ext);
+	sshbuf_free(b);
+	return blocked;
+}
+
+#endif /* HAVE_PTHREAD */
+
 static void
 process_read(u_int32_t id)
 {
 	u_char buf[64*1024];
 	u_int32_t len;
-	int r, handle, fd, ret, status = SSH2_FX_FAILURE;
+	int r, handle, fd;
 	u_int64_t off;
 
 	if ((r = get_handle(iqueue, &handle)) != 0 ||
@@ -748,26 +1062,17 @@ process_read(u_int32_t id)
 		len = sizeof buf;
 		debug2("read change len %d", len);
 	}
-	fd = handle_to_fd(handle);
-	if (fd >= 0) {
-		if (lseek(fd, off, SEEK_SET) < 0) {
-			error("process_read: seek failed");
-			status = errno_to_portable(errno);
-		} else {
-			ret = read(fd, buf, len);
-			if (ret < 0) {
-				status = errno_to_portable(errno);
-			} else if (ret == 0) {
-				status = SSH2_FX_EOF;
-			} else {
-				send_data(id, buf, ret);
-				status = SSH2_FX_OK;
-				handle_update_read(handle, ret);
-			}
-		}
-	}
-	if (status != SSH2_FX_OK)
-		send_status(id, status);
+	if ((fd = handle_to_fd(handle)) < 0)
+		send_status(id, SSH2_FX_FAILURE);
+#ifdef HAVE_PTHREAD
+	else if (num_workers > 0)
+		io_submit(SSH2_FXP_READ, id, handle, off, xmalloc(len), len);
+#endif
+	else if (lseek(fd, off, SEEK_SET) < 0) {
+		error("process_read: seek failed");
+		send_status(id, errno_to_portable(errno));
+	} else
+		read_done(id, handle, buf, read(fd, buf, len));
 }
 
 static void
@@ -775,7 +1080,7 @@ process_write(u_int32_t id)
 {
 	u_int64_t off;
 	size_t len;
-	int r, handle, fd, ret, status;
+	int r, handle, fd;
 	u_char *data;
 
 	if ((r = get_handle(iqueue, &handle)) != 0 ||
@@ -785,31 +1090,22 @@ process_write(u_int32_t id)
 
 	debug("request %u: write \"%s\" (handle %d) off %llu len %zu",
 	    id, handle_to_name(handle), handle, (unsigned long long)off, len);
-	fd = handle_to_fd(handle);
-
-	if (fd < 0)
-		status = SSH2_FX_FAILURE;
-	else {
-		if (!(handle_to_flags(handle) & O_APPEND) &&
-				lseek(fd, off, SEEK_SET) < 0) {
-			status = errno_to_portable(errno);
-			error("process_write: seek failed");
-		} else {
+	if ((fd = handle_to_fd(handle)) < 0)
+		send_status(id, SSH2_FX_FAILURE);
+#ifdef HAVE_PTHREAD
+	else if (num_workers > 0) {
+		io_submit(SSH2_FXP_WRITE, id, handle, off, data, len);
+		return;
+	}
+#endif
+	else if (!(handle_to_flags(handle) & O_APPEND) &&
+	    lseek(fd, off, SEEK_SET) < 0) {
+		send_status(id, errno_to_portable(errno));
+		error("process_write: seek failed");
+	} else {
 /* XXX ATOMICIO ? */
-			ret = write(fd, data, len);
-			if (ret < 0) {
-				error("process_write: write failed");
-				status = errno_to_portable(errno);
-			} else if ((size_t)ret == len) {
-				status = SSH2_FX_OK;
-				handle_update_write(handle, ret);
-			} else {
-				debug2("nothing at all written");
-				status = SSH2_FX_FAILURE;
-			}
-		}
+		write_done(id, handle, len, write(fd, data, len));
 	}
-	send_status(id, status);
 	free(data);
 }
 
@@ -1031,13 +1327,130 @@ process_opendir(u_int32_t id)
 	free(path);
 }
 
+/*
+ * Directory entries read for one SSH2_FXP_NAME reply.  Enough are read to
+ * fill a reply by a generous estimate of their size, then stat()ed in
+ * inode order, which keeps the inode table reads close together.
+ */
+struct readdir_ent {
+	char *name;
+	ino_t ino;
+	long pos;		/* telldir() before reading this entry */
+	int ok;
+	struct stat st;
+};
+
+#define READDIR_ENT_SPACE(namelen)	(2 * (namelen) + 192)
+#define READDIR_MSG_SPACE		(SFTP_MAX_MSG_LENGTH - 1024)
+
+static int
+readdir_ent_cmp(const void *a, const void *b)
+{
+	const struct readdir_ent *ea = *(struct readdir_ent * const *)a;
+	const struct readdir_ent *eb = *(struct readdir_ent * const *)b;
+
+	if (ea->ino == eb->ino)
+		return 0;
+	return ea->ino < eb->ino ? -1 : 1;
+}
+
+/*
+ * Read the next directory entries that fit in one SSH2_FXP_NAME reply
+ * into stats, returning their number or 0 at the end of the directory.
+ */
+static int
+readdir_batch(DIR *dirp, const char *path, Stat **statsp)
+{
+	struct dirent *dp;
+	struct readdir_ent *ents, **byino;
+	Stat *stats;
+	size_t space, len;
+	int nents, maxents, count, i, r;
+	long pos;
+#if !defined(HAVE_FSTATAT) || !defined(HAVE_DIRFD)
+	char pathname[PATH_MAX];
+#endif
+
+ again:
+	space = nents = count = 0;
+	maxents = 64;
+	ents = xcalloc(maxents, sizeof(*ents));
+	for (;;) {
+		pos = telldir(dirp);
+		if ((dp = readdir(dirp)) == NULL)
+			break;
+		space += READDIR_ENT_SPACE(strlen(dp->d_name));
+		if (space > READDIR_MSG_SPACE && nents > 0) {
+			seekdir(dirp, pos);
+			break;
+		}
+		if (nents >= maxents) {
+			maxents *= 2;
+			ents = xreallocarray(ents, maxents, sizeof(*ents));
+		}
+		ents[nents].name = xstrdup(dp->d_name);
+		ents[nents].ino = dp->d_ino;
+		ents[nents].pos = pos;
+		nents++;
+	}
+
+	byino = xcalloc(MAXIMUM(nents, 1), sizeof(*byino));
+	for (i = 0; i < nents; i++)
+		byino[i] = &ents[i];
+	qsort(byino, nents, sizeof(*byino), readdir_ent_cmp);
+	for (i = 0; i < nents; i++) {
+#if defined(HAVE_FSTATAT) && defined(HAVE_DIRFD)
+		r = fstatat(dirfd(dirp), byino[i]->name, &byino[i]->st,
+		    AT_SYMLINK_NOFOLLOW);
+#else
+/* XXX OVERFLOW ? */
+		snprintf(pathname, sizeof pathname, "%s%s%s", path,
+		    strcmp(path, "/") ? "/" : "", byino[i]->name);
+		r = lstat(pathname, &byino[i]->st);
+#endif
+		byino[i]->ok = r == 0;
+	}
+	free(byino);
+
+	/* Reply in directory order, rewinding to what doesn't fit */
+	stats = xcalloc(MAXIMUM(nents, 1), sizeof(Stat));
+	for (i = 0, space = 0; i < nents; i++) {
+		if (!ents[i].ok)
+			continue;
+		stats[count].long_name = ls_file(ents[i].name, &ents[i].st,
+		    0, 0);
+		len = 8 + strlen(ents[i].name) +
+		    strlen(stats[count].long_name) + 64;
+		if (space + len > READDIR_MSG_SPACE && count > 0) {
+			free(stats[count].long_name);
+			seekdir(dirp, ents[i].pos);
+			break;
+		}
+		space += len;
+		stat_to_attrib(&ents[i].st, &(stats[count].attrib));
+		stats[count].name = ents[i].name;
+		ents[i].name = NULL;
+		count++;
+	}
+	for (i = 0; i < nents; i++)
+		free(ents[i].name);
+	free(ents);
+	/* Entries that all vanished before they were stat()ed */
+	if (count == 0 && nents > 0) {
+		free(stats);
+		goto again;
+	}
+	*statsp = stats;
+	return count;
+}
+
 static void
 process_readdir(u_int32_t id)
 {
 	DIR *dirp;
-	struct dirent *dp;
 	char *path;
-	int r, handle;
+	Stat *stats;
+	int r, handle, count, i;
 
 	if ((r = get_handle(iqueue, &handle)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
@@ -1048,43 +1461,18 @@ process_readdir(u_int32_t id)
 	path = handle_to_name(handle);
 	if (dirp == NULL || path == NULL) {
 		send_status(id, SSH2_FX_FAILURE);
-	} else {
-		struct stat st;
-		char pathname[PATH_MAX];
-		Stat *stats;
-		int nstats = 10, count = 0, i;
-
-		stats = xcalloc(nstats, sizeof(Stat));
-		while ((dp = readdir(dirp)) != NULL) {
-			if (count >= nstats) {
-				nstats *= 2;
-				stats = xreallocarray(stats, nstats, sizeof(Stat));
-			}
-/* XXX OVERFLOW ? */
-			snprintf(pathname, sizeof pathname, "%s%s%s", path,
-			    strcmp(path, "/") ? "/" : "", dp->d_name);
-			if (lstat(pathname, &st) < 0)
-				continue;
-			stat_to_attrib(&st, &(stats[count].attrib));
-			stats[count].name = xstrdup(dp->d_name);
-			stats[count].long_name = ls_file(dp->d_name, &st, 0, 0);
-			count++;
-			/* send up to 100 entries in one message */
-			/* XXX check packet size instead */
-			if (count == 100)
-				break;
-		}
-		if (count > 0) {
-			send_names(id, count, stats);
-			for (i = 0; i < count; i++) {
-				free(stats[i].name);
-				free(stats[i].long_name);
-			}
-		} else {
-			send_status(id, SSH2_FX_EOF);
+		return;
+	}
+	if ((count = readdir_batch(dirp, path, &stats)) > 0) {
+		send_names(id, count, stats);
+		for (i = 0; i < count; i++) {
+			free(stats[i].name);
+			free(stats[i].long_name);
 		}
-		free(stats);
+	} else {
+		send_status(id, SSH2_FX_EOF);
 	}
+	free(stats);
 }
 
 static void
@@ -1369,6 +1757,243 @@ process_extended_fsync(u_int32_t id)
 	send_status(id, status);
 }
 
+#define COPY_CHUNK	(64 * 1024 * 1024)	/* per copy_file_range() */
+#define COPY_BUFLEN	(256 * 1024)		/* read/write fallback */
+
+/*
+ * Copy len bytes, or up to EOF if len is 0, from rfd at roff to wfd at
+ * woff (or its end if append is set).  copy_file_range() is used where
+ * possible so the data stays in the kernel and may be cloned by the
+ * filesystem; pread/pwrite take over if it is unsupported for these
+ * files.  Returns an SSH2_FX_* status; *donep is set to the number of
+ * bytes copied.
+ */
+static int
+copy_data(int rfd, off_t roff, u_int64_t len, int wfd, off_t woff,
+    int append, u_int64_t *donep)
+{
+	u_char *buf = NULL;
+	u_int64_t done = 0;
+	size_t want, wlen;
+	ssize_t n, w;
+	int status = SSH2_FX_OK;
+#ifdef HAVE_COPY_FILE_RANGE
+	int use_cfr = !append;
+	off_t ro, wo;
+#endif
+
+	while (len == 0 || done < len) {
+		want = len == 0 ? COPY_CHUNK : MINIMUM(len - done, COPY_CHUNK);
+#ifdef HAVE_COPY_FILE_RANGE
+		if (use_cfr) {
+			ro = roff + done;
+			wo = woff + done;
+			n = copy_file_range(rfd, &ro, wfd, &wo, want, 0);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1 && (errno == ENOSYS || errno == EXDEV ||
+			    errno == EINVAL || errno == EOPNOTSUPP ||
+			    errno == EBADF)) {
+				debug2("%s: copy_file_range: %s, falling back "
+				    "to read/write", __func__, strerror(errno));
+				use_cfr = 0;
+				continue;
+			}
+		} else
+#endif
+		{
+			if (buf == NULL)
+				buf = xmalloc(COPY_BUFLEN);
+			want = MINIMUM(want, COPY_BUFLEN);
+			if ((n = pread(rfd, buf, want, roff + done)) == -1 &&
+			    errno == EINTR)
+				continue;
+			for (wlen = 0; n > 0 && wlen < (size_t)n; wlen += w) {
+				if (append)
+					w = write(wfd, buf + wlen, n - wlen);
+				else
+					w = pwrite(wfd, buf + wlen, n - wlen,
+					    woff + done + wlen);
+				if (w == -1 && errno == EINTR)
+					w = 0;
+				else if (w <= 0) {
+					status = w == 0 ? SSH2_FX_FAILURE :
+					    errno_to_portable(errno);
+					done += wlen;
+					goto out;
+				}
+			}
+		}
+		if (n == -1) {
+			status = errno_to_portable(errno);
+			break;
+		}
+		if (n == 0) {
+			if (len != 0)
+				status = SSH2_FX_EOF;
+			break;
+		}
+		done += n;
+	}
+ out:
+	free(buf);
+	*donep = done;
+	return status;
+}
+
+static void
+process_extended_copy_data(u_int32_t id)
+{
+	int r, rhandle, whandle, rfd, wfd, status = SSH2_FX_FAILURE;
+	u_int64_t roff, rlen, woff, done = 0;
+	struct stat rst, wst;
+
+	if ((r = get_handle(iqueue, &rhandle)) != 0 ||
+	    (r = sshbuf_get_u64(iqueue, &roff)) != 0 ||
+	    (r = sshbuf_get_u64(iqueue, &rlen)) != 0 ||
+	    (r = get_handle(iqueue, &whandle)) != 0 ||
+	    (r = sshbuf_get_u64(iqueue, &woff)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	debug("request %u: copy-data from \"%s\" (handle %d) off %llu "
+	    "len %llu to \"%s\" (handle %d) off %llu", id,
+	    handle_to_name(rhandle), rhandle, (unsigned long long)roff,
+	    (unsigned long long)rlen, handle_to_name(whandle), whandle,
+	    (unsigned long long)woff);
+	rfd = handle_to_fd(rhandle);
+	wfd = handle_to_fd(whandle);
+	if (rfd < 0 || wfd < 0) {
+		status = SSH2_FX_NO_SUCH_FILE;
+		goto out;
+	}
+	if (!handle_is_ok(rhandle, HANDLE_FILE) ||
+	    !handle_is_ok(whandle, HANDLE_FILE))
+		goto out;
+	/* Copying within one file could read back what it just wrote */
+	if (fstat(rfd, &rst) == -1 || fstat(wfd, &wst) == -1) {
+		status = errno_to_portable(errno);
+		goto out;
+	}
+	if (rst.st_dev == wst.st_dev && rst.st_ino == wst.st_ino) {
+		verbose("copy-data: refusing to copy \"%s\" onto itself",
+		    handle_to_name(rhandle));
+		goto out;
+	}
+	status = copy_data(rfd, roff, rlen, wfd, woff,
+	    (handle_to_flags(whandle) & O_APPEND) != 0, &done);
+	handle_update_read(rhandle, done);
+	handle_update_write(whandle, done);
+	debug2("%s: copied %llu bytes", __func__, (unsigned long long)done);
+ out:
+	send_status(id, status);
+}
+
+#define CHECK_FILE_MIN_BLOCK	256
+
+/*
+ * Reply with a digest of each block_size block of the file from offset
+ * for len bytes (or to EOF if len is 0), using the first algorithm in
+ * the client's list that we support.  Only as many digests as fit in a
+ * message are sent; the client asks again for the rest.  The last
+ * block may be short, and no digests are sent for blocks past EOF.
+ */
+static void
+process_extended_check_file_blocks(u_int32_t id)
+{
+	struct sshbuf *msg, *digests;
+	struct ssh_digest_ctx *ctx;
+	u_char buf[64*1024], d[SSH_DIGEST_MAX_LENGTH];
+	char *algs, *cp, *alg, *name = NULL;
+	u_int64_t off, len, end, boff;
+	u_int32_t block_size;
+	size_t dlen, n, maxblocks, nblocks;
+	ssize_t ret = 0;
+	int r, handle, fd, digest = -1;
+
+	if ((r = get_handle(iqueue, &handle)) != 0 ||
+	    (r = sshbuf_get_cstring(iqueue, &algs, NULL)) != 0 ||
+	    (r = sshbuf_get_u64(iqueue, &off)) != 0 ||
+	    (r = sshbuf_get_u64(iqueue, &len)) != 0 ||
+	    (r = sshbuf_get_u32(iqueue, &block_size)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+
+	debug("request %u: check-file-blocks \"%s\" (handle %d) algs \"%s\" "
+	    "off %llu len %llu block %u", id, handle_to_name(handle), handle,
+	    algs, (unsigned long long)off, (unsigned long long)len,
+	    block_size);
+	for (cp = algs; (alg = strsep(&cp, ",")) != NULL; ) {
+		if ((digest = ssh_digest_alg_by_name(alg)) != -1) {
+			name = alg;
+			break;
+		}
+	}
+	if ((fd = handle_to_fd(handle)) < 0 ||
+	    !handle_is_ok(handle, HANDLE_FILE)) {
+		send_status(id, SSH2_FX_FAILURE);
+		goto out;
+	}
+	if (digest == -1 || block_size < CHECK_FILE_MIN_BLOCK) {
+		send_status(id, SSH2_FX_OP_UNSUPPORTED);
+		goto out;
+	}
+	dlen = ssh_digest_bytes(digest);
+	maxblocks = (SFTP_MAX_MSG_LENGTH - 1024) / dlen;
+	end = (len == 0 || off + len < off) ? (u_int64_t)-1 : off + len;
+
+	if ((digests = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	for (nblocks = 0; nblocks < maxblocks && off < end; nblocks++) {
+		if ((ctx = ssh_digest_start(digest)) == NULL)
+			fatal("%s: ssh_digest_start failed", __func__);
+		for (boff = 0; boff < block_size && off + boff < end;
+		    boff += ret) {
+			n = MINIMUM(sizeof(buf), block_size - boff);
+			n = MINIMUM(n, end - (off + boff));
+			if ((ret = pread(fd, buf, n, off + boff)) == -1 &&
+			    errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0)
+				break;
+			if (ssh_digest_update(ctx, buf, ret) != 0)
+				fatal("%s: ssh_digest_update failed", __func__);
+		}
+		if (ret == -1 || boff == 0) {
+			ssh_digest_free(ctx);
+			break;
+		}
+		if (ssh_digest_final(ctx, d, sizeof(d)) != 0)
+			fatal("%s: ssh_digest_final failed", __func__);
+		ssh_digest_free(ctx);
+		if ((r = sshbuf_put(digests, d, dlen)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		handle_update_read(handle, boff);
+		off += boff;
+		/* A short block means EOF */
+		if (boff < block_size)
+			break;
+	}
+	if (ret == -1) {
+		send_status(id, errno_to_portable(errno));
+		sshbuf_free(digests);
+		goto out;
+	}
+	debug2("%s: %zu blocks", __func__, nblocks);
+	if ((msg = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u8(msg, SSH2_FXP_EXTENDED_REPLY)) != 0 ||
+	    (r = sshbuf_put_u32(msg, id)) != 0 ||
+	    (r = sshbuf_put_cstring(msg, name)) != 0 ||
+	    (r = sshbuf_put_stringb(msg, digests)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	send_msg(msg);
+	sshbuf_free(msg);
+	sshbuf_free(digests);
+ out:
+	free(algs);
+}
+
 static void
 process_extended(u_int32_t id)
 {
@@ -1418,6 +2043,10 @@ process(void)
 	}
 	if (buf_len < msg_len + 4)
 		return;
+#ifdef HAVE_PTHREAD
+	if (num_workers > 0 && io_blocked(cp + 4, msg_len))
+		return;
+#endif
 	if ((r = sshbuf_consume(iqueue, 4)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	buf_len -= 4;
@@ -1490,7 +2119,7 @@ sftp_server_usage(void)
 	fprintf(stderr,
 	    "usage: %s [-ehR] [-d start_directory] [-f log_facility] "
 	    "[-l log_level]\n\t[-P blacklisted_requests] "
-	    "[-p whitelisted_requests] [-u umask]\n"
+	    "[-p whitelisted_requests] [-u umask] [-w workers]\n"
 	    "       %s -Q protocol_feature\n",
 	    __progname, __progname);
 	exit(1);
@@ -1502,8 +2131,10 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 	fd_set *rset, *wset;
 	int i, r, in, out, max, ch, skipargs = 0, log_stderr = 0;
 	ssize_t len, olen, set_size;
+	size_t ilen;
 	SyslogFacility log_facility = SYSLOG_FACILITY_AUTH;
 	char *cp, *homedir = NULL, uidstr[32], buf[4*4096];
+	const char *errstr;
 	long mask;
 
 	extern char *optarg;
@@ -1516,7 +2147,7 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 	pw = pwcopy(user_pw);
 
 	while (!skipargs && (ch = getopt(argc, argv,
-	    "d:f:l:P:p:Q:u:cehR")) != -1) {
+	    "d:f:l:P:p:Q:u:w:cehR")) != -1) {
 		switch (ch) {
 		case 'Q':
 			if (strcasecmp(optarg, "requests") != 0) {
@@ -1578,6 +2209,16 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 				fatal("Invalid umask \"%s\"", optarg);
 			(void)umask((mode_t)mask);
 			break;
+		case 'w':
+			num_workers = (int)strtonum(optarg, 0, 256, &errstr);
+			if (errstr != NULL)
+				fatal("Invalid number of workers \"%s\": %s",
+				    optarg, errstr);
+#ifndef HAVE_PTHREAD
+			if (num_workers > 0)
+				fatal("Worker threads are not supported");
+#endif
+			break;
 		case 'h':
 		default:
 			sftp_server_usage();
@@ -1624,6 +2265,13 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 		max = in;
 	if (out > max)
 		max = out;
+#ifdef HAVE_PTHREAD
+	if (num_workers > 0) {
+		io_start(num_workers);
+		if (io_notify[0] > max)
+			max = io_notify[0];
+	}
+#endif
 
 	if ((iqueue = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
@@ -1661,6 +2309,10 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 		olen = sshbuf_len(oqueue);
 		if (olen > 0)
 			FD_SET(out, wset);
+#ifdef HAVE_PTHREAD
+		if (num_workers > 0)
+			FD_SET(io_notify[0], rset);
+#endif
 
 		if (select(max+1, rset, wset, NULL, NULL) < 0) {
 			if (errno == EINTR)
@@ -1695,15 +2347,26 @@ sftp_server_main(int argc, char **argv, struct passwd *user_pw)
 			}
 		}
 
+#ifdef HAVE_PTHREAD
+		if (num_workers > 0 && FD_ISSET(io_notify[0], rset))
+			io_reap();
+#endif
+
 		/*
 		 * Process requests from client if we can fit the results
 		 * into the output buffer, otherwise stop processing input
-		 * and let the output queue drain.
+		 * and let the output queue drain.  Requests handed to the
+		 * I/O workers queue no reply, so keep going while they
+		 * are consumed.
 		 */
-		r = sshbuf_check_reserve(oqueue, SFTP_MAX_MSG_LENGTH);
-		if (r == 0)
+		while ((r = sshbuf_check_reserve(oqueue,
+		    SFTP_MAX_MSG_LENGTH)) == 0) {
+			ilen = sshbuf_len(iqueue);
 			process();
-		else if (r != SSH_ERR_NO_BUFFER_SPACE)
+			if (num_workers == 0 || sshbuf_len(iqueue) == ilen)
+				break;
+		}
+		if (r != 0 && r != SSH_ERR_NO_BUFFER_SPACE)
 			fatal("%s: sshbuf_check_reserve: %s",
 			    __func__, ssh_err(r));
 	}
@@ -72,7 +72,6 @@ typedef void EditLine;
 #include "sftp-client.h"
 
 #define DEFAULT_COPY_BUFLEN	32768	/* Size of buffer for up/download */
-#define DEFAULT_NUM_REQUESTS	64	/* # concurrent outstanding requests */
 
 /* File to read commands from */
 FILE* infile;
@@ -142,6 +141,7 @@ enum sftp_command {
 	I_CHGRP,
 	I_CHMOD,
 	I_CHOWN,
+	I_COPY,
 	I_DF,
 	I_GET,
 	I_HELP,
@@ -185,6 +185,7 @@ static const struct CMD cmds[] = {
 	{ "chgrp",	I_CHGRP,	REMOTE	},
 	{ "chmod",	I_CHMOD,	REMOTE	},
 	{ "chown",	I_CHOWN,	REMOTE	},
+	{ "cp",		I_COPY,		REMOTE	},
 	{ "df",		I_DF,		REMOTE	},
 	{ "dir",	I_LS,		REMOTE	},
 	{ "exit",	I_QUIT,		NOARGS	},
@@ -281,6 +282,7 @@ help(void)
 	    "chgrp grp path                     Change group of file 'path' to 'grp'\n"
 	    "chmod mode path                    Change permissions of file 'path' to 'mode'\n"
 	    "chown own path                     Change owner of file 'path' to 'own'\n"
+	    "cp oldpath newpath                 Copy remote file\n"
 	    "df [-hi] [path]                    Display statistics for current directory or\n"
 	    "                                   filesystem containing 'path'\n"
 	    "exit                               Quit sftp\n"
@@ -1377,6 +1379,7 @@ parse_args(const char **cpp, int *ignore_errors, int *aflag,
 		if ((optidx = parse_rename_flags(cmd, argv, argc, lflag)) == -1)
 			return -1;
 		goto parse_two_paths;
+	case I_COPY:
 	case I_SYMLINK:
 		if ((optidx = parse_no_flags(cmd, argv, argc)) == -1)
 			return -1;
@@ -1539,6 +1542,11 @@ parse_dispatch_command(struct sftp_conn *conn, const char *cmd, char **pwd,
 		path2 = make_absolute(path2, *pwd);
 		err = do_rename(conn, path1, path2, lflag);
 		break;
+	case I_COPY:
+		path1 = make_absolute(path1, *pwd);
+		path2 = make_absolute(path2, *pwd);
+		err = do_copy(conn, path1, path2);
+		break;
 	case I_SYMLINK:
 		sflag = 1;
 	case I_LINK:
@@ -2352,7 +2360,7 @@ main(int argc, char **argv)
 	extern char *optarg;
 	struct sftp_conn *conn;
 	size_t copy_buffer_len = DEFAULT_COPY_BUFLEN;
-	size_t num_requests = DEFAULT_NUM_REQUESTS;
+	size_t num_requests = 0;	/* adaptive */
 	long long limit_kbps = 0;
 
 	ssh_malloc_init();	/* must be called before any mallocs */
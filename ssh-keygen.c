@@ -71,6 +71,9 @@
 #define DEFAULT_BITS		2048
 #define DEFAULT_BITS_DSA	1024
 #define DEFAULT_BITS_ECDSA	256
+
+/* Upper limit for -O threads=N when generating or screening moduli */
+#define MODULI_WORKERS_MAX	1024
 u_int32_t bits = 0;
 
 /*
@@ -197,9 +200,9 @@ char hostname[NI_MAXHOST];
 
 #ifdef WITH_OPENSSL
 /* moduli.c */
-int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *);
+int gen_candidates(FILE *, u_int32_t, u_int32_t, BIGNUM *, u_int);
 int prime_test(FILE *, FILE *, u_int32_t, u_int32_t, char *, unsigned long,
-    unsigned long);
+    unsigned long, u_int);
 #endif
 
 static void
@@ -2317,8 +2320,10 @@ usage(void)
 	    "       ssh-keygen -r hostname [-f input_keyfile] [-g]\n"
 #ifdef WITH_OPENSSL
 	    "       ssh-keygen -G output_file [-v] [-b bits] [-M memory] [-S start_point]\n"
+	    "                  [-O threads=num_threads]\n"
 	    "       ssh-keygen -T output_file -f input_file [-v] [-a rounds] [-J num_lines]\n"
 	    "                  [-j start_line] [-K checkpt] [-W generator]\n"
+	    "                  [-O threads=num_threads]\n"
 #endif
 	    "       ssh-keygen -s ca_key -I certificate_identity [-h] [-U]\n"
 	    "                  [-D pkcs11_provider] [-n principals] [-O option]\n"
@@ -2352,6 +2357,7 @@ main(int argc, char **argv)
 	u_int32_t memory = 0, generator_wanted = 0;
 	int do_gen_candidates = 0, do_screen_candidates = 0;
 	unsigned long start_lineno = 0, lines_to_process = 0;
+	u_int moduli_workers = 1;
 	BIGNUM *start = NULL;
 #endif
 
@@ -2468,6 +2474,17 @@ main(int argc, char **argv)
 			check_krl = 1;
 			break;
 		case 'O':
+#ifdef WITH_OPENSSL
+			/* Moduli option; the rest are for certificates */
+			if (strncasecmp(optarg, "threads=", 8) == 0) {
+				moduli_workers = (u_int)strtonum(optarg + 8,
+				    1, MODULI_WORKERS_MAX, &errstr);
+				if (errstr)
+					fatal("Number of threads is %s: %s",
+					    errstr, optarg + 8);
+				break;
+			}
+#endif
 			add_cert_option(optarg);
 			break;
 		case 'Z':
@@ -2686,7 +2703,8 @@ main(int argc, char **argv)
 		}
 		if (bits == 0)
 			bits = DEFAULT_BITS;
-		if (gen_candidates(out, memory, bits, start) != 0)
+		if (gen_candidates(out, memory, bits, start,
+		    moduli_workers) != 0)
 			fatal("modulus candidate generation failed");
 
 		return (0);
@@ -2711,7 +2729,7 @@ main(int argc, char **argv)
 		}
 		if (prime_test(in, out, rounds == 0 ? 100 : rounds,
 		    generator_wanted, checkpoint,
-		    start_lineno, lines_to_process) != 0)
+		    start_lineno, lines_to_process, moduli_workers) != 0)
 			fatal("modulus screening failed");
 		return (0);
 	}
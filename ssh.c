@@ -733,6 +733,12 @@ main(int ac, char **av)
 				cp = mac_alg_list('\n');
 			else if (strcmp(optarg, "kex") == 0)
 				cp = kex_alg_list('\n');
+			else if (strcmp(optarg, "compression") == 0) {
+				cp = xstrdup(compression_alg_list(0));
+				for (p = cp; *p != '\0'; p++)
+					if (*p == ',')
+						*p = '\n';
+			}
 			else if (strcmp(optarg, "key") == 0)
 				cp = sshkey_alg_list(0, 0, 0, '\n');
 			else if (strcmp(optarg, "key-cert") == 0)
@@ -1208,6 +1214,9 @@ main(int ac, char **av)
 	if (options.port == 0)
 		options.port = default_ssh_port();
 	channel_set_af(ssh, options.address_family);
+	channel_set_window_budget(ssh, options.channel_window_budget);
+	sshbuf_pool_enable(options.buffer_pool);
+	channel_set_zerocopy(ssh, options.zerocopy_forwarding);
 
 	/* Tidy and check options */
 	if (options.host_key_alias != NULL)
@@ -19,15 +19,180 @@
 #include "includes.h"
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "ssherr.h"
 #include "sshbuf.h"
 #include "misc.h"
 
+/*
+ * Optional pool of buffer memory, see sshbuf_pool_enable().  Freed data
+ * blocks are kept on free lists by power-of-two size class, from
+ * SSHBUF_SIZE_INIT up to SSHBUF_POOL_MAX_BLOCK bytes, as are freed
+ * sshbuf structures.  Blocks are zeroed before they are cached, so one
+ * taken from the pool is as clean as a fresh calloc().
+ */
+#define SSHBUF_POOL_CLASSES	12	/* SSHBUF_SIZE_INIT << 0 .. 11 */
+#define SSHBUF_POOL_MAX_BLOCK	(SSHBUF_SIZE_INIT << (SSHBUF_POOL_CLASSES - 1))
+#define SSHBUF_POOL_DEPTH	16	/* Blocks cached per class */
+#define SSHBUF_POOL_MAX_BYTES	(4 * 1024 * 1024) /* Bytes cached in all */
+#define SSHBUF_POOL_STRUCTS	64	/* Structures cached */
+#define SSHBUF_POOL_KEEP	(64 * 1024) /* Kept by sshbuf_reset() */
+
+#define SSHBUF_IOV_MAX		16	/* Segments written at once */
+
+struct pool_block {
+	struct pool_block *next;
+};
+
+static struct {
+	int enabled;
+	struct pool_block *blocks[SSHBUF_POOL_CLASSES];
+	u_int nblocks[SSHBUF_POOL_CLASSES];
+	size_t cached;
+	struct sshbuf *structs;		/* Linked through parent */
+	u_int nstructs;
+} pool;
+
+static struct sshbuf_stats stats;
+
+/* Returns the size class for len bytes, or -1 if it has none */
+static int
+pool_class(size_t len)
+{
+	int c;
+
+	for (c = 0; c < SSHBUF_POOL_CLASSES; c++) {
+		if (len <= (size_t)SSHBUF_SIZE_INIT << c)
+			return c;
+	}
+	return -1;
+}
+
+/*
+ * Returns zeroed memory of at least *lenp bytes, updating *lenp to the
+ * size of its class if that does not exceed max.
+ */
+static u_char *
+pool_get(size_t *lenp, size_t max)
+{
+	struct pool_block *b;
+	int c;
+
+	if (pool.enabled && (c = pool_class(*lenp)) != -1 &&
+	    ((size_t)SSHBUF_SIZE_INIT << c) <= max) {
+		*lenp = (size_t)SSHBUF_SIZE_INIT << c;
+		if ((b = pool.blocks[c]) != NULL) {
+			pool.blocks[c] = b->next;
+			pool.nblocks[c]--;
+			pool.cached -= *lenp;
+			b->next = NULL;
+			stats.reuses++;
+			return (u_char *)b;
+		}
+	}
+	stats.allocs++;
+	return calloc(1, *lenp);
+}
+
+/* Clears memory from pool_get() and caches or frees it */
+static void
+pool_put(u_char *d, size_t len)
+{
+	struct pool_block *b = (struct pool_block *)d;
+	int c;
+
+	if (d == NULL)
+		return;
+	explicit_bzero(d, len);
+	if (pool.enabled && (c = pool_class(len)) != -1 &&
+	    len == (size_t)SSHBUF_SIZE_INIT << c &&
+	    pool.nblocks[c] < SSHBUF_POOL_DEPTH &&
+	    pool.cached + len <= SSHBUF_POOL_MAX_BYTES) {
+		b->next = pool.blocks[c];
+		pool.blocks[c] = b;
+		pool.nblocks[c]++;
+		pool.cached += len;
+		return;
+	}
+	stats.frees++;
+	free(d);
+}
+
+static struct sshbuf *
+pool_get_struct(void)
+{
+	struct sshbuf *ret;
+
+	if ((ret = pool.structs) != NULL) {
+		pool.structs = ret->parent;
+		pool.nstructs--;
+		ret->parent = NULL;
+		stats.reuses++;
+		return ret;
+	}
+	stats.allocs++;
+	return calloc(sizeof(*ret), 1);
+}
+
+static void
+pool_put_struct(struct sshbuf *buf)
+{
+	explicit_bzero(buf, sizeof(*buf));
+	if (pool.enabled && pool.nstructs < SSHBUF_POOL_STRUCTS) {
+		buf->parent = pool.structs;
+		pool.structs = buf;
+		pool.nstructs++;
+		return;
+	}
+	stats.frees++;
+	free(buf);
+}
+
+static void
+pool_flush(void)
+{
+	struct pool_block *b;
+	struct sshbuf *buf;
+	int c;
+
+	for (c = 0; c < SSHBUF_POOL_CLASSES; c++) {
+		while ((b = pool.blocks[c]) != NULL) {
+			pool.blocks[c] = b->next;
+			stats.frees++;
+			free(b);
+		}
+		pool.nblocks[c] = 0;
+	}
+	pool.cached = 0;
+	while ((buf = pool.structs) != NULL) {
+		pool.structs = buf->parent;
+		stats.frees++;
+		free(buf);
+	}
+	pool.nstructs = 0;
+}
+
+void
+sshbuf_pool_enable(int enable)
+{
+	if (!enable)
+		pool_flush();
+	pool.enabled = enable;
+}
+
+void
+sshbuf_get_stats(struct sshbuf_stats *st)
+{
+	*st = stats;
+}
+
 static inline int
 sshbuf_check_sanity(const struct sshbuf *buf)
 {
@@ -39,7 +204,8 @@ sshbuf_check_sanity(const struct sshbuf *buf)
 	    buf->max_size > SSHBUF_SIZE_MAX ||
 	    buf->alloc > buf->max_size ||
 	    buf->size > buf->alloc ||
-	    buf->off > buf->size)) {
+	    buf->off > buf->size ||
+	    (buf->segs == NULL) != (buf->segdata == 0))) {
 		/* Do not try to recover from corrupted buffer internals */
 		SSHBUF_DBG(("SSH_ERR_INTERNAL_ERROR"));
 		signal(SIGSEGV, SIG_DFL);
@@ -59,26 +225,165 @@ sshbuf_maybe_pack(struct sshbuf *buf, int force)
 	if (force ||
 	    (buf->off >= SSHBUF_PACK_MIN && buf->off >= buf->size / 2)) {
 		memmove(buf->d, buf->d + buf->off, buf->size - buf->off);
+		stats.copied += buf->size - buf->off;
 		buf->size -= buf->off;
 		buf->off = 0;
 		SSHBUF_TELL("packed");
 	}
 }
 
+/*
+ * Moves the contents of buf to a new allocation of at least rlen and at
+ * most max bytes.  With the pool enabled, the data is also packed to the
+ * start.
+ */
+static int
+sshbuf_realloc(struct sshbuf *buf, size_t rlen, size_t max)
+{
+	u_char *dp;
+	size_t len = buf->size - buf->off;
+
+	if (!pool.enabled) {
+		if ((dp = recallocarray(buf->d, buf->alloc, rlen, 1)) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		stats.allocs++;
+		stats.frees++;
+		stats.copied += MINIMUM(buf->alloc, rlen);
+		buf->cd = buf->d = dp;
+		buf->alloc = rlen;
+		return 0;
+	}
+	if ((dp = pool_get(&rlen, max)) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	memcpy(dp, buf->d + buf->off, len);
+	stats.copied += len;
+	pool_put(buf->d, buf->alloc);
+	buf->cd = buf->d = dp;
+	buf->alloc = rlen;
+	buf->off = 0;
+	buf->size = len;
+	return 0;
+}
+
+/* Segmented buffers: see sshbuf_set_segmented() */
+
+static int
+sshbuf_seg_new(struct sshbuf *buf, size_t len, struct sshbuf **segp)
+{
+	struct sshbuf *seg;
+
+	*segp = NULL;
+	if ((seg = pool_get_struct()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	/* len never exceeds max_size, having passed sshbuf_check_reserve() */
+	seg->alloc = MINIMUM(ROUNDUP(MAXIMUM(len, buf->segsize),
+	    SSHBUF_SIZE_INC), buf->max_size);
+	seg->max_size = buf->max_size;
+	seg->refcount = 1;
+	if ((seg->cd = seg->d = pool_get(&seg->alloc, seg->max_size)) == NULL) {
+		pool_put_struct(seg);
+		return SSH_ERR_ALLOC_FAIL;
+	}
+	*segp = seg;
+	return 0;
+}
+
+static void
+sshbuf_seg_append(struct sshbuf *buf, struct sshbuf *seg)
+{
+	if (buf->lastseg == NULL)
+		buf->segs = seg;
+	else
+		buf->lastseg->next = seg;
+	buf->lastseg = seg;
+	buf->segdata += seg->size - seg->off;
+}
+
+static void
+sshbuf_seg_free(struct sshbuf *buf)
+{
+	struct sshbuf *seg;
+
+	while ((seg = buf->segs) != NULL) {
+		buf->segs = seg->next;
+		sshbuf_free(seg);
+	}
+	buf->lastseg = NULL;
+	buf->segdata = 0;
+}
+
+/*
+ * Replaces the storage of buf with that of its first segment and returns
+ * that segment, which now holds the old storage and its data.
+ */
+static struct sshbuf *
+sshbuf_seg_promote(struct sshbuf *buf)
+{
+	struct sshbuf *seg = buf->segs;
+	u_char *d = buf->d;
+	size_t alloc = buf->alloc, off = buf->off, size = buf->size;
+
+	if ((buf->segs = seg->next) == NULL)
+		buf->lastseg = NULL;
+	buf->segdata -= seg->size - seg->off;
+	buf->cd = buf->d = seg->d;
+	buf->off = seg->off;
+	buf->size = seg->size;
+	buf->alloc = seg->alloc;
+	seg->cd = seg->d = d;
+	seg->off = off;
+	seg->size = size;
+	seg->alloc = alloc;
+	seg->next = NULL;
+	return seg;
+}
+
+/* Joins the segments of buf into its contiguous storage */
+static int
+sshbuf_seg_join(struct sshbuf *buf)
+{
+	struct sshbuf *seg;
+	size_t len, rlen;
+	int r;
+
+	if (buf->segs == NULL)
+		return 0;
+	SSHBUF_TELL("pre-join");
+	len = buf->size - buf->off + buf->segdata;
+	sshbuf_maybe_pack(buf, 1);
+	if (len > buf->alloc) {
+		rlen = MINIMUM(ROUNDUP(len, SSHBUF_SIZE_INC), buf->max_size);
+		if ((r = sshbuf_realloc(buf, rlen, buf->max_size)) != 0)
+			return r;
+	}
+	while ((seg = buf->segs) != NULL) {
+		len = seg->size - seg->off;
+		memcpy(buf->d + buf->size, seg->cd + seg->off, len);
+		stats.copied += len;
+		buf->size += len;
+		buf->segs = seg->next;
+		sshbuf_free(seg);
+	}
+	buf->lastseg = NULL;
+	buf->segdata = 0;
+	SSHBUF_TELL("joined");
+	return 0;
+}
+
 struct sshbuf *
 sshbuf_new(void)
 {
 	struct sshbuf *ret;
 
-	if ((ret = calloc(sizeof(*ret), 1)) == NULL)
+	if ((ret = pool_get_struct()) == NULL)
 		return NULL;
 	ret->alloc = SSHBUF_SIZE_INIT;
 	ret->max_size = SSHBUF_SIZE_MAX;
 	ret->readonly = 0;
 	ret->refcount = 1;
 	ret->parent = NULL;
-	if ((ret->cd = ret->d = calloc(1, ret->alloc)) == NULL) {
-		free(ret);
+	if ((ret->cd = ret->d = pool_get(&ret->alloc, ret->max_size)) == NULL) {
+		pool_put_struct(ret);
 		return NULL;
 	}
 	return ret;
@@ -90,7 +395,7 @@ sshbuf_from(const void *blob, size_t len)
 	struct sshbuf *ret;
 
 	if (blob == NULL || len > SSHBUF_SIZE_MAX ||
-	    (ret = calloc(sizeof(*ret), 1)) == NULL)
+	    (ret = pool_get_struct()) == NULL)
 		return NULL;
 	ret->alloc = ret->size = ret->max_size = len;
 	ret->readonly = 1;
@@ -157,33 +462,30 @@ sshbuf_free(struct sshbuf *buf)
 	buf->refcount--;
 	if (buf->refcount > 0)
 		return;
-	if (!buf->readonly) {
-		explicit_bzero(buf->d, buf->alloc);
-		free(buf->d);
-	}
-	explicit_bzero(buf, sizeof(*buf));
-	free(buf);
+	sshbuf_seg_free(buf);
+	if (!buf->readonly)
+		pool_put(buf->d, buf->alloc);
+	pool_put_struct(buf);
 }
 
 void
 sshbuf_reset(struct sshbuf *buf)
 {
-	u_char *d;
-
 	if (buf->readonly || buf->refcount > 1) {
 		/* Nonsensical. Just make buffer appear empty */
 		buf->off = buf->size;
 		return;
 	}
 	(void) sshbuf_check_sanity(buf);
+	sshbuf_seg_free(buf);
 	buf->off = buf->size = 0;
-	if (buf->alloc != SSHBUF_SIZE_INIT) {
-		if ((d = recallocarray(buf->d, buf->alloc, SSHBUF_SIZE_INIT,
-		    1)) != NULL) {
-			buf->cd = buf->d = d;
-			buf->alloc = SSHBUF_SIZE_INIT;
-		}
+	if (pool.enabled && buf->alloc <= SSHBUF_POOL_KEEP) {
+		/* Keep the memory for the next use of the buffer */
+		explicit_bzero(buf->d, buf->alloc);
+		return;
 	}
+	if (buf->alloc != SSHBUF_SIZE_INIT)
+		(void)sshbuf_realloc(buf, SSHBUF_SIZE_INIT, SSHBUF_SIZE_INIT);
 	explicit_bzero(buf->d, SSHBUF_SIZE_INIT);
 }
 
@@ -215,7 +517,6 @@ int
 sshbuf_set_max_size(struct sshbuf *buf, size_t max_size)
 {
 	size_t rlen;
-	u_char *dp;
 	int r;
 
 	SSHBUF_DBG(("set max buf = %p len = %zu", buf, max_size));
@@ -227,6 +528,8 @@ sshbuf_set_max_size(struct sshbuf *buf, size_t max_size)
 		return SSH_ERR_BUFFER_READ_ONLY;
 	if (max_size > SSHBUF_SIZE_MAX)
 		return SSH_ERR_NO_BUFFER_SPACE;
+	if ((r = sshbuf_seg_join(buf)) != 0)
+		return r;
 	/* pack and realloc if necessary */
 	sshbuf_maybe_pack(buf, max_size < buf->size);
 	if (max_size < buf->alloc && max_size > buf->size) {
@@ -237,10 +540,8 @@ sshbuf_set_max_size(struct sshbuf *buf, size_t max_size)
 		if (rlen > max_size)
 			rlen = max_size;
 		SSHBUF_DBG(("new alloc = %zu", rlen));
-		if ((dp = recallocarray(buf->d, buf->alloc, rlen, 1)) == NULL)
-			return SSH_ERR_ALLOC_FAIL;
-		buf->cd = buf->d = dp;
-		buf->alloc = rlen;
+		if ((r = sshbuf_realloc(buf, rlen, max_size)) != 0)
+			return r;
 	}
 	SSHBUF_TELL("new-max");
 	if (max_size < buf->alloc)
@@ -254,7 +555,7 @@ sshbuf_len(const struct sshbuf *buf)
 {
 	if (sshbuf_check_sanity(buf) != 0)
 		return 0;
-	return buf->size - buf->off;
+	return buf->size - buf->off + buf->segdata;
 }
 
 size_t
@@ -262,13 +563,15 @@ sshbuf_avail(const struct sshbuf *buf)
 {
 	if (sshbuf_check_sanity(buf) != 0 || buf->readonly || buf->refcount > 1)
 		return 0;
-	return buf->max_size - (buf->size - buf->off);
+	return buf->max_size - (buf->size - buf->off + buf->segdata);
 }
 
 const u_char *
 sshbuf_ptr(const struct sshbuf *buf)
 {
-	if (sshbuf_check_sanity(buf) != 0)
+	/* Joining segments leaves the contents unchanged */
+	if (sshbuf_check_sanity(buf) != 0 ||
+	    sshbuf_seg_join((struct sshbuf *)buf) != 0)
 		return NULL;
 	return buf->cd + buf->off;
 }
@@ -276,11 +579,22 @@ sshbuf_ptr(const struct sshbuf *buf)
 u_char *
 sshbuf_mutable_ptr(const struct sshbuf *buf)
 {
-	if (sshbuf_check_sanity(buf) != 0 || buf->readonly || buf->refcount > 1)
+	if (sshbuf_check_sanity(buf) != 0 || buf->readonly || buf->refcount > 1 ||
+	    sshbuf_seg_join((struct sshbuf *)buf) != 0)
 		return NULL;
 	return buf->d + buf->off;
 }
 
+const u_char *
+sshbuf_peek(const struct sshbuf *buf, size_t *lenp)
+{
+	*lenp = 0;
+	if (sshbuf_check_sanity(buf) != 0)
+		return NULL;
+	*lenp = buf->size - buf->off;
+	return buf->cd + buf->off;
+}
+
 int
 sshbuf_check_reserve(const struct sshbuf *buf, size_t len)
 {
@@ -292,7 +606,8 @@ sshbuf_check_reserve(const struct sshbuf *buf, size_t len)
 		return SSH_ERR_BUFFER_READ_ONLY;
 	SSHBUF_TELL("check");
 	/* Check that len is reasonable and that max_size + available < len */
-	if (len > buf->max_size || buf->max_size - len < buf->size - buf->off)
+	if (len > buf->max_size ||
+	    buf->max_size - len < buf->size - buf->off + buf->segdata)
 		return SSH_ERR_NO_BUFFER_SPACE;
 	return 0;
 }
@@ -301,7 +616,6 @@ int
 sshbuf_allocate(struct sshbuf *buf, size_t len)
 {
 	size_t rlen, need;
-	u_char *dp;
 	int r;
 
 	SSHBUF_DBG(("allocate buf = %p len = %zu", buf, len));
@@ -322,16 +636,17 @@ sshbuf_allocate(struct sshbuf *buf, size_t len)
 	 */
 	need = len + buf->size - buf->alloc;
 	rlen = ROUNDUP(buf->alloc + need, SSHBUF_SIZE_INC);
+	/* Pooled buffers grow geometrically */
+	if (pool.enabled)
+		rlen = MAXIMUM(rlen, buf->alloc * 2);
 	SSHBUF_DBG(("need %zu initial rlen %zu", need, rlen));
 	if (rlen > buf->max_size)
 		rlen = buf->alloc + need;
 	SSHBUF_DBG(("adjusted rlen %zu", rlen));
-	if ((dp = recallocarray(buf->d, buf->alloc, rlen, 1)) == NULL) {
+	if ((r = sshbuf_realloc(buf, rlen, buf->max_size)) != 0) {
 		SSHBUF_DBG(("realloc fail"));
-		return SSH_ERR_ALLOC_FAIL;
+		return r;
 	}
-	buf->alloc = rlen;
-	buf->cd = buf->d = dp;
 	if ((r = sshbuf_check_reserve(buf, len)) < 0) {
 		/* shouldn't fail */
 		return r;
@@ -340,6 +655,30 @@ sshbuf_allocate(struct sshbuf *buf, size_t len)
 	return 0;
 }
 
+static int
+sshbuf_seg_reserve(struct sshbuf *buf, size_t len, u_char **dpp)
+{
+	struct sshbuf *seg = buf->lastseg;
+	int r;
+
+	if ((r = sshbuf_check_reserve(buf, len)) != 0)
+		return r;
+	if (seg == NULL || seg->size + len > seg->alloc) {
+		if ((r = sshbuf_seg_new(buf, len, &seg)) != 0)
+			return r;
+		if (dpp != NULL)
+			*dpp = seg->d;
+		seg->size = len;
+		sshbuf_seg_append(buf, seg);
+		return 0;
+	}
+	if (dpp != NULL)
+		*dpp = seg->d + seg->size;
+	seg->size += len;
+	buf->segdata += len;
+	return 0;
+}
+
 int
 sshbuf_reserve(struct sshbuf *buf, size_t len, u_char **dpp)
 {
@@ -350,6 +689,13 @@ sshbuf_reserve(struct sshbuf *buf, size_t len, u_char **dpp)
 		*dpp = NULL;
 
 	SSHBUF_DBG(("reserve buf = %p len = %zu", buf, len));
+	/*
+	 * Segmented buffers append to a segment rather than moving data
+	 * that has yet to be consumed.
+	 */
+	if (buf->segsize != 0 && (buf->segs != NULL ||
+	    (buf->off < buf->size && buf->size + len > buf->alloc)))
+		return sshbuf_seg_reserve(buf, len, dpp);
 	if ((r = sshbuf_allocate(buf, len)) != 0)
 		return r;
 
@@ -363,6 +709,7 @@ sshbuf_reserve(struct sshbuf *buf, size_t len, u_char **dpp)
 int
 sshbuf_consume(struct sshbuf *buf, size_t len)
 {
+	size_t n;
 	int r;
 
 	SSHBUF_DBG(("len = %zu", len));
@@ -372,7 +719,14 @@ sshbuf_consume(struct sshbuf *buf, size_t len)
 		return 0;
 	if (len > sshbuf_len(buf))
 		return SSH_ERR_MESSAGE_INCOMPLETE;
-	buf->off += len;
+	for (;;) {
+		n = MINIMUM(len, buf->size - buf->off);
+		buf->off += n;
+		len -= n;
+		if (buf->off < buf->size || buf->segs == NULL)
+			break;
+		sshbuf_free(sshbuf_seg_promote(buf));
+	}
 	/* deal with empty buffer */
 	if (buf->off == buf->size)
 		buf->off = buf->size = 0;
@@ -392,8 +746,160 @@ sshbuf_consume_end(struct sshbuf *buf, size_t len)
 		return 0;
 	if (len > sshbuf_len(buf))
 		return SSH_ERR_MESSAGE_INCOMPLETE;
+	if ((r = sshbuf_seg_join(buf)) != 0)
+		return r;
 	buf->size -= len;
 	SSHBUF_TELL("done");
 	return 0;
 }
 
+
+int
+sshbuf_set_segmented(struct sshbuf *buf, size_t segsize)
+{
+	int r;
+
+	if ((r = sshbuf_check_sanity(buf)) != 0)
+		return r;
+	if (buf->readonly || buf->refcount > 1)
+		return SSH_ERR_BUFFER_READ_ONLY;
+	if (segsize > buf->max_size)
+		return SSH_ERR_NO_BUFFER_SPACE;
+	if (segsize == 0 && (r = sshbuf_seg_join(buf)) != 0)
+		return r;
+	buf->segsize = segsize;
+	return 0;
+}
+
+int
+sshbuf_take_head(struct sshbuf *buf, struct sshbuf **headp)
+{
+	struct sshbuf *head;
+	size_t alloc = SSHBUF_SIZE_INIT;
+	u_char *d;
+	int r;
+
+	*headp = NULL;
+	if ((r = sshbuf_check_sanity(buf)) != 0)
+		return r;
+	if (buf->readonly || buf->refcount > 1)
+		return SSH_ERR_BUFFER_READ_ONLY;
+	if (buf->off == buf->size)
+		return SSH_ERR_MESSAGE_INCOMPLETE;
+	if (buf->segs != NULL) {
+		/* The first segment becomes the new head */
+		head = sshbuf_seg_promote(buf);
+	} else {
+		if ((head = pool_get_struct()) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		if ((d = pool_get(&alloc, buf->max_size)) == NULL) {
+			pool_put_struct(head);
+			return SSH_ERR_ALLOC_FAIL;
+		}
+		head->cd = head->d = buf->d;
+		head->off = buf->off;
+		head->size = buf->size;
+		head->alloc = buf->alloc;
+		buf->cd = buf->d = d;
+		buf->off = buf->size = 0;
+		buf->alloc = alloc;
+	}
+	head->max_size = buf->max_size;
+	head->refcount = 1;
+	*headp = head;
+	SSHBUF_TELL("head taken");
+	return 0;
+}
+
+int
+sshbuf_read(int fd, struct sshbuf *buf, size_t maxlen, size_t *rlen)
+{
+	struct sshbuf *tail, *seg = NULL;
+	struct iovec iov[2];
+	size_t room;
+	ssize_t n;
+	u_char *d;
+	int r, oerrno, niov = 0;
+
+	if (rlen != NULL)
+		*rlen = 0;
+	if ((r = sshbuf_check_reserve(buf, maxlen)) != 0)
+		return r;
+	if (buf->segsize == 0 || sshbuf_len(buf) == 0) {
+		/* Read into contiguous space at the end of the buffer */
+		if ((r = sshbuf_reserve(buf, maxlen, &d)) != 0)
+			return r;
+		n = read(fd, d, maxlen);
+		oerrno = errno;
+		if ((r = sshbuf_consume_end(buf,
+		    maxlen - (n < 0 ? 0 : n))) != 0)
+			return r;
+		goto out;
+	}
+	/* Fill the last segment and spill into a new one */
+	tail = buf->lastseg != NULL ? buf->lastseg : buf;
+	room = MINIMUM(tail->alloc - tail->size, maxlen);
+	if (room > 0) {
+		iov[niov].iov_base = tail->d + tail->size;
+		iov[niov++].iov_len = room;
+	}
+	if (room < maxlen) {
+		if ((r = sshbuf_seg_new(buf, maxlen - room, &seg)) != 0)
+			return r;
+		iov[niov].iov_base = seg->d;
+		iov[niov++].iov_len = maxlen - room;
+	}
+	n = readv(fd, iov, niov);
+	oerrno = errno;
+	if (n > 0) {
+		tail->size += MINIMUM((size_t)n, room);
+		if (tail != buf)
+			buf->segdata += MINIMUM((size_t)n, room);
+		if ((size_t)n > room) {
+			seg->size = n - room;
+			sshbuf_seg_append(buf, seg);
+			seg = NULL;
+		}
+	}
+	sshbuf_free(seg);
+ out:
+	errno = oerrno;
+	if (n < 0)
+		return SSH_ERR_SYSTEM_ERROR;
+	if (rlen != NULL)
+		*rlen = n;
+	return 0;
+}
+
+int
+sshbuf_write(int fd, struct sshbuf *buf, size_t maxlen, size_t *wlen)
+{
+	struct sshbuf *seg;
+	struct iovec iov[SSHBUF_IOV_MAX];
+	size_t len;
+	ssize_t n;
+	int r, niov = 0;
+
+	if (wlen != NULL)
+		*wlen = 0;
+	if ((r = sshbuf_check_sanity(buf)) != 0)
+		return r;
+	len = MINIMUM(buf->size - buf->off, maxlen);
+	iov[niov].iov_base = (u_char *)buf->cd + buf->off;
+	iov[niov++].iov_len = len;
+	maxlen -= len;
+	for (seg = buf->segs; seg != NULL && maxlen > 0 &&
+	    niov < SSHBUF_IOV_MAX; seg = seg->next) {
+		len = MINIMUM(seg->size - seg->off, maxlen);
+		iov[niov].iov_base = (u_char *)seg->cd + seg->off;
+		iov[niov++].iov_len = len;
+		maxlen -= len;
+	}
+	if ((n = writev(fd, iov, niov)) < 0)
+		return SSH_ERR_SYSTEM_ERROR;
+	if ((r = sshbuf_consume(buf, n)) != 0)
+		return r;
+	if (wlen != NULL)
+		*wlen = n;
+	return 0;
+}
@@ -48,6 +48,11 @@ struct sshbuf {
 	int dont_free;		/* Kludge to support sshbuf_init */
 	u_int refcount;		/* Tracks self and number of child buffers */
 	struct sshbuf *parent;	/* If child, pointer to parent */
+	size_t segsize;		/* Segment size if segmented, else 0 */
+	size_t segdata;		/* Bytes held in segments after buf->d */
+	struct sshbuf *segs;	/* Segments holding later data */
+	struct sshbuf *lastseg;	/* Last segment, where data is appended */
+	struct sshbuf *next;	/* If segment, pointer to next segment */
 };
 
 /*
@@ -89,6 +94,68 @@ void	sshbuf_free(struct sshbuf *buf);
  */
 void	sshbuf_reset(struct sshbuf *buf);
 
+/*
+ * Enable or disable the pool of buffer memory for this process.  While
+ * enabled, freed buffers are cached by size class for reuse, growing
+ * buffers double in size and reset buffers keep up to 64KB.  Disabling
+ * releases the cached memory.
+ */
+void	sshbuf_pool_enable(int enable);
+
+/* Counters of the memory management done for buffers */
+struct sshbuf_stats {
+	u_int64_t allocs;	/* Allocations from the system */
+	u_int64_t frees;	/* Memory returned to the system */
+	u_int64_t reuses;	/* Allocations satisfied from the pool */
+	u_int64_t copied;	/* Bytes moved to grow or pack buffers */
+};
+
+void	sshbuf_get_stats(struct sshbuf_stats *stats);
+
+/*
+ * Switch buf to store data appended while it is not empty in a chain of
+ * segments of at least segsize bytes, so that data consumed from the
+ * start is never moved to make room at the end.  The contiguous API keeps
+ * working: sshbuf_ptr() and the functions that parse the buffer join the
+ * segments first.  A segsize of 0 returns buf to contiguous storage.
+ * Returns 0 on success, or a negative SSH_ERR_* error code on failure.
+ */
+int	sshbuf_set_segmented(struct sshbuf *buf, size_t segsize);
+
+/*
+ * Returns a pointer to the start of the data in buf and stores in *lenp
+ * the number of bytes available there without joining segments.
+ */
+const u_char *sshbuf_peek(const struct sshbuf *buf, size_t *lenp);
+
+/*
+ * Detach the storage holding the data returned by sshbuf_peek() from buf
+ * and return it in *headp as a new buffer, which the caller must free.
+ * No data is copied; the rest of the data stays in buf.  This is useful
+ * when the memory must stay untouched after the data has been consumed,
+ * e.g. while the kernel still refers to it.
+ * Returns 0 on success, or a negative SSH_ERR_* error code on failure.
+ */
+int	sshbuf_take_head(struct sshbuf *buf, struct sshbuf **headp);
+
+/*
+ * Read up to maxlen bytes from fd into the end of buf, using readv() to
+ * fill a segmented buffer without copying.  The number of bytes read,
+ * which is 0 at end of file, is stored in *rlen.
+ * Returns 0 on success, or a negative SSH_ERR_* error code on failure.
+ * On SSH_ERR_SYSTEM_ERROR, errno is set by the failed read.
+ */
+int	sshbuf_read(int fd, struct sshbuf *buf, size_t maxlen, size_t *rlen);
+
+/*
+ * Write up to maxlen bytes from the start of buf to fd, using writev()
+ * for segmented buffers, and consume what was written.  The number of
+ * bytes written is stored in *wlen.
+ * Returns 0 on success, or a negative SSH_ERR_* error code on failure.
+ * On SSH_ERR_SYSTEM_ERROR, errno is set by the failed write.
+ */
+int	sshbuf_write(int fd, struct sshbuf *buf, size_t maxlen, size_t *wlen);
+
 /*
  * Return the maximum size of buf
  */
@@ -111,7 +178,8 @@ size_t	sshbuf_len(const struct sshbuf *buf);
 size_t	sshbuf_avail(const struct sshbuf *buf);
 
 /*
- * Returns a read-only pointer to the start of the data in buf
+ * Returns a read-only pointer to the start of the data in buf.  The data
+ * of a segmented buffer is joined first; NULL is returned if that fails.
  */
 const u_char *sshbuf_ptr(const struct sshbuf *buf);
 
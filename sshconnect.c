@@ -823,6 +823,17 @@ get_hostfile_hostname_ipaddr(char *hostname, struct sockaddr *hostaddr,
 	}
 }
 
+/* Users' own known_hosts files may be indexed; see KnownHostsIndex */
+static void
+load_user_hostkeys(struct hostkeys *hostkeys, const char *host,
+    const char *path)
+{
+	if (options.known_hosts_index)
+		load_hostkeys_indexed(hostkeys, host, path);
+	else
+		load_hostkeys(hostkeys, host, path);
+}
+
 /*
  * check whether the supplied host key is valid, return -1 if the key
  * is not valid. user_hostfile[0] will not be updated if 'readonly' is true.
@@ -882,7 +893,7 @@ check_host_key(char *hostname, struct sockaddr *hostaddr, u_short port,
 
 	host_hostkeys = init_hostkeys();
 	for (i = 0; i < num_user_hostfiles; i++)
-		load_hostkeys(host_hostkeys, host, user_hostfiles[i]);
+		load_user_hostkeys(host_hostkeys, host, user_hostfiles[i]);
 	for (i = 0; i < num_system_hostfiles; i++)
 		load_hostkeys(host_hostkeys, host, system_hostfiles[i]);
 
@@ -890,7 +901,7 @@ check_host_key(char *hostname, struct sockaddr *hostaddr, u_short port,
 	if (!want_cert && options.check_host_ip) {
 		ip_hostkeys = init_hostkeys();
 		for (i = 0; i < num_user_hostfiles; i++)
-			load_hostkeys(ip_hostkeys, ip, user_hostfiles[i]);
+			load_user_hostkeys(ip_hostkeys, ip, user_hostfiles[i]);
 		for (i = 0; i < num_system_hostfiles; i++)
 			load_hostkeys(ip_hostkeys, ip, system_hostfiles[i]);
 	}
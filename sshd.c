@@ -118,6 +118,8 @@
 #include "ssh-gss.h"
 #endif
 #include "monitor_wrap.h"
+#include "monitor_fdpass.h"
+#include "metrics.h"
 #include "ssh-sandbox.h"
 #include "auth-options.h"
 #include "version.h"
@@ -180,6 +182,9 @@ char **rexec_argv;
 int listen_socks[MAX_LISTEN_SOCKS];
 int num_listen_socks = 0;
 
+/* Listening MetricsSocket, if any */
+static int metrics_sock = -1;
+
 /*
  * the client's version string, passed by sshd2 in compat mode. if != NULL,
  * sshd will skip the version-number exchange
@@ -222,8 +227,21 @@ u_int utmp_len = HOST_NAME_MAX+1;
 
 /* options.max_startup sized array of fd ints */
 int *startup_pipes = NULL;
+struct sshbuf **startup_bufs = NULL;	/* data sent back by children */
+#define STARTUP_MSG_MAX		(16 * 1024 * 1024)
 int startup_pipe;		/* in child */
 
+/* Connection handlers started in advance (PreforkPool) */
+struct pool_handler {
+	pid_t pid;
+	int sock;		/* rexec config socket, -1 if slot unused */
+	int ready;		/* finished starting, waiting for a connection */
+};
+static struct pool_handler *pool = NULL;
+static int pool_size = 0;
+static time_t pool_retry = 0;	/* don't start handlers before this */
+static int rexec_pooled = 0;	/* in child: connection is passed later */
+
 /* variables used for privilege separation */
 int use_privsep = -1;
 struct monitor *pmonitor = NULL;
@@ -239,6 +257,9 @@ struct sshauthopt *auth_opts = NULL;
 /* sshd_config buffer */
 struct sshbuf *cfg;
 
+/* Parsed sshd_config, passed to re-executed children with cfg */
+static struct sshbuf *compiled_cfg;
+
 /* message to be displayed after login */
 struct sshbuf *loginmsg;
 
@@ -261,6 +282,10 @@ close_listen_socks(void)
 	for (i = 0; i < num_listen_socks; i++)
 		close(listen_socks[i]);
 	num_listen_socks = -1;
+	if (metrics_sock != -1) {
+		close(metrics_sock);
+		metrics_sock = -1;
+	}
 }
 
 static void
@@ -274,6 +299,20 @@ close_startup_pipes(void)
 				close(startup_pipes[i]);
 }
 
+/* Close the listener's ends of the sockets to pooled handlers */
+static void
+close_pool_socks(void)
+{
+	int i;
+
+	for (i = 0; i < pool_size; i++) {
+		if (pool[i].sock != -1) {
+			close(pool[i].sock);
+			pool[i].sock = -1;
+		}
+	}
+}
+
 /*
  * Signal handler for SIGHUP.  Sshd execs itself when it receives SIGHUP;
  * the effect is to reread the configuration file (and to regenerate
@@ -303,6 +342,7 @@ sighup_restart(void)
 	platform_pre_restart();
 	close_listen_socks();
 	close_startup_pipes();
+	close_pool_socks();
 	alarm(0);  /* alarm timer persists across exec */
 	signal(SIGHUP, SIG_IGN); /* will be restored after exec */
 	execv(saved_argv[0], saved_argv);
@@ -335,7 +375,8 @@ main_sigchld_handler(int sig)
 
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0 ||
 	    (pid < 0 && errno == EINTR))
-		;
+		if (pid > 0)
+			metrics_child_exited(pid);
 	errno = save_errno;
 }
 
@@ -620,9 +661,16 @@ privsep_preauth(Authctxt *authctxt)
 		/* child */
 		close(pmonitor->m_sendfd);
 		close(pmonitor->m_log_recvfd);
+		/* Only the monitor reports back to the listener */
+		if (startup_pipe != -1) {
+			close(startup_pipe);
+			startup_pipe = -1;
+		}
 
 		/* Arrange for logging to be sent to the monitor */
 		set_log_handler(mm_log_handler, pmonitor);
+		/* The session records its statistics after authentication */
+		metrics_detach();
 
 		privsep_preauth_child();
 		setproctitle("%s", "[net]");
@@ -656,6 +704,7 @@ privsep_postauth(Authctxt *authctxt)
 		verbose("User child is on pid %ld", (long)pmonitor->m_pid);
 		sshbuf_reset(loginmsg);
 		monitor_clear_keystate(pmonitor);
+		metrics_detach();
 		monitor_child_postauth(pmonitor);
 
 		/* NEVERREACHED */
@@ -932,9 +981,9 @@ usage(void)
 }
 
 static void
-send_rexec_state(int fd, struct sshbuf *conf)
+send_rexec_state(int fd, struct sshbuf *conf, int mslot, int pooled)
 {
-	struct sshbuf *m;
+	struct sshbuf *m, *idx;
 	int r;
 
 	debug3("%s: entering fd = %d config len %zu", __func__, fd,
@@ -943,19 +992,35 @@ send_rexec_state(int fd, struct sshbuf *conf)
 	/*
 	 * Protocol from reexec master to child:
 	 *	string	configuration
+	 *	string	parsed configuration (see serialise_server_config())
 	 *	string rngseed		(only if OpenSSL is not self-seeded)
+	 *	string	authorized_keys indexes (empty unless cached)
+	 *	u32	metrics slot (0xffffffff if none)
+	 *	u32	pooled (connection follows once the child is ready)
+	 * followed by the metrics table descriptor if there is a slot.
 	 */
-	if ((m = sshbuf_new()) == NULL)
+	if ((m = sshbuf_new()) == NULL || (idx = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
-	if ((r = sshbuf_put_stringb(m, conf)) != 0)
+	if ((r = sshbuf_put_stringb(m, conf)) != 0 ||
+	    (r = sshbuf_put_stringb(m, compiled_cfg)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
 #if defined(WITH_OPENSSL) && !defined(OPENSSL_PRNG_ONLY)
 	rexec_send_rng_seed(m);
 #endif
+	if (options.authorized_keys_index_cache &&
+	    (r = authkeys_index_serialise(idx, 0)) != 0)
+		fatal("%s: authkeys_index_serialise: %s", __func__, ssh_err(r));
+	if ((r = sshbuf_put_stringb(m, idx)) != 0 ||
+	    (r = sshbuf_put_u32(m, mslot < 0 ? 0xffffffff : (u_int)mslot)) != 0 ||
+	    (r = sshbuf_put_u32(m, pooled)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(idx);
 
 	if (ssh_msg_send(fd, 0, m) == -1)
 		fatal("%s: ssh_msg_send failed", __func__);
+	if (mslot >= 0 && mm_send_fd(fd, metrics_fd()) == -1)
+		fatal("%s: mm_send_fd failed", __func__);
 
 	sshbuf_free(m);
 
@@ -963,12 +1028,13 @@ send_rexec_state(int fd, struct sshbuf *conf)
 }
 
 static void
-recv_rexec_state(int fd, struct sshbuf *conf)
+recv_rexec_state(int fd, struct sshbuf *conf, struct sshbuf *compiled)
 {
-	struct sshbuf *m;
+	struct sshbuf *m, *idx, *c;
 	u_char *cp, ver;
 	size_t len;
-	int r;
+	u_int32_t mslot, pooled;
+	int r, mfd;
 
 	debug3("%s: entering fd = %d", __func__, fd);
 
@@ -984,16 +1050,288 @@ recv_rexec_state(int fd, struct sshbuf *conf)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	if (conf != NULL && (r = sshbuf_put(conf, cp, len)))
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if ((r = sshbuf_froms(m, &c)) != 0 ||
+	    (compiled != NULL && (r = sshbuf_putb(compiled, c)) != 0))
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(c);
 #if defined(WITH_OPENSSL) && !defined(OPENSSL_PRNG_ONLY)
 	rexec_recv_rng_seed(m);
 #endif
+	if ((r = sshbuf_froms(m, &idx)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (conf != NULL && sshbuf_len(idx) != 0 &&
+	    (r = authkeys_index_deserialise(idx)) != 0)
+		error("%s: authkeys_index_deserialise: %s", __func__,
+		    ssh_err(r));
+	if ((r = sshbuf_get_u32(m, &mslot)) != 0 ||
+	    (r = sshbuf_get_u32(m, &pooled)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	rexec_pooled = pooled != 0;
+	if (mslot != 0xffffffff) {
+		if ((mfd = mm_receive_fd(fd)) == -1)
+			fatal("%s: mm_receive_fd failed", __func__);
+		if (conf != NULL)
+			metrics_attach(mfd, mslot);
+		else
+			close(mfd);
+	}
 
+	sshbuf_free(idx);
 	free(cp);
 	sshbuf_free(m);
 
 	debug3("%s: done", __func__);
 }
 
+/*
+ * Send the authorized_keys indexes built by this connection to the
+ * listener, which passes them to later connections.
+ */
+static void
+send_authkeys_index(int fd)
+{
+	struct sshbuf *m, *idx;
+	int r;
+
+	if ((m = sshbuf_new()) == NULL || (idx = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = authkeys_index_serialise(idx, 1)) != 0)
+		fatal("%s: authkeys_index_serialise: %s", __func__, ssh_err(r));
+	if (PEEK_U32(sshbuf_ptr(idx)) != 0) {
+		if ((r = sshbuf_put_stringb(m, idx)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (atomicio(vwrite, fd, (void *)sshbuf_ptr(m),
+		    sshbuf_len(m)) != sshbuf_len(m))
+			debug("%s: write: %s", __func__, strerror(errno));
+	}
+	sshbuf_free(idx);
+	sshbuf_free(m);
+}
+
+/*
+ * Read what a child sends on its startup pipe.  Returns 0 while more may
+ * follow, or -1 once the child has closed it after authentication or
+ * exited.
+ */
+static int
+startup_pipe_read(int i)
+{
+	struct sshbuf *b = startup_bufs[i], *idx;
+	u_char buf[16384];
+	ssize_t len;
+	int r;
+
+	len = read(startup_pipes[i], buf, sizeof(buf));
+	if (len == -1 && (errno == EINTR || errno == EAGAIN ||
+	    errno == EWOULDBLOCK))
+		return 0;
+	if (len > 0) {
+		if (sshbuf_len(b) + len <= STARTUP_MSG_MAX &&
+		    sshbuf_put(b, buf, len) == 0)
+			return 0;
+		error("%s: message from child too long", __func__);
+		sshbuf_reset(b);
+		return -1;
+	}
+	if (sshbuf_len(b) != 0) {
+		if ((r = sshbuf_froms(b, &idx)) != 0 ||
+		    (r = authkeys_index_deserialise(idx)) != 0)
+			error("%s: bad authorized_keys index from child: %s",
+			    __func__, ssh_err(r));
+		sshbuf_free(idx);
+		sshbuf_reset(b);
+	}
+	return -1;
+}
+
+/* Track the startup pipe of a new unauthenticated connection */
+static void
+startup_pipe_add(int fd, int *maxfdp, int *startupsp)
+{
+	int i;
+
+	for (i = 0; i < options.max_startups; i++)
+		if (startup_pipes[i] == -1) {
+			startup_pipes[i] = fd;
+			if (*maxfdp < fd)
+				*maxfdp = fd;
+			(*startupsp)++;
+			break;
+		}
+}
+
+/*
+ * Start a pooled connection handler.  It is re-executed like the child
+ * for an accepted connection and parses its configuration and loads host
+ * keys before any connection arrives.  Returns 1 in the new child, which
+ * leaves the accept loop to re-execute itself, and 0 in the listener.
+ */
+static int
+pool_spawn(struct pool_handler *h, int *newsock, int *config_s, int *maxfdp)
+{
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, config_s) == -1) {
+		error("%s: socketpair: %s", __func__, strerror(errno));
+		return 0;
+	}
+	platform_pre_fork();
+	if ((pid = fork()) == 0) {
+		platform_post_fork_child();
+		startup_pipe = -1;
+		close_startup_pipes();
+		close_listen_socks();
+		close_pool_socks();
+		metrics_connection(-1);
+		close(config_s[0]);
+		log_init(__progname, options.log_level,
+		    options.log_facility, log_stderr);
+		if ((*newsock = open(_PATH_DEVNULL, O_RDWR)) == -1)
+			fatal("%s: open %s: %s", __func__, _PATH_DEVNULL,
+			    strerror(errno));
+		return 1;
+	}
+	platform_post_fork_parent(pid);
+	close(config_s[1]);
+	if (pid == -1) {
+		error("%s: fork: %s", __func__, strerror(errno));
+		close(config_s[0]);
+		return 0;
+	}
+	debug("%s: started handler %ld", __func__, (long)pid);
+	/* Not for connection children re-executed by the listener */
+	if (fcntl(config_s[0], F_SETFD, FD_CLOEXEC) == -1)
+		error("%s: fcntl FD_CLOEXEC: %s", __func__, strerror(errno));
+	send_rexec_state(config_s[0], cfg, -1, 1);
+	h->pid = pid;
+	h->sock = config_s[0];
+	h->ready = 0;
+	if (h->sock > *maxfdp)
+		*maxfdp = h->sock;
+	return 0;
+}
+
+/* Replace used or failed handlers; returns 1 in a new handler */
+static int
+pool_fill(int *newsock, int *config_s, int *maxfdp)
+{
+	int i;
+
+	if (pool_retry != 0 && monotime() < pool_retry)
+		return 0;
+	pool_retry = 0;
+	for (i = 0; i < pool_size; i++) {
+		if (pool[i].sock == -1 &&
+		    pool_spawn(&pool[i], newsock, config_s, maxfdp))
+			return 1;
+	}
+	return 0;
+}
+
+/* Note handlers that have become ready or exited */
+static void
+pool_check(fd_set *fdset)
+{
+	struct pool_handler *h;
+	u_char c;
+	int i;
+
+	for (i = 0; i < pool_size; i++) {
+		h = &pool[i];
+		if (h->sock == -1 || !FD_ISSET(h->sock, fdset))
+			continue;
+		if (!h->ready && read(h->sock, &c, 1) == 1) {
+			h->ready = 1;
+			continue;
+		}
+		if (!h->ready) {
+			/* Don't keep restarting handlers that cannot start */
+			error("Pool handler %ld exited during startup",
+			    (long)h->pid);
+			pool_retry = monotime() + 1;
+		}
+		close(h->sock);
+		h->sock = -1;
+		h->ready = 0;
+	}
+}
+
+/*
+ * Pass an accepted connection and its startup pipe to a ready handler.
+ * Returns 0 on success or -1 if the caller should fork a child as usual.
+ */
+static int
+pool_handoff(int sock, int startup_fd)
+{
+	struct pool_handler *h = NULL;
+	struct sshbuf *m;
+	int i, r, mslot, ret = -1;
+
+	for (i = 0; i < pool_size && h == NULL; i++)
+		if (pool[i].ready)
+			h = &pool[i];
+	if (h == NULL)
+		return -1;
+
+	mslot = metrics_slot_open(sock);
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u32(m, mslot < 0 ? 0xffffffff : (u_int)mslot)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (ssh_msg_send(h->sock, 0, m) == -1 ||
+	    mm_send_fd(h->sock, sock) == -1 ||
+	    mm_send_fd(h->sock, startup_fd) == -1 ||
+	    (mslot >= 0 && mm_send_fd(h->sock, metrics_fd()) == -1))
+		error("%s: could not pass connection to handler %ld",
+		    __func__, (long)h->pid);
+	else {
+		debug("Passed connection to pool handler %ld.", (long)h->pid);
+		ret = 0;
+	}
+	metrics_slot_start(mslot, ret == 0 ? h->pid : -1);
+	sshbuf_free(m);
+	close(h->sock);
+	h->sock = -1;
+	h->ready = 0;
+	return ret;
+}
+
+/*
+ * In a pooled handler: tell the listener that startup is complete and
+ * wait for it to pass a connection, which is returned.  Exits quietly if
+ * the listener goes away first.
+ */
+static int
+pool_accept(int fd, int *startup_pipep)
+{
+	struct sshbuf *m;
+	u_int32_t mslot;
+	u_char c = 0;
+	int r, sock, mfd;
+
+	setproctitle("%s", "[pooled]");
+	if (atomicio(vwrite, fd, &c, 1) != 1)
+		exit(0);
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (ssh_msg_recv(fd, m) == -1)
+		exit(0);
+	if ((r = sshbuf_get_u8(m, &c)) != 0 ||
+	    (r = sshbuf_get_u32(m, &mslot)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if ((sock = mm_receive_fd(fd)) == -1 ||
+	    (*startup_pipep = mm_receive_fd(fd)) == -1)
+		fatal("%s: mm_receive_fd failed", __func__);
+	if (mslot != 0xffffffff) {
+		if ((mfd = mm_receive_fd(fd)) == -1)
+			fatal("%s: mm_receive_fd failed", __func__);
+		metrics_attach(mfd, mslot);
+	}
+	sshbuf_free(m);
+	debug("%s: got connection on fd %d", __func__, sock);
+	return sock;
+}
+
 /* Accept a connection from inetd */
 static void
 server_accept_inetd(int *sock_in, int *sock_out)
@@ -1001,7 +1339,11 @@ server_accept_inetd(int *sock_in, int *sock_out)
 	int fd;
 
 	startup_pipe = -1;
-	if (rexeced_flag) {
+	if (rexeced_flag && rexec_pooled) {
+		*sock_in = *sock_out = pool_accept(REEXEC_CONFIG_PASS_FD,
+		    &startup_pipe);
+		close(REEXEC_CONFIG_PASS_FD);
+	} else if (rexeced_flag) {
 		close(REEXEC_CONFIG_PASS_FD);
 		*sock_in = *sock_out = dup(STDIN_FILENO);
 		if (!debug_flag) {
@@ -1131,12 +1473,14 @@ static void
 server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 {
 	fd_set *fdset;
-	int i, j, ret, maxfd;
+	int i, ret, maxfd;
 	int startups = 0;
 	int startup_p[2] = { -1 , -1 };
 	struct sockaddr_storage from;
 	socklen_t fromlen;
+	struct timeval tv, *tvp;
 	pid_t pid;
+	int mslot;
 	u_char rnd[256];
 
 	/* setup fd set for accept */
@@ -1145,10 +1489,27 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 	for (i = 0; i < num_listen_socks; i++)
 		if (listen_socks[i] > maxfd)
 			maxfd = listen_socks[i];
+	if (metrics_sock > maxfd)
+		maxfd = metrics_sock;
 	/* pipes connected to unauthenticated childs */
 	startup_pipes = xcalloc(options.max_startups, sizeof(int));
 	for (i = 0; i < options.max_startups; i++)
 		startup_pipes[i] = -1;
+	if (options.authorized_keys_index_cache) {
+		startup_bufs = xcalloc(options.max_startups,
+		    sizeof(*startup_bufs));
+		for (i = 0; i < options.max_startups; i++)
+			if ((startup_bufs[i] = sshbuf_new()) == NULL)
+				fatal("%s: sshbuf_new failed", __func__);
+	}
+	if (options.prefork_pool > 0 && !rexec_flag)
+		logit("PreforkPool is not used without re-execution");
+	else if (options.prefork_pool > 0 && !debug_flag) {
+		pool_size = options.prefork_pool;
+		pool = xcalloc(pool_size, sizeof(*pool));
+		for (i = 0; i < pool_size; i++)
+			pool[i].sock = -1;
+	}
 
 	/*
 	 * Stay listening for connections until the system crashes or
@@ -1157,18 +1518,36 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 	for (;;) {
 		if (received_sighup)
 			sighup_restart();
+		if (pool_fill(newsock, config_s, &maxfd)) {
+			/* Child; re-executed by main() as a pooled handler */
+			*sock_in = *sock_out = *newsock;
+			return;
+		}
 		free(fdset);
 		fdset = xcalloc(howmany(maxfd + 1, NFDBITS),
 		    sizeof(fd_mask));
 
 		for (i = 0; i < num_listen_socks; i++)
 			FD_SET(listen_socks[i], fdset);
+		if (metrics_sock != -1)
+			FD_SET(metrics_sock, fdset);
 		for (i = 0; i < options.max_startups; i++)
 			if (startup_pipes[i] != -1)
 				FD_SET(startup_pipes[i], fdset);
+		for (i = 0; i < pool_size; i++)
+			if (pool[i].sock != -1)
+				FD_SET(pool[i].sock, fdset);
+
+		/* Wake up to restart pool handlers after a failure */
+		tvp = NULL;
+		if (pool_retry != 0) {
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+			tvp = &tv;
+		}
 
 		/* Wait in select until there is a connection. */
-		ret = select(maxfd+1, fdset, NULL, NULL, NULL);
+		ret = select(maxfd+1, fdset, NULL, NULL, tvp);
 		if (ret < 0 && errno != EINTR)
 			error("select: %.100s", strerror(errno));
 		if (received_sigterm) {
@@ -1177,14 +1556,24 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 			close_listen_socks();
 			if (options.pid_file != NULL)
 				unlink(options.pid_file);
+			if (options.metrics_socket != NULL)
+				unlink(options.metrics_socket);
 			exit(received_sigterm == SIGTERM ? 0 : 255);
 		}
+		metrics_reap();
 		if (ret < 0)
 			continue;
 
+		if (metrics_sock != -1 && FD_ISSET(metrics_sock, fdset))
+			metrics_serve(metrics_sock);
+		pool_check(fdset);
+
 		for (i = 0; i < options.max_startups; i++)
 			if (startup_pipes[i] != -1 &&
 			    FD_ISSET(startup_pipes[i], fdset)) {
+				if (startup_bufs != NULL &&
+				    startup_pipe_read(i) == 0)
+					continue;
 				/*
 				 * the read end of the pipe is ready
 				 * if the child has closed the pipe
@@ -1231,6 +1620,21 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				close(*newsock);
 				continue;
 			}
+			if (startup_bufs != NULL &&
+			    set_nonblock(startup_p[0]) == -1) {
+				close(*newsock);
+				close(startup_p[0]);
+				close(startup_p[1]);
+				continue;
+			}
+
+			if (pool_handoff(*newsock, startup_p[1]) == 0) {
+				close(*newsock);
+				close(startup_p[1]);
+				startup_pipe_add(startup_p[0], &maxfd,
+				    &startups);
+				continue;
+			}
 
 			if (rexec_flag && socketpair(AF_UNIX,
 			    SOCK_STREAM, 0, config_s) == -1) {
@@ -1242,14 +1646,8 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				continue;
 			}
 
-			for (j = 0; j < options.max_startups; j++)
-				if (startup_pipes[j] == -1) {
-					startup_pipes[j] = startup_p[0];
-					if (maxfd < startup_p[0])
-						maxfd = startup_p[0];
-					startups++;
-					break;
-				}
+			startup_pipe_add(startup_p[0], &maxfd, &startups);
+			mslot = metrics_slot_open(*newsock);
 
 			/*
 			 * Got connection.  Fork a child to handle it, unless
@@ -1269,10 +1667,13 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				close(startup_p[1]);
 				startup_pipe = -1;
 				pid = getpid();
+				metrics_slot_start(mslot, pid);
 				if (rexec_flag) {
-					send_rexec_state(config_s[0], cfg);
+					send_rexec_state(config_s[0], cfg,
+					    mslot, 0);
 					close(config_s[0]);
 				}
+				metrics_connection(mslot);
 				break;
 			}
 
@@ -1292,9 +1693,11 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 				 * the connection.
 				 */
 				platform_post_fork_child();
+				metrics_connection(mslot);
 				startup_pipe = startup_p[1];
 				close_startup_pipes();
 				close_listen_socks();
+				close_pool_socks();
 				*sock_in = *newsock;
 				*sock_out = *newsock;
 				log_init(__progname,
@@ -1316,10 +1719,11 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 			close(startup_p[1]);
 
 			if (rexec_flag) {
-				send_rexec_state(config_s[0], cfg);
+				send_rexec_state(config_s[0], cfg, mslot, 0);
 				close(config_s[0]);
 				close(config_s[1]);
 			}
+			metrics_slot_start(mslot, pid);
 			close(*newsock);
 
 			/*
@@ -1470,7 +1874,7 @@ main(int ac, char **av)
 	struct ssh *ssh = NULL;
 	extern char *optarg;
 	extern int optind;
-	int r, opt, on = 1, already_daemon, remote_port;
+	int r, opt, on = 1, already_daemon, remote_port, cfg_loaded = 0;
 	int sock_in = -1, sock_out = -1, newsock = -1;
 	const char *remote_ip, *rdomain;
 	char *fp, *line, *laddr, *logfile = NULL;
@@ -1668,15 +2072,33 @@ main(int ac, char **av)
 		   "test mode (-T)");
 
 	/* Fetch our configuration */
-	if ((cfg = sshbuf_new()) == NULL)
+	if ((cfg = sshbuf_new()) == NULL ||
+	    (compiled_cfg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 	if (rexeced_flag)
-		recv_rexec_state(REEXEC_CONFIG_PASS_FD, cfg);
+		recv_rexec_state(REEXEC_CONFIG_PASS_FD, cfg, compiled_cfg);
 	else if (strcasecmp(config_file_name, "none") != 0)
 		load_server_config(config_file_name, cfg);
 
-	parse_server_config(&options, rexeced_flag ? "rexec" : config_file_name,
-	    cfg, NULL);
+	/*
+	 * A re-executed child normally loads the configuration already
+	 * parsed by the listener; the listener prepares it for them.
+	 */
+	if (sshbuf_len(compiled_cfg) != 0) {
+		if ((r = deserialise_server_config(compiled_cfg,
+		    &options, cfg)) == 0)
+			cfg_loaded = 1;
+		else
+			debug("Cannot load parsed configuration: %s",
+			    ssh_err(r));
+	}
+	if (!cfg_loaded)
+		parse_server_config(&options,
+		    rexeced_flag ? "rexec" : config_file_name, cfg, NULL);
+	sshbuf_reset(compiled_cfg);
+	if (rexec_flag && !test_flag &&
+	    (r = serialise_server_config(compiled_cfg, &options, cfg)) != 0)
+		fatal("%s: serialise_server_config: %s", __func__, ssh_err(r));
 
 	seed_rng();
 
@@ -1923,6 +2345,8 @@ main(int ac, char **av)
 	if (debug_flag && (!inetd_flag || rexeced_flag))
 		log_stderr = 1;
 	log_init(__progname, options.log_level, options.log_facility, log_stderr);
+	if (cfg_loaded)
+		debug("Loaded parsed configuration");
 
 	/*
 	 * If not in debugging mode, not started from inetd and not already
@@ -1954,6 +2378,10 @@ main(int ac, char **av)
 	} else {
 		platform_pre_listen();
 		server_listen();
+		if (options.metrics_socket != NULL && metrics_init() == 0 &&
+		    (metrics_sock = metrics_listen(options.metrics_socket)) == -1)
+			error("Could not listen on MetricsSocket %s",
+			    options.metrics_socket);
 
 		signal(SIGHUP, sighup_handler);
 		signal(SIGCHLD, main_sigchld_handler);
@@ -2021,13 +2449,17 @@ main(int ac, char **av)
 
 		/* Reexec has failed, fall back and continue */
 		error("rexec of %s failed: %s", rexec_argv[0], strerror(errno));
-		recv_rexec_state(REEXEC_CONFIG_PASS_FD, NULL);
+		recv_rexec_state(REEXEC_CONFIG_PASS_FD, NULL, NULL);
 		log_init(__progname, options.log_level,
 		    options.log_facility, log_stderr);
 
 		/* Clean up fds */
+		if (rexec_pooled)
+			newsock = sock_out = sock_in =
+			    pool_accept(REEXEC_CONFIG_PASS_FD, &startup_pipe);
+		else
+			newsock = sock_out = sock_in = dup(STDIN_FILENO);
 		close(REEXEC_CONFIG_PASS_FD);
-		newsock = sock_out = sock_in = dup(STDIN_FILENO);
 		if ((fd = open(_PATH_DEVNULL, O_RDWR, 0)) != -1) {
 			dup2(fd, STDIN_FILENO);
 			dup2(fd, STDOUT_FILENO);
@@ -2068,6 +2500,9 @@ main(int ac, char **av)
 	/* Prepare the channels layer */
 	channel_init_channels(ssh);
 	channel_set_af(ssh, options.address_family);
+	channel_set_window_budget(ssh, options.channel_window_budget);
+	sshbuf_pool_enable(options.buffer_pool);
+	channel_set_zerocopy(ssh, options.zerocopy_forwarding);
 	process_permitopen(ssh, &options);
 
 	/* Set SO_KEEPALIVE if requested. */
@@ -2171,6 +2606,8 @@ main(int ac, char **av)
 	signal(SIGALRM, SIG_DFL);
 	authctxt->authenticated = 1;
 	if (startup_pipe != -1) {
+		if (options.authorized_keys_index_cache)
+			send_authkeys_index(startup_pipe);
 		close(startup_pipe);
 		startup_pipe = -1;
 	}
@@ -2209,6 +2646,7 @@ main(int ac, char **av)
 	notify_hostkeys(ssh);
 
 	/* Start session. */
+	metrics_set_user(authctxt->user);
 	do_authenticated(ssh, authctxt);
 
 	/* The connection has been terminated. */
@@ -327,7 +327,7 @@ typedef struct {
 
 #if (UMAC_OUTPUT_LEN == 4)
 
-static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
+static void nh_aux_ref(void *kp, const void *dp, void *hp, UINT32 dlen)
 /* NH hashing primitive. Previous (partial) hash result is loaded and
 * then stored via hp pointer. The length of the data pointed at by "dp",
 * "dlen", is guaranteed to be divisible by L1_PAD_BOUNDARY (32).  Key
@@ -362,7 +362,7 @@ static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
 
 #elif (UMAC_OUTPUT_LEN == 8)
 
-static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
+static void nh_aux_ref(void *kp, const void *dp, void *hp, UINT32 dlen)
 /* Same as previous nh_aux, but two streams are handled in one pass,
  * reading and writing 16 bytes of hash-state per call.
  */
@@ -409,7 +409,7 @@ static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
 
 #elif (UMAC_OUTPUT_LEN == 12)
 
-static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
+static void nh_aux_ref(void *kp, const void *dp, void *hp, UINT32 dlen)
 /* Same as previous nh_aux, but two streams are handled in one pass,
  * reading and writing 24 bytes of hash-state per call.
 */
@@ -464,7 +464,7 @@ static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
 
 #elif (UMAC_OUTPUT_LEN == 16)
 
-static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
+static void nh_aux_ref(void *kp, const void *dp, void *hp, UINT32 dlen)
 /* Same as previous nh_aux, but two streams are handled in one pass,
  * reading and writing 24 bytes of hash-state per call.
 */
@@ -530,6 +530,113 @@ static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
 #endif  /* UMAC_OUTPUT_LENGTH */
 /* ---------------------------------------------------------------------- */
 
+#ifdef HAVE_X86_SIMD_DISPATCH
+
+#include <immintrin.h>
+
+/* SSE2 and AVX2 versions of nh_aux_ref() for all STREAMS at once. Each
+ * 32-bit lane holds one key + data word; _mm_mul_epu32 multiplies the
+ * even lanes, so the odd lanes are shifted down for a second multiply.
+ * The 64-bit partial sums are added across lanes at the end, which gives
+ * the same result since NH is a sum modulo 2^64.
+ */
+__attribute__((target("sse2")))
+static void nh_aux_sse2(void *kp, const void *dp, void *hp, UINT32 dlen)
+{
+    UWORD c = dlen / 32, i;
+    const UINT32 *k = (const UINT32 *)kp;
+    const UINT32 *d = (const UINT32 *)dp;
+    __m128i acc[STREAMS], dlo, dhi, a, b;
+    UINT64 t[2];
+
+    for (i = 0; i < STREAMS; i++)
+        acc[i] = _mm_setzero_si128();
+    do {
+        dlo = _mm_loadu_si128((const __m128i *)d);
+        dhi = _mm_loadu_si128((const __m128i *)(d + 4));
+        for (i = 0; i < STREAMS; i++) {
+            a = _mm_add_epi32(dlo,
+                _mm_loadu_si128((const __m128i *)(k + 4 * i)));
+            b = _mm_add_epi32(dhi,
+                _mm_loadu_si128((const __m128i *)(k + 4 * i + 4)));
+            acc[i] = _mm_add_epi64(acc[i], _mm_mul_epu32(a, b));
+            acc[i] = _mm_add_epi64(acc[i], _mm_mul_epu32(
+                _mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32)));
+        }
+        d += 8;
+        k += 8;
+    } while (--c);
+    for (i = 0; i < STREAMS; i++) {
+        _mm_storeu_si128((__m128i *)t, acc[i]);
+        ((UINT64 *)hp)[i] += t[0] + t[1];
+    }
+}
+
+/* Two 32-byte blocks per iteration: the low halves of both blocks are
+ * gathered into one vector and the high halves into another.
+ */
+__attribute__((target("avx2")))
+static void nh_aux_avx2(void *kp, const void *dp, void *hp, UINT32 dlen)
+{
+    UWORD c = dlen / 64, i;
+    const UINT32 *k = (const UINT32 *)kp;
+    const UINT32 *d = (const UINT32 *)dp;
+    __m256i acc[STREAMS], d0, d1, x0, x1, a, b;
+    UINT64 t[4];
+
+    for (i = 0; i < STREAMS; i++)
+        acc[i] = _mm256_setzero_si256();
+    for (; c > 0; c--) {
+        d0 = _mm256_loadu_si256((const __m256i *)d);
+        d1 = _mm256_loadu_si256((const __m256i *)(d + 8));
+        for (i = 0; i < STREAMS; i++) {
+            x0 = _mm256_add_epi32(d0,
+                _mm256_loadu_si256((const __m256i *)(k + 4 * i)));
+            x1 = _mm256_add_epi32(d1,
+                _mm256_loadu_si256((const __m256i *)(k + 4 * i + 8)));
+            a = _mm256_permute2x128_si256(x0, x1, 0x20);
+            b = _mm256_permute2x128_si256(x0, x1, 0x31);
+            acc[i] = _mm256_add_epi64(acc[i], _mm256_mul_epu32(a, b));
+            acc[i] = _mm256_add_epi64(acc[i], _mm256_mul_epu32(
+                _mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)));
+        }
+        d += 16;
+        k += 16;
+    }
+    for (i = 0; i < STREAMS; i++) {
+        _mm256_storeu_si256((__m256i *)t, acc[i]);
+        ((UINT64 *)hp)[i] += t[0] + t[1] + t[2] + t[3];
+    }
+    /* odd trailing 32-byte block */
+    if (dlen & 32)
+        nh_aux_sse2((void *)k, d, hp, 32);
+}
+
+typedef void nh_aux_fn(void *, const void *, void *, UINT32);
+
+static void nh_aux(void *kp, const void *dp, void *hp, UINT32 dlen)
+/* Dispatch to the fastest NH implementation the CPU supports. */
+{
+    static nh_aux_fn *fn;
+
+    if (fn == NULL) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            fn = nh_aux_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            fn = nh_aux_sse2;
+        else
+            fn = nh_aux_ref;
+    }
+    fn(kp, dp, hp, dlen);
+}
+
+#else /* HAVE_X86_SIMD_DISPATCH */
+
+#define nh_aux nh_aux_ref
+
+#endif /* HAVE_X86_SIMD_DISPATCH */
+
 
 /* ---------------------------------------------------------------------- */
 